@@ -97,7 +97,7 @@ static void growstack (lua_State *L, void *ud) {
 LUA_API int lua_checkstack (lua_State *L, int n) {
   int res;
   CallInfo *ci = L->ci;
-  lua_lock(L);
+  api_lock(L);
   api_check(L, n >= 0, "negative 'n'");
   if (L->stack_last - L->top > n)  /* stack large enough? */
     res = 1;  /* yes; check is OK */
@@ -118,7 +118,7 @@ LUA_API int lua_checkstack (lua_State *L, int n) {
 LUA_API void lua_xmove (lua_State *from, lua_State *to, int n) {
   int i;
   if (from == to) return;
-  lua_lock(to);
+  api_lock(to);
   api_checknelems(from, n);
   api_check(from, G(from) == G(to), "moving among independent states");
   api_check(from, to->ci->top - to->top >= n, "stack overflow");
@@ -133,7 +133,7 @@ LUA_API void lua_xmove (lua_State *from, lua_State *to, int n) {
 
 LUA_API lua_CFunction lua_atpanic (lua_State *L, lua_CFunction panicf) {
   lua_CFunction old;
-  lua_lock(L);
+  api_lock(L);
   old = G(L)->panic;
   G(L)->panic = panicf;
   lua_unlock(L);
@@ -171,7 +171,7 @@ LUA_API int lua_gettop (lua_State *L) {
 
 LUA_API void lua_settop (lua_State *L, int idx) {
   StkId func = L->ci->func;
-  lua_lock(L);
+  api_lock(L);
   if (idx >= 0) {
     api_check(L, idx <= L->stack_last - (func + 1), "new top too large");
     while (L->top < (func + 1) + idx)
@@ -206,7 +206,7 @@ static void reverse (lua_State *L, StkId from, StkId to) {
 */
 LUA_API void lua_rotate (lua_State *L, int idx, int n) {
   StkId p, t, m;
-  lua_lock(L);
+  api_lock(L);
   t = L->top - 1;  /* end of stack segment being rotated */
   p = index2addr(L, idx);  /* start of segment */
   api_checkstackindex(L, idx, p);
@@ -221,7 +221,7 @@ LUA_API void lua_rotate (lua_State *L, int idx, int n) {
 
 LUA_API void lua_copy (lua_State *L, int fromidx, int toidx) {
   TValue *fr, *to;
-  lua_lock(L);
+  api_lock(L);
   fr = index2addr(L, fromidx);
   to = index2addr(L, toidx);
   api_checkvalidindex(L, to);
@@ -235,7 +235,7 @@ LUA_API void lua_copy (lua_State *L, int fromidx, int toidx) {
 
 
 LUA_API void lua_pushvalue (lua_State *L, int idx) {
-  lua_lock(L);
+  api_lock(L);
   setobj2s(L, L->top, index2addr(L, idx));
   api_incr_top(L);
   lua_unlock(L);
@@ -300,7 +300,7 @@ LUA_API int lua_rawequal (lua_State *L, int index1, int index2) {
 
 
 LUA_API void lua_arith (lua_State *L, int op) {
-  lua_lock(L);
+  api_lock(L);
   if (op != LUA_OPUNM && op != LUA_OPBNOT)
     api_checknelems(L, 2);  /* all other operations expect two operands */
   else {  /* for unary operations, add fake 2nd operand */
@@ -318,7 +318,7 @@ LUA_API void lua_arith (lua_State *L, int op) {
 LUA_API int lua_compare (lua_State *L, int index1, int index2, int op) {
   StkId o1, o2;
   int i = 0;
-  lua_lock(L);  /* may call tag method */
+  api_lock(L);  /* may call tag method */
   o1 = index2addr(L, index1);
   o2 = index2addr(L, index2);
   if (isvalid(o1) && isvalid(o2)) {
@@ -335,7 +335,7 @@ LUA_API int lua_compare (lua_State *L, int index1, int index2, int op) {
 
 
 LUA_API size_t lua_stringtonumber (lua_State *L, const char *s) {
-  size_t sz = luaO_str2num(s, L->top);
+  size_t sz = luaO_str2num(L, s, L->top);
   if (sz != 0)
     api_incr_top(L);
   return sz;
@@ -377,7 +377,7 @@ LUA_API const char *lua_tolstring (lua_State *L, int idx, size_t *len) {
       if (len != NULL) *len = 0;
       return NULL;
     }
-    lua_lock(L);  /* 'luaO_tostring' may create a new string */
+    api_lock(L);  /* 'luaO_tostring' may create a new string */
     luaC_checkGC(L);
     o = index2addr(L, idx);  /* previous call may reallocate the stack */
     luaO_tostring(L, o);
@@ -448,7 +448,7 @@ LUA_API const void *lua_topointer (lua_State *L, int idx) {
 
 
 LUA_API void lua_pushnil (lua_State *L) {
-  lua_lock(L);
+  api_lock(L);
   setnilvalue(L->top);
   api_incr_top(L);
   lua_unlock(L);
@@ -456,7 +456,7 @@ LUA_API void lua_pushnil (lua_State *L) {
 
 
 LUA_API void lua_pushnumber (lua_State *L, lua_Number n) {
-  lua_lock(L);
+  api_lock(L);
   setfltvalue(L->top, n);
   api_incr_top(L);
   lua_unlock(L);
@@ -464,8 +464,8 @@ LUA_API void lua_pushnumber (lua_State *L, lua_Number n) {
 
 
 LUA_API void lua_pushinteger (lua_State *L, lua_Integer n) {
-  lua_lock(L);
-  setivalue(L->top, n);
+  api_lock(L);
+  setivalue(L, L->top, n);
   api_incr_top(L);
   lua_unlock(L);
 }
@@ -478,7 +478,7 @@ LUA_API void lua_pushinteger (lua_State *L, lua_Integer n) {
 */
 LUA_API const char *lua_pushlstring (lua_State *L, const char *s, size_t len) {
   TString *ts;
-  lua_lock(L);
+  api_lock(L);
   luaC_checkGC(L);
   ts = (len == 0) ? luaS_new(L, "") : luaS_newlstr(L, s, len);
   setsvalue2s(L, L->top, ts);
@@ -488,8 +488,52 @@ LUA_API const char *lua_pushlstring (lua_State *L, const char *s, size_t len) {
 }
 
 
+/*
+** Strings built in place: a buffer for a string of up to 'n' characters
+** is a block of 'lua_strbuffhead(L) + n + 1' bytes allocated with the
+** state's allocator, whose contents start after the first
+** 'lua_strbuffhead(L)' bytes. 'lua_pushstrbuff' makes it a string of
+** 'len' characters without copying it (for long strings); Lua owns the
+** block from then on.
+*/
+LUA_API size_t lua_strbuffhead (lua_State *L) {
+  UNUSED(L);
+  return sizeof(UTString);
+}
+
+
+LUA_API const char *lua_pushstrbuff (lua_State *L, void *block,
+                                     size_t bsize, size_t len) {
+  TString *ts;
+  api_lock(L);
+  ts = luaS_adoptlstr(L, cast(char *, block), bsize, len);
+  setsvalue2s(L, L->top, ts);
+  api_incr_top(L);
+  luaC_checkGC(L);  /* only now (finalizers may raise errors) */
+  lua_unlock(L);
+  return getstr(ts);
+}
+
+
+/*
+** (Re)allocates a block owned by a library the way the core allocates
+** its own memory: the block counts as in use by Lua (so it paces the
+** collector and shows in 'collectgarbage("count")'), and a failed
+** allocation runs an emergency collection before raising a memory
+** error, which leaves the old block valid. 'nsize' 0 frees the block.
+*/
+LUA_API void *lua_resizeblock (lua_State *L, void *block,
+                               size_t osize, size_t nsize) {
+  void *res;
+  api_lock(L);
+  res = luaM_realloc_(L, block, (block) ? osize : 0, nsize);
+  lua_unlock(L);
+  return res;
+}
+
+
 LUA_API const char *lua_pushstring (lua_State *L, const char *s) {
-  lua_lock(L);
+  api_lock(L);
   if (s == NULL)
     setnilvalue(L->top);
   else {
@@ -508,7 +552,7 @@ LUA_API const char *lua_pushstring (lua_State *L, const char *s) {
 LUA_API const char *lua_pushvfstring (lua_State *L, const char *fmt,
                                       va_list argp) {
   const char *ret;
-  lua_lock(L);
+  api_lock(L);
   luaC_checkGC(L);
   ret = luaO_pushvfstring(L, fmt, argp);
   lua_unlock(L);
@@ -519,7 +563,7 @@ LUA_API const char *lua_pushvfstring (lua_State *L, const char *fmt,
 LUA_API const char *lua_pushfstring (lua_State *L, const char *fmt, ...) {
   const char *ret;
   va_list argp;
-  lua_lock(L);
+  api_lock(L);
   luaC_checkGC(L);
   va_start(argp, fmt);
   ret = luaO_pushvfstring(L, fmt, argp);
@@ -530,7 +574,7 @@ LUA_API const char *lua_pushfstring (lua_State *L, const char *fmt, ...) {
 
 
 LUA_API void lua_pushcclosure (lua_State *L, lua_CFunction fn, int n) {
-  lua_lock(L);
+  api_lock(L);
   if (n == 0) {
     setfvalue(L->top, fn);
   }
@@ -554,7 +598,7 @@ LUA_API void lua_pushcclosure (lua_State *L, lua_CFunction fn, int n) {
 
 
 LUA_API void lua_pushboolean (lua_State *L, int b) {
-  lua_lock(L);
+  api_lock(L);
   setbvalue(L->top, (b != 0));  /* ensure that true is 1 */
   api_incr_top(L);
   lua_unlock(L);
@@ -562,7 +606,7 @@ LUA_API void lua_pushboolean (lua_State *L, int b) {
 
 
 LUA_API void lua_pushlightuserdata (lua_State *L, void *p) {
-  lua_lock(L);
+  api_lock(L);
   setpvalue(L->top, p);
   api_incr_top(L);
   lua_unlock(L);
@@ -570,7 +614,7 @@ LUA_API void lua_pushlightuserdata (lua_State *L, void *p) {
 
 
 LUA_API int lua_pushthread (lua_State *L) {
-  lua_lock(L);
+  api_lock(L);
   setthvalue(L, L->top, L);
   api_incr_top(L);
   lua_unlock(L);
@@ -603,14 +647,14 @@ static int auxgetstr (lua_State *L, const TValue *t, const char *k) {
 
 LUA_API int lua_getglobal (lua_State *L, const char *name) {
   Table *reg = hvalue(&G(L)->l_registry);
-  lua_lock(L);
+  api_lock(L);
   return auxgetstr(L, luaH_getint(reg, LUA_RIDX_GLOBALS), name);
 }
 
 
 LUA_API int lua_gettable (lua_State *L, int idx) {
   StkId t;
-  lua_lock(L);
+  api_lock(L);
   t = index2addr(L, idx);
   luaV_gettable(L, t, L->top - 1, L->top - 1);
   lua_unlock(L);
@@ -619,7 +663,7 @@ LUA_API int lua_gettable (lua_State *L, int idx) {
 
 
 LUA_API int lua_getfield (lua_State *L, int idx, const char *k) {
-  lua_lock(L);
+  api_lock(L);
   return auxgetstr(L, index2addr(L, idx), k);
 }
 
@@ -627,14 +671,14 @@ LUA_API int lua_getfield (lua_State *L, int idx, const char *k) {
 LUA_API int lua_geti (lua_State *L, int idx, lua_Integer n) {
   StkId t;
   const TValue *aux;
-  lua_lock(L);
+  api_lock(L);
   t = index2addr(L, idx);
   if (luaV_fastget(L, t, n, aux, luaH_getint)) {
     setobj2s(L, L->top, aux);
     api_incr_top(L);
   }
   else {
-    setivalue(L->top, n);
+    setivalue(L, L->top, n);
     api_incr_top(L);
     luaV_finishget(L, t, L->top - 1, L->top - 1, aux);
   }
@@ -645,7 +689,7 @@ LUA_API int lua_geti (lua_State *L, int idx, lua_Integer n) {
 
 LUA_API int lua_rawget (lua_State *L, int idx) {
   StkId t;
-  lua_lock(L);
+  api_lock(L);
   t = index2addr(L, idx);
   api_check(L, ttistable(t), "table expected");
   setobj2s(L, L->top - 1, luaH_get(hvalue(t), L->top - 1));
@@ -656,7 +700,7 @@ LUA_API int lua_rawget (lua_State *L, int idx) {
 
 LUA_API int lua_rawgeti (lua_State *L, int idx, lua_Integer n) {
   StkId t;
-  lua_lock(L);
+  api_lock(L);
   t = index2addr(L, idx);
   api_check(L, ttistable(t), "table expected");
   setobj2s(L, L->top, luaH_getint(hvalue(t), n));
@@ -669,7 +713,7 @@ LUA_API int lua_rawgeti (lua_State *L, int idx, lua_Integer n) {
 LUA_API int lua_rawgetp (lua_State *L, int idx, const void *p) {
   StkId t;
   TValue k;
-  lua_lock(L);
+  api_lock(L);
   t = index2addr(L, idx);
   api_check(L, ttistable(t), "table expected");
   setpvalue(&k, cast(void *, p));
@@ -682,7 +726,7 @@ LUA_API int lua_rawgetp (lua_State *L, int idx, const void *p) {
 
 LUA_API void lua_createtable (lua_State *L, int narray, int nrec) {
   Table *t;
-  lua_lock(L);
+  api_lock(L);
   luaC_checkGC(L);
   t = luaH_new(L);
   sethvalue(L, L->top, t);
@@ -697,7 +741,7 @@ LUA_API int lua_getmetatable (lua_State *L, int objindex) {
   const TValue *obj;
   Table *mt;
   int res = 0;
-  lua_lock(L);
+  api_lock(L);
   obj = index2addr(L, objindex);
   switch (ttnov(obj)) {
     case LUA_TTABLE:
@@ -722,7 +766,7 @@ LUA_API int lua_getmetatable (lua_State *L, int objindex) {
 
 LUA_API int lua_getuservalue (lua_State *L, int idx) {
   StkId o;
-  lua_lock(L);
+  api_lock(L);
   o = index2addr(L, idx);
   api_check(L, ttisfulluserdata(o), "full userdata expected");
   getuservalue(L, uvalue(o), L->top);
@@ -757,14 +801,14 @@ static void auxsetstr (lua_State *L, const TValue *t, const char *k) {
 
 LUA_API void lua_setglobal (lua_State *L, const char *name) {
   Table *reg = hvalue(&G(L)->l_registry);
-  lua_lock(L);  /* unlock done in 'auxsetstr' */
+  api_lock(L);  /* unlock done in 'auxsetstr' */
   auxsetstr(L, luaH_getint(reg, LUA_RIDX_GLOBALS), name);
 }
 
 
 LUA_API void lua_settable (lua_State *L, int idx) {
   StkId t;
-  lua_lock(L);
+  api_lock(L);
   api_checknelems(L, 2);
   t = index2addr(L, idx);
   luaV_settable(L, t, L->top - 2, L->top - 1);
@@ -774,7 +818,7 @@ LUA_API void lua_settable (lua_State *L, int idx) {
 
 
 LUA_API void lua_setfield (lua_State *L, int idx, const char *k) {
-  lua_lock(L);  /* unlock done in 'auxsetstr' */
+  api_lock(L);  /* unlock done in 'auxsetstr' */
   auxsetstr(L, index2addr(L, idx), k);
 }
 
@@ -782,13 +826,13 @@ LUA_API void lua_setfield (lua_State *L, int idx, const char *k) {
 LUA_API void lua_seti (lua_State *L, int idx, lua_Integer n) {
   StkId t;
   const TValue *aux;
-  lua_lock(L);
+  api_lock(L);
   api_checknelems(L, 1);
   t = index2addr(L, idx);
   if (luaV_fastset(L, t, n, aux, luaH_getint, L->top - 1))
     L->top--;  /* pop value */
   else {
-    setivalue(L->top, n);
+    setivalue(L, L->top, n);
     api_incr_top(L);
     luaV_finishset(L, t, L->top - 1, L->top - 2, aux);
     L->top -= 2;  /* pop value and key */
@@ -800,7 +844,7 @@ LUA_API void lua_seti (lua_State *L, int idx, lua_Integer n) {
 LUA_API void lua_rawset (lua_State *L, int idx) {
   StkId o;
   TValue *slot;
-  lua_lock(L);
+  api_lock(L);
   api_checknelems(L, 2);
   o = index2addr(L, idx);
   api_check(L, ttistable(o), "table expected");
@@ -815,7 +859,7 @@ LUA_API void lua_rawset (lua_State *L, int idx) {
 
 LUA_API void lua_rawseti (lua_State *L, int idx, lua_Integer n) {
   StkId o;
-  lua_lock(L);
+  api_lock(L);
   api_checknelems(L, 1);
   o = index2addr(L, idx);
   api_check(L, ttistable(o), "table expected");
@@ -829,7 +873,7 @@ LUA_API void lua_rawseti (lua_State *L, int idx, lua_Integer n) {
 LUA_API void lua_rawsetp (lua_State *L, int idx, const void *p) {
   StkId o;
   TValue k, *slot;
-  lua_lock(L);
+  api_lock(L);
   api_checknelems(L, 1);
   o = index2addr(L, idx);
   api_check(L, ttistable(o), "table expected");
@@ -842,10 +886,184 @@ LUA_API void lua_rawsetp (lua_State *L, int idx, const void *p) {
 }
 
 
+LUA_API void lua_cleartable (lua_State *L, int idx) {
+  StkId o;
+  api_lock(L);
+  o = index2addr(L, idx);
+  api_check(L, ttistable(o), "table expected");
+  luaH_clear(L, hvalue(o));  /* only removes references; no barrier */
+  lua_unlock(L);
+}
+
+
+/*
+** {======================================================
+** Array fast paths: raw accesses to a whole range of the array part of
+** a table. They do nothing and return 0 when the range is not entirely
+** inside the array part (so that the caller can use the general path).
+** =======================================================
+*/
+
+/* range [i, i + n - 1] lies in the array part of 't' (with 'i' > 0) */
+#define inarray(t,i,n)  	((n) <= cast(lua_Integer, (t)->sizearray) - (i) + 1)
+
+
+/*
+** from[f..e] -> to[t..]; ranges may overlap.
+*/
+LUA_API int lua_arraymove (lua_State *L, int from, lua_Integer f,
+                           lua_Integer e, lua_Integer t, int to) {
+  Table *src, *dst;
+  lua_Integer n;
+  int res = 0;
+  api_lock(L);
+  api_check(L, ttistable(index2addr(L, from)), "table expected");
+  api_check(L, ttistable(index2addr(L, to)), "table expected");
+  src = hvalue(index2addr(L, from));
+  dst = hvalue(index2addr(L, to));
+  if (e < f)
+    res = 1;  /* nothing to move */
+  else if (f > 0 && t > 0) {
+    n = e - f + 1;
+    if (inarray(src, f, n) && inarray(dst, t, n)) {
+      memmove(&dst->array[t - 1], &src->array[f - 1],
+              cast(size_t, n) * sizeof(TValue));
+      if (src != dst && isblack(dst))  /* values new to 'dst'? */
+        luaC_barrierback_(L, dst);
+      res = 1;
+    }
+  }
+  lua_unlock(L);
+  return res;
+}
+
+
+/*
+** pushes t[i..i + n - 1]; the caller must ensure the stack space
+*/
+LUA_API int lua_arraypush (lua_State *L, int idx, lua_Integer i, int n) {
+  Table *t;
+  int res = 0;
+  api_lock(L);
+  api_check(L, ttistable(index2addr(L, idx)), "table expected");
+  api_check(L, n <= L->stack_last - L->top, "stack overflow");
+  t = hvalue(index2addr(L, idx));
+  if (i > 0 && inarray(t, i, n)) {
+    const TValue *a = &t->array[i - 1];
+    int k;
+    for (k = 0; k < n; k++)
+      setobj2s(L, L->top + k, a + k);
+    L->top += n;
+    res = 1;
+  }
+  lua_unlock(L);
+  return res;
+}
+
+
+/*
+** pushes t[i] .. sep .. t[i + 1] .. sep .. ... t[j], when all these
+** elements are strings or numbers; the result is built in place, after
+** a first pass computes its exact length
+*/
+LUA_API int lua_arrayconcat (lua_State *L, int idx, lua_Integer i,
+                             lua_Integer j, const char *sep, size_t lsep) {
+  Table *t;
+  const TValue *a;
+  char buff[MAXNUMBER2STR];
+  unsigned int n, k;
+  size_t len = 0;
+  int res = 0;
+  api_lock(L);
+  api_check(L, ttistable(index2addr(L, idx)), "table expected");
+  t = hvalue(index2addr(L, idx));
+  if (i < 1 || j < i || !inarray(t, i, j - i + 1))
+    goto done;
+  a = &t->array[i - 1];
+  n = cast(unsigned int, j - i + 1);
+  for (k = 0; k < n; k++) {  /* first pass: compute length of result */
+    size_t l;
+    if (ttisstring(&a[k]))
+      l = tsslen(tsvalue(&a[k]));
+    else if (ttisnumber(&a[k]))
+      l = luaO_tostringbuff(&a[k], buff);
+    else
+      goto done;  /* let the caller handle (or complain about) it */
+    if (l + lsep >= MAX_SIZE - sizeof(TString) - len)
+      luaG_runerror(L, "resulting string too large");
+    len += l + lsep;
+  }
+  len -= lsep;  /* no separator after last element */
+  {  /* second pass: build it (nothing here can run the GC) */
+    TString *ts = NULL;
+    char lbuff[LUAI_MAXSHORTLEN];
+    char *p = (len <= LUAI_MAXSHORTLEN) ? lbuff :
+              getstr(ts = luaS_createlngstrobj(L, len));
+    size_t left = len;  /* room left in 'p' */
+    a = &t->array[i - 1];
+    for (k = 0; k < n; k++) {
+      const char *s;
+      size_t l;
+      if (ttisstring(&a[k])) {
+        s = getstr(tsvalue(&a[k]));
+        l = tsslen(tsvalue(&a[k]));
+      }
+      else {
+        s = buff;
+        l = luaO_tostringbuff(&a[k], buff);
+      }
+      if (l + (k > 0 ? lsep : 0) > left)  /* (cannot happen) */
+        break;
+      if (k > 0 && lsep > 0) {
+        memcpy(p, sep, lsep * sizeof(char));
+        p += lsep;
+      }
+      memcpy(p, s, l * sizeof(char));
+      p += l;
+      left -= l + (k > 0 ? lsep : 0);
+    }
+    if (k < n || left != 0)  /* the array changed since the first pass? */
+      luaG_runerror(L, "array changed during concatenation");
+    if (len <= LUAI_MAXSHORTLEN)
+      ts = luaS_newlstr(L, lbuff, len);
+    setsvalue2s(L, L->top, ts);
+    api_incr_top(L);
+  }
+  luaC_checkGC(L);
+  res = 1;
+ done:
+  lua_unlock(L);
+  return res;
+}
+
+
+/*
+** sorts t[1..n] with the order function at 'comp' (or the default
+** order if 'comp' is 0)
+*/
+LUA_API int lua_arraysort (lua_State *L, int idx, lua_Integer n, int comp) {
+  StkId o, f = NULL;
+  int res = 0;
+  api_lock(L);
+  o = index2addr(L, idx);
+  api_check(L, ttistable(o), "table expected");
+  if (comp != 0) {
+    f = index2addr(L, comp);
+    api_check(L, L->ci->top - L->top >= 3, "not enough stack space");
+  }
+  if (0 <= n && n <= cast(lua_Integer, hvalue(o)->sizearray))
+    res = luaH_sort(L, hvalue(o), cast(unsigned int, n), f);
+  lua_unlock(L);
+  return res;
+}
+
+/* }====================================================== */
+
+
 LUA_API int lua_setmetatable (lua_State *L, int objindex) {
   TValue *obj;
   Table *mt;
-  lua_lock(L);
+  api_lock(L);
   api_checknelems(L, 1);
   obj = index2addr(L, objindex);
   if (ttisnil(L->top - 1))
@@ -884,7 +1102,7 @@ LUA_API int lua_setmetatable (lua_State *L, int objindex) {
 
 LUA_API void lua_setuservalue (lua_State *L, int idx) {
   StkId o;
-  lua_lock(L);
+  api_lock(L);
   api_checknelems(L, 1);
   o = index2addr(L, idx);
   api_check(L, ttisfulluserdata(o), "full userdata expected");
@@ -908,7 +1126,7 @@ LUA_API void lua_setuservalue (lua_State *L, int idx) {
 LUA_API void lua_callk (lua_State *L, int nargs, int nresults,
                         lua_KContext ctx, lua_KFunction k) {
   StkId func;
-  lua_lock(L);
+  api_lock(L);
   api_check(L, k == NULL || !isLua(L->ci),
     "cannot use continuations inside hooks");
   api_checknelems(L, nargs+1);
@@ -949,7 +1167,7 @@ LUA_API int lua_pcallk (lua_State *L, int nargs, int nresults, int errfunc,
   struct CallS c;
   int status;
   ptrdiff_t func;
-  lua_lock(L);
+  api_lock(L);
   api_check(L, k == NULL || !isLua(L->ci),
     "cannot use continuations inside hooks");
   api_checknelems(L, nargs+1);
@@ -992,7 +1210,7 @@ LUA_API int lua_load (lua_State *L, lua_Reader reader, void *data,
                       const char *chunkname, const char *mode) {
   ZIO z;
   int status;
-  lua_lock(L);
+  api_lock(L);
   if (!chunkname) chunkname = "?";
   luaZ_init(L, &z, reader, data);
   status = luaD_protectedparser(L, &z, chunkname, mode);
@@ -1015,7 +1233,7 @@ LUA_API int lua_load (lua_State *L, lua_Reader reader, void *data,
 LUA_API int lua_dump (lua_State *L, lua_Writer writer, void *data, int strip) {
   int status;
   TValue *o;
-  lua_lock(L);
+  api_lock(L);
   api_checknelems(L, 1);
   o = L->top - 1;
   if (isLfunction(o))
@@ -1039,7 +1257,7 @@ LUA_API int lua_status (lua_State *L) {
 LUA_API int lua_gc (lua_State *L, int what, int data) {
   int res = 0;
   global_State *g;
-  lua_lock(L);
+  api_lock(L);
   g = G(L);
   switch (what) {
     case LUA_GCSTOP: {
@@ -1078,8 +1296,8 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
         luaC_checkGC(L);
       }
       g->gcrunning = oldrunning;  /* restore previous state */
-      if (debt > 0 && g->gcstate == GCSpause)  /* end of cycle? */
-        res = 1;  /* signal it */
+      if (debt > 0 && (g->gcstate == GCSpause || isgenerational(g)))
+        res = 1;  /* signal end of cycle (every generational step is one) */
       break;
     }
     case LUA_GCSETPAUSE: {
@@ -1097,6 +1315,29 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       res = g->gcrunning;
       break;
     }
+    case LUA_GCGEN: case LUA_GCINC: {
+      res = isgenerational(g) ? LUA_GCGEN : LUA_GCINC;  /* previous mode */
+      luaC_changemode(L, what == LUA_GCGEN);
+      break;
+    }
+    case LUA_GCSETMINORMUL: {
+      res = g->genminormul;
+      if (data < 1) data = 1;  /* avoid a collection at every step */
+      g->genminormul = data;
+      break;
+    }
+    case LUA_GCSETMAJORMUL: {
+      res = g->genmajormul;
+      g->genmajormul = data;
+      break;
+    }
+    case LUA_GCSETTHREADPOOL: {
+      res = g->maxthreadpool;
+      if (data < 0) data = 0;
+      g->maxthreadpool = data;
+      luaE_shrinkthreadpool(L, data);
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   lua_unlock(L);
@@ -1104,6 +1345,65 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
 }
 
 
+/*
+** Does collection work for about 'usec' microseconds (see
+** 'luaC_stepfor'); returns 1 if a cycle was finished
+*/
+LUA_API int lua_gcstepfor (lua_State *L, int usec, lua_GCReport *r) {
+  int res;
+  api_lock(L);
+  res = luaC_stepfor(L, usec, r);
+  lua_unlock(L);
+  return res;
+}
+
+
+/*
+** Gets the statistics of the n-th last collection cycle (0 is the last
+** one finished); returns 0 if that cycle is not kept anymore (or never
+** happened)
+*/
+LUA_API int lua_gcstats (lua_State *L, int n, lua_GCStats *s) {
+  global_State *g;
+  int res = 0;
+  api_lock(L);
+  g = G(L);
+  if (n >= 0 && n < GCSTATSSIZE && cast(unsigned long, n) < g->gcncycles) {
+    *s = g->gcstats[(g->gcncycles - 1 - n) % GCSTATSSIZE];
+    res = 1;
+  }
+  lua_unlock(L);
+  return res;
+}
+
+
+/*
+** Sets a function to be called with the statistics of each collection
+** cycle when it ends. It is called from inside the collector, so it
+** must not call the API.
+*/
+LUA_API void lua_setgcstatsf (lua_State *L, lua_GCStatsF f, void *ud) {
+  api_lock(L);
+  G(L)->gcstatsf = f;
+  G(L)->gcstatsud = ud;
+  lua_unlock(L);
+}
+
+
+/*
+** Writes the objects reachable from the roots, with their sizes and
+** references (see 'luaC_heapsnapshot'). The writer must not use the
+** state. Returns 0, the error from the writer or LUA_ERRMEM.
+*/
+LUA_API int lua_heapsnapshot (lua_State *L, lua_Writer writer, void *data) {
+  int status;
+  api_lock(L);
+  status = luaC_heapsnapshot(L, writer, data);
+  lua_unlock(L);
+  return status;
+}
+
+
 
 /*
 ** miscellaneous functions
@@ -1111,7 +1411,7 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
 
 
 LUA_API int lua_error (lua_State *L) {
-  lua_lock(L);
+  api_lock(L);
   api_checknelems(L, 1);
   luaG_errormsg(L);
   /* code unreachable; will unlock when control actually leaves the kernel */
@@ -1122,7 +1422,7 @@ LUA_API int lua_error (lua_State *L) {
 LUA_API int lua_next (lua_State *L, int idx) {
   StkId t;
   int more;
-  lua_lock(L);
+  api_lock(L);
   t = index2addr(L, idx);
   api_check(L, ttistable(t), "table expected");
   more = luaH_next(L, hvalue(t), L->top - 1);
@@ -1137,7 +1437,7 @@ LUA_API int lua_next (lua_State *L, int idx) {
 
 
 LUA_API void lua_concat (lua_State *L, int n) {
-  lua_lock(L);
+  api_lock(L);
   api_checknelems(L, n);
   if (n >= 2) {
     luaC_checkGC(L);
@@ -1154,7 +1454,7 @@ LUA_API void lua_concat (lua_State *L, int n) {
 
 LUA_API void lua_len (lua_State *L, int idx) {
   StkId t;
-  lua_lock(L);
+  api_lock(L);
   t = index2addr(L, idx);
   luaV_objlen(L, L->top, t);
   api_incr_top(L);
@@ -1164,7 +1464,7 @@ LUA_API void lua_len (lua_State *L, int idx) {
 
 LUA_API lua_Alloc lua_getallocf (lua_State *L, void **ud) {
   lua_Alloc f;
-  lua_lock(L);
+  api_lock(L);
   if (ud) *ud = G(L)->ud;
   f = G(L)->frealloc;
   lua_unlock(L);
@@ -1173,7 +1473,7 @@ LUA_API lua_Alloc lua_getallocf (lua_State *L, void **ud) {
 
 
 LUA_API void lua_setallocf (lua_State *L, lua_Alloc f, void *ud) {
-  lua_lock(L);
+  api_lock(L);
   G(L)->ud = ud;
   G(L)->frealloc = f;
   lua_unlock(L);
@@ -1182,7 +1482,7 @@ LUA_API void lua_setallocf (lua_State *L, lua_Alloc f, void *ud) {
 
 LUA_API void *lua_newuserdata (lua_State *L, size_t size) {
   Udata *u;
-  lua_lock(L);
+  api_lock(L);
   luaC_checkGC(L);
   u = luaS_newudata(L, size);
   setuvalue(L, L->top, u);
@@ -1221,7 +1521,7 @@ static const char *aux_upvalue (StkId fi, int n, TValue **val,
 LUA_API const char *lua_getupvalue (lua_State *L, int funcindex, int n) {
   const char *name;
   TValue *val = NULL;  /* to avoid warnings */
-  lua_lock(L);
+  api_lock(L);
   name = aux_upvalue(index2addr(L, funcindex), n, &val, NULL, NULL);
   if (name) {
     setobj2s(L, L->top, val);
@@ -1238,7 +1538,7 @@ LUA_API const char *lua_setupvalue (lua_State *L, int funcindex, int n) {
   CClosure *owner = NULL;
   UpVal *uv = NULL;
   StkId fi;
-  lua_lock(L);
+  api_lock(L);
   fi = index2addr(L, funcindex);
   api_checknelems(L, 1);
   name = aux_upvalue(fi, n, &val, &owner, &uv);
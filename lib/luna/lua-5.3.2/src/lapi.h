@@ -11,6 +11,12 @@
 #include "llimits.h"
 #include "lstate.h"
 
+/*
+** start of an API call on 'L', which may change its stack (in
+** generational mode 'L' may be an old thread; needs 'lgc.h')
+*/
+#define api_lock(L)	{ lua_lock(L); luaC_threadbarrier(L); }
+
 #define api_incr_top(L)   {L->top++; api_check(L, L->top <= L->ci->top, \
 				"stack overflow");}
 
@@ -485,6 +485,16 @@ static void *newbox (lua_State *L, size_t newsize) {
 #define buffonstack(B)	((B)->b != (B)->initb)
 
 
+/*
+** The block in a buffer box is laid out as a string under construction
+** (see 'lua_strbuffhead'): 'boxsize' is the size of a block for 'n'
+** characters, and the buffer starts 'lua_strbuffhead' bytes into it.
+** So, 'luaL_pushresult' can hand the block over to the final string
+** instead of copying it.
+*/
+#define boxsize(L,n)	(lua_strbuffhead(L) + (n) + 1)
+
+
 /*
 ** returns a pointer to a free area with at least 'sz' bytes
 */
@@ -495,16 +505,17 @@ LUALIB_API char *luaL_prepbuffsize (luaL_Buffer *B, size_t sz) {
     size_t newsize = B->size * 2;  /* double buffer size */
     if (newsize - B->n < sz)  /* not big enough? */
       newsize = B->n + sz;
-    if (newsize < B->n || newsize - B->n < sz)
+    if (newsize < B->n || newsize - B->n < sz ||
+        boxsize(L, newsize) < newsize)
       luaL_error(L, "buffer too large");
     /* create larger buffer */
     if (buffonstack(B))
-      newbuff = (char *)resizebox(L, -1, newsize);
+      newbuff = (char *)resizebox(L, -1, boxsize(L, newsize));
     else {  /* no buffer yet */
-      newbuff = (char *)newbox(L, newsize);
-      memcpy(newbuff, B->b, B->n * sizeof(char));  /* copy original content */
+      newbuff = (char *)newbox(L, boxsize(L, newsize));
+      memcpy(newbuff + lua_strbuffhead(L), B->b, B->n * sizeof(char));
     }
-    B->b = newbuff;
+    B->b = newbuff + lua_strbuffhead(L);
     B->size = newsize;
   }
   return &B->b[B->n];
@@ -527,11 +538,17 @@ LUALIB_API void luaL_addstring (luaL_Buffer *B, const char *s) {
 
 LUALIB_API void luaL_pushresult (luaL_Buffer *B) {
   lua_State *L = B->L;
-  lua_pushlstring(L, B->b, B->n);
   if (buffonstack(B)) {
-    resizebox(L, -2, 0);  /* delete old buffer */
-    lua_remove(L, -2);  /* remove its header from the stack */
+    UBox *box = (UBox *)lua_touserdata(L, -1);
+    void *block = box->box;
+    size_t bsize = box->bsize;
+    box->box = NULL;  /* the string takes over the block */
+    box->bsize = 0;
+    lua_pushstrbuff(L, block, bsize, B->n);
+    lua_remove(L, -2);  /* remove box from the stack */
   }
+  else
+    lua_pushlstring(L, B->b, B->n);
 }
 
 
@@ -191,6 +191,61 @@ typedef struct luaL_Stream {
 
 
 
+/*
+** {======================================================
+** Byte buffers for buffer library
+** =======================================================
+*/
+
+/*
+** A byte buffer is a userdata with metatable 'LUA_BUFFERHANDLE' and
+** structure 'luaL_ByteBuffer'. Its unread data is 'b[r .. w - 1]'.
+** Its block is allocated with 'lua_resizeblock'.
+*/
+
+#define LUA_BUFFERHANDLE        "BUFFER*"
+
+
+typedef struct luaL_ByteBuffer {
+  char *b;  /* block (NULL for empty buffers) */
+  size_t size;  /* block size */
+  size_t r;  /* read offset */
+  size_t w;  /* write offset */
+} luaL_ByteBuffer;
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Numeric arrays for numarray library
+** =======================================================
+*/
+
+/*
+** A numeric array is a userdata with metatable 'LUA_NUMARRAYHANDLE'
+** and structure 'luaL_NumArray': 'n' elements of element type 'type'
+** ('double', 'float', 'int' or 'long long') at 'p'.
+*/
+
+#define LUA_NUMARRAYHANDLE      "NUMARRAY*"
+
+#define LUA_NAFLOAT64	0
+#define LUA_NAFLOAT32	1
+#define LUA_NAINT32	2
+#define LUA_NAINT64	3
+
+
+typedef struct luaL_NumArray {
+  void *p;  /* elements */
+  size_t n;  /* number of elements */
+  int type;  /* element type */
+} luaL_NumArray;
+
+/* }====================================================== */
+
+
+
 /* compatibility with old module system */
 #if defined(LUA_COMPAT_MODULE)
 
@@ -170,16 +170,86 @@ static int luaB_rawset (lua_State *L) {
 }
 
 
+/*
+** collectgarbage("generational" [, minormul [, majormul]]) and
+** collectgarbage("incremental" [, pause [, stepmul]]): set the given
+** (non-zero) parameters, change the collector mode, and return the
+** previous mode
+*/
+static int changegcmode (lua_State *L, int mode) {
+  int p1 = (int)luaL_optinteger(L, 2, 0);
+  int p2 = (int)luaL_optinteger(L, 3, 0);
+  if (p1 != 0)
+    lua_gc(L, (mode == LUA_GCGEN) ? LUA_GCSETMINORMUL : LUA_GCSETPAUSE, p1);
+  if (p2 != 0)
+    lua_gc(L, (mode == LUA_GCGEN) ? LUA_GCSETMAJORMUL : LUA_GCSETSTEPMUL, p2);
+  lua_pushstring(L, (lua_gc(L, mode, 0) == LUA_GCGEN) ? "generational"
+                                                       : "incremental");
+  return 1;
+}
+
+
+/*
+** collectgarbage("stats" [, n]): return a table with the statistics of
+** the n-th last finished collection cycle (default 0, the last one), or
+** nil if that cycle is not kept
+*/
+static int gcstats (lua_State *L) {
+  lua_GCStats s;
+  int t;
+  if (!lua_gcstats(L, (int)luaL_optinteger(L, 2, 0), &s)) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_createtable(L, 0, 10);
+  lua_pushinteger(L, (lua_Integer)s.cycle);
+  lua_setfield(L, -2, "cycle");
+  lua_pushstring(L, s.kind);
+  lua_setfield(L, -2, "kind");
+  lua_pushinteger(L, s.propagate);
+  lua_setfield(L, -2, "propagate");
+  lua_pushinteger(L, s.atomic);
+  lua_setfield(L, -2, "atomic");
+  lua_pushinteger(L, s.sweep);
+  lua_setfield(L, -2, "sweep");
+  lua_pushinteger(L, s.callfin);
+  lua_setfield(L, -2, "callfin");
+  lua_pushinteger(L, (lua_Integer)s.marked);
+  lua_setfield(L, -2, "marked");
+  lua_pushinteger(L, (lua_Integer)s.swept);
+  lua_setfield(L, -2, "swept");
+  lua_pushinteger(L, (lua_Integer)s.memory);
+  lua_setfield(L, -2, "memory");
+  lua_newtable(L);  /* objects freed, by type */
+  for (t = 0; t < LUA_NUMTAGS; t++) {
+    if (s.freed[t] > 0) {
+      lua_pushinteger(L, (lua_Integer)s.freed[t]);
+      lua_setfield(L, -2, lua_typename(L, t));
+    }
+  }
+  lua_setfield(L, -2, "freed");
+  return 1;
+}
+
+
+#define GCSTATSOPT	(-1)  /* pseudo-option for "stats" */
+
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {"stop", "restart", "collect",
     "count", "step", "setpause", "setstepmul",
-    "isrunning", NULL};
+    "isrunning", "generational", "incremental", "stats", "setthreadpool",
+    NULL};
   static const int optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
     LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL,
-    LUA_GCISRUNNING};
+    LUA_GCISRUNNING, LUA_GCGEN, LUA_GCINC, GCSTATSOPT, LUA_GCSETTHREADPOOL};
   int o = optsnum[luaL_checkoption(L, 1, "collect", opts)];
-  int ex = (int)luaL_optinteger(L, 2, 0);
-  int res = lua_gc(L, o, ex);
+  int ex, res;
+  if (o == LUA_GCGEN || o == LUA_GCINC)
+    return changegcmode(L, o);
+  if (o == GCSTATSOPT)
+    return gcstats(L);
+  ex = (int)luaL_optinteger(L, 2, 0);
+  res = lua_gc(L, o, ex);
   switch (o) {
     case LUA_GCCOUNT: {
       int b = lua_gc(L, LUA_GCCOUNTB, 0);
@@ -0,0 +1,285 @@
+/*
+** $Id: lbuflib.c $
+** Library for mutable byte buffers
+** See Copyright Notice in lua.h
+*/
+
+#define lbuflib_c
+#define LUA_LIB
+
+#include "lprefix.h"
+
+
+#include <string.h>
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+/*
+** A buffer is a userdata with metatable 'LUA_BUFFERHANDLE' holding a
+** 'luaL_ByteBuffer': bytes are appended at 'w' and consumed from 'r', so
+** the unread data is always 'b[r .. w - 1]'. The block grows by
+** doubling and is compacted (unread data moved to its start) when at
+** least as much data was already consumed as is still unread. The
+** string library (upvalue 1 of all functions) does the formatting for
+** 'putf' and 'pack'.
+*/
+
+
+/* minimum size of a block */
+#define MINBUFFSIZE	64
+
+
+#define tobuffer(L)	((luaL_ByteBuffer *)luaL_checkudata(L, 1, LUA_BUFFERHANDLE))
+
+#define unread(B)	((B)->w - (B)->r)
+
+
+/*
+** returns a pointer to a free area with at least 'sz' bytes at the end
+** of the buffer
+*/
+static char *reserve (lua_State *L, luaL_ByteBuffer *B, size_t sz) {
+  size_t len = unread(B);
+  if (B->size - B->w >= sz)  /* enough space? */
+    return B->b + B->w;
+  if (B->r >= len && B->size - len >= sz) {  /* worth compacting? */
+    memmove(B->b, B->b + B->r, len);
+  }
+  else {
+    size_t newsize = (B->size < MINBUFFSIZE / 2) ? MINBUFFSIZE : B->size * 2;
+    if (len + sz < len)
+      luaL_error(L, "buffer too large");
+    if (newsize - len < sz || newsize < B->size)  /* not big enough? */
+      newsize = len + sz;
+    if (B->r > 0) {  /* move unread data to the start (no need to copy it) */
+      memmove(B->b, B->b + B->r, len);
+      B->r = 0;
+      B->w = len;  /* keep 'B' valid if the allocation below fails */
+    }
+    /* counted by the GC; on errors, the old block is still valid */
+    B->b = (char *)lua_resizeblock(L, B->b, B->size, newsize);
+    B->size = newsize;
+  }
+  B->r = 0;
+  B->w = len;
+  return B->b + B->w;
+}
+
+
+static void addlstring (lua_State *L, luaL_ByteBuffer *B,
+                        const char *s, size_t l) {
+  if (l > 0) {  /* avoid 'memcpy' when 's' can be NULL */
+    memcpy(reserve(L, B, l), s, l);
+    B->w += l;
+  }
+}
+
+
+/*
+** calls function 'name' from the string library with the values from
+** index 2 on, leaving its result at the top
+*/
+static void callstrlib (lua_State *L, const char *name) {
+  int n = lua_gettop(L) - 1;  /* number of arguments */
+  lua_getfield(L, lua_upvalueindex(1), name);
+  lua_insert(L, 2);  /* put function below its arguments */
+  lua_call(L, n, 1);
+}
+
+
+static int buf_new (lua_State *L) {
+  lua_Integer size = luaL_optinteger(L, 1, 0);
+  luaL_ByteBuffer *B;
+  luaL_argcheck(L, size >= 0, 1, "invalid size");
+  B = (luaL_ByteBuffer *)lua_newuserdata(L, sizeof(luaL_ByteBuffer));
+  B->b = NULL;  /* buffer is 'empty' */
+  B->size = B->r = B->w = 0;
+  luaL_setmetatable(L, LUA_BUFFERHANDLE);
+  if (size > 0)
+    reserve(L, B, (size_t)size);
+  return 1;
+}
+
+
+/*
+** appends all arguments (strings, numbers, or other buffers) and
+** returns the buffer
+*/
+static int buf_put (lua_State *L) {
+  luaL_ByteBuffer *B = tobuffer(L);
+  int n = lua_gettop(L);
+  int arg;
+  for (arg = 2; arg <= n; arg++) {
+    luaL_ByteBuffer *other = (luaL_ByteBuffer *)luaL_testudata(L, arg,
+                                                    LUA_BUFFERHANDLE);
+    if (other != NULL) {
+      size_t l = unread(other);
+      char *p = reserve(L, B, l);  /* (may move 'other' if it is 'B') */
+      if (l > 0)
+        memcpy(p, other->b + other->r, l);
+      B->w += l;
+    }
+    else {
+      size_t l;
+      const char *s = luaL_checklstring(L, arg, &l);
+      addlstring(L, B, s, l);
+    }
+  }
+  lua_settop(L, 1);  /* return buffer */
+  return 1;
+}
+
+
+/* buf:putf(fmt, ...): appends string.format(fmt, ...) */
+static int buf_putf (lua_State *L) {
+  luaL_ByteBuffer *B = tobuffer(L);
+  size_t l;
+  const char *s;
+  luaL_checkstring(L, 2);
+  callstrlib(L, "format");
+  s = lua_tolstring(L, -1, &l);
+  addlstring(L, B, s, l);
+  lua_settop(L, 1);  /* return buffer */
+  return 1;
+}
+
+
+/* buf:pack(fmt, ...): appends string.pack(fmt, ...) */
+static int buf_pack (lua_State *L) {
+  luaL_ByteBuffer *B = tobuffer(L);
+  size_t l;
+  const char *s;
+  luaL_checkstring(L, 2);
+  callstrlib(L, "pack");
+  s = lua_tolstring(L, -1, &l);
+  addlstring(L, B, s, l);
+  lua_settop(L, 1);  /* return buffer */
+  return 1;
+}
+
+
+/* number of bytes to consume: optional argument 2 (default all) */
+static size_t getcount (lua_State *L, luaL_ByteBuffer *B) {
+  size_t len = unread(B);
+  lua_Integer n = luaL_optinteger(L, 2, (lua_Integer)len);
+  luaL_argcheck(L, n >= 0, 2, "invalid count");
+  return ((lua_Unsigned)n < len) ? (size_t)n : len;
+}
+
+
+static void consume (luaL_ByteBuffer *B, size_t n) {
+  B->r += n;
+  if (B->r == B->w)  /* no more data? */
+    B->r = B->w = 0;  /* start again from the beginning */
+}
+
+
+/* buf:get([n]): removes and returns the first 'n' bytes (default all) */
+static int buf_get (lua_State *L) {
+  luaL_ByteBuffer *B = tobuffer(L);
+  size_t n = getcount(L, B);
+  lua_pushlstring(L, B->b + B->r, n);
+  consume(B, n);
+  return 1;
+}
+
+
+/* buf:skip(n): removes the first 'n' bytes */
+static int buf_skip (lua_State *L) {
+  luaL_ByteBuffer *B = tobuffer(L);
+  luaL_checkinteger(L, 2);
+  consume(B, getcount(L, B));
+  lua_settop(L, 1);  /* return buffer */
+  return 1;
+}
+
+
+/* buf:reset(): removes all data, keeping the block */
+static int buf_reset (lua_State *L) {
+  luaL_ByteBuffer *B = tobuffer(L);
+  B->r = B->w = 0;
+  lua_settop(L, 1);  /* return buffer */
+  return 1;
+}
+
+
+/* buf:tostring(): returns all unread data (without consuming it) */
+static int buf_tostring (lua_State *L) {
+  luaL_ByteBuffer *B = tobuffer(L);
+  lua_pushlstring(L, B->b + B->r, unread(B));
+  return 1;
+}
+
+
+static int buf_len (lua_State *L) {
+  luaL_ByteBuffer *B = tobuffer(L);
+  lua_pushinteger(L, (lua_Integer)unread(B));
+  return 1;
+}
+
+
+static int buf_gc (lua_State *L) {
+  luaL_ByteBuffer *B = tobuffer(L);
+  lua_resizeblock(L, B->b, B->size, 0);  /* free block */
+  B->b = NULL;
+  B->size = B->r = B->w = 0;
+  return 0;
+}
+
+
+static int buf_type (lua_State *L) {
+  luaL_checkany(L, 1);
+  if (luaL_testudata(L, 1, LUA_BUFFERHANDLE) == NULL)
+    lua_pushnil(L);  /* not a buffer */
+  else
+    lua_pushliteral(L, "buffer");
+  return 1;
+}
+
+
+/*
+** functions for 'buffer' library
+*/
+static const luaL_Reg buflib[] = {
+  {"new", buf_new},
+  {"type", buf_type},
+  {NULL, NULL}
+};
+
+
+/*
+** methods for buffers
+*/
+static const luaL_Reg blib[] = {
+  {"put", buf_put},
+  {"putf", buf_putf},
+  {"pack", buf_pack},
+  {"get", buf_get},
+  {"skip", buf_skip},
+  {"reset", buf_reset},
+  {"tostring", buf_tostring},
+  {"__tostring", buf_tostring},
+  {"__len", buf_len},
+  {"__gc", buf_gc},
+  {NULL, NULL}
+};
+
+
+LUAMOD_API int luaopen_buffer (lua_State *L) {
+  luaL_requiref(L, LUA_STRLIBNAME, luaopen_string, 0);  /* string library */
+  luaL_newlibtable(L, buflib);
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, buflib, 1);
+  luaL_newmetatable(L, LUA_BUFFERHANDLE);  /* metatable for buffers */
+  lua_pushvalue(L, -1);  /* push metatable */
+  lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+  lua_pushvalue(L, -3);
+  luaL_setfuncs(L, blib, 1);  /* add buffer methods to new metatable */
+  lua_pop(L, 1);  /* pop new metatable */
+  return 1;
+}
+
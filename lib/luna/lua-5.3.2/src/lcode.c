@@ -36,12 +36,12 @@
 #define hasjumps(e)	((e)->t != (e)->f)
 
 
-static int tonumeral(expdesc *e, TValue *v) {
+static int tonumeral(FuncState *fs, expdesc *e, TValue *v) {
   if (hasjumps(e))
     return 0;  /* not a numeral */
   switch (e->k) {
     case VKINT:
-      if (v) setivalue(v, e->u.ival);
+      if (v) setivalue(fs->ls->L, v, e->u.ival);
       return 1;
     case VKFLT:
       if (v) setfltvalue(v, e->u.nval);
@@ -327,7 +327,7 @@ static int addk (FuncState *fs, TValue *key, TValue *v) {
   k = fs->nk;
   /* numerical value does not need GC barrier;
      table has no metatable, so it does not need to invalidate cache */
-  setivalue(idx, k);
+  setivalue(L, idx, k);
   luaM_growvector(L, f->k, k, f->sizek, TValue, MAXARG_Ax, "constants");
   while (oldsize < f->sizek) setnilvalue(&f->k[oldsize++]);
   setobj(L, &f->k[k], v);
@@ -352,7 +352,7 @@ int luaK_stringK (FuncState *fs, TString *s) {
 int luaK_intK (FuncState *fs, lua_Integer n) {
   TValue k, o;
   setpvalue(&k, cast(void*, cast(size_t, n)));
-  setivalue(&o, n);
+  setivalue(fs->ls->L, &o, n);
   return addk(fs, &k, &o);
 }
 
@@ -766,7 +766,8 @@ static int validop (int op, TValue *v1, TValue *v2) {
 */
 static int constfolding (FuncState *fs, int op, expdesc *e1, expdesc *e2) {
   TValue v1, v2, res;
-  if (!tonumeral(e1, &v1) || !tonumeral(e2, &v2) || !validop(op, &v1, &v2))
+  if (!tonumeral(fs, e1, &v1) || !tonumeral(fs, e2, &v2) ||
+      !validop(op, &v1, &v2))
     return 0;  /* non-numeric operands or not safe to fold */
   luaO_arith(fs->ls->L, op, &v1, &v2, &res);  /* does operation */
   if (ttisinteger(&res)) {
@@ -871,7 +872,7 @@ void luaK_infix (FuncState *fs, BinOpr op, expdesc *v) {
     case OPR_MOD: case OPR_POW:
     case OPR_BAND: case OPR_BOR: case OPR_BXOR:
     case OPR_SHL: case OPR_SHR: {
-      if (!tonumeral(v, NULL)) luaK_exp2RK(fs, v);
+      if (!tonumeral(fs, v, NULL)) luaK_exp2RK(fs, v);
       break;
     }
     default: {
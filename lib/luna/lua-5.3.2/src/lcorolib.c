@@ -103,6 +103,28 @@ static int luaB_cowrap (lua_State *L) {
 }
 
 
+/*
+** coroutine.recycle(co [, f]): reset a dead or suspended coroutine to
+** the state of a new one (keeping its stack), with body 'f' if given
+*/
+static int luaB_corecycle (lua_State *L) {
+  lua_State *co = getco(L);
+  lua_Debug ar;
+  luaL_argcheck(L, co != L, 1, "cannot recycle a running coroutine");
+  luaL_argcheck(L, lua_status(co) != LUA_OK || lua_getstack(co, 0, &ar) == 0,
+                1, "cannot recycle a normal coroutine");
+  if (!lua_isnoneornil(L, 2))
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_resetthread(co);
+  if (!lua_isnoneornil(L, 2)) {
+    lua_pushvalue(L, 2);
+    lua_xmove(L, co, 1);  /* move function from L to co */
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+
 static int luaB_yield (lua_State *L) {
   return lua_yield(L, lua_gettop(L));
 }
@@ -156,6 +178,7 @@ static const luaL_Reg co_funcs[] = {
   {"wrap", luaB_cowrap},
   {"yield", luaB_yield},
   {"isyieldable", luaB_yieldable},
+  {"recycle", luaB_corecycle},
   {NULL, NULL}
 };
 
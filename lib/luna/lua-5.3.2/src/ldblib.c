@@ -10,6 +10,8 @@
 #include "lprefix.h"
 
 
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -428,15 +430,79 @@ static int db_traceback (lua_State *L) {
 }
 
 
+static int snapwriter (lua_State *L, const void *b, size_t size, void *f) {
+  (void)L;
+  return (fwrite(b, size, 1, (FILE *)f) != 1);
+}
+
+
+/*
+** debug.heapsnapshot(filename): write to the file the objects reachable
+** from the roots, with their sizes and references
+*/
+static int db_heapsnapshot (lua_State *L) {
+  const char *fname = luaL_checkstring(L, 1);
+  FILE *f = fopen(fname, "wb");
+  int status;
+  if (f == NULL)
+    return luaL_fileresult(L, 0, fname);
+  status = lua_heapsnapshot(L, snapwriter, f);
+  if (status == LUA_ERRMEM)
+    errno = ENOMEM;
+  if (fclose(f) != 0)
+    status = 1;
+  return luaL_fileresult(L, (status == 0), fname);
+}
+
+
+/*
+** debug.memprofile(rate): start the sampling memory profiler with a
+** sample every 'rate' bytes (on average), change its rate, or stop it
+** (rate 0); returns the previous rate
+*/
+static int db_memprofile (lua_State *L) {
+  lua_Integer rate = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, 0 <= rate && rate <= INT_MAX, 1, "out of range");
+  lua_pushinteger(L, lua_memprofile(L, (int)rate));
+  return 1;
+}
+
+
+static int profwriter (lua_State *L, const void *b, size_t size, void *B) {
+  (void)L;
+  luaL_addlstring((luaL_Buffer *)B, (const char *)b, size);
+  return 0;
+}
+
+
+/*
+** debug.memprofdump(["live" | "total"]): returns the profile as folded
+** stacks, one 'frame;...;(type) bytes' line per allocation site
+*/
+static int db_memprofdump (lua_State *L) {
+  static const char *const opts[] = {"live", "total", NULL};
+  static const int optsnum[] = {LUA_MPLIVE, LUA_MPTOTAL};
+  int what = optsnum[luaL_checkoption(L, 1, "live", opts)];
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  lua_memprofdump(L, profwriter, &b, what);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+
 static const luaL_Reg dblib[] = {
   {"debug", db_debug},
   {"getuservalue", db_getuservalue},
   {"gethook", db_gethook},
+  {"heapsnapshot", db_heapsnapshot},
   {"getinfo", db_getinfo},
   {"getlocal", db_getlocal},
   {"getregistry", db_getregistry},
   {"getmetatable", db_getmetatable},
   {"getupvalue", db_getupvalue},
+  {"memprofdump", db_memprofdump},
+  {"memprofile", db_memprofile},
   {"upvaluejoin", db_upvaluejoin},
   {"upvalueid", db_upvalueid},
   {"setuservalue", db_setuservalue},
@@ -21,6 +21,7 @@
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
+#include "lgc.h"
 #include "lobject.h"
 #include "lopcodes.h"
 #include "lstate.h"
@@ -163,7 +164,7 @@ static const char *findlocal (lua_State *L, CallInfo *ci, int n,
 
 LUA_API const char *lua_getlocal (lua_State *L, const lua_Debug *ar, int n) {
   const char *name;
-  lua_lock(L);
+  api_lock(L);
   swapextra(L);
   if (ar == NULL) {  /* information about non-active function? */
     if (!isLfunction(L->top - 1))  /* not a Lua function? */
@@ -188,7 +189,7 @@ LUA_API const char *lua_getlocal (lua_State *L, const lua_Debug *ar, int n) {
 LUA_API const char *lua_setlocal (lua_State *L, const lua_Debug *ar, int n) {
   StkId pos = NULL;  /* to avoid warnings */
   const char *name;
-  lua_lock(L);
+  api_lock(L);
   swapextra(L);
   name = findlocal(L, ar->i_ci, n, &pos);
   if (name) {
@@ -294,7 +295,7 @@ LUA_API int lua_getinfo (lua_State *L, const char *what, lua_Debug *ar) {
   Closure *cl;
   CallInfo *ci;
   StkId func;
-  lua_lock(L);
+  api_lock(L);
   swapextra(L);
   if (*what == '>') {
     ci = NULL;
@@ -11,6 +11,7 @@
 
 
 #include <string.h>
+#include <time.h>
 
 #include "lua.h"
 
@@ -19,6 +20,7 @@
 #include "lfunc.h"
 #include "lgc.h"
 #include "lmem.h"
+#include "lmemprof.h"
 #include "lobject.h"
 #include "lstate.h"
 #include "lstring.h"
@@ -60,10 +62,28 @@
 
 
 /*
-** 'makewhite' erases all color bits then sets only the current white
-** bit
+** 'l_gcclock' gives the current time in microseconds, used to keep
+** 'luaC_stepfor' within its budget: a monotonic clock where POSIX
+** offers one, the processor time otherwise
 */
-#define maskcolors	(~(bitmask(BLACKBIT) | WHITEBITS))
+#if !defined(l_gcclock)
+#if defined(LUA_USE_POSIX) && defined(CLOCK_MONOTONIC)
+static l_mem l_gcclock (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return cast(l_mem, ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+#else
+#define l_gcclock()	cast(l_mem, cast(double, clock()) * 1e6 / CLOCKS_PER_SEC)
+#endif
+#endif
+
+
+/*
+** 'makewhite' erases all color bits (and the old bit) then sets only
+** the current white bit
+*/
+#define maskcolors	(~(bitmask(BLACKBIT) | WHITEBITS | bitmask(OLDBIT)))
 #define makewhite(g,x)	\
  (x->marked = cast_byte((x->marked & maskcolors) | luaC_white(g)))
 
@@ -107,6 +127,39 @@ static void reallymarkobject (global_State *g, GCObject *o);
 #define gnodelast(h)	gnode(h, cast(size_t, sizenode(h)))
 
 
+/*
+** traverse all nodes 'n' in the hash part of table 'h'. When the hash
+** part is being rehashed incrementally, its entries not moved yet are
+** still in the old vector, which is visited after the current one.
+*/
+#if defined(LUA_USE_INCREHASH)
+
+#define fornodes(h,n,limit)  \
+  for (n = gnode(h, 0), limit = gnodelast(h); \
+       n < limit || oldsegment(h, &n, &limit); n++)
+
+static int oldsegment (Table *h, Node **n, Node **limit) {
+  if (h->oldnode != NULL && *limit == gnodelast(h)) {
+    *n = goldfirst(h);
+    *limit = goldlast(h);
+    return (*n < *limit);
+  }
+  return 0;
+}
+
+#define oldnodesize(h)  \
+	((h)->oldnode == NULL ? 0 : cast(size_t, twoto((h)->loldsizenode)))
+
+#else
+
+#define fornodes(h,n,limit)  \
+  for (n = gnode(h, 0), limit = gnodelast(h); n < limit; n++)
+
+#define oldnodesize(h)	0
+
+#endif
+
+
 /*
 ** link collectable object 'o' into list pointed by 'p'
 */
@@ -132,9 +185,9 @@ static void removeentry (Node *n) {
 /*
 ** tells whether a key or value can be cleared from a weak
 ** table. Non-collectable objects are never removed from weak
-** tables. Strings behave as 'values', so are never removed too. for
-** other objects: if really collected, cannot keep them; for objects
-** being finalized, keep them in keys, but not in values
+** tables. Strings (and boxed integers) behave as 'values', so are never
+** removed too. for other objects: if really collected, cannot keep them;
+** for objects being finalized, keep them in keys, but not in values
 */
 static int iscleared (global_State *g, const TValue *o) {
   if (!iscollectable(o)) return 0;
@@ -142,6 +195,10 @@ static int iscleared (global_State *g, const TValue *o) {
     markobject(g, tsvalue(o));  /* strings are 'values', so are never weak */
     return 0;
   }
+  else if (ttisboxedint(o)) {
+    markobject(g, gcvalue(o));  /* so are integers */
+    return 0;
+  }
   else return iswhite(gcvalue(o));
 }
 
@@ -176,6 +233,20 @@ void luaC_barrierback_ (lua_State *L, Table *t) {
 }
 
 
+/*
+** barrier for threads whose stack is about to change. In generational
+** mode, a thread that is not running can be old and out of the gray
+** lists (see 'blackenidle'); put it back in 'grayagain', so that the
+** next collection traverses its stack again.
+*/
+void luaC_threadbarrier_ (lua_State *L) {
+  global_State *g = G(L);
+  lua_assert(isblack(L) && !isdead(g, L));
+  black2gray(L);  /* make thread gray (again) */
+  linkgclist(L, g->grayagain);
+}
+
+
 /*
 ** barrier for assignments to closed upvalues. Because upvalues are
 ** shared among closures, it is impossible to know the color of all
@@ -215,6 +286,24 @@ GCObject *luaC_newobj (lua_State *L, int tt, size_t sz) {
   return o;
 }
 
+
+/*
+** make a new collectable object out of a block with 'sz' bytes that
+** was allocated directly with the state's allocator (and so was not
+** accounted yet)
+*/
+GCObject *luaC_adoptobj (lua_State *L, int tt, void *block, size_t sz) {
+  global_State *g = G(L);
+  GCObject *o = cast(GCObject *, block);
+  g->GCdebt += sz;
+  luaM_profile(L, g, NULL, block, sz, novariant(tt));
+  o->marked = luaC_white(g);
+  o->tt = tt;
+  o->next = g->allgc;
+  g->allgc = o;
+  return o;
+}
+
 /* }====================================================== */
 
 
@@ -246,6 +335,13 @@ static void reallymarkobject (global_State *g, GCObject *o) {
       g->GCmemtrav += sizelstring(gco2ts(o)->u.lnglen);
       break;
     }
+#if defined(LUA_USE_NANBOX)
+    case LUA_TNUMINT: {
+      gray2black(o);
+      g->GCmemtrav += sizeof(IntBox);
+      break;
+    }
+#endif
     case LUA_TUSERDATA: {
       TValue uvalue;
       markobjectN(g, gco2u(o)->metatable);  /* mark its metatable */
@@ -358,12 +454,33 @@ static void restartcollection (global_State *g) {
 ** atomic phase. In the atomic phase, if table has any white value,
 ** put it in 'weak' list, to be cleared.
 */
+/*
+** memory used by each kind of object with internal parts (also used by
+** heap snapshots)
+*/
+#define tablesize(h)  \
+	(sizeof(Table) + sizeof(TValue) * (h)->sizearray + \
+	 sizeof(Node) * (cast(size_t, sizenode(h)) + oldnodesize(h)))
+
+#define protosize(f)  \
+	(sizeof(Proto) + sizeof(Instruction) * (f)->sizecode + \
+	                 sizeof(Proto *) * (f)->sizep + \
+	                 sizeof(TValue) * (f)->sizek + \
+	                 sizeof(int) * (f)->sizelineinfo + \
+	                 sizeof(LocVar) * (f)->sizelocvars + \
+	                 sizeof(Upvaldesc) * (f)->sizeupvalues)
+
+#define threadsize(th)  \
+	(sizeof(lua_State) + sizeof(TValue) * (th)->stacksize + \
+	 sizeof(CallInfo) * (th)->nci)
+
+
 static void traverseweakvalue (global_State *g, Table *h) {
-  Node *n, *limit = gnodelast(h);
+  Node *n, *limit;
   /* if there is array part, assume it may have white values (it is not
      worth traversing it now just to check) */
   int hasclears = (h->sizearray > 0);
-  for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
+  fornodes(h, n, limit) {  /* traverse hash part */
     checkdeadkey(n);
     if (ttisnil(gval(n)))  /* entry is empty? */
       removeentry(n);  /* remove it */
@@ -378,6 +495,8 @@ static void traverseweakvalue (global_State *g, Table *h) {
     linkgclist(h, g->grayagain);  /* must retraverse it in atomic phase */
   else if (hasclears)
     linkgclist(h, g->weak);  /* has to be cleared later */
+  else if (isgenerational(g))
+    gray2black(h);  /* nothing to clear; see 'blackenweak' */
 }
 
 
@@ -395,7 +514,7 @@ static int traverseephemeron (global_State *g, Table *h) {
   int marked = 0;  /* true if an object is marked in this traversal */
   int hasclears = 0;  /* true if table has white keys */
   int hasww = 0;  /* true if table has entry "white-key -> white-value" */
-  Node *n, *limit = gnodelast(h);
+  Node *n, *limit;
   unsigned int i;
   /* traverse array part */
   for (i = 0; i < h->sizearray; i++) {
@@ -405,7 +524,7 @@ static int traverseephemeron (global_State *g, Table *h) {
     }
   }
   /* traverse hash part */
-  for (n = gnode(h, 0); n < limit; n++) {
+  fornodes(h, n, limit) {
     checkdeadkey(n);
     if (ttisnil(gval(n)))  /* entry is empty? */
       removeentry(n);  /* remove it */
@@ -426,16 +545,18 @@ static int traverseephemeron (global_State *g, Table *h) {
     linkgclist(h, g->ephemeron);  /* have to propagate again */
   else if (hasclears)  /* table has white keys? */
     linkgclist(h, g->allweak);  /* may have to clean white keys */
+  else if (isgenerational(g))
+    gray2black(h);  /* nothing to clear; see 'blackenweak' */
   return marked;
 }
 
 
 static void traversestrongtable (global_State *g, Table *h) {
-  Node *n, *limit = gnodelast(h);
+  Node *n, *limit;
   unsigned int i;
   for (i = 0; i < h->sizearray; i++)  /* traverse array part */
     markvalue(g, &h->array[i]);
-  for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
+  fornodes(h, n, limit) {  /* traverse hash part */
     checkdeadkey(n);
     if (ttisnil(gval(n)))  /* entry is empty? */
       removeentry(n);  /* remove it */
@@ -466,8 +587,7 @@ static lu_mem traversetable (global_State *g, Table *h) {
   }
   else  /* not weak */
     traversestrongtable(g, h);
-  return sizeof(Table) + sizeof(TValue) * h->sizearray +
-                         sizeof(Node) * cast(size_t, sizenode(h));
+  return tablesize(h);
 }
 
 
@@ -489,12 +609,7 @@ static int traverseproto (global_State *g, Proto *f) {
     markobjectN(g, f->p[i]);
   for (i = 0; i < f->sizelocvars; i++)  /* mark local-variable names */
     markobjectN(g, f->locvars[i].varname);
-  return sizeof(Proto) + sizeof(Instruction) * f->sizecode +
-                         sizeof(Proto *) * f->sizep +
-                         sizeof(TValue) * f->sizek +
-                         sizeof(int) * f->sizelineinfo +
-                         sizeof(LocVar) * f->sizelocvars +
-                         sizeof(Upvaldesc) * f->sizeupvalues;
+  return protosize(f);
 }
 
 
@@ -547,8 +662,7 @@ static lu_mem traversethread (global_State *g, lua_State *th) {
   }
   else if (g->gckind != KGC_EMERGENCY)
     luaD_shrinkstack(th); /* do not change stack in emergency cycle */
-  return (sizeof(lua_State) + sizeof(TValue) * th->stacksize +
-          sizeof(CallInfo) * th->nci);
+  return threadsize(th);
 }
 
 
@@ -639,12 +753,12 @@ static void convergeephemerons (global_State *g) {
 static void clearkeys (global_State *g, GCObject *l, GCObject *f) {
   for (; l != f; l = gco2t(l)->gclist) {
     Table *h = gco2t(l);
-    Node *n, *limit = gnodelast(h);
-    for (n = gnode(h, 0); n < limit; n++) {
-      if (!ttisnil(gval(n)) && (iscleared(g, gkey(n)))) {
+    Node *n, *limit;
+    fornodes(h, n, limit) {
+      if (iscleared(g, gkey(n)))  /* unmarked key? */
         setnilvalue(gval(n));  /* remove value ... */
-        removeentry(n);  /* and remove entry from table */
-      }
+      if (ttisnil(gval(n)))  /* is entry empty? */
+        removeentry(n);  /* remove entry from table */
     }
   }
 }
@@ -657,14 +771,14 @@ static void clearkeys (global_State *g, GCObject *l, GCObject *f) {
 static void clearvalues (global_State *g, GCObject *l, GCObject *f) {
   for (; l != f; l = gco2t(l)->gclist) {
     Table *h = gco2t(l);
-    Node *n, *limit = gnodelast(h);
+    Node *n, *limit;
     unsigned int i;
     for (i = 0; i < h->sizearray; i++) {
       TValue *o = &h->array[i];
       if (iscleared(g, o))  /* value was collected? */
         setnilvalue(o);  /* remove value */
     }
-    for (n = gnode(h, 0); n < limit; n++) {
+    fornodes(h, n, limit) {
       if (!ttisnil(gval(n)) && iscleared(g, gval(n))) {
         setnilvalue(gval(n));  /* remove value ... */
         removeentry(n);  /* and remove entry from table */
@@ -694,6 +808,8 @@ static void freeLclosure (lua_State *L, LClosure *cl) {
 
 
 static void freeobj (lua_State *L, GCObject *o) {
+  /* count it (prototypes count as functions) */
+  G(L)->gccycle.freed[(o->tt == LUA_TPROTO) ? LUA_TFUNCTION : novariant(o->tt)]++;
   switch (o->tt) {
     case LUA_TPROTO: luaF_freeproto(L, gco2p(o)); break;
     case LUA_TLCL: {
@@ -715,6 +831,9 @@ static void freeobj (lua_State *L, GCObject *o) {
       luaM_freemem(L, o, sizelstring(gco2ts(o)->u.lnglen));
       break;
     }
+#if defined(LUA_USE_NANBOX)
+    case LUA_TNUMINT: luaM_freemem(L, o, sizeof(IntBox)); break;
+#endif
     default: lua_assert(0);
   }
 }
@@ -728,8 +847,10 @@ static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count);
 ** sweep at most 'count' elements from a list of GCObjects erasing dead
 ** objects, where a dead object is one marked with the old (non current)
 ** white; change all non-dead objects back to white, preparing for next
-** collection cycle. Return where to continue the traversal or NULL if
-** list is finished.
+** collection cycle. (In generational mode, non-dead objects keep their
+** marks and become old instead, and the sweep stops at the first old
+** object, as all objects after it are old too.) Return where to
+** continue the traversal or NULL if list is finished.
 */
 static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count) {
   global_State *g = G(L);
@@ -742,6 +863,12 @@ static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count) {
       *p = curr->next;  /* remove 'curr' from list */
       freeobj(L, curr);  /* erase 'curr' */
     }
+    else if (isgenerational(g)) {  /* survivor becomes old */
+      if (isold(curr))  /* reached old objects? */
+        return NULL;  /* nothing more to sweep in this list */
+      curr->marked = cast_byte(marked | bitmask(OLDBIT));
+      p = &curr->next;  /* go to next element */
+    }
     else {  /* change mark to 'white' */
       curr->marked = cast_byte((marked & maskcolors) | white);
       p = &curr->next;  /* go to next element */
@@ -755,12 +882,15 @@ static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count) {
 ** sweep a list until a live object (or end of list)
 */
 static GCObject **sweeptolive (lua_State *L, GCObject **p, int *n) {
+  global_State *g = G(L);
   GCObject **old = p;
+  l_mem olddebt = g->GCdebt;
   int i = 0;
   do {
     i++;
     p = sweeplist(L, p, 1);
   } while (p == old);
+  g->gccycle.swept += olddebt - g->GCdebt;
   if (n) *n += i;
   return p;
 }
@@ -794,6 +924,7 @@ static GCObject *udata2finalize (global_State *g) {
   o->next = g->allgc;  /* return it to 'allgc' list */
   g->allgc = o;
   resetbit(o->marked, FINALIZEDBIT);  /* object is "normal" again */
+  resetbit(o->marked, OLDBIT);  /* it is now before young objects */
   if (issweepphase(g))
     makewhite(g, o);  /* "sweep" object */
   return o;
@@ -917,6 +1048,7 @@ void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
     o->next = g->finobj;  /* link it in 'finobj' list */
     g->finobj = o;
     l_setbit(o->marked, FINALIZEDBIT);  /* mark it as such */
+    resetbit(o->marked, OLDBIT);  /* it is now before young objects */
   }
 }
 
@@ -937,14 +1069,17 @@ void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
 ** should be OK: it cannot be zero (because Lua cannot even start with
 ** less than PAUSEADJ bytes).
 */
-static void setpause (global_State *g) {
-  l_mem threshold, debt;
+static l_mem pausethreshold (global_State *g) {
   l_mem estimate = g->GCestimate / PAUSEADJ;  /* adjust 'estimate' */
   lua_assert(estimate > 0);
-  threshold = (g->gcpause < MAX_LMEM / estimate)  /* overflow? */
-            ? estimate * g->gcpause  /* no overflow */
-            : MAX_LMEM;  /* overflow; truncate to maximum */
-  debt = gettotalbytes(g) - threshold;
+  return (g->gcpause < MAX_LMEM / estimate)  /* overflow? */
+         ? estimate * g->gcpause  /* no overflow */
+         : MAX_LMEM;  /* overflow; truncate to maximum */
+}
+
+
+static void setpause (global_State *g) {
+  l_mem debt = gettotalbytes(g) - pausethreshold(g);
   luaE_setdebt(g, debt);
 }
 
@@ -969,6 +1104,7 @@ static int entersweep (lua_State *L) {
 
 void luaC_freeallobjects (lua_State *L) {
   global_State *g = G(L);
+  luaC_changemode(L, 0);  /* sweep below must visit old objects too */
   separatetobefnz(g, 1);  /* separate all objects with finalizers */
   lua_assert(g->finobj == NULL);
   callallpendingfinalizers(L, 0);
@@ -982,6 +1118,42 @@ void luaC_freeallobjects (lua_State *L) {
 }
 
 
+/*
+** In generational mode, weak tables are kept black after being cleared
+** (as they then have no white entries), so that a barrier catches any
+** young object stored in them and puts them back in 'grayagain' for the
+** next collection.
+*/
+static void blackenweak (GCObject *l) {
+  for (; l != NULL; l = gco2t(l)->gclist)
+    gray2black(l);
+}
+
+
+/*
+** In generational mode, a thread that is not running (suspended, dead,
+** or with no calls in progress) turns black and leaves 'grayagain'
+** (which, at the end of 'atomic', holds only threads), so that minor
+** collections stop traversing its stack; the API puts it back whenever
+** it may change that stack ('luaC_threadbarrier'). The thread running
+** the collection, the main thread, and threads with open upvalues
+** (which other threads can change without any barrier) stay gray.
+*/
+static void blackenidle (lua_State *L, global_State *g) {
+  GCObject **p = &g->grayagain;
+  while (*p != NULL) {
+    lua_State *th = gco2th(*p);
+    if (th != L && th != g->mainthread && th->openupval == NULL &&
+        (th->status != LUA_OK || th->ci == &th->base_ci)) {
+      *p = th->gclist;  /* remove 'th' from 'grayagain' */
+      gray2black(th);
+    }
+    else
+      p = &th->gclist;
+  }
+}
+
+
 static l_mem atomic (lua_State *L) {
   global_State *g = G(L);
   l_mem work;
@@ -989,6 +1161,7 @@ static l_mem atomic (lua_State *L) {
   GCObject *grayagain = g->grayagain;  /* save original list */
   lua_assert(g->ephemeron == NULL && g->weak == NULL);
   lua_assert(!iswhite(g->mainthread));
+  g->grayagain = NULL;  /* collects the threads traversed from now on */
   g->gcstate = GCSinsideatomic;
   g->GCmemtrav = 0;  /* start counting work */
   markobject(g, L);  /* mark running thread */
@@ -1001,6 +1174,7 @@ static l_mem atomic (lua_State *L) {
   work = g->GCmemtrav;  /* stop counting (do not recount 'grayagain') */
   g->gray = grayagain;
   propagateall(g);  /* traverse 'grayagain' list */
+  g->gccycle.marked += g->GCmemtrav - work;  /* (not part of 'work') */
   g->GCmemtrav = 0;  /* restart counting */
   convergeephemerons(g);
   /* at this point, all strongly accessible objects are marked. */
@@ -1023,6 +1197,15 @@ static l_mem atomic (lua_State *L) {
   clearvalues(g, g->weak, origweak);
   clearvalues(g, g->allweak, origall);
   luaS_clearcache(g);
+  if (isgenerational(g)) {
+    /* 'grayagain' (the live threads still running) is the start of
+       the next remembered set */
+    blackenweak(g->weak);
+    blackenweak(g->allweak);
+    blackenweak(g->ephemeron);
+    g->weak = g->allweak = g->ephemeron = NULL;
+    blackenidle(L, g);
+  }
   g->currentwhite = cast_byte(otherwhite(g));  /* flip current white */
   work += g->GCmemtrav;  /* complete counting */
   return work;  /* estimate of memory marked by 'atomic' */
@@ -1033,8 +1216,11 @@ static lu_mem sweepstep (lua_State *L, global_State *g,
                          int nextstate, GCObject **nextlist) {
   if (g->sweepgc) {
     l_mem olddebt = g->GCdebt;
+    luaM_deferfrees(g, g->gckind == KGC_NORMAL);  /* (see LUA_USE_BGFREE) */
     g->sweepgc = sweeplist(L, g->sweepgc, GCSWEEPMAX);
+    luaM_deferfrees(g, 0);
     g->GCestimate += g->GCdebt - olddebt;  /* update estimate */
+    g->gccycle.swept += olddebt - g->GCdebt;
     if (g->sweepgc)  /* is there still something to sweep? */
       return (GCSWEEPMAX * GCSWEEPCOST);
   }
@@ -1045,7 +1231,7 @@ static lu_mem sweepstep (lua_State *L, global_State *g,
 }
 
 
-static lu_mem singlestep (lua_State *L) {
+static lu_mem runphase (lua_State *L) {
   global_State *g = G(L);
   switch (g->gcstate) {
     case GCSpause: {
@@ -1056,9 +1242,10 @@ static lu_mem singlestep (lua_State *L) {
     }
     case GCSpropagate: {
       g->GCmemtrav = 0;
-      lua_assert(g->gray);
-      propagatemark(g);
-       if (g->gray == NULL)  /* no more gray objects? */
+      lua_assert(g->gray || isgenerational(g));
+      if (g->gray)  /* (a minor collection may have nothing to mark) */
+        propagatemark(g);
+      if (g->gray == NULL)  /* no more gray objects? */
         g->gcstate = GCSatomic;  /* finish propagate phase */
       return g->GCmemtrav;  /* memory traversed in this step */
     }
@@ -1067,6 +1254,7 @@ static lu_mem singlestep (lua_State *L) {
       int sw;
       propagateall(g);  /* make sure gray list is empty */
       work = atomic(L);  /* work is what was traversed by 'atomic' */
+      g->gccycle.marked += work;
       sw = entersweep(L);
       g->GCestimate = gettotalbytes(g);  /* first estimate */;
       return work + sw * GCSWEEPCOST;
@@ -1081,8 +1269,10 @@ static lu_mem singlestep (lua_State *L) {
       return sweepstep(L, g, GCSswpend, NULL);
     }
     case GCSswpend: {  /* finish sweeps */
-      makewhite(g, g->mainthread);  /* sweep main thread */
+      if (!isgenerational(g))  /* (else it stays gray in 'grayagain') */
+        makewhite(g, g->mainthread);  /* sweep main thread */
       checkSizes(L, g);
+      luaM_flushfrees(L);  /* let the last dead objects go */
       g->gcstate = GCScallfin;
       return 0;
     }
@@ -1101,14 +1291,73 @@ static lu_mem singlestep (lua_State *L) {
 }
 
 
+/*
+** The collector charges its time to the statistics of the current
+** cycle ('gccycle') whenever it changes state and at the end of each
+** stretch of work; 'startclock' marks the beginning of a stretch.
+*/
+#define startclock(g)	((g)->gcclock = l_gcclock())
+
+
+static void chargetime (global_State *g, int state) {
+  lua_GCStats *c = &g->gccycle;
+  l_mem now = l_gcclock();
+  long t = cast(long, now - g->gcclock);
+  g->gcclock = now;
+  switch (state) {
+    case GCSpause: case GCSpropagate: c->propagate += t; break;
+    case GCSatomic: c->atomic += t; break;
+    case GCScallfin: c->callfin += t; break;
+    default: c->sweep += t; break;  /* sweep phases */
+  }
+}
+
+
+/*
+** Closes the statistics of the current cycle: stores them in the ring
+** 'gcstats' (the slot is filled before 'gcncycles' counts it, so that
+** it is never seen half written) and calls 'gcstatsf'. The next cycle
+** starts with empty statistics.
+*/
+static void endcycle (global_State *g, const char *kind) {
+  lua_GCStats *c = &g->gccycle;
+  if (c->kind == NULL)  /* kind not set during the cycle? */
+    c->kind = kind;
+  c->cycle = g->gcncycles + 1;
+  c->memory = gettotalbytes(g);
+  g->gcstats[g->gcncycles % GCSTATSSIZE] = *c;
+  g->gcncycles++;
+  if (g->gcstatsf)
+    (*g->gcstatsf)(g->gcstatsud, c);
+  memset(c, 0, sizeof(*c));
+}
+
+
+/*
+** runs one step of the current phase, keeping its statistics
+*/
+static lu_mem singlestep (lua_State *L) {
+  global_State *g = G(L);
+  int state = g->gcstate;
+  lu_mem work = runphase(L);
+  if (state == GCSpropagate || state == GCSpause)  /* ('atomic' counts its own) */
+    g->gccycle.marked += g->GCmemtrav;
+  if (g->gcstate != state)  /* phase is over? */
+    chargetime(g, state);
+  return work;
+}
+
+
 /*
 ** advances the garbage collector until it reaches a state allowed
 ** by 'statemask'
 */
 void luaC_runtilstate (lua_State *L, int statesmask) {
   global_State *g = G(L);
+  startclock(g);
   while (!testbit(statesmask, g->gcstate))
     singlestep(L);
+  chargetime(g, g->gcstate);
 }
 
 
@@ -1127,6 +1376,105 @@ static l_mem getdebt (global_State *g) {
   }
 }
 
+/*
+** Set the debt for the next minor collection (generational mode):
+** after the program allocates 'genminormul'% of the memory in use
+** (kept in 'GCestimate').
+*/
+static void setminordebt (global_State *g) {
+  g->GCestimate = gettotalbytes(g);
+  luaE_setdebt(g, -(cast(l_mem, gettotalbytes(g) / 100) * g->genminormul));
+}
+
+
+/*
+** Minor collection: run a cycle from the propagate phase, without
+** restarting it (old objects are still marked), and go back to that
+** phase. The finalizers run after that, so that they see the collector
+** in its usual state between collections.
+*/
+static void youngcollection (lua_State *L, global_State *g) {
+  lua_assert(g->gcstate == GCSpropagate);
+  luaC_runtilstate(L, bitmask(GCScallfin));
+  g->gcstate = GCSpropagate;  /* skip restart */
+  if (g->gckind != KGC_EMERGENCY) {
+    startclock(g);
+    callallpendingfinalizers(L, 1);
+    chargetime(g, GCScallfin);
+  }
+}
+
+
+/*
+** Enter generational mode: finish any pending cycle (so that all
+** objects are white) and run a new one where every survivor becomes
+** old.
+*/
+static void entergen (lua_State *L, global_State *g) {
+  luaC_runtilstate(L, bitmask(GCSpause));  /* finish any pending cycle */
+  luaC_runtilstate(L, bitmask(GCSpropagate));  /* start new cycle */
+  g->gcgen = 1;
+  youngcollection(L, g);  /* all objects are young now */
+  g->GClastmajor = gettotalbytes(g);
+}
+
+
+/*
+** Major collection: sweep everything to turn it white and young again
+** (as white has not changed, nothing is collected) and enter
+** generational mode again.
+*/
+static void fullgen (lua_State *L, global_State *g) {
+  g->gcgen = 0;
+  entersweep(L);
+  entergen(L, g);
+}
+
+
+/*
+** Does a minor collection, or a major one if the last minor collection
+** left the heap larger than 'genmajormul'% over the size after the
+** last major collection (signaled by a zero 'GClastmajor').
+*/
+static void genstep (lua_State *L, global_State *g) {
+  if (g->GClastmajor == 0) {  /* major collection signaled? */
+    fullgen(L, g);
+    endcycle(g, "major");
+  }
+  else {
+    lu_mem majorbase = g->GClastmajor;
+    youngcollection(L, g);
+    if (gettotalbytes(g) > (majorbase / 100) * (100 + g->genmajormul))
+      g->GClastmajor = 0;  /* signal for a major collection */
+    endcycle(g, "minor");
+  }
+  setminordebt(g);
+}
+
+
+/*
+** Change collector mode: generational ('gen' true) or incremental.
+** Going back to incremental mode sweeps everything to turn it white;
+** the incremental collector finishes that sweep and starts a regular
+** cycle.
+*/
+void luaC_changemode (lua_State *L, int gen) {
+  global_State *g = G(L);
+  if ((gen != 0) == isgenerational(g))
+    return;  /* nothing to be done */
+  if (gen) {
+    entergen(L, g);
+    endcycle(g, "major");
+    setminordebt(g);
+  }
+  else {
+    g->gcgen = 0;
+    entersweep(L);
+    luaE_setdebt(g, 0);
+  }
+}
+
+
 /*
 ** performs a basic GC step when collector is running
 */
@@ -1137,12 +1485,20 @@ void luaC_step (lua_State *L) {
     luaE_setdebt(g, -GCSTEPSIZE * 10);  /* avoid being called too often */
     return;
   }
+  if (isgenerational(g)) {
+    genstep(L, g);
+    return;
+  }
+  startclock(g);
   do {  /* repeat until pause or enough "credit" (negative debt) */
     lu_mem work = singlestep(L);  /* perform one single step */
     debt -= work;
   } while (debt > -GCSTEPSIZE && g->gcstate != GCSpause);
-  if (g->gcstate == GCSpause)
+  chargetime(g, g->gcstate);
+  if (g->gcstate == GCSpause) {
+    endcycle(g, "incremental");
     setpause(g);  /* pause until next cycle */
+  }
   else {
     debt = (debt / g->gcstepmul) * STEPMULADJ;  /* convert 'work units' to Kb */
     luaE_setdebt(g, debt);
@@ -1151,6 +1507,90 @@ void luaC_step (lua_State *L) {
 }
 
 
+static const char *const gcstatenames[] = {"propagate", "atomic",
+  "sweepallgc", "sweepfinobj", "sweeptobefnz", "sweepend", "callfin",
+  "pause"};
+
+
+/*
+** Whether there is collection work to do: the collector is in the
+** middle of a cycle or memory grew past the point where the next cycle
+** (or minor collection) starts. (This does not use the debt, which is
+** reset all the time while the collector is stopped.)
+*/
+static int gcisdue (global_State *g) {
+  if (isgenerational(g))
+    return (gettotalbytes(g) >=
+            g->GCestimate + (g->GCestimate / 100) * g->genminormul);
+  else
+    return (g->gcstate != GCSpause ||
+            cast(l_mem, gettotalbytes(g)) >= pausethreshold(g));
+}
+
+
+/*
+** Performs basic steps (each one worth GCSTEPSIZE units of work) until
+** the collector reaches the end of a cycle or 'usec' microseconds have
+** passed. It does not depend on the collector running, which lets the
+** host stop the collector and do all the work at times it chooses;
+** it does nothing when no work is due. In generational mode, a step
+** is a whole (minor or major) collection. Fills 'r' (if not NULL)
+** with a report and returns whether a cycle was finished.
+*/
+int luaC_stepfor (lua_State *L, l_mem usec, lua_GCReport *r) {
+  global_State *g = G(L);
+  lu_mem before = gettotalbytes(g);
+  l_mem start = l_gcclock();
+  l_mem now = start;
+  l_mem maxstep = 0;
+  int steps = 0, transitions = 0, cycles = 0;
+  if (!gcisdue(g))
+    ;  /* nothing to be done */
+  else if (isgenerational(g)) {
+    genstep(L, g);
+    now = l_gcclock();
+    maxstep = now - start;
+    steps = cycles = 1;
+  }
+  else {
+    startclock(g);
+    do {  /* repeat until end of cycle or end of budget */
+      l_mem stepstart = now;
+      l_mem work = 0;
+      do {  /* a basic step */
+        lu_byte state = g->gcstate;
+        work += singlestep(L);
+        if (g->gcstate != state) {  /* went to another state? */
+          transitions++;
+          if (g->gcstate == GCSpause)
+            cycles++;
+        }
+      } while (work < GCSTEPSIZE && g->gcstate != GCSpause);
+      steps++;
+      now = l_gcclock();
+      if (now - stepstart > maxstep)
+        maxstep = now - stepstart;
+    } while (g->gcstate != GCSpause && now - start < usec);
+    chargetime(g, g->gcstate);
+    if (g->gcstate == GCSpause) {
+      endcycle(g, "incremental");
+      setpause(g);  /* pause until next cycle */
+    }
+  }
+  if (r != NULL) {
+    lu_mem after = gettotalbytes(g);
+    r->steps = steps;
+    r->transitions = transitions;
+    r->cycles = cycles;
+    r->state = isgenerational(g) ? "generational" : gcstatenames[g->gcstate];
+    r->usec = cast(long, now - start);
+    r->maxusec = cast(long, maxstep);
+    r->reclaimed = (before > after) ? cast(size_t, before - after) : 0;
+  }
+  return (cycles > 0);
+}
+
+
 /*
 ** Performs a full GC cycle; if 'isemergency', set a flag to avoid
 ** some operations which could change the interpreter state in some
@@ -1163,21 +1603,368 @@ void luaC_step (lua_State *L) {
 void luaC_fullgc (lua_State *L, int isemergency) {
   global_State *g = G(L);
   lua_assert(g->gckind == KGC_NORMAL);
-  if (isemergency) g->gckind = KGC_EMERGENCY;  /* set flag */
-  if (keepinvariant(g)) {  /* black objects? */
-    entersweep(L); /* sweep everything to turn them back to white */
+  if (isemergency) {
+    g->gckind = KGC_EMERGENCY;  /* set flag */
+    luaE_shrinkthreadpool(L, 0);  /* give back the stacks kept for reuse */
+  }
+  if (isgenerational(g)) {
+    g->gccycle.kind = isemergency ? "emergency" : "full";
+    fullgen(L, g);
+    g->gckind = KGC_NORMAL;
+    endcycle(g, NULL);
+    setminordebt(g);
+    return;
+  }
+  if (g->gcstate != GCSpause) {  /* an incremental cycle is running? */
+    if (keepinvariant(g))  /* black objects? */
+      entersweep(L); /* sweep everything to turn them back to white */
+    /* finish the pending cycle (as such) to start a new one */
+    luaC_runtilstate(L, bitmask(GCSpause));
+    endcycle(g, "incremental");
   }
-  /* finish any pending sweep phase to start a new cycle */
-  luaC_runtilstate(L, bitmask(GCSpause));
+  g->gccycle.kind = isemergency ? "emergency" : "full";
   luaC_runtilstate(L, ~bitmask(GCSpause));  /* start new collection */
   luaC_runtilstate(L, bitmask(GCScallfin));  /* run up to finalizers */
   /* estimate must be correct after a full GC cycle */
   lua_assert(g->GCestimate == gettotalbytes(g));
   luaC_runtilstate(L, bitmask(GCSpause));  /* finish collection */
   g->gckind = KGC_NORMAL;
+  endcycle(g, NULL);
   setpause(g);
 }
 
 /* }====================================================== */
 
 
+
+
+/*
+** {======================================================
+** Heap snapshots
+** =======================================================
+*/
+
+/*
+** A heap snapshot walks the objects reachable from the roots (the
+** registry, the main thread, the metatables of basic types and the
+** objects being finalized) with the same per-type traversal as the
+** collector, and streams them to a writer. It does not allocate in the
+** Lua heap: reached objects are marked with VISITEDBIT (cleared at the
+** end) and the objects still to be written are kept in a vector taken
+** straight from 'frealloc'.
+**
+** Format (all numbers are unsigned LEB128 varints; objects are named
+** by their addresses):
+**   header: "\33LuaHeap" version(1)
+**   'r' kind id                  a root (kind: SNAPROOT_*)
+**   'o' id tag size [payload] {edgekind target aux} 0
+**                                an object; 'tag' is its variant tag
+**     payload: strings: length, n, n bytes (n <= SNAPSTRLEN)
+**              C closures: address of the C function
+**              prototypes: line defined
+**     edge kinds: SNAP_*, plus SNAP_WEAK when the reference is weak;
+**     'aux' is an index (array, upvalue, stack, constant...), the key
+**     for fields with integer or string keys (the string's id), or 0
+**   'e' count                    end; number of objects written
+*/
+
+#define SNAPVERSION	1
+#define SNAPSTRLEN	64  /* bytes of each string kept in a snapshot */
+#define SNAPBUFFSIZE	4096
+
+/* kinds of roots */
+#define SNAPROOT_REGISTRY	1
+#define SNAPROOT_MAINTHREAD	2
+#define SNAPROOT_METATABLE	3
+#define SNAPROOT_TOBEFNZ	4
+
+/* kinds of edges */
+#define SNAP_METATABLE	1
+#define SNAP_USERVALUE	2
+#define SNAP_ARRAY	3  /* aux: index */
+#define SNAP_KEY	4  /* aux: 0 */
+#define SNAP_FIELD	5  /* aux: key string */
+#define SNAP_INDEX	6  /* aux: integer key */
+#define SNAP_VALUE	7  /* aux: key object (or 0) */
+#define SNAP_UPVALUE	8  /* aux: index */
+#define SNAP_PROTO	9  /* aux: index (of nested protos) */
+#define SNAP_CONSTANT	10  /* aux: index */
+#define SNAP_NAME	11  /* source and variable names */
+#define SNAP_STACK	12  /* aux: slot */
+#define SNAP_WEAK	32  /* flag: weak reference */
+
+
+typedef struct Snapshot {
+  lua_State *L;
+  lua_Writer writer;
+  void *data;
+  int status;  /* error from the writer (or LUA_ERRMEM) */
+  GCObject **stack;  /* objects reached but not written yet */
+  size_t nstack;
+  size_t sizestack;
+  size_t nobjs;  /* number of objects written */
+  size_t n;  /* number of bytes in 'buff' */
+  char buff[SNAPBUFFSIZE];
+} Snapshot;
+
+
+static void snapflush (Snapshot *s) {
+  if (s->n > 0 && s->status == 0) {
+    lua_unlock(s->L);
+    s->status = (*s->writer)(s->L, s->buff, s->n, s->data);
+    lua_lock(s->L);
+  }
+  s->n = 0;
+}
+
+
+static void snapbytes (Snapshot *s, const void *b, size_t size) {
+  if (s->n + size > SNAPBUFFSIZE)
+    snapflush(s);
+  memcpy(s->buff + s->n, b, size);  /* (sizes are always small) */
+  s->n += size;
+}
+
+
+static void snapuint (Snapshot *s, size_t x) {
+  char b[sizeof(size_t) * 8 / 7 + 1];
+  int n = 0;
+  do {
+    b[n] = cast(char, x & 0x7f);
+    x >>= 7;
+    if (x != 0) b[n] |= 0x80;
+    n++;
+  } while (x != 0);
+  snapbytes(s, b, n);
+}
+
+
+#define snapid(o)	cast(size_t, (o))
+
+
+/*
+** mark an object as reached, queueing it to be written
+*/
+static void snapreach (Snapshot *s, GCObject *o) {
+  if (testbit(o->marked, VISITEDBIT))
+    return;
+  if (s->nstack == s->sizestack) {
+    global_State *g = G(s->L);
+    size_t newsize = (s->sizestack == 0) ? 1024 : 2 * s->sizestack;
+    GCObject **ns = cast(GCObject **,
+        (*g->frealloc)(g->ud, s->stack, s->sizestack * sizeof(GCObject *),
+                       newsize * sizeof(GCObject *)));
+    if (ns == NULL) {
+      s->status = LUA_ERRMEM;
+      return;
+    }
+    s->stack = ns;
+    s->sizestack = newsize;
+  }
+  l_setbit(o->marked, VISITEDBIT);
+  s->stack[s->nstack++] = o;
+}
+
+
+static void snapref (Snapshot *s, int kind, GCObject *o, size_t aux) {
+  snapuint(s, kind);
+  snapuint(s, snapid(o));
+  snapuint(s, aux);
+  snapreach(s, o);
+}
+
+#define snapobjectN(s,k,o,aux)  \
+	{ if (o) snapref(s, k, obj2gco(o), aux); }
+
+#define snapvalue(s,k,v,aux)  \
+	{ if (iscollectable(v)) snapref(s, k, gcvalue(v), aux); }
+
+
+static void snaproot (Snapshot *s, int kind, GCObject *o) {
+  snapbytes(s, "r", 1);
+  snapuint(s, kind);
+  snapuint(s, snapid(o));
+  snapreach(s, o);
+}
+
+
+static void snaptable (Snapshot *s, Table *h) {
+  const TValue *mode = gfasttm(G(s->L), h->metatable, TM_MODE);
+  int wk = 0, wv = 0;
+  Node *n, *limit;
+  unsigned int i;
+  if (mode && ttisstring(mode)) {  /* weak table? */
+    if (strchr(svalue(mode), 'k')) wk = SNAP_WEAK;
+    if (strchr(svalue(mode), 'v')) wv = SNAP_WEAK;
+  }
+  snapobjectN(s, SNAP_METATABLE, h->metatable, 0);
+  for (i = 0; i < h->sizearray; i++)
+    snapvalue(s, SNAP_ARRAY | wv, &h->array[i], i + 1);
+  fornodes(h, n, limit) {
+    const TValue *k = gkey(n);
+    if (ttisnil(gval(n)))  /* empty entry (or dead key)? */
+      continue;
+    snapvalue(s, SNAP_KEY | wk, k, 0);
+    if (ttisstring(k))
+      snapvalue(s, SNAP_FIELD | wv, gval(n), snapid(tsvalue(k)))
+    else if (ttisinteger(k))
+      snapvalue(s, SNAP_INDEX | wv, gval(n), cast(size_t, ivalue(k)))
+    else
+      snapvalue(s, SNAP_VALUE | wv, gval(n),
+                iscollectable(k) ? snapid(gcvalue(k)) : 0)
+  }
+}
+
+
+static void snapproto (Snapshot *s, Proto *f) {
+  int i;
+  snapuint(s, f->linedefined);
+  snapobjectN(s, SNAP_NAME, f->source, 0);
+  for (i = 0; i < f->sizek; i++)
+    snapvalue(s, SNAP_CONSTANT, &f->k[i], i);
+  for (i = 0; i < f->sizeupvalues; i++)
+    snapobjectN(s, SNAP_NAME, f->upvalues[i].name, 0);
+  for (i = 0; i < f->sizep; i++)
+    snapobjectN(s, SNAP_PROTO, f->p[i], i);
+  for (i = 0; i < f->sizelocvars; i++)
+    snapobjectN(s, SNAP_NAME, f->locvars[i].varname, 0);
+}
+
+
+static void snapthread (Snapshot *s, lua_State *th) {
+  StkId o;
+  if (th->stack == NULL)
+    return;  /* stack not completely built yet */
+  for (o = th->stack; o < th->top; o++)
+    snapvalue(s, SNAP_STACK, o, cast(size_t, o - th->stack));
+}
+
+
+/*
+** write an object (with the memory it uses, as counted by the
+** collector) and its references
+*/
+static void snapobject (Snapshot *s, GCObject *o) {
+  int i;
+  snapbytes(s, "o", 1);
+  snapuint(s, snapid(o));
+  snapuint(s, o->tt);
+  switch (o->tt) {
+    case LUA_TSHRSTR: case LUA_TLNGSTR: {
+      TString *ts = gco2ts(o);
+      size_t len = tsslen(ts);
+      size_t n = (len < SNAPSTRLEN) ? len : SNAPSTRLEN;
+      snapuint(s, sizelstring(len));
+      snapuint(s, len);
+      snapuint(s, n);
+      snapbytes(s, getstr(ts), n);
+      break;
+    }
+#if defined(LUA_USE_NANBOX)
+    case LUA_TNUMINT: {
+      snapuint(s, sizeof(IntBox));
+      break;
+    }
+#endif
+    case LUA_TUSERDATA: {
+      Udata *u = gco2u(o);
+      TValue uvalue;
+      snapuint(s, sizeudata(u));
+      snapobjectN(s, SNAP_METATABLE, u->metatable, 0);
+      getuservalue(s->L, u, &uvalue);
+      snapvalue(s, SNAP_USERVALUE, &uvalue, 0);
+      break;
+    }
+    case LUA_TLCL: {
+      LClosure *cl = gco2lcl(o);
+      snapuint(s, sizeLclosure(cl->nupvalues));
+      snapobjectN(s, SNAP_PROTO, cl->p, 0);
+      for (i = 0; i < cl->nupvalues; i++) {
+        if (cl->upvals[i] != NULL)
+          snapvalue(s, SNAP_UPVALUE, cl->upvals[i]->v, i + 1);
+      }
+      break;
+    }
+    case LUA_TCCL: {
+      CClosure *cl = gco2ccl(o);
+      snapuint(s, sizeCclosure(cl->nupvalues));
+      snapuint(s, cast(size_t, cl->f));
+      for (i = 0; i < cl->nupvalues; i++)
+        snapvalue(s, SNAP_UPVALUE, &cl->upvalue[i], i + 1);
+      break;
+    }
+    case LUA_TTABLE: {
+      Table *h = gco2t(o);
+      snapuint(s, tablesize(h));
+      snaptable(s, h);
+      break;
+    }
+    case LUA_TPROTO: {
+      Proto *f = gco2p(o);
+      snapuint(s, protosize(f));
+      snapproto(s, f);
+      break;
+    }
+    case LUA_TTHREAD: {
+      lua_State *th = gco2th(o);
+      snapuint(s, (th->stack == NULL) ? 1 : threadsize(th));
+      snapthread(s, th);
+      break;
+    }
+    default: lua_assert(0);
+  }
+  snapuint(s, 0);  /* end of references */
+  s->nobjs++;
+}
+
+
+static void clearvisited (GCObject *o) {
+  for (; o != NULL; o = o->next)
+    resetbit(o->marked, VISITEDBIT);
+}
+
+
+int luaC_heapsnapshot (lua_State *L, lua_Writer w, void *data) {
+  global_State *g = G(L);
+  Snapshot s;
+  int i;
+  s.L = L;
+  s.writer = w;
+  s.data = data;
+  s.status = 0;
+  s.stack = NULL;
+  s.nstack = s.sizestack = 0;
+  s.nobjs = 0;
+  s.n = 0;
+  snapbytes(&s, "\33LuaHeap", 8);
+  snapuint(&s, SNAPVERSION);
+  if (iscollectable(&g->l_registry))
+    snaproot(&s, SNAPROOT_REGISTRY, gcvalue(&g->l_registry));
+  snaproot(&s, SNAPROOT_MAINTHREAD, obj2gco(g->mainthread));
+  for (i = 0; i < LUA_NUMTAGS; i++) {
+    if (g->mt[i] != NULL)
+      snaproot(&s, SNAPROOT_METATABLE, obj2gco(g->mt[i]));
+  }
+  {
+    GCObject *o;
+    for (o = g->tobefnz; o != NULL; o = o->next)
+      snaproot(&s, SNAPROOT_TOBEFNZ, o);
+  }
+  while (s.nstack > 0 && s.status == 0)
+    snapobject(&s, s.stack[--s.nstack]);
+  snapbytes(&s, "e", 1);
+  snapuint(&s, s.nobjs);
+  snapflush(&s);
+  /* clear marks of all objects */
+  clearvisited(g->allgc);
+  clearvisited(g->finobj);
+  clearvisited(g->tobefnz);
+  clearvisited(g->fixedgc);
+  resetbit(g->mainthread->marked, VISITEDBIT);
+  if (s.stack != NULL)
+    (*g->frealloc)(g->ud, s.stack, s.sizestack * sizeof(GCObject *), 0);
+  return s.status;
+}
+
+/* }====================================================== */
+
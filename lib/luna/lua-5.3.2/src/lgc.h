@@ -22,6 +22,18 @@
 ** allweak, ephemeron) so that it can be visited again before finishing
 ** the collection cycle. These lists have no meaning when the invariant
 ** is not being enforced (e.g., sweep phase).
+**
+** In generational mode, objects that survive a collection become old:
+** they keep their marks (so they are black or, for threads and tables
+** caught by a barrier, gray) and get the old bit. As new objects are
+** always linked at the head of the GC lists, the old ones form the
+** tail of each list. A minor collection marks from the objects touched
+** by barriers (plus the roots and all threads) without restarting, so
+** it never visits old objects that did not change, and its sweep stops
+** at the first old object. Between collections the collector stays in
+** the propagate phase, so that the barriers keep the invariant. A
+** major collection turns everything white and young again and runs a
+** whole cycle.
 */
 
 
@@ -79,6 +91,8 @@
 #define WHITE1BIT	1  /* object is white (type 1) */
 #define BLACKBIT	2  /* object is black */
 #define FINALIZEDBIT	3  /* object has been marked for finalization */
+#define OLDBIT		4  /* object is old (generational mode) */
+#define VISITEDBIT	5  /* object reached by a heap snapshot */
 /* bit 7 is currently used by tests (luaL_checkmemory) */
 
 #define WHITEBITS	bit2mask(WHITE0BIT, WHITE1BIT)
@@ -91,6 +105,10 @@
 
 #define tofinalize(x)	testbit((x)->marked, FINALIZEDBIT)
 
+#define isold(x)	testbit((x)->marked, OLDBIT)
+
+#define isgenerational(g)	((g)->gcgen)
+
 #define otherwhite(g)	((g)->currentwhite ^ WHITEBITS)
 #define isdeadm(ow,m)	(!(((m) ^ WHITEBITS) & (ow)))
 #define isdead(g,v)	isdeadm(otherwhite(g), (v)->marked)
@@ -131,15 +149,24 @@
 	(iscollectable((uv)->v) && !upisopen(uv)) ? \
          luaC_upvalbarrier_(L,uv) : cast_void(0))
 
+#define luaC_threadbarrier(L) (  \
+	isblack(L) ? luaC_threadbarrier_(L) : cast_void(0))
+
 LUAI_FUNC void luaC_fix (lua_State *L, GCObject *o);
 LUAI_FUNC void luaC_freeallobjects (lua_State *L);
 LUAI_FUNC void luaC_step (lua_State *L);
+LUAI_FUNC int luaC_stepfor (lua_State *L, l_mem usec, lua_GCReport *r);
 LUAI_FUNC void luaC_runtilstate (lua_State *L, int statesmask);
 LUAI_FUNC void luaC_fullgc (lua_State *L, int isemergency);
+LUAI_FUNC void luaC_changemode (lua_State *L, int gen);
+LUAI_FUNC int luaC_heapsnapshot (lua_State *L, lua_Writer w, void *data);
 LUAI_FUNC GCObject *luaC_newobj (lua_State *L, int tt, size_t sz);
+LUAI_FUNC GCObject *luaC_adoptobj (lua_State *L, int tt, void *block,
+                                                         size_t sz);
 LUAI_FUNC void luaC_barrier_ (lua_State *L, GCObject *o, GCObject *v);
 LUAI_FUNC void luaC_barrierback_ (lua_State *L, Table *o);
 LUAI_FUNC void luaC_upvalbarrier_ (lua_State *L, UpVal *uv);
+LUAI_FUNC void luaC_threadbarrier_ (lua_State *L);
 LUAI_FUNC void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt);
 LUAI_FUNC void luaC_upvdeccount (lua_State *L, UpVal *uv);
 
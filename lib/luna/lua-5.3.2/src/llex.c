@@ -224,11 +224,12 @@ static void buffreplace (LexState *ls, char from, char to) {
 ** in case of format error, try to change decimal point separator to
 ** the one defined in the current locale and check again
 */
-static void trydecpoint (LexState *ls, TValue *o) {
+static void trydecpoint (LexState *ls, lua_Integer *i, lua_Number *n,
+                        int *isint) {
   char old = ls->decpoint;
   ls->decpoint = lua_getlocaledecpoint();
   buffreplace(ls, old, ls->decpoint);  /* try new decimal separator */
-  if (luaO_str2num(luaZ_buffer(ls->buff), o) == 0) {
+  if (luaO_str2val(luaZ_buffer(ls->buff), i, n, isint) == 0) {
     /* format error with correct decimal point: no more options */
     buffreplace(ls, ls->decpoint, '.');  /* undo change (for error message) */
     lexerror(ls, "malformed number", TK_FLT);
@@ -238,11 +239,13 @@ static void trydecpoint (LexState *ls, TValue *o) {
 
 /* LUA_NUMBER */
 /*
-** this function is quite liberal in what it accepts, as 'luaO_str2num'
+** this function is quite liberal in what it accepts, as 'luaO_str2val'
 ** will reject ill-formed numerals.
 */
 static int read_numeral (LexState *ls, SemInfo *seminfo) {
-  TValue obj;
+  lua_Integer i;
+  lua_Number n;
+  int isint;
   const char *expo = "Ee";
   int first = ls->current;
   lua_assert(lisdigit(ls->current));
@@ -260,15 +263,14 @@ static int read_numeral (LexState *ls, SemInfo *seminfo) {
   }
   save(ls, '\0');
   buffreplace(ls, '.', ls->decpoint);  /* follow locale for decimal point */
-  if (luaO_str2num(luaZ_buffer(ls->buff), &obj) == 0)  /* format error? */
-    trydecpoint(ls, &obj); /* try to update decimal point separator */
-  if (ttisinteger(&obj)) {
-    seminfo->i = ivalue(&obj);
+  if (luaO_str2val(luaZ_buffer(ls->buff), &i, &n, &isint) == 0)  /* error? */
+    trydecpoint(ls, &i, &n, &isint); /* try to update decimal point separator */
+  if (isint) {
+    seminfo->i = i;
     return TK_INT;
   }
   else {
-    lua_assert(ttisfloat(&obj));
-    seminfo->r = fltvalue(&obj);
+    seminfo->r = n;
     return TK_FLT;
   }
 }
@@ -144,6 +144,16 @@ typedef LUAI_UACINT l_uacInt;
 #endif
 
 
+/*
+** hint for a condition that is almost always true
+*/
+#if defined(__GNUC__)
+#define l_likely(x)	(__builtin_expect(((x) != 0), 1))
+#else
+#define l_likely(x)	(x)
+#endif
+
+
 
 /*
 ** maximum depth for nested C calls and syntactical nested non-terminals
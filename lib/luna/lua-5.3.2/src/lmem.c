@@ -18,6 +18,7 @@
 #include "ldo.h"
 #include "lgc.h"
 #include "lmem.h"
+#include "lmemprof.h"
 #include "lobject.h"
 #include "lstate.h"
 
@@ -71,6 +72,229 @@ l_noret luaM_toobig (lua_State *L) {
 
 
 
+#if defined(LUA_USE_BGFREE)
+/*
+** {======================================================
+** Background freeing
+** =======================================================
+*/
+
+#include <pthread.h>
+
+
+/* number of blocks handed to the helper thread at a time */
+#define FREEBATCH	256
+
+
+/*
+** A batch of blocks to be freed. It keeps the allocation function
+** used to free them, as the state may change it in the meantime.
+*/
+typedef struct FreeBatch {
+  struct FreeBatch *next;
+  lua_Alloc frealloc;
+  void *ud;
+  int n;  /* number of blocks */
+  void *block[FREEBATCH];
+  size_t size[FREEBATCH];
+} FreeBatch;
+
+
+/*
+** The helper thread takes the batches from 'queue' and puts them in
+** 'spare' once done; the (filling) batch in 'current' belongs to the
+** Lua thread. Batches and this structure itself are not counted as
+** memory in use by the state.
+*/
+typedef struct BGFree {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  FreeBatch *queue;
+  FreeBatch *spare;
+  FreeBatch *current;
+  int running;  /* true if thread was created */
+  int stop;  /* true when the thread must finish */
+} BGFree;
+
+
+static void freebatch (FreeBatch *b) {
+  int i;
+  for (i = 0; i < b->n; i++)
+    (*b->frealloc)(b->ud, b->block[i], b->size[i], 0);
+  b->n = 0;
+}
+
+
+static void *freeloop (void *ud) {
+  BGFree *bg = cast(BGFree *, ud);
+  pthread_mutex_lock(&bg->lock);
+  for (;;) {
+    FreeBatch *b;
+    while (bg->queue == NULL && !bg->stop)
+      pthread_cond_wait(&bg->cond, &bg->lock);
+    if ((b = bg->queue) == NULL)  /* stop and nothing else to do? */
+      break;
+    bg->queue = b->next;
+    pthread_mutex_unlock(&bg->lock);
+    freebatch(b);  /* free blocks outside the lock */
+    pthread_mutex_lock(&bg->lock);
+    b->next = bg->spare;
+    bg->spare = b;
+  }
+  pthread_mutex_unlock(&bg->lock);
+  return NULL;
+}
+
+
+/*
+** creates the helper thread; in case of errors, keeps the structure
+** (with 'running' false) so that blocks are just freed directly
+*/
+static BGFree *newbgfree (global_State *g) {
+  BGFree *bg = cast(BGFree *, (*g->frealloc)(g->ud, NULL, 0, sizeof(BGFree)));
+  if (bg == NULL) return NULL;
+  bg->queue = bg->spare = bg->current = NULL;
+  bg->stop = 0;
+  bg->running = 0;
+  if (pthread_mutex_init(&bg->lock, NULL) == 0) {
+    if (pthread_cond_init(&bg->cond, NULL) == 0) {
+      if (pthread_create(&bg->thread, NULL, freeloop, bg) == 0)
+        bg->running = 1;
+      else
+        pthread_cond_destroy(&bg->cond);
+    }
+    if (!bg->running)
+      pthread_mutex_destroy(&bg->lock);
+  }
+  g->bgfree = bg;
+  return bg;
+}
+
+
+/*
+** hands the current batch (if any) to the helper thread
+*/
+static void flushbatch (BGFree *bg) {
+  FreeBatch *b = bg->current;
+  if (b == NULL)
+    return;
+  bg->current = NULL;
+  pthread_mutex_lock(&bg->lock);
+  b->next = bg->queue;
+  bg->queue = b;
+  pthread_cond_signal(&bg->cond);
+  pthread_mutex_unlock(&bg->lock);
+}
+
+
+/*
+** puts a block in the current batch; returns false if it could not
+** do it (so that the caller frees the block itself)
+*/
+static int deferfree (global_State *g, void *block, size_t osize) {
+  BGFree *bg = g->bgfree;
+  FreeBatch *b;
+  if (bg == NULL && (bg = newbgfree(g)) == NULL)
+    return 0;
+  if (!bg->running)
+    return 0;
+  if ((b = bg->current) == NULL) {  /* needs a new batch? */
+    pthread_mutex_lock(&bg->lock);
+    if ((b = bg->spare) != NULL)
+      bg->spare = b->next;
+    pthread_mutex_unlock(&bg->lock);
+    if (b == NULL &&
+        (b = cast(FreeBatch *,
+                  (*g->frealloc)(g->ud, NULL, 0, sizeof(FreeBatch)))) == NULL)
+      return 0;
+    b->frealloc = g->frealloc;
+    b->ud = g->ud;
+    b->n = 0;
+    bg->current = b;
+  }
+  b->block[b->n] = block;
+  b->size[b->n] = osize;
+  if (++b->n == FREEBATCH)  /* batch is full? */
+    flushbatch(bg);
+  return 1;
+}
+
+
+/*
+** hands the blocks freed so far to the helper thread
+*/
+void luaM_flushfrees (lua_State *L) {
+  BGFree *bg = G(L)->bgfree;
+  if (bg != NULL)
+    flushbatch(bg);
+}
+
+
+/*
+** frees in this thread all blocks not yet taken by the helper thread
+** (to get memory back as soon as possible after an allocation error)
+*/
+static void drainfrees (global_State *g) {
+  BGFree *bg = g->bgfree;
+  FreeBatch *l;
+  if (bg == NULL || !bg->running)
+    return;
+  flushbatch(bg);
+  pthread_mutex_lock(&bg->lock);
+  l = bg->queue;
+  bg->queue = NULL;
+  pthread_mutex_unlock(&bg->lock);
+  while (l != NULL) {
+    FreeBatch *b = l;
+    l = b->next;
+    freebatch(b);
+    pthread_mutex_lock(&bg->lock);
+    b->next = bg->spare;
+    bg->spare = b;
+    pthread_mutex_unlock(&bg->lock);
+  }
+}
+
+
+/*
+** waits for the helper thread to free all pending blocks and finish,
+** and releases everything it used
+*/
+void luaM_closefrees (lua_State *L) {
+  global_State *g = G(L);
+  BGFree *bg = g->bgfree;
+  if (bg == NULL)
+    return;
+  g->deferfree = 0;
+  if (bg->running) {
+    flushbatch(bg);
+    pthread_mutex_lock(&bg->lock);
+    bg->stop = 1;
+    pthread_cond_signal(&bg->cond);
+    pthread_mutex_unlock(&bg->lock);
+    pthread_join(bg->thread, NULL);
+    pthread_cond_destroy(&bg->cond);
+    pthread_mutex_destroy(&bg->lock);
+  }
+  while (bg->spare != NULL) {
+    FreeBatch *b = bg->spare;
+    bg->spare = b->next;
+    (*b->frealloc)(b->ud, b, sizeof(FreeBatch), 0);
+  }
+  (*g->frealloc)(g->ud, bg, sizeof(BGFree), 0);
+  g->bgfree = NULL;
+}
+
+/* }====================================================== */
+
+#else
+
+#define drainfrees(g)	((void)0)
+
+#endif
+
+
 /*
 ** generic allocation routine.
 */
@@ -82,12 +306,21 @@ void *luaM_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
 #if defined(HARDMEMTESTS)
   if (nsize > realosize && g->gcrunning)
     luaC_fullgc(L, 1);  /* force a GC whenever possible */
+#endif
+#if defined(LUA_USE_BGFREE)
+  if (nsize == 0 && g->deferfree && block != NULL &&
+      deferfree(g, block, osize)) {  /* block freed in the background? */
+    g->GCdebt -= realosize;
+    luaM_profile(L, g, block, NULL, 0, osize);
+    return NULL;
+  }
 #endif
   newblock = (*g->frealloc)(g->ud, block, osize, nsize);
   if (newblock == NULL && nsize > 0) {
     lua_assert(nsize > realosize);  /* cannot fail when shrinking a block */
     if (g->version) {  /* is state fully built? */
       luaC_fullgc(L, 1);  /* try to free some memory... */
+      drainfrees(g);  /* ...including blocks not freed yet */
       newblock = (*g->frealloc)(g->ud, block, osize, nsize);  /* try again */
     }
     if (newblock == NULL)
@@ -95,6 +328,7 @@ void *luaM_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
   }
   lua_assert((nsize == 0) == (newblock == NULL));
   g->GCdebt = (g->GCdebt + nsize) - realosize;
+  luaM_profile(L, g, block, newblock, nsize, osize);
   return newblock;
 }
 
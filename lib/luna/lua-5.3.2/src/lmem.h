@@ -56,6 +56,16 @@
 #define luaM_reallocvector(L, v,oldn,n,t) \
    ((v)=cast(t *, luaM_reallocv(L, v, oldn, n, sizeof(t))))
 
+#if defined(LUA_USE_BGFREE)
+#define luaM_deferfrees(g,on)	((g)->deferfree = cast_byte(on))
+LUAI_FUNC void luaM_flushfrees (lua_State *L);
+LUAI_FUNC void luaM_closefrees (lua_State *L);
+#else
+#define luaM_deferfrees(g,on)	((void)0)
+#define luaM_flushfrees(L)	((void)0)
+#define luaM_closefrees(L)	((void)0)
+#endif
+
 LUAI_FUNC l_noret luaM_toobig (lua_State *L);
 
 /* not to be called directly */
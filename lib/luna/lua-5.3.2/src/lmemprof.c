@@ -0,0 +1,500 @@
+/*
+** $Id: lmemprof.c $
+** Sampling memory profiler
+** See Copyright Notice in lua.h
+*/
+
+#define lmemprof_c
+#define LUA_CORE
+
+#include "lprefix.h"
+
+
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "ldebug.h"
+#include "ldo.h"
+#include "lmemprof.h"
+#include "lobject.h"
+#include "lstate.h"
+#include "ltm.h"
+
+
+/*
+** The profiler samples the bytes allocated through 'luaM_realloc_' as
+** a Poisson process with a mean of 'rate' bytes between samples. Each
+** sampled block is charged to its allocation site: the call stack of
+** the running thread (as 'source:line' frames) plus the type of the
+** block. Blocks of 'size' bytes are sampled with probability
+** 1 - exp(-size/rate), so each sample is scaled by the inverse of that
+** to estimate the bytes allocated at its site. Sampled blocks are kept
+** in a hash table, so that freeing them gives their bytes back to the
+** 'live' count of their sites.
+** The profiler allocates its own memory straight from 'frealloc'; it
+** is not counted in the state's memory and is never sampled. When it
+** cannot get memory it just loses samples.
+*/
+
+
+/* maximum number of frames kept in a sample (outer frames are dropped) */
+#define MAXPROFDEPTH	64
+
+/* size of the buffer where stacks are built */
+#define STACKBUFFSIZE	(MAXPROFDEPTH * (LUA_IDSIZE + 12) + 32)
+
+/*
+** pseudo tag for the stack of the running thread: while it is moved,
+** its frames cannot be read
+*/
+#define STACKTAG	(~cast(size_t, 0))
+
+/* initial sizes of the hash tables (log2) */
+#define MINLSIZESITES	6
+#define MINLSIZEBLOCKS	8
+
+
+typedef struct ProfSite {
+  struct ProfSite *next;  /* next site in the hash chain */
+  unsigned int h;  /* hash of 'stack' */
+  size_t len;  /* length of 'stack' */
+  lu_mem bytes;  /* bytes allocated at this site (estimate) */
+  lu_mem live;  /* bytes allocated at this site still in use (estimate) */
+  char stack[1];  /* folded stack: frames from the root, split by ';' */
+} ProfSite;
+
+
+typedef struct ProfBlock {
+  void *block;  /* sampled block (NULL for empty slots) */
+  ProfSite *site;  /* where it was allocated */
+  lu_mem bytes;  /* bytes charged to 'site' */
+} ProfBlock;
+
+
+typedef struct MemProf {
+  l_mem rate;  /* mean number of bytes between samples */
+  l_mem next;  /* bytes still to be allocated before the next sample */
+  unsigned int rand;  /* state of the random generator */
+  int dumping;  /* true while sites are being listed (do not rehash) */
+  ProfSite **sites;  /* hash table of sites */
+  int lsizesites;  /* log2 of the size of 'sites' */
+  int nsites;
+  ProfBlock *blocks;  /* sampled blocks (open addressing) */
+  int lsizeblocks;  /* log2 of the size of 'blocks' */
+  int nblocks;
+  char buff[STACKBUFFSIZE];  /* where stacks are built */
+} MemProf;
+
+
+static void *rawalloc (global_State *g, size_t size) {
+  return (*g->frealloc)(g->ud, NULL, 0, size);
+}
+
+
+static void rawfree (global_State *g, void *block, size_t size) {
+  (*g->frealloc)(g->ud, block, size, 0);
+}
+
+
+/*
+** distance in bytes to the next sample: an exponential variable with
+** mean 'rate' (from a xorshift generator)
+*/
+static l_mem nextsample (MemProf *p) {
+  unsigned int x = p->rand;
+  lua_Number u;
+  x ^= x << 13; x &= 0xffffffffu;
+  x ^= x >> 17;
+  x ^= x << 5; x &= 0xffffffffu;
+  p->rand = x;
+  u = (cast_num(x >> 8) + 1) / cast_num(1 << 24);  /* in (0, 1] */
+  return cast(l_mem, -l_mathop(log)(u) * cast_num(p->rate)) + 1;
+}
+
+
+/*
+** {======================================================
+** Sampled blocks
+** =======================================================
+*/
+
+#define blockslot(p,b) \
+	cast_int(((point2uint(b) * 2654435769u) & 0xffffffffu) >> \
+	         (32 - (p)->lsizeblocks))
+
+
+static ProfBlock *findblock (MemProf *p, void *block) {
+  int mask = (1 << p->lsizeblocks) - 1;
+  int i = blockslot(p, block);
+  while (p->blocks[i].block != NULL) {
+    if (p->blocks[i].block == block)
+      return &p->blocks[i];
+    i = (i + 1) & mask;
+  }
+  return NULL;
+}
+
+
+/*
+** remove an entry, moving back the entries after it that would not be
+** found anymore (as there are no tombstones)
+*/
+static void removeblock (MemProf *p, ProfBlock *pb) {
+  int mask = (1 << p->lsizeblocks) - 1;
+  int i = cast_int(pb - p->blocks);
+  int j = i;
+  p->nblocks--;
+  for (;;) {
+    int k;
+    p->blocks[i].block = NULL;
+    do {
+      j = (j + 1) & mask;
+      if (p->blocks[j].block == NULL)
+        return;
+      k = blockslot(p, p->blocks[j].block);  /* main position of 'j' */
+    } while ((i <= j) ? (i < k && k <= j) : (i < k || k <= j));
+    p->blocks[i] = p->blocks[j];  /* 'j' can move to the hole */
+    i = j;
+  }
+}
+
+
+static void insertblock (MemProf *p, void *block, ProfSite *site,
+                         lu_mem bytes) {
+  int mask = (1 << p->lsizeblocks) - 1;
+  int i = blockslot(p, block);
+  while (p->blocks[i].block != NULL)
+    i = (i + 1) & mask;
+  p->blocks[i].block = block;
+  p->blocks[i].site = site;
+  p->blocks[i].bytes = bytes;
+  p->nblocks++;
+}
+
+
+/*
+** keep the table at most half full; returns 0 if it is full and cannot
+** grow
+*/
+static int checkblocks (global_State *g, MemProf *p) {
+  if (2 * (p->nblocks + 1) > (1 << p->lsizeblocks)) {
+    int oldsize = 1 << p->lsizeblocks;
+    ProfBlock *old = p->blocks;
+    ProfBlock *nb;
+    int i;
+    if (p->lsizeblocks >= 30 ||
+        (nb = cast(ProfBlock *,
+                   rawalloc(g, 2 * oldsize * sizeof(ProfBlock)))) == NULL)
+      return 0;
+    memset(nb, 0, 2 * oldsize * sizeof(ProfBlock));
+    p->blocks = nb;
+    p->lsizeblocks++;
+    p->nblocks = 0;
+    for (i = 0; i < oldsize; i++) {
+      if (old[i].block != NULL)
+        insertblock(p, old[i].block, old[i].site, old[i].bytes);
+    }
+    rawfree(g, old, oldsize * sizeof(ProfBlock));
+  }
+  return 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Allocation sites
+** =======================================================
+*/
+
+static unsigned int hashstack (const char *s, size_t l) {
+  unsigned int h = cast(unsigned int, l);
+  for (; l > 0; l--)
+    h ^= ((h<<5) + (h>>2) + cast_byte(s[l - 1]));
+  return h;
+}
+
+
+static void rehashsites (global_State *g, MemProf *p) {
+  int oldsize = 1 << p->lsizesites;
+  int mask = 2 * oldsize - 1;
+  ProfSite **ns = cast(ProfSite **,
+                       rawalloc(g, 2 * oldsize * sizeof(ProfSite *)));
+  int i;
+  if (ns == NULL)
+    return;  /* keep the old table (with longer chains) */
+  memset(ns, 0, 2 * oldsize * sizeof(ProfSite *));
+  for (i = 0; i < oldsize; i++) {
+    ProfSite *site = p->sites[i];
+    while (site != NULL) {
+      ProfSite *next = site->next;
+      site->next = ns[site->h & mask];
+      ns[site->h & mask] = site;
+      site = next;
+    }
+  }
+  rawfree(g, p->sites, oldsize * sizeof(ProfSite *));
+  p->sites = ns;
+  p->lsizesites++;
+}
+
+
+static ProfSite *getsite (global_State *g, MemProf *p, const char *s,
+                          size_t l) {
+  unsigned int h = hashstack(s, l);
+  ProfSite *site;
+  for (site = p->sites[h & ((1 << p->lsizesites) - 1)];
+       site != NULL; site = site->next) {
+    if (site->h == h && site->len == l && memcmp(site->stack, s, l) == 0)
+      return site;
+  }
+  if (p->nsites >= (1 << p->lsizesites) && !p->dumping &&
+      p->lsizesites < 30)
+    rehashsites(g, p);
+  site = cast(ProfSite *, rawalloc(g, offsetof(ProfSite, stack) + l + 1));
+  if (site == NULL)
+    return NULL;
+  memcpy(site->stack, s, l);
+  site->stack[l] = '\0';
+  site->len = l;
+  site->h = h;
+  site->bytes = site->live = 0;
+  site->next = p->sites[h & ((1 << p->lsizesites) - 1)];
+  p->sites[h & ((1 << p->lsizesites) - 1)] = site;
+  p->nsites++;
+  return site;
+}
+
+
+static size_t addframe (char *buff, size_t len, const char *s) {
+  size_t l = strlen(s);
+  memcpy(buff + len, s, l);
+  len += l;
+  buff[len++] = ';';
+  return len;
+}
+
+
+/*
+** build in 'buff' the folded stack of the running thread, from its
+** outermost frame, followed by the type of the block ('tag' is the
+** 'osize' given to 'luaM_realloc_' for new blocks, which tells the type
+** of new objects; it is 0 for other blocks)
+*/
+static size_t foldstack (lua_State *L, char *buff, size_t tag) {
+  CallInfo *frames[MAXPROFDEPTH];
+  CallInfo *ci;
+  size_t len = 0;
+  int n = 0;
+  if (tag == STACKTAG)
+    return l_sprintf(buff, STACKBUFFSIZE, "%s", "(stack)");
+  for (ci = L->ci; ci != &L->base_ci && n < MAXPROFDEPTH; ci = ci->previous)
+    frames[n++] = ci;
+  if (ci != &L->base_ci)  /* stack too deep? */
+    len = addframe(buff, len, "...");
+  else if (L != G(L)->mainthread)
+    len = addframe(buff, len, "(coroutine)");
+  while (n-- > 0) {
+    ci = frames[n];
+    if (isLua(ci)) {
+      Proto *p = clLvalue(ci->func)->p;
+      int pc = pcRel(ci->u.l.savedpc, p);
+      char *src = buff + len;
+      if (p->source)
+        luaO_chunkid(src, getstr(p->source), LUA_IDSIZE);
+      else
+        strcpy(src, "?");
+      for (; *src; src++)  /* ';' separates frames */
+        if (*src == ';') *src = ',';
+      len = src - buff;
+      len += l_sprintf(buff + len, STACKBUFFSIZE - len, ":%d;",
+                       getfuncline(p, (pc < 0) ? 0 : pc));
+    }
+    else
+      len = addframe(buff, len, "[C]");
+  }
+  tag = novariant(tag);
+  len += l_sprintf(buff + len, STACKBUFFSIZE - len, "(%s)",
+                   (tag >= LUA_TSTRING && tag <= LUA_TPROTO)
+                   ? ttypename(tag) : "memory");
+  return len;
+}
+
+
+static void sample (lua_State *L, MemProf *p, void *block, size_t size,
+                    size_t tag) {
+  global_State *g = G(L);
+  lua_Number s = cast_num(size);
+  size_t len = foldstack(L, p->buff, tag);
+  ProfSite *site = getsite(g, p, p->buff, len);
+  lu_mem bytes;
+  if (site == NULL)
+    return;  /* no memory for the profiler */
+  bytes = cast(lu_mem, s / (1 - l_mathop(exp)(-s / cast_num(p->rate))));
+  site->bytes += bytes;
+  if (checkblocks(g, p)) {  /* can keep track of it? */
+    insertblock(p, block, site, bytes);
+    site->live += bytes;
+  }
+}
+
+/* }====================================================== */
+
+
+void luaM_profilemem (lua_State *L, void *block, void *newblock,
+                      size_t nsize, size_t tag) {
+  MemProf *p = G(L)->memprof;
+  if (block != NULL && p->nblocks > 0) {  /* old block gone? */
+    ProfBlock *pb = findblock(p, block);
+    if (pb != NULL) {  /* was it sampled? */
+      pb->site->live -= pb->bytes;
+      removeblock(p, pb);
+    }
+  }
+  if (nsize > 0 && (p->next -= cast(l_mem, nsize)) <= 0) {
+    if (block == NULL)
+      sample(L, p, newblock, nsize, tag);
+    else  /* not a new object */
+      sample(L, p, newblock, nsize, (block == L->stack) ? STACKTAG : 0);
+    p->next = nextsample(p);
+  }
+}
+
+
+void luaM_closeprofile (lua_State *L) {
+  global_State *g = G(L);
+  MemProf *p = g->memprof;
+  int i;
+  if (p == NULL)
+    return;
+  g->memprof = NULL;
+  for (i = 0; i < (1 << p->lsizesites); i++) {
+    ProfSite *site = p->sites[i];
+    while (site != NULL) {
+      ProfSite *next = site->next;
+      rawfree(g, site, offsetof(ProfSite, stack) + site->len + 1);
+      site = next;
+    }
+  }
+  rawfree(g, p->sites, (1 << p->lsizesites) * sizeof(ProfSite *));
+  rawfree(g, p->blocks, (1 << p->lsizeblocks) * sizeof(ProfBlock));
+  rawfree(g, p, sizeof(MemProf));
+}
+
+
+static MemProf *newprofile (lua_State *L) {
+  global_State *g = G(L);
+  MemProf *p = cast(MemProf *, rawalloc(g, sizeof(MemProf)));
+  size_t ssize = (1 << MINLSIZESITES) * sizeof(ProfSite *);
+  size_t bsize = (1 << MINLSIZEBLOCKS) * sizeof(ProfBlock);
+  if (p == NULL)
+    luaD_throw(L, LUA_ERRMEM);
+  p->sites = cast(ProfSite **, rawalloc(g, ssize));
+  p->blocks = cast(ProfBlock *, rawalloc(g, bsize));
+  if (p->sites == NULL || p->blocks == NULL) {
+    if (p->sites) rawfree(g, p->sites, ssize);
+    if (p->blocks) rawfree(g, p->blocks, bsize);
+    rawfree(g, p, sizeof(MemProf));
+    luaD_throw(L, LUA_ERRMEM);
+  }
+  memset(p->sites, 0, ssize);
+  memset(p->blocks, 0, bsize);
+  p->lsizesites = MINLSIZESITES;
+  p->lsizeblocks = MINLSIZEBLOCKS;
+  p->nsites = p->nblocks = 0;
+  p->dumping = 0;
+  p->rand = g->seed | 1;  /* (cannot be 0) */
+  return p;
+}
+
+
+/*
+** Start the profiler with a sample every 'rate' bytes (on average) or
+** change its rate; 0 stops it and discards what it collected. Returns
+** the previous rate (0 if it was not running).
+*/
+LUA_API int lua_memprofile (lua_State *L, int rate) {
+  global_State *g;
+  int old;
+  lua_lock(L);
+  g = G(L);
+  old = (g->memprof) ? cast_int(g->memprof->rate) : 0;
+  if (rate <= 0)
+    luaM_closeprofile(L);
+  else {
+    if (g->memprof == NULL)
+      g->memprof = newprofile(L);
+    g->memprof->rate = rate;
+    g->memprof->next = nextsample(g->memprof);
+  }
+  lua_unlock(L);
+  return old;
+}
+
+
+typedef struct DumpState {
+  lua_Writer writer;
+  void *data;
+  int what;
+  int status;
+} DumpState;
+
+
+static void dumpsites (lua_State *L, void *ud) {
+  DumpState *D = cast(DumpState *, ud);
+  MemProf *p = G(L)->memprof;
+  int i;
+  for (i = 0; i < (1 << p->lsizesites) && D->status == 0; i++) {
+    ProfSite *site;
+    for (site = p->sites[i]; site != NULL && D->status == 0;
+         site = site->next) {
+      lu_mem v = (D->what == LUA_MPLIVE) ? site->live : site->bytes;
+      if (v > 0) {
+        char num[LUAI_MAXSHORTLEN];
+        int n = l_sprintf(num, sizeof(num), " " LUA_INTEGER_FMT "\n",
+                          cast(LUA_INTEGER, v));
+        lua_unlock(L);
+        D->status = (*D->writer)(L, site->stack, site->len, D->data);
+        if (D->status == 0)
+          D->status = (*D->writer)(L, num, n, D->data);
+        lua_lock(L);
+      }
+    }
+  }
+}
+
+
+/*
+** Write the profile in folded-stack format: a line 'frame;...;(type)
+** bytes' for each site, with the bytes still in use (LUA_MPLIVE) or
+** all bytes allocated there (LUA_MPTOTAL). The writer must not stop or
+** restart the profiler; it may raise errors, which are propagated once
+** the profiler can grow its table of sites again.
+*/
+LUA_API int lua_memprofdump (lua_State *L, lua_Writer writer, void *data,
+                             int what) {
+  MemProf *p;
+  DumpState D;
+  lua_lock(L);
+  D.writer = writer;
+  D.data = data;
+  D.what = what;
+  D.status = 0;
+  p = G(L)->memprof;
+  if (p != NULL) {
+    int errcode;
+    p->dumping = 1;  /* new sites go to the current chains */
+    errcode = luaD_rawrunprotected(L, dumpsites, &D);
+    p->dumping = 0;
+    if (errcode != LUA_OK)
+      luaD_throw(L, errcode);  /* propagate the writer's error */
+  }
+  lua_unlock(L);
+  return D.status;
+}
+
@@ -0,0 +1,29 @@
+/*
+** $Id: lmemprof.h $
+** Sampling memory profiler
+** See Copyright Notice in lua.h
+*/
+
+#ifndef lmemprof_h
+#define lmemprof_h
+
+
+#include "lobject.h"
+#include "lstate.h"
+
+
+/*
+** tell the profiler (if running) that 'luaM_realloc_' changed 'block'
+** into 'newblock' with 'nsize' bytes ('tag' is the 'osize' given to it)
+*/
+#define luaM_profile(L,g,b,nb,ns,tag) \
+	{ if ((g)->memprof != NULL) luaM_profilemem(L, b, nb, ns, tag); }
+
+
+LUAI_FUNC void luaM_profilemem (lua_State *L, void *block, void *newblock,
+                                size_t nsize, size_t tag);
+LUAI_FUNC void luaM_closeprofile (lua_State *L);
+
+
+#endif
+
@@ -0,0 +1,793 @@
+/*
+** $Id: lnumarrlib.c $
+** Library for typed numeric arrays
+** See Copyright Notice in lua.h
+*/
+
+#define lnumarrlib_c
+#define LUA_LIB
+
+#include "lprefix.h"
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+/*
+** A numeric array is a userdata with metatable 'LUA_NUMARRAYHANDLE'
+** holding a 'luaL_NumArray' with 'n' elements of one type. An array
+** made by 'new' keeps its elements in the userdata itself, right after
+** the header; a view points into another array, which it keeps alive
+** as its user value. Elements are indexed from 1, like tables, but the
+** length is fixed. All functions have the metatable as upvalue 1, to
+** check their arguments without a registry lookup.
+**
+** Bulk operations work in place on the first array and take either
+** another array of the same type and length or a number. The float
+** kernels use SSE2 where available (summing in several lanes, so
+** 'sum' and 'dot' may round differently from a sequential loop);
+** integer arithmetic wraps around. Results are undefined if the target
+** overlaps an operand at a different position.
+*/
+
+
+#if defined(__SSE2__) && !defined(LUA_NOSIMD)
+#define NA_SSE2
+#include <emmintrin.h>
+#endif
+
+
+static const char *const typenames[] = {
+  "float64", "float32", "int32", "int64", NULL
+};
+
+static const size_t typesizes[] = {
+  sizeof(double), sizeof(float), sizeof(int), sizeof(long long)
+};
+
+#define MAXARRAYSIZE	(~(size_t)0)
+
+#define isfloattype(t)	((t) <= LUA_NAFLOAT32)
+
+#define elemaddr(A,i)	((char *)(A)->p + (i) * typesizes[(A)->type])
+
+
+typedef union NAScalar {
+  double f64;
+  float f32;
+  int i32;
+  long long i64;
+} NAScalar;
+
+
+/*
+** {======================================================
+** Kernels
+** =======================================================
+*/
+
+/*
+** Generic loops, for all types; 'U' is the type arithmetic is done in
+** (unsigned for integers, so that it wraps around).
+*/
+#define GENERIC_KERNELS(S,T,U) \
+static void add_##S (void *pa, const void *pb, size_t n) { \
+  T *a = (T *)pa; const T *b = (const T *)pb; size_t i; \
+  for (i = 0; i < n; i++) a[i] = (T)((U)a[i] + (U)b[i]); \
+} \
+static void sub_##S (void *pa, const void *pb, size_t n) { \
+  T *a = (T *)pa; const T *b = (const T *)pb; size_t i; \
+  for (i = 0; i < n; i++) a[i] = (T)((U)a[i] - (U)b[i]); \
+} \
+static void mul_##S (void *pa, const void *pb, size_t n) { \
+  T *a = (T *)pa; const T *b = (const T *)pb; size_t i; \
+  for (i = 0; i < n; i++) a[i] = (T)((U)a[i] * (U)b[i]); \
+} \
+static void adds_##S (void *pa, const NAScalar *s, size_t n) { \
+  T *a = (T *)pa; U k = (U)s->S; size_t i; \
+  for (i = 0; i < n; i++) a[i] = (T)((U)a[i] + k); \
+} \
+static void subs_##S (void *pa, const NAScalar *s, size_t n) { \
+  T *a = (T *)pa; U k = (U)s->S; size_t i; \
+  for (i = 0; i < n; i++) a[i] = (T)((U)a[i] - k); \
+} \
+static void muls_##S (void *pa, const NAScalar *s, size_t n) { \
+  T *a = (T *)pa; U k = (U)s->S; size_t i; \
+  for (i = 0; i < n; i++) a[i] = (T)((U)a[i] * k); \
+} \
+static void fma_##S (void *pa, const void *pb, const void *pc, \
+                     size_t n) { \
+  T *a = (T *)pa; const T *b = (const T *)pb; const T *c = (const T *)pc; \
+  size_t i; \
+  for (i = 0; i < n; i++) a[i] = (T)((U)a[i] + (U)b[i] * (U)c[i]); \
+} \
+static void fmas_##S (void *pa, const void *pb, const NAScalar *s, \
+                      size_t n) { \
+  T *a = (T *)pa; const T *b = (const T *)pb; U k = (U)s->S; size_t i; \
+  for (i = 0; i < n; i++) a[i] = (T)((U)a[i] + (U)b[i] * k); \
+} \
+static void sum_##S (const void *pa, size_t n, NAScalar *r) { \
+  const T *a = (const T *)pa; U s = 0; size_t i; \
+  for (i = 0; i < n; i++) s += (U)a[i]; \
+  r->S = (T)s; \
+} \
+static void dot_##S (const void *pa, const void *pb, size_t n, \
+                     NAScalar *r) { \
+  const T *a = (const T *)pa; const T *b = (const T *)pb; U s = 0; \
+  size_t i; \
+  for (i = 0; i < n; i++) s += (U)a[i] * (U)b[i]; \
+  r->S = (T)s; \
+} \
+static void min_##S (const void *pa, size_t n, NAScalar *r) { \
+  const T *a = (const T *)pa; T m = a[0]; size_t i; \
+  for (i = 1; i < n; i++) if (a[i] < m) m = a[i]; \
+  r->S = m; \
+} \
+static void max_##S (const void *pa, size_t n, NAScalar *r) { \
+  const T *a = (const T *)pa; T m = a[0]; size_t i; \
+  for (i = 1; i < n; i++) if (a[i] > m) m = a[i]; \
+  r->S = m; \
+}
+
+GENERIC_KERNELS(f64, double, double)
+GENERIC_KERNELS(f32, float, float)
+GENERIC_KERNELS(i32, int, unsigned int)
+GENERIC_KERNELS(i64, long long, unsigned long long)
+
+
+#if defined(NA_SSE2)
+
+/*
+** SSE2 loops for the float types: 'W' elements per register, two
+** registers per iteration, the rest done by the generic loop.
+*/
+#define SSE2_KERNELS(S,T,W,V,LOAD,STORE,SET1,ADD,SUB,MUL,MIN,MAX) \
+static void add_##S##_sse2 (void *pa, const void *pb, size_t n) { \
+  T *a = (T *)pa; const T *b = (const T *)pb; size_t i = 0; \
+  for (; i + 2 * W <= n; i += 2 * W) { \
+    STORE(a + i, ADD(LOAD(a + i), LOAD(b + i))); \
+    STORE(a + i + W, ADD(LOAD(a + i + W), LOAD(b + i + W))); \
+  } \
+  add_##S(a + i, b + i, n - i); \
+} \
+static void sub_##S##_sse2 (void *pa, const void *pb, size_t n) { \
+  T *a = (T *)pa; const T *b = (const T *)pb; size_t i = 0; \
+  for (; i + 2 * W <= n; i += 2 * W) { \
+    STORE(a + i, SUB(LOAD(a + i), LOAD(b + i))); \
+    STORE(a + i + W, SUB(LOAD(a + i + W), LOAD(b + i + W))); \
+  } \
+  sub_##S(a + i, b + i, n - i); \
+} \
+static void mul_##S##_sse2 (void *pa, const void *pb, size_t n) { \
+  T *a = (T *)pa; const T *b = (const T *)pb; size_t i = 0; \
+  for (; i + 2 * W <= n; i += 2 * W) { \
+    STORE(a + i, MUL(LOAD(a + i), LOAD(b + i))); \
+    STORE(a + i + W, MUL(LOAD(a + i + W), LOAD(b + i + W))); \
+  } \
+  mul_##S(a + i, b + i, n - i); \
+} \
+static void adds_##S##_sse2 (void *pa, const NAScalar *s, size_t n) { \
+  T *a = (T *)pa; V k = SET1(s->S); size_t i = 0; \
+  for (; i + 2 * W <= n; i += 2 * W) { \
+    STORE(a + i, ADD(LOAD(a + i), k)); \
+    STORE(a + i + W, ADD(LOAD(a + i + W), k)); \
+  } \
+  adds_##S(a + i, s, n - i); \
+} \
+static void subs_##S##_sse2 (void *pa, const NAScalar *s, size_t n) { \
+  T *a = (T *)pa; V k = SET1(s->S); size_t i = 0; \
+  for (; i + 2 * W <= n; i += 2 * W) { \
+    STORE(a + i, SUB(LOAD(a + i), k)); \
+    STORE(a + i + W, SUB(LOAD(a + i + W), k)); \
+  } \
+  subs_##S(a + i, s, n - i); \
+} \
+static void muls_##S##_sse2 (void *pa, const NAScalar *s, size_t n) { \
+  T *a = (T *)pa; V k = SET1(s->S); size_t i = 0; \
+  for (; i + 2 * W <= n; i += 2 * W) { \
+    STORE(a + i, MUL(LOAD(a + i), k)); \
+    STORE(a + i + W, MUL(LOAD(a + i + W), k)); \
+  } \
+  muls_##S(a + i, s, n - i); \
+} \
+static void fma_##S##_sse2 (void *pa, const void *pb, const void *pc, \
+                            size_t n) { \
+  T *a = (T *)pa; const T *b = (const T *)pb; const T *c = (const T *)pc; \
+  size_t i = 0; \
+  for (; i + 2 * W <= n; i += 2 * W) { \
+    STORE(a + i, ADD(LOAD(a + i), MUL(LOAD(b + i), LOAD(c + i)))); \
+    STORE(a + i + W, ADD(LOAD(a + i + W), \
+                         MUL(LOAD(b + i + W), LOAD(c + i + W)))); \
+  } \
+  fma_##S(a + i, b + i, c + i, n - i); \
+} \
+static void fmas_##S##_sse2 (void *pa, const void *pb, const NAScalar *s, \
+                             size_t n) { \
+  T *a = (T *)pa; const T *b = (const T *)pb; V k = SET1(s->S); \
+  size_t i = 0; \
+  for (; i + 2 * W <= n; i += 2 * W) { \
+    STORE(a + i, ADD(LOAD(a + i), MUL(LOAD(b + i), k))); \
+    STORE(a + i + W, ADD(LOAD(a + i + W), MUL(LOAD(b + i + W), k))); \
+  } \
+  fmas_##S(a + i, b + i, s, n - i); \
+} \
+static void sum_##S##_sse2 (const void *pa, size_t n, NAScalar *r) { \
+  const T *a = (const T *)pa; V s0 = SET1(0), s1 = SET1(0); \
+  T lanes[W]; T s; size_t i = 0; int l; \
+  for (; i + 2 * W <= n; i += 2 * W) { \
+    s0 = ADD(s0, LOAD(a + i)); \
+    s1 = ADD(s1, LOAD(a + i + W)); \
+  } \
+  sum_##S(a + i, n - i, r); \
+  STORE(lanes, ADD(s0, s1)); \
+  s = r->S; \
+  for (l = 0; l < W; l++) s += lanes[l]; \
+  r->S = s; \
+} \
+static void dot_##S##_sse2 (const void *pa, const void *pb, size_t n, \
+                            NAScalar *r) { \
+  const T *a = (const T *)pa; const T *b = (const T *)pb; \
+  V s0 = SET1(0), s1 = SET1(0); T lanes[W]; T s; size_t i = 0; int l; \
+  for (; i + 2 * W <= n; i += 2 * W) { \
+    s0 = ADD(s0, MUL(LOAD(a + i), LOAD(b + i))); \
+    s1 = ADD(s1, MUL(LOAD(a + i + W), LOAD(b + i + W))); \
+  } \
+  dot_##S(a + i, b + i, n - i, r); \
+  STORE(lanes, ADD(s0, s1)); \
+  s = r->S; \
+  for (l = 0; l < W; l++) s += lanes[l]; \
+  r->S = s; \
+} \
+static void min_##S##_sse2 (const void *pa, size_t n, NAScalar *r) { \
+  const T *a = (const T *)pa; V m0 = SET1(a[0]), m1 = m0; \
+  T lanes[W]; T m; size_t i = 0; int l; \
+  for (; i + 2 * W <= n; i += 2 * W) { \
+    m0 = MIN(m0, LOAD(a + i)); \
+    m1 = MIN(m1, LOAD(a + i + W)); \
+  } \
+  min_##S(a + (i < n ? i : 0), i < n ? n - i : 1, r); \
+  STORE(lanes, MIN(m0, m1)); \
+  m = r->S; \
+  for (l = 0; l < W; l++) if (lanes[l] < m) m = lanes[l]; \
+  r->S = m; \
+} \
+static void max_##S##_sse2 (const void *pa, size_t n, NAScalar *r) { \
+  const T *a = (const T *)pa; V m0 = SET1(a[0]), m1 = m0; \
+  T lanes[W]; T m; size_t i = 0; int l; \
+  for (; i + 2 * W <= n; i += 2 * W) { \
+    m0 = MAX(m0, LOAD(a + i)); \
+    m1 = MAX(m1, LOAD(a + i + W)); \
+  } \
+  max_##S(a + (i < n ? i : 0), i < n ? n - i : 1, r); \
+  STORE(lanes, MAX(m0, m1)); \
+  m = r->S; \
+  for (l = 0; l < W; l++) if (lanes[l] > m) m = lanes[l]; \
+  r->S = m; \
+}
+
+SSE2_KERNELS(f64, double, 2, __m128d, _mm_loadu_pd, _mm_storeu_pd,
+             _mm_set1_pd, _mm_add_pd, _mm_sub_pd, _mm_mul_pd,
+             _mm_min_pd, _mm_max_pd)
+SSE2_KERNELS(f32, float, 4, __m128, _mm_loadu_ps, _mm_storeu_ps,
+             _mm_set1_ps, _mm_add_ps, _mm_sub_ps, _mm_mul_ps,
+             _mm_min_ps, _mm_max_ps)
+
+#define FLOATK(op,S)	op##_##S##_sse2
+
+#else
+
+#define FLOATK(op,S)	op##_##S
+
+#endif
+
+
+typedef struct NAKernels {
+  void (*vv[3]) (void *a, const void *b, size_t n);  /* add, sub, mul */
+  void (*vs[3]) (void *a, const NAScalar *s, size_t n);
+  void (*fma) (void *a, const void *b, const void *c, size_t n);
+  void (*fmas) (void *a, const void *b, const NAScalar *s, size_t n);
+  void (*sum) (const void *a, size_t n, NAScalar *r);
+  void (*dot) (const void *a, const void *b, size_t n, NAScalar *r);
+  void (*min) (const void *a, size_t n, NAScalar *r);
+  void (*max) (const void *a, size_t n, NAScalar *r);
+} NAKernels;
+
+
+#define FLOAT_KERNELS(S) { \
+  {FLOATK(add,S), FLOATK(sub,S), FLOATK(mul,S)}, \
+  {FLOATK(adds,S), FLOATK(subs,S), FLOATK(muls,S)}, \
+  FLOATK(fma,S), FLOATK(fmas,S), FLOATK(sum,S), FLOATK(dot,S), \
+  FLOATK(min,S), FLOATK(max,S) }
+
+#define INT_KERNELS(S) { \
+  {add_##S, sub_##S, mul_##S}, {adds_##S, subs_##S, muls_##S}, \
+  fma_##S, fmas_##S, sum_##S, dot_##S, min_##S, max_##S }
+
+
+/* indexed by element type */
+static const NAKernels kernels[] = {
+  FLOAT_KERNELS(f64), FLOAT_KERNELS(f32), INT_KERNELS(i32), INT_KERNELS(i64)
+};
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Elements
+** =======================================================
+*/
+
+static luaL_NumArray *toarray (lua_State *L, int arg) {
+  void *p = lua_touserdata(L, arg);
+  if (p != NULL && lua_getmetatable(L, arg)) {
+    int same = lua_rawequal(L, -1, lua_upvalueindex(1));
+    lua_pop(L, 1);
+    if (same)
+      return (luaL_NumArray *)p;
+  }
+  return NULL;
+}
+
+
+static luaL_NumArray *checkarray (lua_State *L, int arg) {
+  luaL_NumArray *A = toarray(L, arg);
+  if (A == NULL)
+    luaL_argerror(L, arg, "numarray expected");
+  return A;
+}
+
+
+static void pushelem (lua_State *L, const luaL_NumArray *A, size_t i) {
+  const char *e = elemaddr(A, i);
+  switch (A->type) {
+    case LUA_NAFLOAT64: lua_pushnumber(L, *(const double *)e); break;
+    case LUA_NAFLOAT32: lua_pushnumber(L, *(const float *)e); break;
+    case LUA_NAINT32: lua_pushinteger(L, *(const int *)e); break;
+    default: lua_pushinteger(L, (lua_Integer)*(const long long *)e); break;
+  }
+}
+
+
+/* converts the value at 'arg' to the element type of 'A' */
+static void toscalar (lua_State *L, const luaL_NumArray *A, int arg,
+                      NAScalar *s) {
+  switch (A->type) {
+    case LUA_NAFLOAT64: s->f64 = (double)luaL_checknumber(L, arg); break;
+    case LUA_NAFLOAT32: s->f32 = (float)luaL_checknumber(L, arg); break;
+    case LUA_NAINT32: {
+      lua_Integer v = luaL_checkinteger(L, arg);
+      luaL_argcheck(L, v == (int)v, arg, "value out of int32 range");
+      s->i32 = (int)v;
+      break;
+    }
+    default: s->i64 = (long long)luaL_checkinteger(L, arg); break;
+  }
+}
+
+
+static void pushscalar (lua_State *L, const luaL_NumArray *A,
+                        const NAScalar *s) {
+  switch (A->type) {
+    case LUA_NAFLOAT64: lua_pushnumber(L, s->f64); break;
+    case LUA_NAFLOAT32: lua_pushnumber(L, s->f32); break;
+    case LUA_NAINT32: lua_pushinteger(L, s->i32); break;
+    default: lua_pushinteger(L, (lua_Integer)s->i64); break;
+  }
+}
+
+
+static void setelem (lua_State *L, luaL_NumArray *A, size_t i, int arg) {
+  NAScalar s;
+  toscalar(L, A, arg, &s);
+  memcpy(elemaddr(A, i), &s, typesizes[A->type]);
+}
+
+
+/* position 'i' (from 1) of an element, or 'n' if out of range */
+static size_t elemindex (lua_State *L, const luaL_NumArray *A, int arg) {
+  int isnum;
+  lua_Integer i;
+  if (lua_type(L, arg) != LUA_TNUMBER)
+    return A->n;
+  i = lua_tointegerx(L, arg, &isnum);
+  if (!isnum || (lua_Unsigned)i - 1u >= (lua_Unsigned)A->n)
+    return A->n;
+  return (size_t)(i - 1);
+}
+
+
+static luaL_NumArray *newarray (lua_State *L, int type, size_t n) {
+  luaL_NumArray *A;
+  size_t size = typesizes[type];
+  if (n > (MAXARRAYSIZE - sizeof(luaL_NumArray)) / size)
+    luaL_error(L, "numarray too large");
+  A = (luaL_NumArray *)lua_newuserdata(L, sizeof(luaL_NumArray) + n * size);
+  A->p = A + 1;
+  A->n = n;
+  A->type = type;
+  memset(A->p, 0, n * size);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_setmetatable(L, -2);
+  return A;
+}
+
+
+/* copies the values of table or array 'arg' into 'A' from position 'i' */
+static void copyfrom (lua_State *L, luaL_NumArray *A, size_t i, int arg) {
+  luaL_NumArray *src = toarray(L, arg);
+  size_t n, k;
+  if (src != NULL)
+    n = src->n;
+  else {
+    luaL_checktype(L, arg, LUA_TTABLE);
+    n = (size_t)luaL_len(L, arg);
+  }
+  luaL_argcheck(L, n <= A->n - i, arg, "too many values");
+  if (src != NULL && src->type == A->type)
+    memmove(elemaddr(A, i), src->p, n * typesizes[A->type]);
+  else {
+    for (k = 0; k < n; k++) {
+      if (src != NULL)
+        pushelem(L, src, k);
+      else
+        lua_geti(L, arg, (lua_Integer)k + 1);
+      setelem(L, A, i + k, -1);
+      lua_pop(L, 1);
+    }
+  }
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Library functions
+** =======================================================
+*/
+
+/*
+** numarray.new(type, n | values): a new array of 'n' zeros, or with
+** the values of a table or another array
+*/
+static int na_new (lua_State *L) {
+  int type = luaL_checkoption(L, 1, NULL, typenames);
+  luaL_NumArray *A;
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    lua_Integer n = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, n >= 0, 2, "invalid size");
+    newarray(L, type, (size_t)n);
+  }
+  else {
+    luaL_NumArray *src = toarray(L, 2);
+    if (src == NULL)
+      luaL_checktype(L, 2, LUA_TTABLE);
+    A = newarray(L, type, src ? src->n : (size_t)luaL_len(L, 2));
+    copyfrom(L, A, 0, 2);
+  }
+  return 1;
+}
+
+
+/* numarray.type(x): element type of array 'x', or nil */
+static int na_type (lua_State *L) {
+  luaL_NumArray *A;
+  luaL_checkany(L, 1);
+  A = toarray(L, 1);
+  if (A == NULL)
+    lua_pushnil(L);  /* not a numarray */
+  else
+    lua_pushstring(L, typenames[A->type]);
+  return 1;
+}
+
+
+static int na_index (lua_State *L) {
+  luaL_NumArray *A = checkarray(L, 1);
+  size_t i = elemindex(L, A, 2);
+  if (i < A->n)
+    pushelem(L, A, i);
+  else if (lua_type(L, 2) == LUA_TSTRING) {  /* method? */
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+  }
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+
+static int na_newindex (lua_State *L) {
+  luaL_NumArray *A = checkarray(L, 1);
+  size_t i = elemindex(L, A, 2);
+  luaL_argcheck(L, i < A->n, 2, "index out of range");
+  setelem(L, A, i, 3);
+  return 0;
+}
+
+
+static int na_len (lua_State *L) {
+  luaL_NumArray *A = checkarray(L, 1);
+  lua_pushinteger(L, (lua_Integer)A->n);
+  return 1;
+}
+
+
+static int na_tostring (lua_State *L) {
+  luaL_NumArray *A = checkarray(L, 1);
+  lua_pushfstring(L, "numarray(%s, %I): %p", typenames[A->type],
+                  (lua_Integer)A->n, (void *)A);
+  return 1;
+}
+
+
+/*
+** a:view(i [, j]): an array sharing the elements 'i .. j' of 'a'
+** (default to the end)
+*/
+static int na_view (lua_State *L) {
+  luaL_NumArray *A = checkarray(L, 1);
+  lua_Integer i = luaL_checkinteger(L, 2);
+  lua_Integer j = luaL_optinteger(L, 3, (lua_Integer)A->n);
+  luaL_NumArray *V;
+  luaL_argcheck(L, 1 <= i && (lua_Unsigned)i <= (lua_Unsigned)A->n + 1, 2,
+                "out of range");
+  luaL_argcheck(L, i - 1 <= j && (lua_Unsigned)j <= (lua_Unsigned)A->n, 3,
+                "out of range");
+  V = (luaL_NumArray *)lua_newuserdata(L, sizeof(luaL_NumArray));
+  V->p = elemaddr(A, (size_t)(i - 1));
+  V->n = (size_t)(j - i + 1);
+  V->type = A->type;
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_setmetatable(L, -2);
+  if (lua_getuservalue(L, 1) == LUA_TNIL) {  /* 'a' owns its elements? */
+    lua_pop(L, 1);
+    lua_pushvalue(L, 1);
+  }
+  lua_setuservalue(L, -2);  /* keep the owner alive */
+  return 1;
+}
+
+
+/* a:fill(v) */
+static int na_fill (lua_State *L) {
+  luaL_NumArray *A = checkarray(L, 1);
+  size_t size = typesizes[A->type];
+  NAScalar s;
+  size_t i;
+  toscalar(L, A, 2, &s);
+  for (i = 0; i < A->n; i++)
+    memcpy(elemaddr(A, i), &s, size);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/* a:copy(values [, i]): stores a table or array from position 'i' */
+static int na_copy (lua_State *L) {
+  luaL_NumArray *A = checkarray(L, 1);
+  lua_Integer i = luaL_optinteger(L, 3, 1);
+  luaL_argcheck(L, 1 <= i && (lua_Unsigned)i <= (lua_Unsigned)A->n + 1, 3,
+                "out of range");
+  copyfrom(L, A, (size_t)(i - 1), 2);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/* a:totable([i [, j]]) */
+static int na_totable (lua_State *L) {
+  luaL_NumArray *A = checkarray(L, 1);
+  lua_Integer i = luaL_optinteger(L, 2, 1);
+  lua_Integer j = luaL_optinteger(L, 3, (lua_Integer)A->n);
+  lua_Integer k;
+  luaL_argcheck(L, 1 <= i, 2, "out of range");
+  luaL_argcheck(L, (lua_Unsigned)j <= (lua_Unsigned)A->n, 3, "out of range");
+  lua_createtable(L, i <= j ? (int)(j - i + 1) : 0, 0);
+  for (k = i; k <= j; k++) {
+    pushelem(L, A, (size_t)(k - 1));
+    lua_rawseti(L, -2, k - i + 1);
+  }
+  return 1;
+}
+
+
+/* an array operand at 'arg' of the same type and length as 'A' */
+static luaL_NumArray *checkoperand (lua_State *L, const luaL_NumArray *A,
+                                    int arg) {
+  luaL_NumArray *B = checkarray(L, arg);
+  luaL_argcheck(L, B->type == A->type, arg, "numarray of another type");
+  luaL_argcheck(L, B->n == A->n, arg, "numarray of another length");
+  return B;
+}
+
+
+/* a:add(x), a:sub(x), a:mul(x): element by element, 'x' array or number */
+static int arith (lua_State *L, int op) {
+  luaL_NumArray *A = checkarray(L, 1);
+  const NAKernels *K = &kernels[A->type];
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    NAScalar s;
+    toscalar(L, A, 2, &s);
+    K->vs[op](A->p, &s, A->n);
+  }
+  else
+    K->vv[op](A->p, checkoperand(L, A, 2)->p, A->n);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int na_add (lua_State *L) { return arith(L, 0); }
+static int na_sub (lua_State *L) { return arith(L, 1); }
+static int na_mul (lua_State *L) { return arith(L, 2); }
+
+
+/* a:scale(k) */
+static int na_scale (lua_State *L) {
+  luaL_checktype(L, 2, LUA_TNUMBER);
+  return arith(L, 2);
+}
+
+
+/* a:fma(b, c): a = a + b * c, 'c' array or number */
+static int na_fma (lua_State *L) {
+  luaL_NumArray *A = checkarray(L, 1);
+  const NAKernels *K = &kernels[A->type];
+  luaL_NumArray *B = checkoperand(L, A, 2);
+  if (lua_type(L, 3) == LUA_TNUMBER) {
+    NAScalar s;
+    toscalar(L, A, 3, &s);
+    K->fmas(A->p, B->p, &s, A->n);
+  }
+  else
+    K->fma(A->p, B->p, checkoperand(L, A, 3)->p, A->n);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int na_sum (lua_State *L) {
+  luaL_NumArray *A = checkarray(L, 1);
+  NAScalar r;
+  kernels[A->type].sum(A->p, A->n, &r);
+  pushscalar(L, A, &r);
+  return 1;
+}
+
+
+static int na_dot (lua_State *L) {
+  luaL_NumArray *A = checkarray(L, 1);
+  NAScalar r;
+  kernels[A->type].dot(A->p, checkoperand(L, A, 2)->p, A->n, &r);
+  pushscalar(L, A, &r);
+  return 1;
+}
+
+
+/* a:min(), a:max(): nil for an empty array */
+static int minmax (lua_State *L, int max) {
+  luaL_NumArray *A = checkarray(L, 1);
+  NAScalar r;
+  if (A->n == 0)
+    return 0;
+  if (max)
+    kernels[A->type].max(A->p, A->n, &r);
+  else
+    kernels[A->type].min(A->p, A->n, &r);
+  pushscalar(L, A, &r);
+  return 1;
+}
+
+static int na_min (lua_State *L) { return minmax(L, 0); }
+static int na_max (lua_State *L) { return minmax(L, 1); }
+
+
+/* position (from 0) given by element 'k' of index array 'I' */
+static size_t getindex (lua_State *L, const luaL_NumArray *I, size_t k,
+                        size_t n) {
+  long long i = (I->type == LUA_NAINT32) ? ((const int *)I->p)[k]
+                                         : ((const long long *)I->p)[k];
+  if ((unsigned long long)i - 1u >= (unsigned long long)n)
+    luaL_error(L, "index %I out of range", (lua_Integer)i);
+  return (size_t)(i - 1);
+}
+
+
+static luaL_NumArray *checkindices (lua_State *L, int arg, size_t n) {
+  luaL_NumArray *I = checkarray(L, arg);
+  luaL_argcheck(L, !isfloattype(I->type), arg, "integer numarray expected");
+  luaL_argcheck(L, I->n == n, arg, "numarray of another length");
+  return I;
+}
+
+
+/* a:gather(src, idx): a[k] = src[idx[k]] */
+static int na_gather (lua_State *L) {
+  luaL_NumArray *A = checkarray(L, 1);
+  luaL_NumArray *src = checkarray(L, 2);
+  luaL_NumArray *I = checkindices(L, 3, A->n);
+  size_t size = typesizes[A->type];
+  size_t k;
+  luaL_argcheck(L, src->type == A->type, 2, "numarray of another type");
+  for (k = 0; k < A->n; k++)
+    memcpy(elemaddr(A, k), elemaddr(src, getindex(L, I, k, src->n)), size);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/* a:scatter(idx, src): a[idx[k]] = src[k] */
+static int na_scatter (lua_State *L) {
+  luaL_NumArray *A = checkarray(L, 1);
+  luaL_NumArray *src = checkarray(L, 3);
+  luaL_NumArray *I = checkindices(L, 2, src->n);
+  size_t size = typesizes[A->type];
+  size_t k;
+  luaL_argcheck(L, src->type == A->type, 3, "numarray of another type");
+  for (k = 0; k < src->n; k++)
+    memcpy(elemaddr(A, getindex(L, I, k, A->n)), elemaddr(src, k), size);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/*
+** functions for 'numarray' library
+*/
+static const luaL_Reg nalib[] = {
+  {"new", na_new},
+  {"type", na_type},
+  {NULL, NULL}
+};
+
+
+/*
+** methods for numeric arrays
+*/
+static const luaL_Reg alib[] = {
+  {"view", na_view},
+  {"fill", na_fill},
+  {"copy", na_copy},
+  {"totable", na_totable},
+  {"add", na_add},
+  {"sub", na_sub},
+  {"mul", na_mul},
+  {"scale", na_scale},
+  {"fma", na_fma},
+  {"sum", na_sum},
+  {"dot", na_dot},
+  {"min", na_min},
+  {"max", na_max},
+  {"gather", na_gather},
+  {"scatter", na_scatter},
+  {"__index", na_index},
+  {"__newindex", na_newindex},
+  {"__len", na_len},
+  {"__tostring", na_tostring},
+  {NULL, NULL}
+};
+
+/* }====================================================== */
+
+
+LUAMOD_API int luaopen_numarray (lua_State *L) {
+  luaL_newmetatable(L, LUA_NUMARRAYHANDLE);  /* metatable for arrays */
+  luaL_newlibtable(L, nalib);
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, nalib, 1);
+  lua_pushvalue(L, -2);
+  lua_pushvalue(L, -1);
+  luaL_setfuncs(L, alib, 1);  /* add methods to the metatable */
+  lua_pop(L, 1);  /* pop metatable */
+  return 1;
+}
+
@@ -22,6 +22,7 @@
 #include "lctype.h"
 #include "ldebug.h"
 #include "ldo.h"
+#include "lgc.h"
 #include "lmem.h"
 #include "lobject.h"
 #include "lstate.h"
@@ -33,6 +34,17 @@
 LUAI_DDEF const TValue luaO_nilobject_ = {NILCONSTANT};
 
 
+#if defined(LUA_USE_NANBOX)
+/* raw tags of boxed values: by code, then collectables by variant */
+LUAI_DDEF const lu_byte luaO_nbtags[16] = {
+  LUA_TNUMFLT, LUA_TNIL, LUA_TLIGHTUSERDATA, LUA_TLCF,
+  LUA_TDEADKEY, LUA_TNUMINT, LUA_TNIL, LUA_TBOOLEAN,
+  ctb(LUA_TSHRSTR), ctb(LUA_TTABLE), ctb(LUA_TLCL), ctb(LUA_TUSERDATA),
+  ctb(LUA_TTHREAD), ctb(LUA_TLNGSTR), ctb(LUA_TNUMINT), ctb(LUA_TCCL)
+};
+#endif
+
+
 /*
 ** converts an integer to a "floating point byte", represented as
 ** (eeeeexxx), where the real value is (1xxx) * 2^(eeeee - 1) if
@@ -128,7 +140,7 @@ void luaO_arith (lua_State *L, int op, const TValue *p1, const TValue *p2,
     case LUA_OPBNOT: {  /* operate only on integers */
       lua_Integer i1; lua_Integer i2;
       if (tointeger(p1, &i1) && tointeger(p2, &i2)) {
-        setivalue(res, intarith(L, op, i1, i2));
+        setivalue(L, res, intarith(L, op, i1, i2));
         return;
       }
       else break;  /* go to the end */
@@ -144,7 +156,7 @@ void luaO_arith (lua_State *L, int op, const TValue *p1, const TValue *p2,
     default: {  /* other operations */
       lua_Number n1; lua_Number n2;
       if (ttisinteger(p1) && ttisinteger(p2)) {
-        setivalue(res, intarith(L, op, ivalue(p1), ivalue(p2)));
+        setivalue(L, res, intarith(L, op, ivalue(p1), ivalue(p2)));
         return;
       }
       else if (tonumber(p1, &n1) && tonumber(p2, &n2)) {
@@ -243,9 +255,460 @@ static lua_Number lua_strx2number (const char *s, char **endptr) {
 /* }====================================================== */
 
 
+/*
+** {==================================================================
+** Fast conversions between numbers and decimal strings
+** ===================================================================
+*/
+
+/*
+** Integers are written two digits at a time. With double floats,
+** common decimal numerals are read exactly with one multiplication or
+** division by a power of 10 (both exact, so the result is correctly
+** rounded), and '%.14g' is produced by scaling the number to 14 digits
+** the same way, unless the result is too close to a tie to be sure how
+** to round it. Everything else goes to 'strtod'/'lua_number2str'. With
+** LUA_USE_SHORTESTFLOAT, floats are written with the shortest digits
+** that read back to the same value (Grisu2), instead of '%.14g'.
+*/
+
+static const char digitpairs[] =
+  "00010203040506070809" "10111213141516171819" "20212223242526272829"
+  "30313233343536373839" "40414243444546474849" "50515253545556575859"
+  "60616263646566676869" "70717273747576777879" "80818283848586878889"
+  "90919293949596979899";
+
+
+/*
+** writes the decimal digits of 'u' backwards, ending just before 'p';
+** returns a pointer to the first digit ('u' is wider than 'lua_Unsigned'
+** when integers are 32-bit, as floats also use it)
+*/
+static char *writedigits (char *p, unsigned long long u) {
+  while (u >= 100) {
+    const char *d = digitpairs + (u % 100) * 2;
+    u /= 100;
+    *--p = d[1];
+    *--p = d[0];
+  }
+  if (u >= 10) {
+    *--p = digitpairs[u * 2 + 1];
+    *--p = digitpairs[u * 2];
+  }
+  else
+    *--p = cast(char, '0' + u);
+  return p;
+}
+
+
+static size_t tostringint (char *buff, lua_Integer x) {
+  char temp[MAXNUMBER2STR];
+  char *end = temp + sizeof(temp);
+  lua_Unsigned u = l_castS2U(x);
+  char *p = writedigits(end, (x < 0) ? 0u - u : u);
+  size_t len;
+  if (x < 0) *--p = '-';
+  len = end - p;
+  memcpy(buff, p, len);
+  buff[len] = '\0';
+  return len;
+}
+
+
+#if LUA_FLOAT_TYPE == LUA_FLOAT_DOUBLE	/* { */
+
+typedef unsigned long long l_u64;
+
+/* number of significant digits in LUA_NUMBER_FMT ("%.14g") */
+#define NUMDIGITS	14
+
+/* powers of 10 that are exact as doubles */
+static const double exactpow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define MAXEXACTPOW	22
+
+/* largest integer up to which all integers are exact as doubles */
+#define MAXEXACTINT	(1ULL << 53)
+
+
+/*
+** tries to convert a decimal numeral with at most 19 significant digits
+** whose value is exactly 'm * 10^e' with 'm' and '10^|e|' both exact
+** doubles; returns NULL for anything else (which 'strtod' then handles)
+*/
+static const char *l_str2dfast (const char *s, lua_Number *result) {
+  int dot = lua_getlocaledecpoint();
+  l_u64 m = 0;  /* significant digits */
+  int nd = 0;  /* number of significant digits */
+  int e = 0;  /* decimal exponent */
+  int hasdot = 0;
+  int any = 0;  /* true if read some digit */
+  int neg;
+  double r;
+  while (lisspace(cast_uchar(*s))) s++;  /* skip initial spaces */
+  neg = isneg(&s);
+  for (;; s++) {
+    if (*s == dot && !hasdot)
+      hasdot = 1;
+    else if (lisdigit(cast_uchar(*s))) {
+      int d = *s - '0';
+      any = 1;
+      if (m != 0 || d != 0) {  /* significant digit? */
+        if (++nd > 19) return NULL;  /* too many */
+        m = m * 10 + d;
+      }
+      if (hasdot) e--;
+    }
+    else break;
+  }
+  if (!any) return NULL;
+  if (*s == 'e' || *s == 'E') {  /* exponent part? */
+    int exp1 = 0;
+    int neg1;
+    s++;  /* skip 'e' */
+    neg1 = isneg(&s);
+    if (!lisdigit(cast_uchar(*s))) return NULL;
+    for (; lisdigit(cast_uchar(*s)); s++)
+      if (exp1 < 10000)  /* avoid overflows */
+        exp1 = exp1 * 10 + *s - '0';
+    e += (neg1) ? -exp1 : exp1;
+  }
+  while (lisspace(cast_uchar(*s))) s++;  /* skip trailing spaces */
+  if (*s != '\0') return NULL;
+  if (m > MAXEXACTINT || (m != 0 && (e < -MAXEXACTPOW || e > MAXEXACTPOW)))
+    return NULL;
+  r = cast_num(m);
+  if (m != 0)
+    r = (e < 0) ? r / exactpow10[-e] : r * exactpow10[e];
+  *result = (neg) ? -r : r;
+  return s;
+}
+
+
+/*
+** writes digits 'dig[0 .. nd - 1]' of a number with decimal exponent
+** 'x' (that is, 'd.ddd * 10^x') as '%g' does with precision 'prec'
+*/
+static char *layout (char *p, const char *dig, int nd, int x, int prec) {
+  int dot = lua_getlocaledecpoint();
+  while (nd > 1 && dig[nd - 1] == '0') nd--;  /* remove trailing zeros */
+  if (x < -4 || x >= prec) {  /* exponential format? */
+    *p++ = dig[0];
+    if (nd > 1) {
+      *p++ = cast(char, dot);
+      memcpy(p, dig + 1, nd - 1);
+      p += nd - 1;
+    }
+    *p++ = 'e';
+    if (x < 0) { *p++ = '-'; x = -x; }
+    else *p++ = '+';
+    if (x >= 100) { *p++ = cast(char, '0' + x / 100); x %= 100; }
+    *p++ = digitpairs[x * 2];
+    *p++ = digitpairs[x * 2 + 1];
+  }
+  else if (x < 0) {  /* '0.000ddd' */
+    *p++ = '0';
+    *p++ = cast(char, dot);
+    memset(p, '0', -x - 1);
+    p += -x - 1;
+    memcpy(p, dig, nd);
+    p += nd;
+  }
+  else if (nd <= x + 1) {  /* 'ddd000' */
+    memcpy(p, dig, nd);
+    memset(p + nd, '0', x + 1 - nd);
+    p += x + 1;
+  }
+  else {  /* 'ddd.ddd' */
+    memcpy(p, dig, x + 1);
+    p += x + 1;
+    *p++ = cast(char, dot);
+    memcpy(p, dig + x + 1, nd - x - 1);
+    p += nd - x - 1;
+  }
+  return p;
+}
+
+
+#if !defined(LUA_USE_SHORTESTFLOAT)	/* { */
+
+/*
+** writes 'a' (positive, finite, normal) as '%.14g' does; returns NULL
+** when it cannot be sure to round as 'printf' does
+*/
+static char *tostringg (char *p, double a, int be) {
+  char dig[NUMDIGITS];
+  int x = cast_int(l_floor((be - 1023) * 0.30102999566398114));
+  int k = NUMDIGITS - 1 - x;  /* scale to 'NUMDIGITS' integer digits */
+  double y, fl;
+  l_u64 m;
+  if (k < -MAXEXACTPOW || k > MAXEXACTPOW) return NULL;
+  y = (k < 0) ? a / exactpow10[-k] : a * exactpow10[k];
+  if (y >= 1e14) {  /* 'x' was too small? */
+    x++; k--;
+    if (k < -MAXEXACTPOW) return NULL;
+    y = (k < 0) ? a / exactpow10[-k] : a * exactpow10[k];
+  }
+  if (y < 1e13 || y > 1e14) return NULL;
+  /* 'y' is within 2^-7 of the exact product (as y < 2^47) */
+  fl = l_floor(y);
+  if (y - fl > 0.5 - 1.0/64 && y - fl < 0.5 + 1.0/64)
+    return NULL;  /* too close to a tie */
+  m = (l_u64)fl + (y - fl > 0.5);
+  if (m == 100000000000000ULL) {  /* rounded up to one more digit? */
+    m /= 10;
+    x++;
+  }
+  writedigits(dig + NUMDIGITS, m);
+  return layout(p, dig, NUMDIGITS, x, NUMDIGITS);
+}
+
+#else						/* }{ */
+
+/*
+** Grisu2 (Florian Loitsch, "Printing Floating-Point Numbers Quickly
+** and Accurately with Integers"): the number and the boundaries of
+** its rounding interval are multiplied by a cached power of 10, in
+** 64-bit fixed point, and digits are generated until they fall inside
+** the (slightly narrowed) interval. The result always reads back to
+** the same number and is the shortest in all but very rare cases.
+*/
+
+typedef struct DiyFp {
+  l_u64 f;  /* significand */
+  int e;  /* binary exponent */
+} DiyFp;
+
+
+/* 10^k, k = -348, -340, ..., 340, normalized, and their exponents */
+static const l_u64 cachedsig[] = {
+  0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+  0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+  0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+  0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+  0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+  0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+  0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+  0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+  0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+  0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+  0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+  0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+  0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+  0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+  0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+  0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+  0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+  0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+  0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+  0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+  0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+  0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+  0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+  0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+  0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+  0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+  0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+  0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+  0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+
+static const short cachedexp[] = {
+  -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007,  -980,
+   -954,  -927,  -901,  -874,  -847,  -821,  -794,  -768,  -741,  -715,
+   -688,  -661,  -635,  -608,  -582,  -555,  -529,  -502,  -475,  -449,
+   -422,  -396,  -369,  -343,  -316,  -289,  -263,  -236,  -210,  -183,
+   -157,  -130,  -103,   -77,   -50,   -24,     3,    30,    56,    83,
+    109,   136,   162,   189,   216,   242,   269,   295,   322,   348,
+    375,   402,   428,   455,   481,   508,   534,   561,   588,   614,
+    641,   667,   694,   720,   747,   774,   800,   827,   853,   880,
+    907,   933,   960,   986,  1013,  1039,  1066
+};
+
+static const l_u64 pow10u[] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+  10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+  100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+  100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+  100000000000000000ULL, 1000000000000000000ULL,
+  10000000000000000000ULL
+};
+
+
+/* upper half of the 128-bit product, rounded */
+static DiyFp fpmul (DiyFp x, DiyFp y) {
+  DiyFp r;
+  l_u64 a = x.f >> 32, b = x.f & 0xffffffffu;
+  l_u64 c = y.f >> 32, d = y.f & 0xffffffffu;
+  l_u64 ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  l_u64 mid = (bd >> 32) + (ad & 0xffffffffu) + (bc & 0xffffffffu);
+  mid += 1u << 31;  /* round */
+  r.f = ac + (ad >> 32) + (bc >> 32) + (mid >> 32);
+  r.e = x.e + y.e + 64;
+  return r;
+}
+
+
+static DiyFp fpnormalize (DiyFp x) {
+  while (!(x.f & (1ULL << 63))) {
+    x.f <<= 1;
+    x.e--;
+  }
+  return x;
+}
+
+
+/*
+** Rounds the last digit down (the buffer holds the upper boundary
+** side) while the result gets closer to the number and stays in the
+** interval.
+*/
+static void grisuround (char *dig, int nd, l_u64 delta, l_u64 rest,
+                        l_u64 tenk, l_u64 wpw) {
+  while (rest < wpw && delta - rest >= tenk &&
+         (rest + tenk < wpw || wpw - rest > rest + tenk - wpw)) {
+    dig[nd - 1]--;
+    rest += tenk;
+  }
+}
+
+
+/*
+** generates the digits of 'mp' (the upper boundary) until they are
+** within 'delta' of it; '*k' gets the decimal exponent of the last one
+*/
+static int digitgen (DiyFp w, DiyFp mp, l_u64 delta, char *dig, int *k) {
+  int sh = -mp.e;  /* bits of the fraction part */
+  l_u64 one = 1ULL << sh;
+  l_u64 wpw = mp.f - w.f;
+  unsigned int p1 = cast(unsigned int, mp.f >> sh);  /* integer part */
+  l_u64 p2 = mp.f & (one - 1);  /* fraction part */
+  int kappa = 1;
+  int nd = 0;
+  while (kappa < 10 && p1 >= pow10u[kappa]) kappa++;
+  while (kappa > 0) {
+    unsigned int d = cast(unsigned int, p1 / pow10u[kappa - 1]);
+    l_u64 rest;
+    p1 = cast(unsigned int, p1 % pow10u[kappa - 1]);
+    kappa--;
+    if (d != 0 || nd != 0) dig[nd++] = cast(char, '0' + d);
+    rest = (cast(l_u64, p1) << sh) + p2;
+    if (rest <= delta) {
+      *k += kappa;
+      grisuround(dig, nd, delta, rest, pow10u[kappa] << sh, wpw);
+      return nd;
+    }
+  }
+  for (;;) {
+    unsigned int d;
+    p2 *= 10;
+    delta *= 10;
+    d = cast(unsigned int, p2 >> sh);
+    if (d != 0 || nd != 0) dig[nd++] = cast(char, '0' + d);
+    p2 &= one - 1;
+    kappa--;
+    if (p2 < delta) {
+      *k += kappa;
+      grisuround(dig, nd, delta, p2, one,
+                 (-kappa < 20) ? wpw * pow10u[-kappa] : 0);
+      return nd;
+    }
+  }
+}
+
+
+/*
+** writes 'a' (positive and finite) with the shortest digits that read
+** back to it, in the layout of '%.17g'
+*/
+static char *tostringg (char *p, double a, int be) {
+  char dig[24];
+  l_u64 bits;
+  DiyFp w, mp, mm, c;
+  double dk;
+  int k, idx, nd;
+  memcpy(&bits, &a, sizeof(bits));
+  w.f = bits & ((1ULL << 52) - 1);
+  if (be != 0) {  /* normal? */
+    w.f |= 1ULL << 52;
+    w.e = be - 1075;
+  }
+  else w.e = -1074;
+  /* boundaries of the interval of numbers that round to 'a' */
+  mp.f = (w.f << 1) + 1; mp.e = w.e - 1;
+  mp = fpnormalize(mp);
+  if (w.f == (1ULL << 52) && be > 1) {  /* lower neighbor is closer? */
+    mm.f = (w.f << 2) - 1; mm.e = w.e - 2;
+  }
+  else {
+    mm.f = (w.f << 1) - 1; mm.e = w.e - 1;
+  }
+  mm.f <<= mm.e - mp.e; mm.e = mp.e;
+  w = fpnormalize(w);
+  /* cached power bringing the exponent of 'mp' to [-60, -32] */
+  dk = (-61 - mp.e) * 0.30102999566398114 + 347;
+  k = cast_int(dk);
+  if (dk - k > 0.0) k++;
+  idx = (k >> 3) + 1;
+  k = 348 - idx * 8;  /* 'c' is 10^-k */
+  c.f = cachedsig[idx]; c.e = cachedexp[idx];
+  w = fpmul(w, c);
+  mp = fpmul(mp, c); mp.f--;
+  mm = fpmul(mm, c); mm.f++;
+  nd = digitgen(w, mp, mp.f - mm.f, dig, &k);
+  return layout(p, dig, nd, nd + k - 1, 17);
+}
+
+#endif						/* } */
+
+
+/*
+** writes a float as 'lua_number2str' does (or in the shortest form);
+** returns its length
+*/
+static size_t tostringflt (char *buff, lua_Number n) {
+  char *p = buff;
+  l_u64 bits;
+  int be;
+  memcpy(&bits, &n, sizeof(bits));
+  be = cast_int((bits >> 52) & 0x7ff);
+  if (be == 0x7ff)  /* inf or nan? */
+    return lua_number2str(buff, MAXNUMBER2STR, n);
+  if (bits >> 63) *p++ = '-';
+  if (n == 0)
+    *p++ = '0';
+  else {
+#if defined(LUA_USE_SHORTESTFLOAT)
+    p = tostringg(p, l_mathop(fabs)(n), be);
+#else
+    if (be == 0 || (p = tostringg(p, l_mathop(fabs)(n), be)) == NULL)
+      return lua_number2str(buff, MAXNUMBER2STR, n);  /* slow path */
+#endif
+  }
+  *p = '\0';
+  return p - buff;
+}
+
+#else						/* }{ */
+
+#define l_str2dfast(s,r)	NULL
+
+#define tostringflt(b,n)	lua_number2str(b, MAXNUMBER2STR, n)
+
+#endif						/* } */
+
+/* }================================================================== */
+
+
 static const char *l_str2d (const char *s, lua_Number *result) {
   char *endptr;
-  if (strpbrk(s, "nN"))  /* reject 'inf' and 'nan' */
+  const char *e = l_str2dfast(s, result);
+  if (e != NULL)  /* common decimal numeral? */
+    return e;
+  else if (strpbrk(s, "nN"))  /* reject 'inf' and 'nan' */
     return NULL;
   else if (strpbrk(s, "xX"))  /* hex? */
     *result = lua_strx2number(s, &endptr);
@@ -286,21 +749,51 @@ static const char *l_str2int (const char *s, lua_Integer *result) {
 }
 
 
-size_t luaO_str2num (const char *s, TValue *o) {
-  lua_Integer i; lua_Number n;
+/*
+** Convert string 's' to an integer in '*i' or else to a float in '*n'
+** ('*isint' tells which); returns 0 when 's' is not a numeral.
+*/
+size_t luaO_str2val (const char *s, lua_Integer *i, lua_Number *n,
+                     int *isint) {
   const char *e;
-  if ((e = l_str2int(s, &i)) != NULL) {  /* try as an integer */
-    setivalue(o, i);
-  }
-  else if ((e = l_str2d(s, &n)) != NULL) {  /* else try as a float */
-    setfltvalue(o, n);
-  }
+  if ((e = l_str2int(s, i)) != NULL)  /* try as an integer */
+    *isint = 1;
+  else if ((e = l_str2d(s, n)) != NULL)  /* else try as a float */
+    *isint = 0;
   else
     return 0;  /* conversion failed */
   return (e - s) + 1;  /* success; return string size */
 }
 
 
+size_t luaO_str2num (lua_State *L, const char *s, TValue *o) {
+  lua_Integer i; lua_Number n;
+  int isint;
+  size_t sz = luaO_str2val(s, &i, &n, &isint);
+  if (sz == 0)
+    return 0;  /* conversion failed */
+  else if (isint) {
+    setivalue(L, o, i);
+  }
+  else {
+    setfltvalue(o, n);
+  }
+  return sz;
+}
+
+
+#if defined(LUA_USE_NANBOX)
+/*
+** Set 'obj' to an integer that does not fit in a NaN-boxed value
+*/
+void luaO_boxint (lua_State *L, TValue *obj, lua_Integer i) {
+  GCObject *o = luaC_newobj(L, LUA_TNUMINT, sizeof(IntBox));
+  gco2ib(o)->i = i;
+  nbsetgc(obj, o, LUA_TNUMINT);
+}
+#endif
+
+
 int luaO_utf8esc (char *buff, unsigned long x) {
   int n = 1;  /* number of bytes put in buffer (backwards) */
   lua_assert(x <= 0x10FFFF);
@@ -319,21 +812,17 @@ int luaO_utf8esc (char *buff, unsigned long x) {
 }
 
 
-/* maximum length of the conversion of a number to a string */
-#define MAXNUMBER2STR	50
-
-
 /*
-** Convert a number object to a string
+** Convert a number object to a string in 'buff' (with at least
+** MAXNUMBER2STR bytes), returning its length (without a final '\0')
 */
-void luaO_tostring (lua_State *L, StkId obj) {
-  char buff[MAXNUMBER2STR];
+size_t luaO_tostringbuff (const TValue *obj, char *buff) {
   size_t len;
   lua_assert(ttisnumber(obj));
   if (ttisinteger(obj))
-    len = lua_integer2str(buff, sizeof(buff), ivalue(obj));
+    len = tostringint(buff, ivalue(obj));
   else {
-    len = lua_number2str(buff, sizeof(buff), fltvalue(obj));
+    len = tostringflt(buff, fltvalue(obj));
 #if !defined(LUA_COMPAT_FLOATSTRING)
     if (buff[strspn(buff, "-0123456789")] == '\0') {  /* looks like an int? */
       buff[len++] = lua_getlocaledecpoint();
@@ -341,6 +830,16 @@ void luaO_tostring (lua_State *L, StkId obj) {
     }
 #endif
   }
+  return len;
+}
+
+
+/*
+** Convert a number object to a string
+*/
+void luaO_tostring (lua_State *L, StkId obj) {
+  char buff[MAXNUMBER2STR];
+  size_t len = luaO_tostringbuff(obj, buff);
   setsvalue2s(L, obj, luaS_newlstr(L, buff, len));
 }
 
@@ -375,11 +874,11 @@ const char *luaO_pushvfstring (lua_State *L, const char *fmt, va_list argp) {
         break;
       }
       case 'd': {
-        setivalue(L->top, va_arg(argp, int));
+        setivalue(L, L->top, va_arg(argp, int));
         goto top2str;
       }
       case 'I': {
-        setivalue(L->top, cast(lua_Integer, va_arg(argp, l_uacInt)));
+        setivalue(L, L->top, cast(lua_Integer, va_arg(argp, l_uacInt)));
         goto top2str;
       }
       case 'f': {
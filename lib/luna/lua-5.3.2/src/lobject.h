@@ -107,6 +107,12 @@ typedef union Value {
 } Value;
 
 
+/* tag with no variants (bits 0-3) */
+#define novariant(x)	((x) & 0x0F)
+
+
+#if !defined(LUA_USE_NANBOX)	/* { */
+
 #define TValuefields	Value value_; int tt_
 
 
@@ -126,9 +132,6 @@ typedef struct lua_TValue {
 /* raw type tag of a TValue */
 #define rttype(o)	((o)->tt_)
 
-/* tag with no variants (bits 0-3) */
-#define novariant(x)	((x) & 0x0F)
-
 /* type tag of a TValue (bits 0-3 for tags + variant bits 4-5) */
 #define ttype(o)	(rttype(o) & 0x3F)
 
@@ -157,31 +160,157 @@ typedef struct lua_TValue {
 #define ttisfulluserdata(o)	checktag((o), ctb(LUA_TUSERDATA))
 #define ttisthread(o)		checktag((o), ctb(LUA_TTHREAD))
 #define ttisdeadkey(o)		checktag((o), LUA_TDEADKEY)
+#define ttisboxedint(o)		0
+
+#else				/* }{ */
+
+/*
+** NaN-boxed values: a value takes 8 bytes. A float is stored as itself
+** (with NaNs made canonical); any other value is a negative quiet NaN
+** with a code 'NB_*' (never 0) in bits 48-50 and a pointer, integer or
+** boolean in bits 0-47. Collectable objects are aligned to 8 bytes, so
+** the low 3 bits of their pointers hold their variant ('nbvariant').
+** Integers that fit in 48 bits are stored inline (sign-extended when
+** read); any other integer goes to a collectable 'IntBox'.
+*/
+#if LUA_FLOAT_TYPE != LUA_FLOAT_DOUBLE
+#error "LUA_USE_NANBOX needs 'double' floats"
+#endif
+
+typedef union NBValue {
+  unsigned long long u;  /* boxed bits */
+  lua_Number n;  /* float numbers */
+} NBValue;
+
+#define TValuefields	NBValue v_
+
+
+typedef struct lua_TValue {
+  TValuefields;
+} TValue;
+
+
+/* codes of boxed values */
+#define NB_GC		1	/* collectable objects */
+#define NB_LUD		2	/* light userdata */
+#define NB_LCF		3	/* light C functions */
+#define NB_DEAD		4	/* dead keys (keep their object pointer) */
+#define NB_INT		5	/* integer numbers */
+#define NB_NIL		6
+#define NB_BOOL		7
+
+#define nbtag(c)	(cast(unsigned long long, 0xFFF8 | (c)) << 48)
+#define NB_TAGMASK	0xFFFF000000000000ULL
+#define NB_PAYLOAD	0x0000FFFFFFFFFFFFULL
+#define NB_GCPTR	0x0000FFFFFFFFFFF8ULL
+#define NB_CANONNAN	0x7FF8000000000000ULL
+
+/* variant (0-7) of a collectable tag (boxed integers take variant 6) */
+#define nbvariant(t)	((t) == LUA_TNUMINT ? 6 : \
+	novariant(t) - 4 + (((t) & 0x30) ? 5 : 0))
+
+#define nbbits(o)	((o)->v_.u)
+#define nbcode(o)	(cast_int(nbbits(o) >> 48) & 7)
+#define nbchecktag(o,c)	((nbbits(o) & NB_TAGMASK) == nbtag(c))
+#define nbcheckgc(o,t) \
+	((nbbits(o) & (NB_TAGMASK | 7)) == (nbtag(NB_GC) | nbvariant(t)))
+
+/*
+** low 48 bits of 'u', zero- or sign-extended (shifts avoid 64-bit
+** masks; assumes that '>>' on a negative 'long long' is arithmetic)
+*/
+#define nbzext(u)	(cast(unsigned long long, (u)) << 16 >> 16)
+#define nbsext(u) \
+	(cast(long long, cast(unsigned long long, (u)) << 16) >> 16)
+
+
+/* macro defining a nil value */
+#define NILCONSTANT	{nbtag(NB_NIL)}
+
+
+/* raw type tag of a TValue (tags by code, then collectable by variant) */
+#define rttype(o)	(ttisfloat(o) ? LUA_TNUMFLT : luaO_nbtags[ \
+	nbcode(o) == NB_GC ? 8 + cast_int(nbbits(o) & 7) : nbcode(o)])
+
+LUAI_DDEC const lu_byte luaO_nbtags[16];
+
+/* type tag of a TValue (bits 0-3 for tags + variant bits 4-5) */
+#define ttype(o)	(rttype(o) & 0x3F)
+
+/* type tag of a TValue with no variants (bits 0-3) */
+#define ttnov(o)	(novariant(rttype(o)))
+
+
+/* Macros to test type */
+#define checktag(o,t)		(rttype(o) == (t))
+#define checktype(o,t)		(ttnov(o) == (t))
+#define ttisnumber(o)		(ttisfloat(o) || ttisinteger(o))
+#define ttisfloat(o)		(nbbits(o) < nbtag(1))
+#define ttisinteger(o)		\
+	(l_likely(nbchecktag((o), NB_INT)) || ttisboxedint(o))
+#define ttisboxedint(o)		nbcheckgc((o), LUA_TNUMINT)
+#define ttisnil(o)		(nbbits(o) == nbtag(NB_NIL))
+#define ttisboolean(o)		nbchecktag((o), NB_BOOL)
+#define ttislightuserdata(o)	nbchecktag((o), NB_LUD)
+#define ttisstring(o)		(ttisshrstring(o) || ttislngstring(o))
+#define ttisshrstring(o)	nbcheckgc((o), LUA_TSHRSTR)
+#define ttislngstring(o)	nbcheckgc((o), LUA_TLNGSTR)
+#define ttistable(o)		nbcheckgc((o), LUA_TTABLE)
+#define ttisfunction(o)		(ttisclosure(o) || ttislcf(o))
+#define ttisclosure(o)		(ttisLclosure(o) || ttisCclosure(o))
+#define ttisCclosure(o)		nbcheckgc((o), LUA_TCCL)
+#define ttisLclosure(o)		nbcheckgc((o), LUA_TLCL)
+#define ttislcf(o)		nbchecktag((o), NB_LCF)
+#define ttisfulluserdata(o)	nbcheckgc((o), LUA_TUSERDATA)
+#define ttisthread(o)		nbcheckgc((o), LUA_TTHREAD)
+#define ttisdeadkey(o)		nbchecktag((o), NB_DEAD)
+
+#endif				/* } */
 
 
 /* Macros to access values */
+#if !defined(LUA_USE_NANBOX)
 #define ivalue(o)	check_exp(ttisinteger(o), val_(o).i)
 #define fltvalue(o)	check_exp(ttisfloat(o), val_(o).n)
-#define nvalue(o)	check_exp(ttisnumber(o), \
-	(ttisinteger(o) ? cast_num(ivalue(o)) : fltvalue(o)))
 #define gcvalue(o)	check_exp(iscollectable(o), val_(o).gc)
 #define pvalue(o)	check_exp(ttislightuserdata(o), val_(o).p)
-#define tsvalue(o)	check_exp(ttisstring(o), gco2ts(val_(o).gc))
-#define uvalue(o)	check_exp(ttisfulluserdata(o), gco2u(val_(o).gc))
-#define clvalue(o)	check_exp(ttisclosure(o), gco2cl(val_(o).gc))
-#define clLvalue(o)	check_exp(ttisLclosure(o), gco2lcl(val_(o).gc))
-#define clCvalue(o)	check_exp(ttisCclosure(o), gco2ccl(val_(o).gc))
 #define fvalue(o)	check_exp(ttislcf(o), val_(o).f)
-#define hvalue(o)	check_exp(ttistable(o), gco2t(val_(o).gc))
 #define bvalue(o)	check_exp(ttisboolean(o), val_(o).b)
-#define thvalue(o)	check_exp(ttisthread(o), gco2th(val_(o).gc))
 /* a dead value may get the 'gc' field, but cannot access its contents */
 #define deadvalue(o)	check_exp(ttisdeadkey(o), cast(void *, val_(o).gc))
 
-#define l_isfalse(o)	(ttisnil(o) || (ttisboolean(o) && bvalue(o) == 0))
+#define iscollectable(o)	(rttype(o) & BIT_ISCOLLECTABLE)
+#else
+#define ivalue(o)	check_exp(ttisinteger(o), \
+	l_likely(nbchecktag((o), NB_INT)) ? \
+	cast(lua_Integer, nbsext(nbbits(o))) : \
+	cast(IntBox *, cast(size_t, nbbits(o) & NB_GCPTR))->i)
+#define fltvalue(o)	check_exp(ttisfloat(o), (o)->v_.n)
+#define gcvalue(o)	check_exp(iscollectable(o), \
+	cast(GCObject *, cast(size_t, nbbits(o) & NB_GCPTR)))
+#define pvalue(o)	check_exp(ttislightuserdata(o), \
+	cast(void *, cast(size_t, nbbits(o) & NB_PAYLOAD)))
+#define fvalue(o)	check_exp(ttislcf(o), \
+	cast(lua_CFunction, cast(size_t, nbbits(o) & NB_PAYLOAD)))
+#define bvalue(o)	check_exp(ttisboolean(o), cast_int(nbbits(o) & 1))
+/* a dead value may get the 'gc' field, but cannot access its contents */
+#define deadvalue(o)	check_exp(ttisdeadkey(o), \
+	cast(void *, cast(size_t, nbbits(o) & NB_GCPTR)))
 
+#define iscollectable(o)	nbchecktag((o), NB_GC)
+#endif
 
-#define iscollectable(o)	(rttype(o) & BIT_ISCOLLECTABLE)
+#define nvalue(o)	check_exp(ttisnumber(o), \
+	(ttisinteger(o) ? cast_num(ivalue(o)) : fltvalue(o)))
+#define tsvalue(o)	check_exp(ttisstring(o), gco2ts(gcvalue(o)))
+#define uvalue(o)	check_exp(ttisfulluserdata(o), gco2u(gcvalue(o)))
+#define clvalue(o)	check_exp(ttisclosure(o), gco2cl(gcvalue(o)))
+#define clLvalue(o)	check_exp(ttisLclosure(o), gco2lcl(gcvalue(o)))
+#define clCvalue(o)	check_exp(ttisCclosure(o), gco2ccl(gcvalue(o)))
+#define hvalue(o)	check_exp(ttistable(o), gco2t(gcvalue(o)))
+#define thvalue(o)	check_exp(ttisthread(o), gco2th(gcvalue(o)))
+
+#define l_isfalse(o)	(ttisnil(o) || (ttisboolean(o) && bvalue(o) == 0))
 
 
 /* Macros for internal tests */
@@ -192,6 +321,7 @@ typedef struct lua_TValue {
 		(righttt(obj) && (L == NULL || !isdead(G(L),gcvalue(obj)))))
 
 
+#if !defined(LUA_USE_NANBOX)
 /* Macros to set values */
 #define settt_(o,t)	((o)->tt_=(t))
 
@@ -201,11 +331,11 @@ typedef struct lua_TValue {
 #define chgfltvalue(obj,x) \
   { TValue *io=(obj); lua_assert(ttisfloat(io)); val_(io).n=(x); }
 
-#define setivalue(obj,x) \
-  { TValue *io=(obj); val_(io).i=(x); settt_(io, LUA_TNUMINT); }
+#define setivalue(L,obj,x) \
+  { TValue *io=(obj); val_(io).i=(x); settt_(io, LUA_TNUMINT); (void)L; }
 
-#define chgivalue(obj,x) \
-  { TValue *io=(obj); lua_assert(ttisinteger(io)); val_(io).i=(x); }
+#define chgivalue(L,obj,x) \
+  { TValue *io=(obj); lua_assert(ttisinteger(io)); val_(io).i=(x); (void)L; }
 
 #define setnilvalue(obj) settt_(obj, LUA_TNIL)
 
@@ -253,6 +383,84 @@ typedef struct lua_TValue {
     checkliveness(L,io); }
 
 #define setdeadvalue(obj)	settt_(obj, LUA_TDEADKEY)
+#else
+/* Macros to set values */
+#define nbset(o,c,x)	((o)->v_.u = nbtag(c) | (x))
+
+/* 'x' is a collectable object of variant tag 't' */
+#define nbsetgc(o,x,t) \
+	nbset(o, NB_GC, cast(size_t, x) | cast(unsigned int, nbvariant(t)))
+
+#define setfltvalue(obj,x) \
+  { TValue *io=(obj); lua_Number n_=(x); io->v_.n=n_; \
+    if (luai_numisnan(n_)) io->v_.u=NB_CANONNAN; }
+
+#define chgfltvalue(obj,x) \
+  { TValue *io=(obj); lua_Number n_=(x); lua_assert(ttisfloat(io)); \
+    io->v_.n=n_; if (luai_numisnan(n_)) io->v_.u=NB_CANONNAN; }
+
+/* integers in [-2^47, 2^47) fit in the payload */
+#define nbfitsint(i)	(nbsext(cast(long long, i)) == (i))
+
+#define setivalue(L,obj,x) \
+  { TValue *io=(obj); lua_Integer i_=(x); \
+    if (l_likely(nbfitsint(i_))) \
+      nbset(io, NB_INT, nbzext(cast(long long, i_))); \
+    else luaO_boxint(L, io, i_); }
+
+/* a boxed integer may change to an inline one and vice versa */
+#define chgivalue(L,obj,x) \
+  { lua_assert(ttisinteger(obj)); setivalue(L,obj,x); }
+
+#define setnilvalue(obj) ((obj)->v_.u = nbtag(NB_NIL))
+
+#define setfvalue(obj,x) \
+  { TValue *io=(obj); nbset(io, NB_LCF, cast(size_t, (x))); }
+
+/* (keeps only 48 bits, as for the integer-constant keys of 'luaK_intK') */
+#define setpvalue(obj,x) \
+  { TValue *io=(obj); nbset(io, NB_LUD, cast(size_t, (x)) & NB_PAYLOAD); }
+
+#define setbvalue(obj,x) \
+  { TValue *io=(obj); nbset(io, NB_BOOL, cast(unsigned int, (x) != 0)); }
+
+#define setgcovalue(L,obj,x) \
+  { TValue *io = (obj); GCObject *i_g=(x); nbsetgc(io, i_g, i_g->tt); }
+
+#define setsvalue(L,obj,x) \
+  { TValue *io = (obj); TString *x_ = (x); \
+    nbsetgc(io, x_, x_->tt); \
+    checkliveness(L,io); }
+
+#define setuvalue(L,obj,x) \
+  { TValue *io = (obj); Udata *x_ = (x); \
+    nbsetgc(io, x_, LUA_TUSERDATA); \
+    checkliveness(L,io); }
+
+#define setthvalue(L,obj,x) \
+  { TValue *io = (obj); lua_State *x_ = (x); \
+    nbsetgc(io, x_, LUA_TTHREAD); \
+    checkliveness(L,io); }
+
+#define setclLvalue(L,obj,x) \
+  { TValue *io = (obj); LClosure *x_ = (x); \
+    nbsetgc(io, x_, LUA_TLCL); \
+    checkliveness(L,io); }
+
+#define setclCvalue(L,obj,x) \
+  { TValue *io = (obj); CClosure *x_ = (x); \
+    nbsetgc(io, x_, LUA_TCCL); \
+    checkliveness(L,io); }
+
+#define sethvalue(L,obj,x) \
+  { TValue *io = (obj); Table *x_ = (x); \
+    nbsetgc(io, x_, LUA_TTABLE); \
+    checkliveness(L,io); }
+
+/* keeps the pointer (and variant) of the collectable key */
+#define setdeadvalue(obj) \
+	((obj)->v_.u = ((obj)->v_.u & NB_PAYLOAD) | nbtag(NB_DEAD))
+#endif
 
 
 
@@ -295,6 +503,17 @@ typedef TValue *StkId;  /* index to stack elements */
 
 
 
+#if defined(LUA_USE_NANBOX)
+/*
+** Header for an integer that does not fit in a NaN-boxed value
+*/
+typedef struct IntBox {
+  CommonHeader;
+  lua_Integer i;
+} IntBox;
+#endif
+
+
 
 /*
 ** Header for string value; string bytes follow the end of this structure
@@ -348,7 +567,11 @@ typedef struct Udata {
   lu_byte ttuv_;  /* user value's tag */
   struct Table *metatable;
   size_t len;  /* number of bytes */
+#if !defined(LUA_USE_NANBOX)
   union Value user_;  /* user value */
+#else
+  TValue user_;  /* user value ('ttuv_' is not used) */
+#endif
 } Udata;
 
 
@@ -368,6 +591,7 @@ typedef union UUdata {
 #define getudatamem(u)  \
   check_exp(sizeof((u)->ttuv_), (cast(char*, (u)) + sizeof(UUdata)))
 
+#if !defined(LUA_USE_NANBOX)
 #define setuservalue(L,u,o) \
 	{ const TValue *io=(o); Udata *iu = (u); \
 	  iu->user_ = io->value_; iu->ttuv_ = rttype(io); \
@@ -378,6 +602,16 @@ typedef union UUdata {
 	{ TValue *io=(o); const Udata *iu = (u); \
 	  io->value_ = iu->user_; settt_(io, iu->ttuv_); \
 	  checkliveness(L,io); }
+#else
+#define setuservalue(L,u,o) \
+	{ const TValue *io=(o); Udata *iu = (u); \
+	  iu->user_ = *io; checkliveness(L,io); }
+
+
+#define getuservalue(L,u,o) \
+	{ TValue *io=(o); const Udata *iu = (u); \
+	  *io = iu->user_; checkliveness(L,io); }
+#endif
 
 
 /*
@@ -482,10 +716,17 @@ typedef union TKey {
 
 
 /* copy a value into a key without messing up field 'next' */
+#if !defined(LUA_USE_NANBOX)
 #define setnodekey(L,key,obj) \
 	{ TKey *k_=(key); const TValue *io_=(obj); \
 	  k_->nk.value_ = io_->value_; k_->nk.tt_ = io_->tt_; \
 	  (void)L; checkliveness(L,io_); }
+#else
+#define setnodekey(L,key,obj) \
+	{ TKey *k_=(key); const TValue *io_=(obj); \
+	  k_->nk.v_ = io_->v_; \
+	  (void)L; checkliveness(L,io_); }
+#endif
 
 
 typedef struct Node {
@@ -498,10 +739,23 @@ typedef struct Table {
   CommonHeader;
   lu_byte flags;  /* 1<<p means tagmethod(p) is not present */
   lu_byte lsizenode;  /* log2 of size of 'node' array */
+#if defined(LUA_USE_INCREHASH)
+  lu_byte loldsizenode;  /* log2 of size of 'oldnode' array */
+#endif
   unsigned int sizearray;  /* size of 'array' array */
+  unsigned int nexthint;  /* node of the key last returned by 'next' */
+  unsigned int lenhint;  /* border last found by the length operator */
   TValue *array;  /* array part */
   Node *node;
+#if defined(LUA_USE_SWISSTABLE)
+  unsigned int growthleft;  /* empty nodes still usable before a rehash */
+#else
   Node *lastfree;  /* any free position is before this position */
+#endif
+#if defined(LUA_USE_INCREHASH)
+  Node *oldnode;  /* hash part still being moved into 'node' (or NULL) */
+  unsigned int oldpos;  /* number of nodes of 'oldnode' already moved */
+#endif
   struct Table *metatable;
   GCObject *gclist;
 } Table;
@@ -530,14 +784,23 @@ LUAI_DDEC const TValue luaO_nilobject_;
 /* size of buffer for 'luaO_utf8esc' function */
 #define UTF8BUFFSZ	8
 
+/* maximum length of the conversion of a number to a string */
+#define MAXNUMBER2STR	50
+
 LUAI_FUNC int luaO_int2fb (unsigned int x);
 LUAI_FUNC int luaO_fb2int (int x);
 LUAI_FUNC int luaO_utf8esc (char *buff, unsigned long x);
 LUAI_FUNC int luaO_ceillog2 (unsigned int x);
 LUAI_FUNC void luaO_arith (lua_State *L, int op, const TValue *p1,
                            const TValue *p2, TValue *res);
-LUAI_FUNC size_t luaO_str2num (const char *s, TValue *o);
+LUAI_FUNC size_t luaO_str2num (lua_State *L, const char *s, TValue *o);
+LUAI_FUNC size_t luaO_str2val (const char *s, lua_Integer *i, lua_Number *n,
+                               int *isint);
+#if defined(LUA_USE_NANBOX)
+LUAI_FUNC void luaO_boxint (lua_State *L, TValue *obj, lua_Integer i);
+#endif
 LUAI_FUNC int luaO_hexavalue (int c);
+LUAI_FUNC size_t luaO_tostringbuff (const TValue *obj, char *buff);
 LUAI_FUNC void luaO_tostring (lua_State *L, StkId obj);
 LUAI_FUNC const char *luaO_pushvfstring (lua_State *L, const char *fmt,
                                                        va_list argp);
@@ -22,6 +22,7 @@
 #include "lgc.h"
 #include "llex.h"
 #include "lmem.h"
+#include "lmemprof.h"
 #include "lstate.h"
 #include "lstring.h"
 #include "ltable.h"
@@ -36,6 +37,23 @@
 #define LUAI_GCMUL	200 /* GC runs 'twice the speed' of memory allocation */
 #endif
 
+#if !defined(LUAI_GENMINORMUL)
+#define LUAI_GENMINORMUL	20  /* minor collection after 20% more memory */
+#endif
+
+#if !defined(LUAI_GENMAJORMUL)
+#define LUAI_GENMAJORMUL	100  /* major collection when heap doubles */
+#endif
+
+#if !defined(LUAI_THREADPOOL)
+#define LUAI_THREADPOOL	32  /* dead threads kept for reuse */
+#endif
+
+/* threads with larger stacks are not kept for reuse */
+#if !defined(LUAI_POOLSTACK)
+#define LUAI_POOLSTACK	(4*BASIC_STACK_SIZE)
+#endif
+
 
 /*
 ** a macro to help the creation of a unique random seed when a state is
@@ -236,16 +254,25 @@ static void preinit_thread (lua_State *L, global_State *g) {
   L->nny = 1;
   L->status = LUA_OK;
   L->errfunc = 0;
+  L->gen = 0;
 }
 
 
 static void close_state (lua_State *L) {
   global_State *g = G(L);
+  luaM_closefrees(L);  /* give back blocks still in the helper thread */
+  luaM_closeprofile(L);
   luaF_close(L, L->stack);  /* close all upvalues for this thread */
+  g->maxthreadpool = 0;  /* dead threads must be freed from now on */
   luaC_freeallobjects(L);  /* collect all objects */
+  luaE_shrinkthreadpool(L, 0);
   if (g->version)  /* closing a fully built state? */
     luai_userstateclose(L);
+#if defined(LUA_USE_FASTINTERN)
+  luaM_freemem(L, G(L)->strt.hash, sizestrtab(G(L)->strt.size));
+#else
   luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size);
+#endif
   freestack(L);
   lua_assert(gettotalbytes(g) == sizeof(LG));
   (*g->frealloc)(g->ud, fromstate(L), sizeof(LG), 0);  /* free main block */
@@ -255,10 +282,17 @@ static void close_state (lua_State *L) {
 LUA_API lua_State *lua_newthread (lua_State *L) {
   global_State *g = G(L);
   lua_State *L1;
-  lua_lock(L);
+  GCObject *pooled;
+  api_lock(L);
   luaC_checkGC(L);
-  /* create new thread */
-  L1 = &cast(LX *, luaM_newobject(L, LUA_TTHREAD, sizeof(LX)))->l;
+  pooled = g->threadpool;
+  if (pooled != NULL) {  /* reuse a dead thread, with its stack */
+    L1 = gco2th(pooled);
+    g->threadpool = pooled->next;
+    g->nthreadpool--;
+  }
+  else  /* create new thread */
+    L1 = &cast(LX *, luaM_newobject(L, LUA_TTHREAD, sizeof(LX)))->l;
   L1->marked = luaC_white(g);
   L1->tt = LUA_TTHREAD;
   /* link it on list 'allgc' */
@@ -267,7 +301,8 @@ LUA_API lua_State *lua_newthread (lua_State *L) {
   /* anchor it on L stack */
   setthvalue(L, L->top, L1);
   api_incr_top(L);
-  preinit_thread(L1, g);
+  if (pooled == NULL)
+    preinit_thread(L1, g);
   L1->hookmask = L->hookmask;
   L1->basehookcount = L->basehookcount;
   L1->hook = L->hook;
@@ -276,17 +311,92 @@ LUA_API lua_State *lua_newthread (lua_State *L) {
   memcpy(lua_getextraspace(L1), lua_getextraspace(g->mainthread),
          LUA_EXTRASPACE);
   luai_userstatethread(L, L1);
-  stack_init(L1, L);  /* init stack */
+  if (pooled == NULL)
+    stack_init(L1, L);  /* init stack */
   lua_unlock(L);
   return L1;
 }
 
 
+/*
+** bring a thread back to the state of a new one: closes its upvalues,
+** empties its stack and leaves only the base CallInfo in use (the
+** stack and the CallInfo list are kept for the next use)
+*/
+void luaE_resetthread (lua_State *L) {
+  CallInfo *ci = L->ci = &L->base_ci;
+  StkId o;
+  luaF_close(L, L->stack);  /* close all upvalues for this thread */
+  for (o = L->stack; o < L->stack + L->stacksize; o++)
+    setnilvalue(o);
+  ci->func = L->stack;
+  ci->callstatus = 0;
+  L->top = L->stack + 1;  /* 'function' entry for the base 'ci' */
+  ci->top = L->top + LUA_MINSTACK;
+  L->errorJmp = NULL;
+  L->nCcalls = 0;
+  L->allowhook = 1;
+  L->nny = 1;
+  L->status = LUA_OK;
+  L->errfunc = 0;
+  L->gen++;  /* no longer the same coroutine */
+}
+
+
+LUA_API int lua_resetthread (lua_State *L) {
+  int status;
+  lua_lock(L);
+  status = (L->status == LUA_YIELD) ? LUA_OK : L->status;
+  luaE_resetthread(L);
+  lua_unlock(L);
+  return status;
+}
+
+
+/*
+** The generation of a thread changes whenever the thread is resumed or
+** reset, so code that keeps a suspended thread can tell whether it is
+** still suspended at the same point (of the same coroutine).
+*/
+LUA_API unsigned int lua_threadgen (lua_State *L) {
+  return L->gen;
+}
+
+
+/*
+** free threads from the pool of dead threads until it has at most 'n'
+*/
+void luaE_shrinkthreadpool (lua_State *L, int n) {
+  global_State *g = G(L);
+  while (g->nthreadpool > n) {
+    lua_State *L1 = gco2th(g->threadpool);
+    g->threadpool = L1->next;
+    g->nthreadpool--;
+    freestack(L1);
+    luaM_free(L, fromstate(L1));
+  }
+}
+
+
+/*
+** Dead threads go to the pool of 'lua_newthread' (if it is not full and
+** their stacks did not grow too much), so that programs creating many
+** short-lived coroutines do not allocate and free a stack for each one.
+*/
 void luaE_freethread (lua_State *L, lua_State *L1) {
+  global_State *g = G(L);
   LX *l = fromstate(L1);
   luaF_close(L1, L1->stack);  /* close all upvalues for this thread */
   lua_assert(L1->openupval == NULL);
   luai_userstatefree(L, L1);
+  if (g->nthreadpool < g->maxthreadpool && L1->stack != NULL &&
+      L1->stacksize <= LUAI_POOLSTACK) {
+    luaE_resetthread(L1);
+    L1->next = g->threadpool;
+    g->threadpool = obj2gco(L1);
+    g->nthreadpool++;
+    return;
+  }
   freestack(L1);
   luaM_free(L, l);
 }
@@ -311,13 +421,22 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->seed = makeseed(L);
   g->gcrunning = 0;  /* no GC while building state */
   g->GCestimate = 0;
+  g->GClastmajor = 0;
   g->strt.size = g->strt.nuse = 0;
   g->strt.hash = NULL;
+#if defined(LUA_USE_FASTINTERN)
+  g->strt.tag = NULL;
+#endif
   setnilvalue(&g->l_registry);
   g->panic = NULL;
   g->version = NULL;
   g->gcstate = GCSpause;
   g->gckind = KGC_NORMAL;
+  g->gcgen = 0;  /* start in incremental mode */
+#if defined(LUA_USE_BGFREE)
+  g->deferfree = 0;
+  g->bgfree = NULL;  /* helper thread is created when first needed */
+#endif
   g->allgc = g->finobj = g->tobefnz = g->fixedgc = NULL;
   g->sweepgc = NULL;
   g->gray = g->grayagain = NULL;
@@ -328,6 +447,17 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gcfinnum = 0;
   g->gcpause = LUAI_GCPAUSE;
   g->gcstepmul = LUAI_GCMUL;
+  g->genminormul = LUAI_GENMINORMUL;
+  g->genmajormul = LUAI_GENMAJORMUL;
+  memset(&g->gccycle, 0, sizeof(g->gccycle));
+  g->gcncycles = 0;
+  g->gcclock = 0;
+  g->gcstatsf = NULL;
+  g->gcstatsud = NULL;
+  g->memprof = NULL;
+  g->threadpool = NULL;
+  g->nthreadpool = 0;
+  g->maxthreadpool = LUAI_THREADPOOL;
   for (i=0; i < LUA_NUMTAGS; i++) g->mt[i] = NULL;
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != LUA_OK) {
     /* memory allocation error: free partial state */
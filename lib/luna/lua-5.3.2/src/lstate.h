@@ -46,8 +46,16 @@ struct lua_longjmp;  /* defined in ldo.c */
 #define KGC_EMERGENCY	1	/* gc was forced by an allocation failure */
 
 
+/*
+** With LUA_USE_FASTINTERN, 'hash' is an open-addressed vector of
+** strings and 'tag' has the hash of each of its entries (0 for empty
+** entries); otherwise, 'hash' has the heads of the hash chains.
+*/
 typedef struct stringtable {
   TString **hash;
+#if defined(LUA_USE_FASTINTERN)
+  unsigned int *tag;  /* hash tags of 'hash' entries */
+#endif
   int nuse;  /* number of elements */
   int size;
 } stringtable;
@@ -103,6 +111,10 @@ typedef struct CallInfo {
 #define getoah(st)	((st) & CIST_OAH)
 
 
+/* number of finished collection cycles kept in 'gcstats' */
+#define GCSTATSSIZE	16
+
+
 /*
 ** 'global state', shared by all threads of this state
 */
@@ -113,13 +125,19 @@ typedef struct global_State {
   l_mem GCdebt;  /* bytes allocated not yet compensated by the collector */
   lu_mem GCmemtrav;  /* memory traversed by the GC */
   lu_mem GCestimate;  /* an estimate of the non-garbage memory in use */
+  lu_mem GClastmajor;  /* memory in use after last major collection */
   stringtable strt;  /* hash table for strings */
   TValue l_registry;
   unsigned int seed;  /* randomized seed for hashes */
   lu_byte currentwhite;
   lu_byte gcstate;  /* state of garbage collector */
   lu_byte gckind;  /* kind of GC running */
+  lu_byte gcgen;  /* true if GC is in generational mode */
   lu_byte gcrunning;  /* true if GC is running */
+#if defined(LUA_USE_BGFREE)
+  lu_byte deferfree;  /* true if freed blocks go to 'bgfree' */
+  struct BGFree *bgfree;  /* helper thread that frees blocks */
+#endif
   GCObject *allgc;  /* list of all collectable objects */
   GCObject **sweepgc;  /* current position of sweep in list */
   GCObject *finobj;  /* list of collectable objects with finalizers */
@@ -134,6 +152,18 @@ typedef struct global_State {
   unsigned int gcfinnum;  /* number of finalizers to call in each GC step */
   int gcpause;  /* size of pause between successive GCs */
   int gcstepmul;  /* GC 'granularity' */
+  int genminormul;  /* allocation between minor collections (% of heap) */
+  int genmajormul;  /* heap growth that triggers a major collection (%) */
+  lua_GCStats gccycle;  /* statistics of the cycle being collected */
+  lua_GCStats gcstats[GCSTATSSIZE];  /* ring with the last cycles */
+  unsigned long gcncycles;  /* number of cycles finished */
+  l_mem gcclock;  /* time of the last charge to 'gccycle' */
+  lua_GCStatsF gcstatsf;  /* function called at the end of each cycle */
+  void *gcstatsud;  /* auxiliary data to 'gcstatsf' */
+  struct MemProf *memprof;  /* sampling memory profiler (if running) */
+  GCObject *threadpool;  /* dead threads kept for reuse */
+  int nthreadpool;  /* number of threads in 'threadpool' */
+  int maxthreadpool;  /* maximum number of threads in 'threadpool' */
   lua_CFunction panic;  /* to be called in unprotected errors */
   struct lua_State *mainthread;
   const lua_Number *version;  /* pointer to version number */
@@ -171,6 +201,7 @@ struct lua_State {
   unsigned short nCcalls;  /* number of nested C calls */
   lu_byte hookmask;
   lu_byte allowhook;
+  unsigned int gen;  /* generation (changes when it is resumed or reset) */
 };
 
 
@@ -188,6 +219,9 @@ union GCUnion {
   struct Table h;
   struct Proto p;
   struct lua_State th;  /* thread */
+#if defined(LUA_USE_NANBOX)
+  struct IntBox ib;  /* boxed integer */
+#endif
 };
 
 
@@ -204,6 +238,7 @@ union GCUnion {
 #define gco2t(o)  check_exp((o)->tt == LUA_TTABLE, &((cast_u(o))->h))
 #define gco2p(o)  check_exp((o)->tt == LUA_TPROTO, &((cast_u(o))->p))
 #define gco2th(o)  check_exp((o)->tt == LUA_TTHREAD, &((cast_u(o))->th))
+#define gco2ib(o)  check_exp((o)->tt == LUA_TNUMINT, &((cast_u(o))->ib))
 
 
 /* macro to convert a Lua object into a GCObject */
@@ -216,6 +251,8 @@ union GCUnion {
 
 LUAI_FUNC void luaE_setdebt (global_State *g, l_mem debt);
 LUAI_FUNC void luaE_freethread (lua_State *L, lua_State *L1);
+LUAI_FUNC void luaE_resetthread (lua_State *L);
+LUAI_FUNC void luaE_shrinkthreadpool (lua_State *L, int n);
 LUAI_FUNC CallInfo *luaE_extendCI (lua_State *L);
 LUAI_FUNC void luaE_freeCI (lua_State *L);
 LUAI_FUNC void luaE_shrinkCI (lua_State *L);
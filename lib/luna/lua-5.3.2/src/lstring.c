@@ -55,6 +55,84 @@ unsigned int luaS_hash (const char *str, size_t l, unsigned int seed) {
 }
 
 
+#if defined(LUA_USE_FASTINTERN)
+
+/*
+** Fast interning: short strings are hashed in full, a word at a time,
+** folding each word into the state with a 64x64->128-bit multiply (as
+** in wyhash). The string table uses linear probing; 'tag' keeps the
+** hash of each entry (with 0 reserved for empty entries, so a hash 0
+** is stored as 1), so a lookup scans a compact vector of hashes and
+** compares only strings with the same hash. A removal shifts back the
+** entries that follow it, so no tombstones are needed.
+*/
+
+typedef unsigned long long l_u64;
+
+#define HK0	0xa0761d6478bd642fULL
+#define HK1	0xe7037ed1a0b428dbULL
+#define HK2	0x8ebc6af09c88c6e3ULL
+
+#define strtag(h)	((h) != 0 ? (h) : 1u)
+
+
+static l_u64 mix (l_u64 a, l_u64 b) {
+#if defined(__SIZEOF_INT128__)
+  __uint128_t r = (__uint128_t)a * b;
+  return cast(l_u64, r) ^ cast(l_u64, r >> 64);
+#else
+  l_u64 ha = a >> 32, la = a & 0xffffffffu;
+  l_u64 hb = b >> 32, lb = b & 0xffffffffu;
+  l_u64 mid0 = ha * lb, mid1 = la * hb;
+  l_u64 lo = la * lb;
+  l_u64 hi = ha * hb + (mid0 >> 32) + (mid1 >> 32);
+  l_u64 t = lo + (mid0 << 32);
+  hi += (t < lo);
+  lo = t + (mid1 << 32);
+  hi += (lo < t);
+  return lo ^ hi;
+#endif
+}
+
+
+static l_u64 read64 (const char *p) {
+  l_u64 w;
+  memcpy(&w, p, sizeof(w));
+  return w;
+}
+
+
+static l_u64 read32 (const char *p) {
+  unsigned int w;
+  memcpy(&w, p, sizeof(w));
+  return w;
+}
+
+
+static unsigned int shrhash (const char *str, size_t l, unsigned int seed) {
+  l_u64 h = mix(seed ^ HK0, l ^ HK1);
+  l_u64 w;
+  if (l > 8) {
+    const char *last = str + l - 8;
+    for (; str < last; str += 8)
+      h = mix(h ^ read64(str), HK1);
+    w = read64(last);  /* last word (may overlap the previous one) */
+  }
+  else if (l >= 4)
+    w = (read32(str) << 32) | read32(str + l - 4);
+  else if (l > 0)
+    w = (cast(l_u64, cast_byte(str[0])) << 16) |
+        (cast(l_u64, cast_byte(str[l >> 1])) << 8) | cast_byte(str[l - 1]);
+  else
+    w = 0;
+  h = mix(h ^ w, HK2);
+  return cast(unsigned int, h ^ (h >> 32));
+}
+
+
+#endif
+
+
 unsigned int luaS_hashlongstr (TString *ts) {
   lua_assert(ts->tt == LUA_TLNGSTR);
   if (ts->extra == 0) {  /* no hash? */
@@ -65,6 +143,36 @@ unsigned int luaS_hashlongstr (TString *ts) {
 }
 
 
+#if defined(LUA_USE_FASTINTERN)
+
+/*
+** resizes the string table
+*/
+void luaS_resize (lua_State *L, int newsize) {
+  stringtable *tb = &G(L)->strt;
+  TString **nhash = cast(TString **, luaM_malloc(L, sizestrtab(newsize)));
+  unsigned int *ntag = cast(unsigned int *, nhash + newsize);
+  int i;
+  for (i = 0; i < newsize; i++)
+    ntag[i] = 0;
+  for (i = 0; i < tb->size; i++) {  /* reinsert entries */
+    if (tb->tag[i] != 0) {
+      int j = lmod(tb->tag[i], newsize);
+      while (ntag[j] != 0)
+        j = (j + 1) & (newsize - 1);
+      nhash[j] = tb->hash[i];
+      ntag[j] = tb->tag[i];
+    }
+  }
+  if (tb->size > 0)
+    luaM_freemem(L, tb->hash, sizestrtab(tb->size));
+  tb->hash = nhash;
+  tb->tag = ntag;
+  tb->size = newsize;
+}
+
+#else
+
 /*
 ** resizes the string table
 */
@@ -95,6 +203,8 @@ void luaS_resize (lua_State *L, int newsize) {
   tb->size = newsize;
 }
 
+#endif
+
 
 /*
 ** Clear API string cache. (Entries cannot be empty, so fill them with
@@ -151,6 +261,66 @@ TString *luaS_createlngstrobj (lua_State *L, size_t l) {
 }
 
 
+#if defined(LUA_USE_FASTINTERN)
+
+void luaS_remove (lua_State *L, TString *ts) {
+  stringtable *tb = &G(L)->strt;
+  int mask = tb->size - 1;
+  int i = lmod(strtag(ts->hash), tb->size);
+  int j;
+  while (tb->hash[i] != ts)  /* find its entry */
+    i = (i + 1) & mask;
+  for (j = (i + 1) & mask; tb->tag[j] != 0; j = (j + 1) & mask) {
+    int home = lmod(tb->tag[j], tb->size);
+    if (((j - home) & mask) >= ((j - i) & mask)) {  /* can go to hole? */
+      tb->hash[i] = tb->hash[j];
+      tb->tag[i] = tb->tag[j];
+      i = j;  /* 'j' is the new hole */
+    }
+  }
+  tb->hash[i] = NULL;
+  tb->tag[i] = 0;
+  tb->nuse--;
+}
+
+
+/*
+** checks whether short string exists and reuses it or creates a new one
+*/
+static TString *internshrstr (lua_State *L, const char *str, size_t l) {
+  TString *ts;
+  global_State *g = G(L);
+  stringtable *tb = &g->strt;
+  unsigned int h = shrhash(str, l, g->seed);
+  unsigned int tag = strtag(h);
+  int i;
+  lua_assert(str != NULL);  /* otherwise 'memcmp'/'memcpy' are undefined */
+  for (i = lmod(tag, tb->size); tb->tag[i] != 0; i = (i + 1) & (tb->size - 1)) {
+    ts = tb->hash[i];
+    if (tb->tag[i] == tag && l == ts->shrlen &&
+        (memcmp(str, getstr(ts), l * sizeof(char)) == 0)) {
+      /* found! */
+      if (isdead(g, ts))  /* dead (but not collected yet)? */
+        changewhite(ts);  /* resurrect it */
+      return ts;
+    }
+  }
+  if (tb->nuse >= tb->size - tb->size / 4 && tb->size <= MAX_INT/2)
+    luaS_resize(L, tb->size * 2);  /* keep at least 1/4 of it empty */
+  ts = createstrobj(L, l, LUA_TSHRSTR, h);
+  memcpy(getstr(ts), str, l * sizeof(char));
+  ts->shrlen = cast_byte(l);
+  /* (an emergency collection may have moved entries, so search now) */
+  for (i = lmod(tag, tb->size); tb->tag[i] != 0; i = (i + 1) & (tb->size - 1))
+    ;
+  tb->hash[i] = ts;
+  tb->tag[i] = tag;
+  tb->nuse++;
+  return ts;
+}
+
+#else
+
 void luaS_remove (lua_State *L, TString *ts) {
   stringtable *tb = &G(L)->strt;
   TString **p = &tb->hash[lmod(ts->hash, tb->size)];
@@ -171,7 +341,7 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
   TString **list = &g->strt.hash[lmod(h, g->strt.size)];
   lua_assert(str != NULL);  /* otherwise 'memcmp'/'memcpy' are undefined */
   for (ts = *list; ts != NULL; ts = ts->u.hnext) {
-    if (l == ts->shrlen &&
+    if (ts->hash == h && l == ts->shrlen &&
         (memcmp(str, getstr(ts), l * sizeof(char)) == 0)) {
       /* found! */
       if (isdead(g, ts))  /* dead (but not collected yet)? */
@@ -192,6 +362,8 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
   return ts;
 }
 
+#endif
+
 
 /*
 ** new string (with explicit length)
@@ -210,6 +382,44 @@ TString *luaS_newlstr (lua_State *L, const char *str, size_t l) {
 }
 
 
+/*
+** Create a string from 'block', a block of 'bsize' bytes allocated with
+** the state's allocator that has the 'l' characters of the string
+** after 'sizeof(UTString)' bytes. The block then belongs to Lua: long
+** strings keep it (shrunk to fit); short ones are internalized as usual
+** and it is freed.
+*/
+TString *luaS_adoptlstr (lua_State *L, char *block, size_t bsize, size_t l) {
+  global_State *g = G(L);
+  size_t totalsize = sizelstring(l);
+  GCObject *o;
+  TString *ts;
+  lua_assert(bsize >= totalsize);
+  if (l <= LUAI_MAXSHORTLEN) {  /* short string? */
+    char buff[LUAI_MAXSHORTLEN];
+    memcpy(buff, block + sizeof(UTString), l * sizeof(char));
+    (*g->frealloc)(g->ud, block, bsize, 0);
+    return internshrstr(L, buff, l);
+  }
+  if (bsize != totalsize) {  /* free unused space */
+    char *newblock = cast(char *, (*g->frealloc)(g->ud, block, bsize,
+                                                 totalsize));
+    if (newblock == NULL) {  /* cannot shrink it?? */
+      (*g->frealloc)(g->ud, block, bsize, 0);
+      luaD_throw(L, LUA_ERRMEM);
+    }
+    block = newblock;
+  }
+  o = luaC_adoptobj(L, LUA_TLNGSTR, block, totalsize);
+  ts = gco2ts(o);
+  ts->hash = g->seed;
+  ts->extra = 0;
+  ts->u.lnglen = l;
+  getstr(ts)[l] = '\0';  /* ending 0 */
+  return ts;
+}
+
+
 /*
 ** Create or reuse a zero-terminated string, first checking in the
 ** cache (using the string address as a key). The cache can contain
@@ -209,10 +209,67 @@ static int str_dump (lua_State *L) {
 #define CAP_POSITION	(-2)
 
 
+/*
+** Patterns are compiled into a vector of items ended by PI_END, so that
+** matching does not have to parse them again. A single-char class is
+** compiled to a character (PI_CHAR), any character (PI_ANY), or a set
+** of characters (PI_SET) computed once from the '%' class or '[set]';
+** a '^' anchor becomes 'Pattern.anchor'. A malformed part of a pattern
+** compiles to PI_ERROR, which raises its error only if the match
+** reaches it, as when patterns were parsed while matching. (Character
+** classes follow the locale in effect when the pattern is compiled.)
+*/
+
+typedef enum PatOp {
+  PI_END,  /* end of pattern */
+  PI_CHAR,  /* a given character */
+  PI_ANY,  /* any character ('.') */
+  PI_SET,  /* a character in a set */
+  PI_OPEN,  /* start capture */
+  PI_POSITION,  /* position capture */
+  PI_CLOSE,  /* end capture */
+  PI_EOS,  /* end of subject ('$' at the end of the pattern) */
+  PI_BALANCE,  /* balanced string ('%b') */
+  PI_FRONTIER,  /* frontier ('%f') */
+  PI_BACKREF,  /* capture results ('%0'-'%9') */
+  PI_ERROR  /* malformed pattern */
+} PatOp;
+
+
+/* sets of characters */
+#define CHARSETSIZE	((UCHAR_MAX + 1) / CHAR_BIT)
+
+typedef unsigned char CharSet[CHARSETSIZE];
+
+#define inset(set,c)	(((set)[(c) / CHAR_BIT] >> ((c) % CHAR_BIT)) & 1)
+
+
+typedef struct PatItem {
+  unsigned char op;  /* kind of item ('PatOp') */
+  unsigned char suffix;  /* repetition ('*', '+', '-', '?'), or 0 */
+  unsigned char c;  /* character; capture index; error message */
+  unsigned char c2;  /* closing character of a balanced string */
+  unsigned int set;  /* index of set (PI_SET, PI_FRONTIER) */
+} PatItem;
+
+
+/* maximum length of a literal prefix */
+#define MAXPREFIX	32
+
+typedef struct Pattern {
+  CharSet *sets;  /* sets used by the items (stored after them) */
+  int anchor;  /* does the pattern start with an anchor? */
+  int first;  /* item with the first char of any match, or -1 */
+  size_t lprefix;  /* length of literal prefix of any match (or 0) */
+  char prefix[MAXPREFIX];
+  PatItem item[1];  /* items */
+} Pattern;
+
+
 typedef struct MatchState {
   const char *src_init;  /* init of source string */
   const char *src_end;  /* end ('\0') of source string */
-  const char *p_end;  /* end ('\0') of pattern */
+  const Pattern *prog;  /* compiled pattern */
   lua_State *L;
   size_t nrep;  /* limit to avoid non-linear complexity */
   int matchdepth;  /* control for recursive depth (to avoid C stack overflow) */
@@ -225,7 +282,7 @@ typedef struct MatchState {
 
 
 /* recursive function */
-static const char *match (MatchState *ms, const char *s, const char *p);
+static const char *match (MatchState *ms, const char *s, const PatItem *it);
 
 
 /* maximum recursion depth for 'match' */
@@ -249,6 +306,20 @@ static const char *match (MatchState *ms, const char *s, const char *p);
 #define SPECIALS	"^$*+?.([%-"
 
 
+/* messages for PI_ERROR items */
+#define PE_ESC		0
+#define PE_SET		1
+#define PE_BALANCE	2
+#define PE_FRONTIER	3
+
+static const char *const patterrors[] = {
+  "malformed pattern (ends with '%')",
+  "malformed pattern (missing ']')",
+  "malformed pattern (missing arguments to '%b')",
+  "missing '[' after '%f' in pattern"
+};
+
+
 static int check_capture (MatchState *ms, int l) {
   l -= '1';
   if (l < 0 || l >= ms->level || ms->capture[l].len == CAP_UNFINISHED)
@@ -265,103 +336,32 @@ static int capture_to_close (MatchState *ms) {
 }
 
 
-static const char *classend (MatchState *ms, const char *p) {
-  switch (*p++) {
-    case L_ESC: {
-      if (p == ms->p_end)
-        luaL_error(ms->L, "malformed pattern (ends with '%%')");
-      return p+1;
-    }
-    case '[': {
-      if (*p == '^') p++;
-      do {  /* look for a ']' */
-        if (p == ms->p_end)
-          luaL_error(ms->L, "malformed pattern (missing ']')");
-        if (*(p++) == L_ESC && p < ms->p_end)
-          p++;  /* skip escapes (e.g. '%]') */
-      } while (*p != ']');
-      return p+1;
-    }
-    default: {
-      return p;
-    }
-  }
-}
-
-
-static int match_class (int c, int cl) {
-  int res;
-  switch (tolower(cl)) {
-    case 'a' : res = isalpha(c); break;
-    case 'c' : res = iscntrl(c); break;
-    case 'd' : res = isdigit(c); break;
-    case 'g' : res = isgraph(c); break;
-    case 'l' : res = islower(c); break;
-    case 'p' : res = ispunct(c); break;
-    case 's' : res = isspace(c); break;
-    case 'u' : res = isupper(c); break;
-    case 'w' : res = isalnum(c); break;
-    case 'x' : res = isxdigit(c); break;
-    case 'z' : res = (c == 0); break;  /* deprecated option */
-    default: return (cl == c);
-  }
-  return (islower(cl) ? res : !res);
-}
-
-
-static int matchbracketclass (int c, const char *p, const char *ec) {
-  int sig = 1;
-  if (*(p+1) == '^') {
-    sig = 0;
-    p++;  /* skip the '^' */
-  }
-  while (++p < ec) {
-    if (*p == L_ESC) {
-      p++;
-      if (match_class(c, uchar(*p)))
-        return sig;
-    }
-    else if ((*(p+1) == '-') && (p+2 < ec)) {
-      p+=2;
-      if (uchar(*(p-2)) <= c && c <= uchar(*p))
-        return sig;
-    }
-    else if (uchar(*p) == c) return sig;
-  }
-  return !sig;
-}
-
-
-static int singlematch (MatchState *ms, const char *s, const char *p,
-                        const char *ep) {
+static int singlematch (MatchState *ms, const char *s, const PatItem *it) {
   if (s >= ms->src_end)
     return 0;
   else {
     int c = uchar(*s);
-    switch (*p) {
-      case '.': return 1;  /* matches any char */
-      case L_ESC: return match_class(c, uchar(*(p+1)));
-      case '[': return matchbracketclass(c, p, ep-1);
-      default:  return (uchar(*p) == c);
+    switch (it->op) {
+      case PI_ANY: return 1;  /* matches any char */
+      case PI_CHAR: return (it->c == c);
+      default: return inset(ms->prog->sets[it->set], c);  /* PI_SET */
     }
   }
 }
 
 
 static const char *matchbalance (MatchState *ms, const char *s,
-                                   const char *p) {
-  if (p >= ms->p_end - 1)
-    luaL_error(ms->L, "malformed pattern (missing arguments to '%%b')");
-  if (*s != *p) return NULL;
+                                   const PatItem *it) {
+  if (uchar(*s) != it->c) return NULL;
   else {
-    int b = *p;
-    int e = *(p+1);
+    int b = it->c;
+    int e = it->c2;
     int cont = 1;
     while (++s < ms->src_end) {
-      if (*s == e) {
+      if (uchar(*s) == e) {
         if (--cont == 0) return s+1;
       }
-      else if (*s == b) cont++;
+      else if (uchar(*s) == b) cont++;
     }
   }
   return NULL;  /* string ends out of balance */
@@ -369,13 +369,17 @@ static const char *matchbalance (MatchState *ms, const char *s,
 
 
 static const char *max_expand (MatchState *ms, const char *s,
-                                 const char *p, const char *ep) {
+                                 const PatItem *it) {
   ptrdiff_t i = 0;  /* counts maximum expand for item */
-  while (singlematch(ms, s + i, p, ep))
-    i++;
+  if (it->op == PI_ANY)
+    i = ms->src_end - s;
+  else {
+    while (singlematch(ms, s + i, it))
+      i++;
+  }
   /* keeps trying to match with the maximum repetitions */
   while (i>=0) {
-    const char *res = match(ms, (s+i), ep+1);
+    const char *res = match(ms, (s+i), it + 1);
     if (res) return res;
     i--;  /* else didn't match; reduce 1 repetition to try again */
   }
@@ -384,12 +388,12 @@ static const char *max_expand (MatchState *ms, const char *s,
 
 
 static const char *min_expand (MatchState *ms, const char *s,
-                                 const char *p, const char *ep) {
+                                 const PatItem *it) {
   for (;;) {
-    const char *res = match(ms, s, ep+1);
+    const char *res = match(ms, s, it + 1);
     if (res != NULL)
       return res;
-    else if (singlematch(ms, s, p, ep))
+    else if (singlematch(ms, s, it))
       s++;  /* try with one more repetition */
     else return NULL;
   }
@@ -397,25 +401,25 @@ static const char *min_expand (MatchState *ms, const char *s,
 
 
 static const char *start_capture (MatchState *ms, const char *s,
-                                    const char *p, int what) {
+                                    const PatItem *it, int what) {
   const char *res;
   int level = ms->level;
   if (level >= LUA_MAXCAPTURES) luaL_error(ms->L, "too many captures");
   ms->capture[level].init = s;
   ms->capture[level].len = what;
   ms->level = level+1;
-  if ((res=match(ms, s, p)) == NULL)  /* match failed? */
+  if ((res=match(ms, s, it)) == NULL)  /* match failed? */
     ms->level--;  /* undo capture */
   return res;
 }
 
 
 static const char *end_capture (MatchState *ms, const char *s,
-                                  const char *p) {
+                                  const PatItem *it) {
   int l = capture_to_close(ms);
   const char *res;
   ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
-  if ((res = match(ms, s, p)) == NULL)  /* match failed? */
+  if ((res = match(ms, s, it)) == NULL)  /* match failed? */
     ms->capture[l].len = CAP_UNFINISHED;  /* undo capture */
   return res;
 }
@@ -432,103 +436,91 @@ static const char *match_capture (MatchState *ms, const char *s, int l) {
 }
 
 
-static const char *match (MatchState *ms, const char *s, const char *p) {
+static const char *match (MatchState *ms, const char *s, const PatItem *it) {
   if (ms->matchdepth-- == 0)
     luaL_error(ms->L, "pattern too complex");
   init: /* using goto's to optimize tail recursion */
-  if (p != ms->p_end) {  /* end of pattern? */
-    switch (*p) {
-      case '(': {  /* start capture */
-        if (*(p + 1) == ')')  /* position capture? */
-          s = start_capture(ms, s, p + 2, CAP_POSITION);
-        else
-          s = start_capture(ms, s, p + 1, CAP_UNFINISHED);
-        break;
+  switch (it->op) {
+    case PI_END: break;  /* end of pattern */
+    case PI_OPEN: {  /* start capture */
+      s = start_capture(ms, s, it + 1, CAP_UNFINISHED);
+      break;
+    }
+    case PI_POSITION: {  /* position capture */
+      s = start_capture(ms, s, it + 1, CAP_POSITION);
+      break;
+    }
+    case PI_CLOSE: {  /* end capture */
+      s = end_capture(ms, s, it + 1);
+      break;
+    }
+    case PI_EOS: {  /* check end of string */
+      s = (s == ms->src_end) ? s : NULL;
+      break;
+    }
+    case PI_BALANCE: {  /* balanced string? */
+      s = matchbalance(ms, s, it);
+      if (s != NULL) {
+        it++; goto init;  /* return match(ms, s, it + 1); */
+      }  /* else fail (s == NULL) */
+      break;
+    }
+    case PI_FRONTIER: {  /* frontier? */
+      const unsigned char *set = ms->prog->sets[it->set];
+      int previous = (s == ms->src_init) ? '\0' : uchar(*(s - 1));
+      if (!inset(set, previous) && inset(set, uchar(*s))) {
+        it++; goto init;  /* return match(ms, s, it + 1); */
       }
-      case ')': {  /* end capture */
-        s = end_capture(ms, s, p + 1);
-        break;
+      s = NULL;  /* match failed */
+      break;
+    }
+    case PI_BACKREF: {  /* capture results (%0-%9)? */
+      s = match_capture(ms, s, it->c);
+      if (s != NULL) {
+        it++; goto init;  /* return match(ms, s, it + 1) */
       }
-      case '$': {
-        if ((p + 1) != ms->p_end)  /* is the '$' the last char in pattern? */
-          goto dflt;  /* no; go to default */
-        s = (s == ms->src_end) ? s : NULL;  /* check end of string */
-        break;
+      break;
+    }
+    case PI_ERROR: {
+      luaL_error(ms->L, "%s", patterrors[it->c]);
+      break;
+    }
+    default: {  /* pattern class plus optional suffix */
+      /* does not match at least once? */
+      if (!singlematch(ms, s, it)) {
+        if (it->suffix == '*' || it->suffix == '?' || it->suffix == '-') {
+          it++; goto init;  /* accept empty; return match(ms, s, it + 1); */
+        }
+        else  /* '+' or no suffix */
+          s = NULL;  /* fail */
       }
-      case L_ESC: {  /* escaped sequences not in the format class[*+?-]? */
-        switch (*(p + 1)) {
-          case 'b': {  /* balanced string? */
-            s = matchbalance(ms, s, p + 2);
-            if (s != NULL) {
-              p += 4; goto init;  /* return match(ms, s, p + 4); */
-            }  /* else fail (s == NULL) */
-            break;
-          }
-          case 'f': {  /* frontier? */
-            const char *ep; char previous;
-            p += 2;
-            if (*p != '[')
-              luaL_error(ms->L, "missing '[' after '%%f' in pattern");
-            ep = classend(ms, p);  /* points to what is next */
-            previous = (s == ms->src_init) ? '\0' : *(s - 1);
-            if (!matchbracketclass(uchar(previous), p, ep - 1) &&
-               matchbracketclass(uchar(*s), p, ep - 1)) {
-              p = ep; goto init;  /* return match(ms, s, ep); */
+      else {  /* matched once */
+        if (ms->nrep-- == 0)
+          luaL_error(ms->L, "pattern too complex");
+        switch (it->suffix) {  /* handle optional suffix */
+          case '?': {  /* optional */
+            const char *res;
+            if ((res = match(ms, s + 1, it + 1)) != NULL)
+              s = res;
+            else {
+              it++; goto init;  /* else return match(ms, s, it + 1); */
             }
-            s = NULL;  /* match failed */
             break;
           }
-          case '0': case '1': case '2': case '3':
-          case '4': case '5': case '6': case '7':
-          case '8': case '9': {  /* capture results (%0-%9)? */
-            s = match_capture(ms, s, uchar(*(p + 1)));
-            if (s != NULL) {
-              p += 2; goto init;  /* return match(ms, s, p + 2) */
-            }
+          case '+':  /* 1 or more repetitions */
+            s++;  /* 1 match already done */
+            /* FALLTHROUGH */
+          case '*':  /* 0 or more repetitions */
+            s = max_expand(ms, s, it);
             break;
-          }
-          default: goto dflt;
-        }
-        break;
-      }
-      default: dflt: {  /* pattern class plus optional suffix */
-        const char *ep = classend(ms, p);  /* points to optional suffix */
-        /* does not match at least once? */
-        if (!singlematch(ms, s, p, ep)) {
-          if (*ep == '*' || *ep == '?' || *ep == '-') {  /* accept empty? */
-            p = ep + 1; goto init;  /* return match(ms, s, ep + 1); */
-          }
-          else  /* '+' or no suffix */
-            s = NULL;  /* fail */
-        }
-        else {  /* matched once */
-          if (ms->nrep-- == 0)
-            luaL_error(ms->L, "pattern too complex");
-          switch (*ep) {  /* handle optional suffix */
-            case '?': {  /* optional */
-              const char *res;
-              if ((res = match(ms, s + 1, ep + 1)) != NULL)
-                s = res;
-              else {
-                p = ep + 1; goto init;  /* else return match(ms, s, ep + 1); */
-              }
-              break;
-            }
-            case '+':  /* 1 or more repetitions */
-              s++;  /* 1 match already done */
-              /* FALLTHROUGH */
-            case '*':  /* 0 or more repetitions */
-              s = max_expand(ms, s, p, ep);
-              break;
-            case '-':  /* 0 or more repetitions (minimum) */
-              s = min_expand(ms, s, p, ep);
-              break;
-            default:  /* no suffix */
-              s++; p = ep; goto init;  /* return match(ms, s + 1, ep); */
-          }
+          case '-':  /* 0 or more repetitions (minimum) */
+            s = min_expand(ms, s, it);
+            break;
+          default:  /* no suffix */
+            s++; it++; goto init;  /* return match(ms, s + 1, it + 1); */
         }
-        break;
       }
+      break;
     }
   }
   ms->matchdepth++;
@@ -537,28 +529,125 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
 
 
 
-static const char *lmemfind (const char *s1, size_t l1,
+/*
+** 'lmemfind' finds the first occurrence of 's2' in 's1'. With SSE2, a
+** needle with at least two characters is searched a block at a time:
+** its first and last characters are compared against every position
+** of the block at once, and only the positions where both match are
+** compared in full. Blocks have 32 bytes (AVX2) when the running CPU
+** supports it. Define LUA_NOSIMD to always use the portable loop.
+*/
+
+/* search with 'memchr' for the 1st char (assumes 0 < l2 <= l1) */
+static const char *scanfind (const char *s1, size_t l1,
+                             const char *s2, size_t l2) {
+  const char *init;  /* to search for a '*s2' inside 's1' */
+  l2--;  /* 1st char will be checked by 'memchr' */
+  l1 = l1-l2;  /* 's2' cannot be found after that */
+  while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
+    init++;   /* 1st char is already checked */
+    if (memcmp(init, s2+1, l2) == 0)
+      return init-1;
+    else {  /* correct 'l1' and 's1' to try again */
+      l1 -= init-s1;
+      s1 = init;
+    }
+  }
+  return NULL;  /* not found */
+}
+
+
+#if !defined(LUA_NOSIMD) && defined(__GNUC__) && defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#define SIMDFIND
+
+/*
+** checks the candidate positions 's + i' for each bit 'i' set in 'mask'
+** (their first and last characters are already known to match)
+*/
+static const char *checkcands (unsigned int mask, const char *s,
                                const char *s2, size_t l2) {
-  if (l2 == 0) return s1;  /* empty strings are everywhere */
-  else if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
-  else {
-    const char *init;  /* to search for a '*s2' inside 's1' */
-    l2--;  /* 1st char will be checked by 'memchr' */
-    l1 = l1-l2;  /* 's2' cannot be found after that */
-    while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
-      init++;   /* 1st char is already checked */
-      if (memcmp(init, s2+1, l2) == 0)
-        return init-1;
-      else {  /* correct 'l1' and 's1' to try again */
-        l1 -= init-s1;
-        s1 = init;
-      }
+  while (mask != 0) {
+    const char *c = s + __builtin_ctz(mask);
+    if (memcmp(c + 1, s2 + 1, l2 - 2) == 0)
+      return c;
+    mask &= mask - 1;  /* clear lowest bit */
+  }
+  return NULL;
+}
+
+
+/* assumes 2 <= l2 <= l1 */
+static const char *sse2find (const char *s1, size_t l1,
+                             const char *s2, size_t l2) {
+  __m128i first = _mm_set1_epi8(s2[0]);
+  __m128i last = _mm_set1_epi8(s2[l2 - 1]);
+  size_t i;
+  for (i = 0; l1 - i >= 16 + l2 - 1; i += 16) {
+    __m128i bf = _mm_loadu_si128((const __m128i *)(s1 + i));
+    __m128i bl = _mm_loadu_si128((const __m128i *)(s1 + i + l2 - 1));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bl, last)));
+    if (mask != 0) {
+      const char *res = checkcands(mask, s1 + i, s2, l2);
+      if (res != NULL) return res;
     }
-    return NULL;  /* not found */
   }
+  return scanfind(s1 + i, l1 - i, s2, l2);  /* last positions */
 }
 
 
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#define hasavx2()	__builtin_cpu_supports("avx2")
+
+/* assumes 2 <= l2 <= l1 */
+__attribute__((target("avx2")))
+static const char *avx2find (const char *s1, size_t l1,
+                             const char *s2, size_t l2) {
+  __m256i first = _mm256_set1_epi8(s2[0]);
+  __m256i last = _mm256_set1_epi8(s2[l2 - 1]);
+  size_t i;
+  for (i = 0; l1 - i >= 32 + l2 - 1; i += 32) {
+    __m256i bf = _mm256_loadu_si256((const __m256i *)(s1 + i));
+    __m256i bl = _mm256_loadu_si256((const __m256i *)(s1 + i + l2 - 1));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+      _mm256_and_si256(_mm256_cmpeq_epi8(bf, first),
+                       _mm256_cmpeq_epi8(bl, last)));
+    if (mask != 0) {
+      const char *res = checkcands(mask, s1 + i, s2, l2);
+      if (res != NULL) return res;
+    }
+  }
+  return sse2find(s1 + i, l1 - i, s2, l2);  /* last positions */
+}
+
+#else
+
+#define hasavx2()	0
+#define avx2find	sse2find
+
+#endif
+
+#endif
+
+
+static const char *lmemfind (const char *s1, size_t l1,
+                               const char *s2, size_t l2) {
+  if (l2 == 0) return s1;  /* empty strings are everywhere */
+  else if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
+#if defined(SIMDFIND)
+  else if (l2 >= 2)  /* ('memchr' is already fast for a single char) */
+    return hasavx2() ? avx2find(s1, l1, s2, l2) : sse2find(s1, l1, s2, l2);
+#endif
+  else
+    return scanfind(s1, l1, s2, l2);
+}
+
 static void push_onecapture (MatchState *ms, int i, const char *s,
                                                     const char *e) {
   if (i >= ms->level) {
@@ -600,13 +689,13 @@ static int nospecials (const char *p, size_t l) {
 }
 
 
-static void prepstate (MatchState *ms, lua_State *L,
-                       const char *s, size_t ls, const char *p, size_t lp) {
+static void prepstate (MatchState *ms, lua_State *L, const char *s,
+                       size_t ls, const Pattern *prog) {
   ms->L = L;
   ms->matchdepth = MAXCCALLS;
   ms->src_init = s;
   ms->src_end = s + ls;
-  ms->p_end = p + lp;
+  ms->prog = prog;
   if (ls < (MAX_SIZET - B_REPS) / A_REPS)
     ms->nrep = A_REPS * ls + B_REPS;
   else  /* overflow (very long subject) */
@@ -620,6 +709,361 @@ static void reprepstate (MatchState *ms) {
 }
 
 
+/* end of the single-char class at 'p', or NULL if it is malformed */
+static const char *classend (const char *p, const char *p_end, int *err) {
+  switch (*p++) {
+    case L_ESC: {
+      if (p == p_end) {
+        *err = PE_ESC;
+        return NULL;
+      }
+      return p+1;
+    }
+    case '[': {
+      if (*p == '^') p++;
+      do {  /* look for a ']' */
+        if (p == p_end) {
+          *err = PE_SET;
+          return NULL;
+        }
+        if (*(p++) == L_ESC && p < p_end)
+          p++;  /* skip escapes (e.g. '%]') */
+      } while (*p != ']');
+      return p+1;
+    }
+    default: {
+      return p;
+    }
+  }
+}
+
+
+#define addtoset(set,c)  \
+	((set)[(c) / CHAR_BIT] |= (unsigned char)(1u << ((c) % CHAR_BIT)))
+
+#define fillset(set,test)  \
+	{ int c; for (c = 0; c <= UCHAR_MAX; c++) if (test) addtoset(set, c); }
+
+
+/* adds to 'set' the characters matched by '%cl' */
+static void addclass (CharSet set, int cl) {
+  CharSet cs;
+  int i;
+  memset(cs, 0, CHARSETSIZE);
+  switch (tolower(cl)) {
+    case 'a' : fillset(cs, isalpha(c)); break;
+    case 'c' : fillset(cs, iscntrl(c)); break;
+    case 'd' : fillset(cs, isdigit(c)); break;
+    case 'g' : fillset(cs, isgraph(c)); break;
+    case 'l' : fillset(cs, islower(c)); break;
+    case 'p' : fillset(cs, ispunct(c)); break;
+    case 's' : fillset(cs, isspace(c)); break;
+    case 'u' : fillset(cs, isupper(c)); break;
+    case 'w' : fillset(cs, isalnum(c)); break;
+    case 'x' : fillset(cs, isxdigit(c)); break;
+    case 'z' : addtoset(cs, 0); break;  /* deprecated option */
+    default: addtoset(set, cl); return;
+  }
+  for (i = 0; i < CHARSETSIZE; i++)
+    set[i] |= islower(cl) ? cs[i] : (unsigned char)~cs[i];
+}
+
+
+/*
+** fills 'set' with the characters matched by the class ('%x' or '[set]')
+** from 'p' to 'ep'; returns the character if it is the only one, or -1
+*/
+static int makeset (CharSet set, const char *p, const char *ep) {
+  int i, n = 0, last = -1;
+  memset(set, 0, CHARSETSIZE);
+  if (*p == L_ESC)
+    addclass(set, uchar(*(p + 1)));
+  else {  /* '[set]' */
+    const char *ec = ep - 1;
+    int sig = 1;
+    if (*(p+1) == '^') {
+      sig = 0;
+      p++;  /* skip the '^' */
+    }
+    while (++p < ec) {
+      if (*p == L_ESC) {
+        p++;
+        addclass(set, uchar(*p));
+      }
+      else if ((*(p+1) == '-') && (p+2 < ec)) {
+        int c;
+        p+=2;
+        for (c = uchar(*(p-2)); c <= uchar(*p); c++)
+          addtoset(set, c);
+      }
+      else addtoset(set, uchar(*p));
+    }
+    if (!sig) {
+      for (i = 0; i < CHARSETSIZE; i++)
+        set[i] = (unsigned char)~set[i];
+    }
+  }
+  for (i = 0; i <= UCHAR_MAX; i++) {
+    if (inset(set, i)) {
+      n++; last = i;
+    }
+  }
+  return (n == 1) ? last : -1;
+}
+
+
+/*
+** compiles pattern 'p' (already without its anchor) into the items of
+** 'prog', which must have room for one item per character plus two and
+** one set per '%' or '[' in the pattern
+*/
+static void compile (Pattern *prog, const char *p, const char *p_end) {
+  PatItem *it = prog->item;
+  unsigned int nsets = 0;
+  int err = 0;
+  for (; p != p_end; it++) {
+    const char *ep;
+    it->suffix = it->c = it->c2 = 0;
+    it->set = 0;
+    switch (*p) {
+      case '(': {  /* start capture */
+        if (*(p + 1) == ')') {  /* position capture? */
+          it->op = PI_POSITION; p += 2;
+        }
+        else {
+          it->op = PI_OPEN; p++;
+        }
+        continue;
+      }
+      case ')': {  /* end capture */
+        it->op = PI_CLOSE; p++;
+        continue;
+      }
+      case '$': {
+        if ((p + 1) != p_end)  /* is the '$' the last char in pattern? */
+          goto dflt;  /* no; go to default */
+        it->op = PI_EOS; p++;
+        continue;
+      }
+      case L_ESC: {  /* escaped sequences not in the format class[*+?-]? */
+        switch (*(p + 1)) {
+          case 'b': {  /* balanced string? */
+            if (p + 2 >= p_end - 1) {
+              err = PE_BALANCE;
+              break;
+            }
+            it->op = PI_BALANCE;
+            it->c = uchar(*(p + 2)); it->c2 = uchar(*(p + 3));
+            p += 4;
+            continue;
+          }
+          case 'f': {  /* frontier? */
+            p += 2;
+            if (*p != '[') {
+              err = PE_FRONTIER;
+              break;
+            }
+            if ((ep = classend(p, p_end, &err)) == NULL)
+              break;
+            it->op = PI_FRONTIER;
+            it->set = nsets;
+            makeset(prog->sets[nsets++], p, ep);
+            p = ep;
+            continue;
+          }
+          case '0': case '1': case '2': case '3':
+          case '4': case '5': case '6': case '7':
+          case '8': case '9': {  /* capture results (%0-%9)? */
+            it->op = PI_BACKREF;
+            it->c = uchar(*(p + 1));
+            p += 2;
+            continue;
+          }
+          default: goto dflt;
+        }
+        break;  /* malformed */
+      }
+      default: dflt: {  /* pattern class plus optional suffix */
+        if ((ep = classend(p, p_end, &err)) == NULL)
+          break;  /* malformed */
+        if (*p == '.')
+          it->op = PI_ANY;
+        else if (*p == L_ESC || *p == '[') {
+          int c = makeset(prog->sets[nsets], p, ep);
+          if (c >= 0) {  /* only one character? */
+            it->op = PI_CHAR; it->c = uchar(c);
+          }
+          else {
+            it->op = PI_SET; it->set = nsets++;
+          }
+        }
+        else {
+          it->op = PI_CHAR; it->c = uchar(*p);
+        }
+        if (*ep == '*' || *ep == '+' || *ep == '-' || *ep == '?')
+          it->suffix = uchar(*ep++);
+        p = ep;
+        continue;
+      }
+    }
+    it->op = PI_ERROR;  /* malformed item */
+    it->c = uchar(err);
+    it++;
+    break;  /* rest of the pattern is never reached */
+  }
+  it->op = PI_END;
+}
+
+
+/*
+** When the first item of a pattern must match one character, a match
+** can only start where that character is, so unanchored searches skip
+** the positions where it is not instead of trying 'match' on each. If
+** the pattern starts with literal characters, they are searched with
+** 'lmemfind'; otherwise the subject is scanned with the first set.
+*/
+static void prepstart (Pattern *prog) {
+  const PatItem *it = prog->item;
+  prog->first = -1;
+  prog->lprefix = 0;
+  while (it->op == PI_OPEN || it->op == PI_POSITION)
+    it++;  /* skip captures (they match no chars) */
+  if ((it->op == PI_CHAR || it->op == PI_SET) &&
+      (it->suffix == 0 || it->suffix == '+')) {
+    prog->first = (int)(it - prog->item);
+    for (; it->op == PI_CHAR && prog->lprefix < MAXPREFIX; it++) {
+      if (it->suffix != 0 && it->suffix != '+')
+        break;  /* optional character */
+      prog->prefix[prog->lprefix++] = (char)it->c;
+      if (it->suffix == '+')
+        break;  /* repetitions are not part of the prefix */
+    }
+  }
+}
+
+
+/* compiles the pattern 'p' and pushes the result */
+static Pattern *newpattern (lua_State *L, const char *p, size_t lp,
+                            int anchorable) {
+  Pattern *prog;
+  size_t i, nsets = 0;
+  int anchor = (anchorable && lp > 0 && *p == '^');
+  if (anchor) {
+    p++; lp--;  /* skip anchor character */
+  }
+  for (i = 0; i < lp; i++) {
+    if (p[i] == L_ESC || p[i] == '[')
+      nsets++;
+  }
+  if (lp >= (MAX_SIZET - sizeof(Pattern)) / (sizeof(PatItem) + sizeof(CharSet)))
+    luaL_error(L, "pattern too long");
+  prog = (Pattern *)lua_newuserdata(L, sizeof(Pattern) +
+                        (lp + 1) * sizeof(PatItem) + nsets * sizeof(CharSet));
+  prog->sets = (CharSet *)(prog->item + lp + 2);
+  prog->anchor = anchor;
+  compile(prog, p, p + lp);
+  prepstart(prog);
+  return prog;
+}
+
+
+/*
+** Compiled patterns are kept in a direct-mapped cache, a userdata shared
+** as upvalue by the library functions. Slots are keyed by the address
+** of the pattern's contents, which identifies a short string, as they
+** are internalized. The user value of the cache keeps the pattern and
+** compiled pattern of each slot alive, so that no other string can
+** take that address while the slot refers to it.
+*/
+
+#if !defined(LUA_PATCACHESIZE)
+#define LUA_PATCACHESIZE	64
+#endif
+
+
+typedef struct PatCache {
+  struct {
+    const char *p;  /* contents of the pattern */
+    size_t lp;  /* its length */
+    int anchorable;  /* whether its initial '^' is an anchor */
+    Pattern *prog;  /* compiled pattern */
+  } slot[LUA_PATCACHESIZE];
+} PatCache;
+
+
+static void newpatcache (lua_State *L) {
+  PatCache *pc = (PatCache *)lua_newuserdata(L, sizeof(PatCache));
+  int i;
+  for (i = 0; i < LUA_PATCACHESIZE; i++) {
+    pc->slot[i].p = NULL;
+    pc->slot[i].lp = 0;
+    pc->slot[i].anchorable = 0;
+    pc->slot[i].prog = NULL;
+  }
+  lua_createtable(L, 2 * LUA_PATCACHESIZE, 0);
+  lua_setuservalue(L, -2);
+}
+
+
+/*
+** returns the compiled pattern for the string at index 'arg'; with
+** 'push', also pushes it, to keep it alive while running Lua code that
+** could remove it from the cache
+*/
+static const Pattern *getpattern (lua_State *L, int arg, int anchorable,
+                                  int push) {
+  PatCache *pc = (PatCache *)lua_touserdata(L, lua_upvalueindex(1));
+  size_t lp;
+  const char *p = lua_tolstring(L, arg, &lp);
+  size_t h = (size_t)p;
+  Pattern *prog;
+  h = ((h >> 4) ^ (h >> 10) ^ (size_t)anchorable) % LUA_PATCACHESIZE;
+  if (pc->slot[h].p == p && pc->slot[h].lp == lp &&
+      pc->slot[h].anchorable == anchorable) {  /* hit? */
+    prog = pc->slot[h].prog;
+    if (push) {
+      lua_getuservalue(L, lua_upvalueindex(1));
+      lua_rawgeti(L, -1, (lua_Integer)(2 * h + 2));
+      lua_remove(L, -2);
+    }
+  }
+  else {  /* compile pattern into slot 'h' */
+    prog = newpattern(L, p, lp, anchorable);
+    lua_getuservalue(L, lua_upvalueindex(1));
+    lua_pushvalue(L, arg);
+    lua_rawseti(L, -2, (lua_Integer)(2 * h + 1));
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, (lua_Integer)(2 * h + 2));
+    lua_pop(L, push ? 1 : 2);
+    pc->slot[h].p = p;
+    pc->slot[h].lp = lp;
+    pc->slot[h].anchorable = anchorable;
+    pc->slot[h].prog = prog;
+  }
+  return prog;
+}
+
+/*
+** returns the first position from 's' on where a match can start, or
+** NULL if there is none
+*/
+static const char *skipstart (MatchState *ms, const char *s) {
+  const Pattern *prog = ms->prog;
+  if (prog->lprefix > 0)
+    return lmemfind(s, ms->src_end - s, prog->prefix, prog->lprefix);
+  else if (prog->first >= 0) {  /* first item is a set */
+    const unsigned char *set = prog->sets[prog->item[prog->first].set];
+    for (; s < ms->src_end; s++) {
+      if (inset(set, uchar(*s)))
+        return s;
+    }
+    return NULL;
+  }
+  else
+    return s;  /* any position */
+}
+
+
 static int str_find_aux (lua_State *L, int find) {
   size_t ls, lp;
   const char *s = luaL_checklstring(L, 1, &ls);
@@ -643,15 +1087,15 @@ static int str_find_aux (lua_State *L, int find) {
   else {
     MatchState ms;
     const char *s1 = s + init - 1;
-    int anchor = (*p == '^');
-    if (anchor) {
-      p++; lp--;  /* skip anchor character */
-    }
-    prepstate(&ms, L, s, ls, p, lp);
+    const Pattern *prog = getpattern(L, 2, 1, 0);
+    int anchor = prog->anchor;
+    prepstate(&ms, L, s, ls, prog);
     do {
       const char *res;
+      if (!anchor && (s1 = skipstart(&ms, s1)) == NULL)
+        break;  /* no more places where a match can start */
       reprepstate(&ms);
-      if ((res=match(&ms, s1, p)) != NULL) {
+      if ((res=match(&ms, s1, prog->item)) != NULL) {
         if (find) {
           lua_pushinteger(L, (s1 - s) + 1);  /* start */
           lua_pushinteger(L, res - s);   /* end */
@@ -680,7 +1124,6 @@ static int str_match (lua_State *L) {
 /* state for 'gmatch' */
 typedef struct GMatchState {
   const char *src;  /* current position */
-  const char *p;  /* pattern */
   MatchState ms;  /* match state */
 } GMatchState;
 
@@ -690,8 +1133,10 @@ static int gmatch_aux (lua_State *L) {
   const char *src;
   for (src = gm->src; src <= gm->ms.src_end; src++) {
     const char *e;
+    if ((src = skipstart(&gm->ms, src)) == NULL)
+      break;  /* no more places where a match can start */
     reprepstate(&gm->ms);
-    if ((e = match(&gm->ms, src, gm->p)) != NULL) {
+    if ((e = match(&gm->ms, src, gm->ms.prog->item)) != NULL) {
       if (e == src)  /* empty match? */
         gm->src =src + 1;  /* go at least one position */
       else
@@ -704,15 +1149,16 @@ static int gmatch_aux (lua_State *L) {
 
 
 static int gmatch (lua_State *L) {
-  size_t ls, lp;
+  size_t ls;
   const char *s = luaL_checklstring(L, 1, &ls);
-  const char *p = luaL_checklstring(L, 2, &lp);
   GMatchState *gm;
+  luaL_checkstring(L, 2);
   lua_settop(L, 2);  /* keep them on closure to avoid being collected */
   gm = (GMatchState *)lua_newuserdata(L, sizeof(GMatchState));
-  prepstate(&gm->ms, L, s, ls, p, lp);
-  gm->src = s; gm->p = p;
-  lua_pushcclosure(L, gmatch_aux, 3);
+  /* '^' is not an anchor here; compiled pattern is kept on closure too */
+  prepstate(&gm->ms, L, s, ls, getpattern(L, 2, 0, 1));
+  gm->src = s;
+  lua_pushcclosure(L, gmatch_aux, 4);
   return 1;
 }
 
@@ -777,27 +1223,32 @@ static void add_value (MatchState *ms, luaL_Buffer *b, const char *s,
 
 
 static int str_gsub (lua_State *L) {
-  size_t srcl, lp;
+  size_t srcl;
   const char *src = luaL_checklstring(L, 1, &srcl);
-  const char *p = luaL_checklstring(L, 2, &lp);
   int tr = lua_type(L, 3);
   lua_Integer max_s = luaL_optinteger(L, 4, srcl + 1);
-  int anchor = (*p == '^');
   lua_Integer n = 0;
+  const Pattern *prog;
   MatchState ms;
   luaL_Buffer b;
+  luaL_checkstring(L, 2);
   luaL_argcheck(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
                    tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
                       "string/function/table expected");
+  prog = getpattern(L, 2, 1, 1);  /* (kept on the stack) */
+  prepstate(&ms, L, src, srcl, prog);
   luaL_buffinit(L, &b);
-  if (anchor) {
-    p++; lp--;  /* skip anchor character */
-  }
-  prepstate(&ms, L, src, srcl, p, lp);
   while (n < max_s) {
     const char *e;
+    if (!prog->anchor) {
+      const char *s2 = skipstart(&ms, src);
+      if (s2 == NULL)
+        break;  /* no more matches; rest is copied below */
+      luaL_addlstring(&b, src, s2 - src);  /* keep skipped text */
+      src = s2;
+    }
     reprepstate(&ms);
-    if ((e = match(&ms, src, p)) != NULL) {
+    if ((e = match(&ms, src, prog->item)) != NULL) {
       n++;
       add_value(&ms, &b, src, e, tr);
     }
@@ -806,7 +1257,7 @@ static int str_gsub (lua_State *L) {
     else if (src < ms.src_end)
       luaL_addchar(&b, *src++);
     else break;
-    if (anchor) break;
+    if (prog->anchor) break;
   }
   luaL_addlstring(&b, src, ms.src_end-src);
   luaL_pushresult(&b);
@@ -1546,7 +1997,9 @@ static void createmetatable (lua_State *L) {
 ** Open string library
 */
 LUAMOD_API int luaopen_string (lua_State *L) {
-  luaL_newlib(L, strlib);
+  luaL_newlibtable(L, strlib);
+  newpatcache(L);
+  luaL_setfuncs(L, strlib, 1);
   createmetatable(L);
   return 1;
 }
@@ -21,10 +21,15 @@
 ** in its main position (i.e. the 'original' position that its hash gives
 ** to it), then the colliding element is in its own main position.
 ** Hence even when the load factor reaches 100%, performance remains good.
+** With LUA_USE_SWISSTABLE, the hash part uses open addressing instead
+** (see "Open-addressing hash part" below).
+** With LUA_USE_INCREHASH, big hash parts grow incrementally (see
+** "Incremental rehash" below).
 */
 
 #include <math.h>
 #include <limits.h>
+#include <string.h>
 
 #include "lua.h"
 
@@ -55,6 +60,25 @@
 #define MAXHBITS	(MAXABITS - 1)
 
 
+#if defined(LUA_USE_INCREHASH)
+
+#if defined(LUA_USE_SWISSTABLE)
+#error "LUA_USE_INCREHASH cannot be used with LUA_USE_SWISSTABLE"
+#endif
+
+/* minimum size of a hash part that grows incrementally */
+#if !defined(LUAI_INCREHASHMIN)
+#define LUAI_INCREHASHMIN	(1 << 12)
+#endif
+
+/* number of old nodes moved by each new key */
+#if !defined(LUAI_INCREHASHSTEP)
+#define LUAI_INCREHASHSTEP	8
+#endif
+
+#endif
+
+
 #define hashpow2(t,n)		(gnode(t, lmod((n), sizenode(t))))
 
 #define hashstr(t,str)		hashpow2(t, (str)->hash)
@@ -72,15 +96,37 @@
 #define hashpointer(t,p)	hashmod(t, point2uint(p))
 
 
-#define dummynode		(&dummynode_)
+#if !defined(LUA_USE_SWISSTABLE)
 
-#define isdummy(n)		((n) == dummynode)
+#define dummynode		(&dummynode_)
 
 static const Node dummynode_ = {
   {NILCONSTANT},  /* value */
   {{NILCONSTANT, 0}}  /* key */
 };
 
+#else
+
+#define dummynode		(&dummynode_.n)
+
+#define CTRL_EMPTY	0x80	/* control byte for a never-used node */
+
+/* the dummy node is followed by the control bytes of a 1-node table */
+static const struct {
+  Node n;
+  lu_byte ctrl[16];
+} dummynode_ = {
+  {{NILCONSTANT}, {{NILCONSTANT, 0}}},
+  {CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY,
+   CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY,
+   CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY,
+   CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY, CTRL_EMPTY}
+};
+
+#endif
+
+#define isdummy(n)		((n) == dummynode)
+
 
 /*
 ** Hash for floating-point numbers.
@@ -112,6 +158,17 @@ static int l_hashfloat (lua_Number n) {
 #endif
 
 
+/*
+** whether node key 'k' is 'key' (which may be dead already, but it is
+** ok to use it in 'next')
+*/
+#define samekey(k,key) \
+	(luaV_rawequalobj(k, key) || (ttisdeadkey(k) && iscollectable(key) && \
+	                              deadvalue(k) == gcvalue(key)))
+
+
+#if !defined(LUA_USE_SWISSTABLE)
+
 /*
 ** returns the 'main' position of an element in a table (that is, the index
 ** of its hash value)
@@ -139,6 +196,242 @@ static Node *mainposition (const Table *t, const TValue *key) {
 }
 
 
+/* returns the node holding 'key' (maybe a dead key), or NULL */
+static Node *findkeynode (const Table *t, const TValue *key) {
+  Node *n = mainposition(t, key);
+  for (;;) {  /* check whether 'key' is somewhere in the chain */
+    if (samekey(gkey(n), key))
+      return n;
+    else {
+      int nx = gnext(n);
+      if (nx == 0)
+        return NULL;  /* not found */
+      n += nx;
+    }
+  }
+}
+
+#else
+
+/*
+** {=============================================================
+** Open-addressing hash part
+** ==============================================================
+*/
+
+/*
+** The node vector of a table is followed by one control byte per node
+** plus GROUPWIDTH copies of its first control bytes (taken modulo the
+** size), so that a whole group can be loaded from any position. A
+** control byte is CTRL_EMPTY for a never-used node and the 7-bit 'h2'
+** fragment of the key's hash otherwise. As with chained scatter, keys
+** are only removed from the hash part by a rehash (a removed entry just
+** has a nil value), so a search stops at the first group with an empty
+** node. Groups are visited by triangular probing, which covers the whole
+** vector when its size is a power of 2.
+*/
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+
+#include <emmintrin.h>
+
+#define GROUPWIDTH	16
+
+/* bit 'i' is set if control byte 'i' of the group equals 'h2' */
+static unsigned int matchgroup (const lu_byte *g, lu_byte h2) {
+  __m128i ctrl = _mm_loadu_si128(cast(const __m128i *, g));
+  return cast(unsigned int,
+      _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(cast(char, h2)), ctrl)));
+}
+
+/* bit 'i' is set if control byte 'i' of the group is empty */
+static unsigned int matchempty (const lu_byte *g) {
+  __m128i ctrl = _mm_loadu_si128(cast(const __m128i *, g));
+  return cast(unsigned int, _mm_movemask_epi8(ctrl));
+}
+
+#else
+
+#define GROUPWIDTH	8
+
+static unsigned int matchgroup (const lu_byte *g, lu_byte h2) {
+  unsigned int m = 0;
+  int i;
+  for (i = 0; i < GROUPWIDTH; i++)
+    m |= cast(unsigned int, g[i] == h2) << i;
+  return m;
+}
+
+static unsigned int matchempty (const lu_byte *g) {
+  unsigned int m = 0;
+  int i;
+  for (i = 0; i < GROUPWIDTH; i++)
+    m |= cast(unsigned int, (g[i] & CTRL_EMPTY) != 0) << i;
+  return m;
+}
+
+#endif
+
+
+/*
+** index of the lowest bit set in a (non-zero) group mask; 'prefetch'
+** starts loading the first node of a group together with its control
+** bytes, as most searches end there.
+*/
+#if defined(__GNUC__)
+#define lowbit(m)	__builtin_ctz(m)
+#define prefetch(p)	__builtin_prefetch(p)
+#else
+#define prefetch(p)	((void)0)
+static int lowbit (unsigned int m) {
+  int i = 0;
+  while (!(m & 1u)) { m >>= 1; i++; }
+  return i;
+}
+#endif
+
+
+#define ctrlof(t)	cast(lu_byte *, gnode(t, sizenode(t)))
+
+/* total size of a node vector with 'size' nodes and its control bytes */
+#define nodebytes(size)	((size) * (sizeof(Node) + 1) + GROUPWIDTH)
+
+/* top bits of the hash go to control bytes, low bits select positions */
+#define h2of(h)		cast(lu_byte, (h) >> 25)
+
+
+/*
+** Hashes used by the chained version are good for picking a slot modulo
+** a size, but here both ends of the hash are used; mix them (this is
+** the finalizer from MurmurHash3).
+*/
+static unsigned int mixhash (unsigned int h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+
+static unsigned int hashinteger (lua_Integer i) {
+  lua_Unsigned u = l_castS2U(i);
+  return mixhash(cast(unsigned int, u) ^ cast(unsigned int, (u >> 31) >> 1));
+}
+
+
+static unsigned int hashkey (const TValue *key) {
+  switch (ttype(key)) {
+    case LUA_TNUMINT:
+      return hashinteger(ivalue(key));
+    case LUA_TNUMFLT:
+      return mixhash(cast(unsigned int, l_hashfloat(fltvalue(key))));
+    case LUA_TSHRSTR:
+      return mixhash(tsvalue(key)->hash);
+    case LUA_TLNGSTR:
+      return mixhash(luaS_hashlongstr(tsvalue(key)));
+    case LUA_TBOOLEAN:
+      return mixhash(cast(unsigned int, bvalue(key)));
+    case LUA_TLIGHTUSERDATA:
+      return mixhash(point2uint(pvalue(key)));
+    case LUA_TLCF:
+      return mixhash(point2uint(fvalue(key)));
+    default:
+      lua_assert(!ttisdeadkey(key));
+      return mixhash(point2uint(gcvalue(key)));
+  }
+}
+
+
+/*
+** Walks the probe sequence of hash 'h' in table 't', running 'body' for
+** each node 'n' whose control byte matches; the walk ends (falling
+** through the macro) after the first group holding an empty node.
+*/
+#define forprobe(t,h,n,body) { \
+  unsigned int mask_ = cast(unsigned int, sizenode(t) - 1); \
+  const lu_byte *ctrl_ = ctrlof(t); \
+  lu_byte h2_ = h2of(h); \
+  unsigned int pos_ = (h) & mask_, step_ = 0; \
+  prefetch(gnode(t, pos_)); \
+  for (;;) { \
+    unsigned int m_ = matchgroup(ctrl_ + pos_, h2_); \
+    while (m_ != 0) { \
+      Node *n = gnode(t, (pos_ + lowbit(m_)) & mask_); \
+      body \
+      m_ &= m_ - 1; \
+    } \
+    if (matchempty(ctrl_ + pos_) != 0) break; \
+    step_ += GROUPWIDTH; \
+    pos_ = (pos_ + step_) & mask_; \
+  } }
+
+
+/* returns the first empty node in the probe sequence of hash 'h' */
+static unsigned int findempty (const Table *t, unsigned int h) {
+  unsigned int mask = cast(unsigned int, sizenode(t) - 1);
+  const lu_byte *ctrl = ctrlof(t);
+  unsigned int pos = h & mask, step = 0;
+  for (;;) {
+    unsigned int m = matchempty(ctrl + pos);
+    if (m != 0)
+      return (pos + lowbit(m)) & mask;
+    step += GROUPWIDTH;
+    pos = (pos + step) & mask;
+  }
+}
+
+
+/* sets control byte 'i' and its copies after the end of the vector */
+static void setctrl (Table *t, unsigned int i, lu_byte c) {
+  unsigned int size = cast(unsigned int, sizenode(t));
+  lu_byte *ctrl = ctrlof(t);
+  ctrl[i] = c;
+  for (i += size; i < size + GROUPWIDTH; i += size)
+    ctrl[i] = c;
+}
+
+
+/*
+** Maximum number of keys in a hash part with 'size' nodes. Small vectors
+** keep one node empty, to end searches; larger ones keep 1/8 empty.
+*/
+static unsigned int maxload (unsigned int size) {
+  return (size < GROUPWIDTH) ? size - 1 : size - size / 8;
+}
+
+
+/*
+** Puts a key that is known to be absent into the hash part (which must
+** have room for it) and returns its node.
+*/
+static Node *insertkey (Table *t, const TValue *key) {
+  unsigned int h = hashkey(key);
+  unsigned int i = findempty(t, h);
+  lua_assert(t->growthleft > 0);
+  setctrl(t, i, h2of(h));
+  t->growthleft--;
+  return gnode(t, i);
+}
+
+
+/* returns the node holding 'key' (maybe a dead key), or NULL */
+static Node *findkeynode (const Table *t, const TValue *key) {
+  unsigned int h = hashkey(key);
+  forprobe(t, h, n,
+    if (samekey(gkey(n), key))
+      return n;
+  )
+  return NULL;
+}
+
+/* }============================================================= */
+
+#endif
+
+
 /*
 ** returns the index for 'key' if 'key' is an appropriate key to live in
 ** the array part of the table, 0 otherwise.
@@ -153,6 +446,67 @@ static unsigned int arrayindex (const TValue *key) {
 }
 
 
+#if defined(LUA_USE_INCREHASH)
+
+/*
+** {=============================================================
+** Incremental rehash
+** ==============================================================
+*/
+
+/*
+** When a hash part with at least LUAI_INCREHASHMIN nodes is full, it is
+** not rehashed at once. Instead, a node vector with twice its size
+** becomes the table's 'node' and the full one is kept in 'oldnode'.
+** Each new key first moves the next LUAI_INCREHASHSTEP old nodes to the
+** new vector ('oldpos' counts the nodes already moved), so the old
+** vector is empty after at most a half of its size of new keys, which
+** always fit in the new vector. Moved nodes are left in the old vector
+** (to keep its chains), with collectable keys marked dead, but they are
+** stale: searches look into the new vector first and ignore old nodes
+** before 'oldpos';
+** 'next' numbers the old nodes after the current hash part; and the
+** collector traverses both vectors. Such a growth does not recompute
+** the size of the array part.
+*/
+
+
+static void movenodes (lua_State *L, Table *t, unsigned int n);
+
+
+#define nodefromval(v)	cast(Node *, cast(char *, (v)) - offsetof(Node, i_val))
+
+
+/* fills 'old' with a table header describing only the old node vector */
+static void oldview (const Table *t, Table *old) {
+  old->node = t->oldnode;
+  old->lsizenode = t->loldsizenode;
+  old->sizearray = 0;
+  old->oldnode = NULL;
+}
+
+
+/* value 'v' found in the old nodes of 't', unless already moved */
+static const TValue *notmoved (const Table *t, const TValue *v) {
+  if (v != luaO_nilobject &&
+      cast(unsigned int, nodefromval(v) - t->oldnode) < t->oldpos)
+    return luaO_nilobject;  /* stale copy of an entry already moved */
+  return v;
+}
+
+
+/* search for a key in the old nodes of 't' not moved yet */
+static const TValue *getold (const Table *t, const TValue *key) {
+  Table old;
+  oldview(t, &old);
+  return notmoved(t, luaH_get(&old, key));
+}
+
+/* }============================================================= */
+
+#endif
+
+
 /*
 ** returns the index of a 'key' for table traversals. First goes all
 ** elements in the array part, then elements in the hash part. The
@@ -160,28 +514,34 @@ static unsigned int arrayindex (const TValue *key) {
 */
 static unsigned int findindex (lua_State *L, Table *t, StkId key) {
   unsigned int i;
+  Node *n;
   if (ttisnil(key)) return 0;  /* first iteration */
   i = arrayindex(key);
   if (i != 0 && i <= t->sizearray)  /* is 'key' inside array part? */
     return i;  /* yes; that's the index */
-  else {
-    int nx;
-    Node *n = mainposition(t, key);
-    for (;;) {  /* check whether 'key' is somewhere in the chain */
-      /* key may be dead already, but it is ok to use it in 'next' */
-      if (luaV_rawequalobj(gkey(n), key) ||
-            (ttisdeadkey(gkey(n)) && iscollectable(key) &&
-             deadvalue(gkey(n)) == gcvalue(key))) {
-        i = cast_int(n - gnode(t, 0));  /* key index in hash table */
-        /* hash elements are numbered after array ones */
-        return (i + 1) + t->sizearray;
-      }
-      nx = gnext(n);
-      if (nx == 0)
-        luaG_runerror(L, "invalid key to 'next'");  /* key not found */
-      else n += nx;
+  i = t->nexthint;  /* traversals usually continue from the last key */
+  if (i < cast(unsigned int, sizenode(t)) && samekey(gkey(gnode(t, i)), key))
+    return (i + 1) + t->sizearray;
+  n = findkeynode(t, key);
+  if (n != NULL) {
+    i = cast_int(n - gnode(t, 0));  /* key index in hash table */
+    /* hash elements are numbered after array ones */
+    return (i + 1) + t->sizearray;
+  }
+#if defined(LUA_USE_INCREHASH)
+  else if (t->oldnode != NULL) {  /* try the old nodes not moved yet */
+    Table old;
+    oldview(t, &old);
+    n = findkeynode(&old, key);
+    if (n != NULL && cast(unsigned int, n - t->oldnode) >= t->oldpos) {
+      i = cast_int(n - t->oldnode);
+      /* they are numbered after the current hash part */
+      return (i + 1) + t->sizearray + sizenode(t);
     }
   }
+#endif
+  luaG_runerror(L, "invalid key to 'next'");  /* key not found */
+  return 0;  /* to avoid warnings */
 }
 
 
@@ -189,18 +549,34 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
   unsigned int i = findindex(L, t, key);  /* find original element */
   for (; i < t->sizearray; i++) {  /* try first array part */
     if (!ttisnil(&t->array[i])) {  /* a non-nil value? */
-      setivalue(key, i + 1);
+      setivalue(L, key, i + 1);
       setobj2s(L, key+1, &t->array[i]);
       return 1;
     }
   }
   for (i -= t->sizearray; cast_int(i) < sizenode(t); i++) {  /* hash part */
     if (!ttisnil(gval(gnode(t, i)))) {  /* a non-nil value? */
+      t->nexthint = i;
       setobj2s(L, key, gkey(gnode(t, i)));
       setobj2s(L, key+1, gval(gnode(t, i)));
       return 1;
     }
   }
+#if defined(LUA_USE_INCREHASH)
+  if (t->oldnode != NULL) {  /* then the old nodes not moved yet */
+    unsigned int size = twoto(t->loldsizenode);
+    i -= sizenode(t);
+    if (i < t->oldpos) i = t->oldpos;
+    for (; i < size; i++) {
+      Node *n = t->oldnode + i;
+      if (!ttisnil(gval(n))) {
+        setobj2s(L, key, gkey(n));
+        setobj2s(L, key+1, gval(n));
+        return 1;
+      }
+    }
+  }
+#endif
   return 0;  /* no more elements */
 }
 
@@ -307,6 +683,8 @@ static void setarrayvector (lua_State *L, Table *t, unsigned int size) {
 }
 
 
+#if !defined(LUA_USE_SWISSTABLE)
+
 static void setnodevector (lua_State *L, Table *t, unsigned int size) {
   int lsize;
   if (size == 0) {  /* no elements to hash part? */
@@ -332,13 +710,79 @@ static void setnodevector (lua_State *L, Table *t, unsigned int size) {
 }
 
 
+#define freenodevector(L,n,size)	luaM_freearray(L, n, size)
+
+/* number of keys that fit in the current hash part */
+#define hashcapacity(t)		(isdummy((t)->node) ? 0 : sizenode(t))
+
+#define reinsertkey(L,t,k)	luaH_set(L, t, k)
+
+#else
+
+/* 'size' is the number of keys the new hash part must be able to hold */
+static void setnodevector (lua_State *L, Table *t, unsigned int size) {
+  if (size == 0) {  /* no elements to hash part? */
+    t->node = cast(Node *, dummynode);  /* use common 'dummynode' */
+    t->lsizenode = 0;
+    t->growthleft = 0;
+  }
+  else {
+    unsigned int i;
+    int lsize = luaO_ceillog2(size);
+    while (maxload(twoto(lsize)) < size)
+      lsize++;
+    if (lsize > MAXHBITS)
+      luaG_runerror(L, "table overflow");
+    size = twoto(lsize);
+    t->node = cast(Node *, luaM_malloc(L, nodebytes(size)));
+    for (i = 0; i < size; i++) {
+      Node *n = gnode(t, i);
+      gnext(n) = 0;
+      setnilvalue(wgkey(n));
+      setnilvalue(gval(n));
+    }
+    t->lsizenode = cast_byte(lsize);
+    memset(ctrlof(t), CTRL_EMPTY, size + GROUPWIDTH);
+    t->growthleft = maxload(size);
+  }
+}
+
+
+#define freenodevector(L,n,size)	luaM_freemem(L, n, nodebytes(size))
+
+#define hashcapacity(t)		(isdummy((t)->node) ? 0 : maxload(sizenode(t)))
+
+/*
+** Entries moved by a resize are known to be absent from the new table;
+** they go either to a (grown) array part or straight to an empty node.
+*/
+static TValue *reinsertkey (lua_State *L, Table *t, const TValue *key) {
+  unsigned int k = arrayindex(key);
+  if (k != 0 && k <= t->sizearray)
+    return &t->array[k - 1];
+  else {
+    Node *n = insertkey(t, key);
+    setnodekey(L, &n->i_key, key);
+    return gval(n);
+  }
+}
+
+#endif
+
+
 void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
                                           unsigned int nhsize) {
   unsigned int i;
   int j;
   unsigned int oldasize = t->sizearray;
-  int oldhsize = t->lsizenode;
-  Node *nold = t->node;  /* save old hash ... */
+  int oldhsize;
+  Node *nold;
+#if defined(LUA_USE_INCREHASH)
+  if (t->oldnode != NULL)  /* still growing its hash part? */
+    movenodes(L, t, twoto(t->loldsizenode));  /* finish it */
+#endif
+  oldhsize = t->lsizenode;
+  nold = t->node;  /* save old hash ... */
   if (nasize > oldasize)  /* array part must grow? */
     setarrayvector(L, t, nasize);
   /* create new hash part with appropriate size */
@@ -359,17 +803,16 @@ void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
     if (!ttisnil(gval(old))) {
       /* doesn't need barrier/invalidate cache, as entry was
          already present in the table */
-      setobjt2t(L, luaH_set(L, t, gkey(old)), gval(old));
+      setobjt2t(L, reinsertkey(L, t, gkey(old)), gval(old));
     }
   }
   if (!isdummy(nold))
-    luaM_freearray(L, nold, cast(size_t, twoto(oldhsize))); /* free old hash */
+    freenodevector(L, nold, cast(size_t, twoto(oldhsize))); /* free old hash */
 }
 
 
 void luaH_resizearray (lua_State *L, Table *t, unsigned int nasize) {
-  int nsize = isdummy(t->node) ? 0 : sizenode(t);
-  luaH_resize(L, t, nasize, nsize);
+  luaH_resize(L, t, nasize, hashcapacity(t));
 }
 
 /*
@@ -381,6 +824,10 @@ static void rehash (lua_State *L, Table *t, const TValue *ek) {
   unsigned int nums[MAXABITS + 1];
   int i;
   int totaluse;
+#if defined(LUA_USE_INCREHASH)
+  if (t->oldnode != NULL)  /* still growing its hash part? */
+    movenodes(L, t, twoto(t->loldsizenode));  /* finish it before counting */
+#endif
   for (i = 0; i <= MAXABITS; i++) nums[i] = 0;  /* reset counts */
   na = numusearray(t, nums);  /* count keys in array part */
   totaluse = na;  /* all those keys are integer keys */
@@ -408,19 +855,66 @@ Table *luaH_new (lua_State *L) {
   t->flags = cast_byte(~0);
   t->array = NULL;
   t->sizearray = 0;
+  t->nexthint = 0;
+  t->lenhint = 0;
   setnodevector(L, t, 0);
+#if defined(LUA_USE_INCREHASH)
+  t->loldsizenode = 0;
+  t->oldnode = NULL;
+  t->oldpos = 0;
+#endif
   return t;
 }
 
 
 void luaH_free (lua_State *L, Table *t) {
   if (!isdummy(t->node))
-    luaM_freearray(L, t->node, cast(size_t, sizenode(t)));
+    freenodevector(L, t->node, cast(size_t, sizenode(t)));
+#if defined(LUA_USE_INCREHASH)
+  if (t->oldnode != NULL)
+    luaM_freearray(L, t->oldnode, cast(size_t, twoto(t->loldsizenode)));
+#endif
   luaM_freearray(L, t->array, t->sizearray);
   luaM_free(L, t);
 }
 
 
+/*
+** removes all entries from a table, keeping its array part and node
+** vector for reuse
+*/
+void luaH_clear (lua_State *L, Table *t) {
+  unsigned int i;
+  for (i = 0; i < t->sizearray; i++)
+    setnilvalue(&t->array[i]);
+#if defined(LUA_USE_INCREHASH)
+  if (t->oldnode != NULL) {  /* drop the part still being moved */
+    luaM_freearray(L, t->oldnode, cast(size_t, twoto(t->loldsizenode)));
+    t->oldnode = NULL;
+  }
+#else
+  UNUSED(L);
+#endif
+  if (!isdummy(t->node)) {
+    unsigned int size = sizenode(t);
+    for (i = 0; i < size; i++) {
+      Node *n = gnode(t, i);
+      gnext(n) = 0;
+      setnilvalue(wgkey(n));
+      setnilvalue(gval(n));
+    }
+#if defined(LUA_USE_SWISSTABLE)
+    memset(ctrlof(t), CTRL_EMPTY, size + GROUPWIDTH);
+    t->growthleft = maxload(size);
+#else
+    t->lastfree = gnode(t, size);  /* all positions are free */
+#endif
+  }
+}
+
+
+#if !defined(LUA_USE_SWISSTABLE)
+
 static Node *getfreepos (Table *t) {
   while (t->lastfree > t->node) {
     t->lastfree--;
@@ -430,37 +924,27 @@ static Node *getfreepos (Table *t) {
   return NULL;  /* could not find a free place */
 }
 
+#endif
+
+
 
+#if !defined(LUA_USE_SWISSTABLE)
 
 /*
 ** inserts a new key into a hash table; first, check whether key's main
 ** position is free. If not, check whether colliding node is in its main
 ** position or not: if it is not, move colliding node to an empty place and
 ** put new key in its main position; otherwise (colliding node is in its main
-** position), new key goes to an empty position.
+** position), new key goes to an empty position. Returns the node for the
+** new key (which the caller must set), or NULL if there is no free place.
 */
-TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
-  Node *mp;
-  TValue aux;
-  if (ttisnil(key)) luaG_runerror(L, "table index is nil");
-  else if (ttisfloat(key)) {
-    lua_Integer k;
-    if (luaV_tointeger(key, &k, 0)) {  /* index is int? */
-      setivalue(&aux, k);
-      key = &aux;  /* insert it as an integer */
-    }
-    else if (luai_numisnan(fltvalue(key)))
-      luaG_runerror(L, "table index is NaN");
-  }
-  mp = mainposition(t, key);
+static Node *insertnode (Table *t, const TValue *key) {
+  Node *mp = mainposition(t, key);
   if (!ttisnil(gval(mp)) || isdummy(mp)) {  /* main position is taken? */
     Node *othern;
     Node *f = getfreepos(t);  /* get a free place */
-    if (f == NULL) {  /* cannot find a free place? */
-      rehash(L, t, key);  /* grow table */
-      /* whatever called 'newkey' takes care of TM cache */
-      return luaH_set(L, t, key);  /* insert key into grown table */
-    }
+    if (f == NULL)  /* cannot find a free place? */
+      return NULL;
     lua_assert(!isdummy(f));
     othern = mainposition(t, gkey(mp));
     if (othern != mp) {  /* is colliding node out of its main position? */
@@ -484,6 +968,103 @@ TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
       mp = f;
     }
   }
+  return mp;
+}
+
+#endif
+
+
+#if defined(LUA_USE_INCREHASH)
+
+/* moves up to 'n' old nodes of 't' to its current node vector */
+static void movenodes (lua_State *L, Table *t, unsigned int n) {
+  Node *old = t->oldnode;
+  unsigned int size = twoto(t->loldsizenode);
+  for (; n > 0 && t->oldpos < size; n--) {
+    Node *o = old + t->oldpos++;
+    if (!ttisnil(gval(o))) {
+      /* doesn't need barrier/invalidate cache, as entry was
+         already present in the table */
+      Node *mp = insertnode(t, gkey(o));
+      lua_assert(mp != NULL);
+      setnodekey(L, &mp->i_key, gkey(o));
+      setobjt2t(L, gval(mp), gval(o));
+    }
+    if (iscollectable(gkey(o)))  /* the collector no longer sees this key */
+      setdeadvalue(wgkey(o));
+  }
+  if (t->oldpos == size) {  /* old vector is empty? */
+    t->oldnode = NULL;
+    luaM_freearray(L, old, cast(size_t, size));
+  }
+}
+
+
+/*
+** starts an incremental growth of the (full) hash part of 't', if it is
+** big enough and not growing already; returns whether it did
+*/
+static int growhash (lua_State *L, Table *t) {
+  Node *old = t->node;
+  lu_byte lsize = t->lsizenode;
+  if (t->oldnode != NULL || isdummy(old) ||
+      sizenode(t) < LUAI_INCREHASHMIN || lsize >= MAXHBITS)
+    return 0;
+  setnodevector(L, t, twoto(lsize + 1));
+  t->oldnode = old;
+  t->loldsizenode = lsize;
+  t->oldpos = 0;
+  return 1;
+}
+
+#endif
+
+
+/*
+** inserts a new key into a hash table. (With open addressing, the new
+** key simply goes to the first empty node in its probe sequence.)
+*/
+TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
+  Node *mp;
+  TValue aux;
+  if (ttisnil(key)) luaG_runerror(L, "table index is nil");
+  else if (ttisfloat(key)) {
+    lua_Integer k;
+    if (luaV_tointeger(key, &k, 0)) {  /* index is int? */
+      setivalue(L, &aux, k);
+      key = &aux;  /* insert it as an integer */
+    }
+    else if (luai_numisnan(fltvalue(key)))
+      luaG_runerror(L, "table index is NaN");
+  }
+#if defined(LUA_USE_SWISSTABLE)
+  if (t->growthleft == 0) {  /* no room for another key? */
+    rehash(L, t, key);  /* grow table */
+    return luaH_set(L, t, key);  /* insert key into grown table */
+  }
+  mp = insertkey(t, key);
+#else
+#if defined(LUA_USE_INCREHASH)
+  if (t->oldnode != NULL)  /* hash part still growing? */
+    movenodes(L, t, LUAI_INCREHASHSTEP);  /* do a step */
+#endif
+  mp = insertnode(t, key);
+  if (mp == NULL) {  /* cannot find a free place? */
+#if defined(LUA_USE_INCREHASH)
+    if (growhash(L, t)) {
+      movenodes(L, t, LUAI_INCREHASHSTEP);
+      mp = insertnode(t, key);
+      lua_assert(mp != NULL);
+    }
+    else
+#endif
+    {
+      rehash(L, t, key);  /* grow table */
+      /* whatever called 'newkey' takes care of TM cache */
+      return luaH_set(L, t, key);  /* insert key into grown table */
+    }
+  }
+#endif
   setnodekey(L, &mp->i_key, key);
   luaC_barrierback(L, t, key);
   lua_assert(ttisnil(gval(mp)));
@@ -498,6 +1079,16 @@ const TValue *luaH_getint (Table *t, lua_Integer key) {
   /* (1 <= key && key <= t->sizearray) */
   if (l_castS2U(key) - 1 < t->sizearray)
     return &t->array[key - 1];
+#if defined(LUA_USE_SWISSTABLE)
+  else {
+    unsigned int h = hashinteger(key);
+    forprobe(t, h, n,
+      if (ttisinteger(gkey(n)) && ivalue(gkey(n)) == key)
+        return gval(n);
+    )
+    return luaO_nilobject;
+  }
+#else
   else {
     Node *n = hashint(t, key);
     for (;;) {  /* check whether 'key' is somewhere in the chain */
@@ -509,14 +1100,46 @@ const TValue *luaH_getint (Table *t, lua_Integer key) {
         n += nx;
       }
     }
+#if defined(LUA_USE_INCREHASH)
+    if (t->oldnode != NULL) {  /* not moved yet? */
+      Table old;
+      oldview(t, &old);
+      return notmoved(t, luaH_getint(&old, key));
+    }
+#endif
     return luaO_nilobject;
   }
+#endif
 }
 
 
 /*
 ** search function for short strings
 */
+#if defined(LUA_USE_SWISSTABLE)
+
+const TValue *luaH_getshortstr (Table *t, TString *key) {
+  unsigned int h = mixhash(key->hash);
+  lua_assert(key->tt == LUA_TSHRSTR);
+  forprobe(t, h, n,
+    if (ttisshrstring(gkey(n)) && eqshrstr(tsvalue(gkey(n)), key))
+      return gval(n);
+  )
+  return luaO_nilobject;
+}
+
+
+static const TValue *getgeneric (Table *t, const TValue *key) {
+  unsigned int h = hashkey(key);
+  forprobe(t, h, n,
+    if (luaV_rawequalobj(gkey(n), key))
+      return gval(n);
+  )
+  return luaO_nilobject;
+}
+
+#else
+
 const TValue *luaH_getshortstr (Table *t, TString *key) {
   Node *n = hashstr(t, key);
   lua_assert(key->tt == LUA_TSHRSTR);
@@ -526,11 +1149,18 @@ const TValue *luaH_getshortstr (Table *t, TString *key) {
       return gval(n);  /* that's it */
     else {
       int nx = gnext(n);
-      if (nx == 0)
-        return luaO_nilobject;  /* not found */
+      if (nx == 0) break;
       n += nx;
     }
   }
+#if defined(LUA_USE_INCREHASH)
+  if (t->oldnode != NULL) {  /* not moved yet? */
+    TValue k;
+    setsvalue(cast(lua_State *, NULL), &k, key);
+    return getold(t, &k);
+  }
+#endif
+  return luaO_nilobject;  /* not found */
 }
 
 
@@ -545,13 +1175,19 @@ static const TValue *getgeneric (Table *t, const TValue *key) {
       return gval(n);  /* that's it */
     else {
       int nx = gnext(n);
-      if (nx == 0)
-        return luaO_nilobject;  /* not found */
+      if (nx == 0) break;
       n += nx;
     }
   }
+#if defined(LUA_USE_INCREHASH)
+  if (t->oldnode != NULL)  /* not moved yet? */
+    return getold(t, key);
+#endif
+  return luaO_nilobject;  /* not found */
 }
 
+#endif
+
 
 const TValue *luaH_getstr (Table *t, TString *key) {
   if (key->tt == LUA_TSHRSTR)
@@ -603,7 +1239,7 @@ void luaH_setint (lua_State *L, Table *t, lua_Integer key, TValue *value) {
     cell = cast(TValue *, p);
   else {
     TValue k;
-    setivalue(&k, key);
+    setivalue(L, &k, key);
     cell = luaH_newkey(L, t, &k);
   }
   setobj2t(L, cell, value);
@@ -638,7 +1274,7 @@ static int unbound_search (Table *t, unsigned int j) {
 ** Try to find a boundary in table 't'. A 'boundary' is an integer index
 ** such that t[i] is non-nil and t[i+1] is nil (and 0 if t[1] is nil).
 */
-int luaH_getn (Table *t) {
+static unsigned int findborder (Table *t) {
   unsigned int j = t->sizearray;
   if (j > 0 && ttisnil(&t->array[j - 1])) {
     /* there is a boundary in the array part: (binary) search for it */
@@ -657,11 +1293,452 @@ int luaH_getn (Table *t) {
 }
 
 
+/* whether 'j' is a boundary of table 't' */
+static int isborder (Table *t, unsigned int j) {
+  if (j < t->sizearray) {
+    if (!ttisnil(&t->array[j])) return 0;  /* t[j + 1] is present */
+  }
+  else if (!isdummy(t->node)) {
+    if (j >= cast(unsigned int, MAX_INT) ||
+        !ttisnil(luaH_getint(t, cast(lua_Integer, j) + 1)))
+      return 0;
+  }
+  if (j == 0) return 1;
+  else if (j <= t->sizearray) return !ttisnil(&t->array[j - 1]);
+  else return !isdummy(t->node) && !ttisnil(luaH_getint(t, j));
+}
+
+
+/*
+** The length of a table is checked first against the boundary found
+** last time, and then against the ones next to it, so that '#t' stays
+** O(1) while a sequence grows or shrinks by one element at a time (as
+** with 't[#t + 1] = v', 'table.insert', and 'table.remove'); a stale
+** hint is only a wasted check before the search.
+*/
+int luaH_getn (Table *t) {
+  unsigned int j = t->lenhint;
+  if (!isborder(t, j)) {
+    if (isborder(t, j + 1))
+      j++;  /* one element was appended */
+    else if (j > 0 && isborder(t, j - 1))
+      j--;  /* one element was removed */
+    else
+      j = findborder(t);
+    t->lenhint = j;
+  }
+  return cast_int(j);
+}
+
+
+
+/*
+** {=============================================================
+** Sorting
+** ==============================================================
+*/
+
+/*
+** Pattern-defeating quicksort (after Orson Peters' pdqsort) over the
+** array part: median-of-3 (ninther for big ranges) pivots, a separate
+** partition for runs of elements equal to the pivot, insertion sort
+** for small or almost sorted ranges, and heapsort when partitions keep
+** being too unbalanced. Elements are only swapped inside the array, so
+** every value stays anchored in the table while a comparison function
+** runs; all scans are bounded, so an inconsistent order function can
+** produce a wrong order but cannot access outside the range.
+** Arrays with only integers or only floats do not need comparisons at
+** all: they are sorted by an LSD radix sort over unsigned keys with the
+** same order (see 'radixsort').
+*/
+
+/* kinds of comparison */
+#define SORT_INT	0	/* all integers */
+#define SORT_FLT	1	/* all floats (without NaN) */
+#define SORT_STR	2	/* all strings */
+#define SORT_LT		3	/* mixed integers and floats */
+#define SORT_FUNC	4	/* calling an order function */
+
+/* ranges up to this size are sorted by insertion */
+#define SORT_INSERTION	24
+
+/* ranges larger than this use the ninther as pivot */
+#define SORT_NINTHER	128
+
+
+typedef struct SortState {
+  lua_State *L;
+  Table *t;
+  TValue *a;  /* array being sorted (0-based) */
+  unsigned int n;  /* number of elements being sorted */
+  int kind;
+  ptrdiff_t f;  /* stack position of the order function (SORT_FUNC) */
+} SortState;
+
+
+static int callorder (SortState *S, unsigned int i, unsigned int j) {
+  lua_State *L = S->L;
+  StkId func = L->top;
+  int res;
+  setobj2s(L, func, restorestack(L, S->f));
+  setobj2s(L, func + 1, &S->a[i]);
+  setobj2s(L, func + 2, &S->a[j]);
+  L->top = func + 3;
+  luaD_callnoyield(L, func, 1);
+  res = !l_isfalse(L->top - 1);
+  L->top--;
+  S->a = S->t->array;  /* the function may have resized the table */
+  if (S->t->sizearray < S->n)
+    luaG_runerror(L, "array changed during sort");
+  return res;
+}
+
+
+/* a[i] < a[j]? */
+static int sortlt (SortState *S, unsigned int i, unsigned int j) {
+  switch (S->kind) {
+    case SORT_INT: return ivalue(&S->a[i]) < ivalue(&S->a[j]);
+    case SORT_FLT: return luai_numlt(fltvalue(&S->a[i]), fltvalue(&S->a[j]));
+    case SORT_STR:
+      if (tsvalue(&S->a[i]) == tsvalue(&S->a[j])) return 0;
+      /* else */ /* FALLTHROUGH */
+    case SORT_LT: return luaV_lessthan(S->L, &S->a[i], &S->a[j]);
+    default: return callorder(S, i, j);
+  }
+}
+
+
+static void sortswap (SortState *S, unsigned int i, unsigned int j) {
+  TValue temp;
+  setobj(S->L, &temp, &S->a[i]);
+  setobj(S->L, &S->a[i], &S->a[j]);
+  setobj(S->L, &S->a[j], &temp);
+}
+
+
+/* sort a[i], a[j], a[k] */
+static void sort3 (SortState *S, unsigned int i, unsigned int j,
+                                 unsigned int k) {
+  if (sortlt(S, j, i)) sortswap(S, i, j);
+  if (sortlt(S, k, j)) {
+    sortswap(S, j, k);
+    if (sortlt(S, j, i)) sortswap(S, i, j);
+  }
+}
+
+
+static void insertionsort (SortState *S, unsigned int lo, unsigned int up) {
+  unsigned int i, j;
+  for (i = lo + 1; i <= up; i++)
+    for (j = i; j > lo && sortlt(S, j, j - 1); j--)
+      sortswap(S, j, j - 1);
+}
+
+
+/*
+** insertion sort that gives up (returning 0) after moving elements
+** more than a few positions in total
+*/
+static int partialinsertion (SortState *S, unsigned int lo,
+                                           unsigned int up) {
+  unsigned int i, j, moves = 0;
+  for (i = lo + 1; i <= up; i++) {
+    for (j = i; j > lo && sortlt(S, j, j - 1); j--)
+      sortswap(S, j, j - 1);
+    moves += i - j;
+    if (moves > 8)
+      return 0;
+  }
+  return 1;
+}
+
+
+static void siftdown (SortState *S, unsigned int lo, unsigned int i,
+                                    unsigned int n) {
+  for (;;) {
+    unsigned int c = 2 * i + 1;
+    if (c >= n) break;
+    if (c + 1 < n && sortlt(S, lo + c, lo + c + 1)) c++;
+    if (!sortlt(S, lo + i, lo + c)) break;
+    sortswap(S, lo + i, lo + c);
+    i = c;
+  }
+}
+
+
+static void heapsort (SortState *S, unsigned int lo, unsigned int up) {
+  unsigned int n = up - lo + 1;
+  unsigned int i;
+  for (i = n / 2; i > 0; i--)
+    siftdown(S, lo, i - 1, n);
+  for (i = n - 1; i > 0; i--) {
+    sortswap(S, lo, lo + i);
+    siftdown(S, lo, 0, i);
+  }
+}
+
+
+/*
+** Partition around the pivot a[lo]: returns its final position 'p',
+** with a[lo .. p - 1] < P <= a[p + 1 .. up]. '*sorted' tells whether
+** no element had to be swapped.
+*/
+static unsigned int partright (SortState *S, unsigned int lo,
+                               unsigned int up, int *sorted) {
+  unsigned int i = lo + 1;
+  unsigned int j = up;
+  while (i <= up && sortlt(S, i, lo)) i++;
+  while (j >= i && !sortlt(S, j, lo)) j--;
+  *sorted = (j < i);
+  while (i < j) {  /* a[i] >= P and a[j] < P */
+    sortswap(S, i, j);
+    do i++; while (i <= up && sortlt(S, i, lo));
+    do j--; while (j > lo && !sortlt(S, j, lo));
+  }
+  sortswap(S, lo, i - 1);
+  return i - 1;
+}
+
+
+/*
+** Partition around the pivot a[lo] putting elements equal to it on its
+** left: returns 'p' with a[lo .. p] <= P < a[p + 1 .. up]. Used when the
+** pivot is equal to the element just before the range, so that there
+** is nothing more to sort in a[lo .. p].
+*/
+static unsigned int partleft (SortState *S, unsigned int lo,
+                                            unsigned int up) {
+  unsigned int i = lo + 1;
+  unsigned int j = up;
+  while (j >= i && sortlt(S, lo, j)) j--;
+  while (i <= j && !sortlt(S, lo, i)) i++;
+  while (i < j) {  /* a[i] > P and a[j] <= P */
+    sortswap(S, i, j);
+    do j--; while (j > lo && sortlt(S, lo, j));
+    do i++; while (i <= up && !sortlt(S, lo, i));
+  }
+  sortswap(S, lo, j);
+  return j;
+}
+
+
+/* break patterns in a badly partitioned range of size 'n' from 'lo' */
+static void shuffle (SortState *S, unsigned int lo, unsigned int n) {
+  if (n >= SORT_INSERTION) {
+    sortswap(S, lo, lo + n / 4);
+    sortswap(S, lo + n - 1, lo + n - n / 4);
+  }
+}
+
+
+/*
+** 'leftmost' tells whether a[lo - 1] does not belong to the array being
+** sorted; 'bad' counts how many unbalanced partitions are still allowed
+** before switching to heapsort.
+*/
+static void pdqsort (SortState *S, unsigned int lo, unsigned int up,
+                                   int bad, int leftmost) {
+  while (up > lo) {  /* loop for tail recursion */
+    unsigned int size = up - lo + 1;
+    unsigned int p, ls, rs;
+    int sorted;
+    if (size <= SORT_INSERTION) {
+      insertionsort(S, lo, up);
+      return;
+    }
+    else {  /* choose pivot and move it to 'lo' */
+      unsigned int m = lo + size / 2;
+      if (size > SORT_NINTHER) {
+        sort3(S, lo, m, up);
+        sort3(S, lo + 1, m - 1, up - 1);
+        sort3(S, lo + 2, m + 1, up - 2);
+        sort3(S, m - 1, m, m + 1);
+        sortswap(S, lo, m);
+      }
+      else
+        sort3(S, m, lo, up);
+    }
+    if (!leftmost && !sortlt(S, lo - 1, lo)) {
+      /* pivot equals previous element: skip all elements equal to it */
+      lo = partleft(S, lo, up) + 1;
+      continue;
+    }
+    p = partright(S, lo, up, &sorted);
+    ls = p - lo;
+    rs = up - p;
+    if (ls < size / 8 || rs < size / 8) {  /* too unbalanced? */
+      if (--bad == 0) {
+        heapsort(S, lo, up);
+        return;
+      }
+      shuffle(S, lo, ls);
+      shuffle(S, p + 1, rs);
+    }
+    else if (sorted && (ls == 0 || partialinsertion(S, lo, p - 1)) &&
+                       (rs == 0 || partialinsertion(S, p + 1, up)))
+      return;  /* range was already (almost) sorted */
+    /* recurse into the smaller part; loop for the larger one */
+    if (ls < rs) {
+      if (ls > 0) pdqsort(S, lo, p - 1, bad, leftmost);
+      lo = p + 1;
+      leftmost = 0;
+    }
+    else {
+      if (rs > 0) pdqsort(S, p + 1, up, bad, 0);
+      if (ls == 0) return;
+      up = p - 1;
+    }
+  }
+}
+
+
+/* kind of comparison for the default order, or -1 if not possible */
+static int sortkind (const TValue *a, unsigned int n) {
+  unsigned int i, nint = 0, nbox = 0;
+  if (ttisstring(&a[0])) {
+    for (i = 1; i < n; i++)
+      if (!ttisstring(&a[i])) return -1;
+    return SORT_STR;
+  }
+  for (i = 0; i < n; i++) {
+    if (ttisinteger(&a[i])) {
+      nint++;
+      if (ttisboxedint(&a[i])) nbox++;
+    }
+    else if (!ttisfloat(&a[i]) || luai_numisnan(fltvalue(&a[i])))
+      return -1;
+  }
+  if (nbox > 0)  /* radix sort cannot rebuild boxed integers from keys */
+    return SORT_LT;
+  return (nint == n) ? SORT_INT : (nint == 0) ? SORT_FLT : SORT_LT;
+}
+
+
+#define SIGNBIT		(~(~cast(lua_Unsigned, 0) >> 1))
+
+/* radix sort works on the bits of floats when they fit in a key */
+#define radixfloats	(sizeof(lua_Number) == sizeof(lua_Unsigned))
+
+/* bytes copied between floats and keys (all of them when 'radixfloats') */
+#define KEYBYTES	(sizeof(lua_Number) < sizeof(lua_Unsigned) ? \
+                         sizeof(lua_Number) : sizeof(lua_Unsigned))
+
+
+/*
+** Unsigned key with the same order as number 'o': integers just flip
+** their sign bit; floats flip it when positive and all bits otherwise.
+*/
+static lua_Unsigned sortkey (const TValue *o) {
+  lua_Unsigned u = 0;
+  lua_Number f;
+  if (ttisinteger(o))
+    return l_castS2U(ivalue(o)) ^ SIGNBIT;
+  f = fltvalue(o);
+  memcpy(&u, &f, KEYBYTES);
+  return (u & SIGNBIT) ? ~u : (u | SIGNBIT);
+}
+
+
+static void setfromkey (lua_State *L, TValue *o, lua_Unsigned u, int kind) {
+  if (kind == SORT_INT) {
+    setivalue(L, o, l_castU2S(u ^ SIGNBIT));
+  }
+  else {
+    lua_Number f = 0;
+    u = (u & SIGNBIT) ? (u & ~SIGNBIT) : ~u;
+    memcpy(&f, &u, KEYBYTES);
+    setfltvalue(o, f);
+  }
+}
+
+
+/*
+** LSD radix sort of the keys, one byte per pass; passes where all keys
+** have the same byte (e.g., the high bytes of small integers) are
+** skipped, and so is everything when the array is already sorted.
+*/
+static void radixsort (lua_State *L, TValue *a, unsigned int n, int kind) {
+  lua_Unsigned *k = luaM_newvector(L, 2 * cast(size_t, n), lua_Unsigned);
+  lua_Unsigned *src = k, *dst = k + n;
+  unsigned int count[256];
+  unsigned int i;
+  int shift;
+  int sorted = 1;
+  for (i = 0; i < n; i++) {
+    k[i] = sortkey(&a[i]);
+    if (i > 0 && k[i] < k[i - 1]) sorted = 0;
+  }
+  if (!sorted) {
+    for (shift = 0; shift < cast_int(sizeof(lua_Unsigned) * CHAR_BIT);
+                    shift += 8) {
+      unsigned int sum = 0;
+      memset(count, 0, sizeof(count));
+      for (i = 0; i < n; i++)
+        count[(src[i] >> shift) & 0xff]++;
+      if (count[(src[0] >> shift) & 0xff] == n)
+        continue;  /* same byte in all keys */
+      for (i = 0; i < 256; i++) {  /* compute starting positions */
+        unsigned int c = count[i];
+        count[i] = sum;
+        sum += c;
+      }
+      for (i = 0; i < n; i++)
+        dst[count[(src[i] >> shift) & 0xff]++] = src[i];
+      { lua_Unsigned *temp = src; src = dst; dst = temp; }
+    }
+    for (i = 0; i < n; i++)
+      setfromkey(L, &a[i], src[i], kind);
+  }
+  luaM_freearray(L, k, 2 * cast(size_t, n));
+}
+
+
+/*
+** Sorts t[1 .. n] in place when they are all in the array part, either
+** by the default order (only for arrays of numbers without NaN or of
+** strings, which cannot raise errors or call metamethods) or by calling
+** the order function 'f' (a stack value, or NULL for the default
+** order). Returns 0 (and does nothing) when that is not possible.
+*/
+int luaH_sort (lua_State *L, Table *t, unsigned int n, StkId f) {
+  SortState S;
+  int bad = 0;
+  if (n > t->sizearray)
+    return 0;
+  if (n < 2)
+    return 1;
+  S.L = L;
+  S.t = t;
+  S.a = t->array;
+  S.n = n;
+  S.f = 0;
+  if (f != NULL) {
+    S.kind = SORT_FUNC;
+    S.f = savestack(L, f);
+  }
+  else if ((S.kind = sortkind(S.a, n)) < 0)
+    return 0;
+  else if (S.kind == SORT_INT || (S.kind == SORT_FLT && radixfloats)) {
+    radixsort(L, S.a, n, S.kind);
+    return 1;
+  }
+  while (n >>= 1) bad++;  /* log2 of the number of elements */
+  pdqsort(&S, 0, S.n - 1, bad, 1);
+  return 1;
+}
+
+/* }============================================================= */
+
+
 
 #if defined(LUA_DEBUG)
 
 Node *luaH_mainposition (const Table *t, const TValue *key) {
+#if defined(LUA_USE_SWISSTABLE)
+  return gnode(t, hashkey(key) & (sizenode(t) - 1));
+#else
   return mainposition(t, key);
+#endif
 }
 
 int luaH_isdummy (Node *n) { return isdummy(n); }
@@ -27,6 +27,13 @@
 #define invalidateTMcache(t)	((t)->flags = 0)
 
 
+#if defined(LUA_USE_INCREHASH)
+/* nodes of the old hash part not moved yet (see ltable.c) */
+#define goldfirst(t)	((t)->oldnode + (t)->oldpos)
+#define goldlast(t)	((t)->oldnode + twoto((t)->loldsizenode))
+#endif
+
+
 /* returns the key, given the value of a table entry */
 #define keyfromval(v) \
   (gkey(cast(Node *, cast(char *, (v)) - offsetof(Node, i_val))))
@@ -45,8 +52,10 @@ LUAI_FUNC void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
                                                     unsigned int nhsize);
 LUAI_FUNC void luaH_resizearray (lua_State *L, Table *t, unsigned int nasize);
 LUAI_FUNC void luaH_free (lua_State *L, Table *t);
+LUAI_FUNC void luaH_clear (lua_State *L, Table *t);
 LUAI_FUNC int luaH_next (lua_State *L, Table *t, StkId key);
 LUAI_FUNC int luaH_getn (Table *t);
+LUAI_FUNC int luaH_sort (lua_State *L, Table *t, unsigned int n, StkId f);
 
 
 #if defined(LUA_DEBUG)
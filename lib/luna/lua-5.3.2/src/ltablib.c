@@ -30,7 +30,24 @@
 #define TAB_RW	(TAB_R | TAB_W)		/* read/write */
 
 
-#define aux_getn(L,n,w)	(checktab(L, n, (w) | TAB_L), luaL_len(L, n))
+#define aux_getn(L,n,w)	(checktab(L, n, (w) | TAB_L), \
+	plaintable(L, n) ? (lua_Integer)lua_rawlen(L, n) : luaL_len(L, n))
+
+
+/*
+** Check whether 'arg' is a table without a metatable, so that raw
+** accesses are equivalent to regular ones (and the array fast paths
+** 'lua_arraymove'/'lua_arraypush' can be used)
+*/
+static int plaintable (lua_State *L, int arg) {
+  if (lua_type(L, arg) != LUA_TTABLE)
+    return 0;
+  if (lua_getmetatable(L, arg)) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  return 1;
+}
 
 
 static int checkfield (lua_State *L, const char *key, int n) {
@@ -76,6 +93,31 @@ static int maxn (lua_State *L) {
 #endif
 
 
+/*
+** Creates a table with preallocated space for 'narray' array elements
+** and 'nhash' other elements.
+*/
+static int tnew (lua_State *L) {
+  lua_Integer na = luaL_optinteger(L, 1, 0);
+  lua_Integer nh = luaL_optinteger(L, 2, 0);
+  luaL_argcheck(L, 0 <= na && na <= INT_MAX, 1, "out of range");
+  luaL_argcheck(L, 0 <= nh && nh <= INT_MAX, 2, "out of range");
+  lua_createtable(L, (int)na, (int)nh);
+  return 1;
+}
+
+
+/*
+** Removes all elements of a table, keeping its allocated space, so
+** that scratch tables can be reused instead of garbage collected.
+*/
+static int tclear (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_cleartable(L, 1);
+  return 0;
+}
+
+
 static int tinsert (lua_State *L) {
   lua_Integer e = aux_getn(L, 1, TAB_RW) + 1;  /* first empty element */
   lua_Integer pos;  /* where to insert new element */
@@ -88,7 +130,15 @@ static int tinsert (lua_State *L) {
       lua_Integer i;
       pos = luaL_checkinteger(L, 2);  /* 2nd argument is the position */
       luaL_argcheck(L, 1 <= pos && pos <= e, 2, "position out of bounds");
-      for (i = e; i > pos; i--) {  /* move up elements */
+      i = e;
+      if (i > pos && plaintable(L, 1)) {
+        lua_geti(L, 1, i - 1);
+        lua_seti(L, 1, i);  /* t[e] = t[e - 1] (may resize the table) */
+        i--;
+        if (lua_arraymove(L, 1, pos, i - 1, pos + 1, 1))
+          i = pos;  /* moved up all the others at once */
+      }
+      for (; i > pos; i--) {  /* move up elements */
         lua_geti(L, 1, i - 1);
         lua_seti(L, 1, i);  /* t[i] = t[i - 1] */
       }
@@ -109,6 +159,9 @@ static int tremove (lua_State *L) {
   if (pos != size)  /* validate 'pos' if given */
     luaL_argcheck(L, 1 <= pos && pos <= size + 1, 1, "position out of bounds");
   lua_geti(L, 1, pos);  /* result = t[pos] */
+  if (pos < size && plaintable(L, 1) &&
+      lua_arraymove(L, 1, pos + 1, size, pos, 1))
+    pos = size;  /* moved down all elements at once */
   for ( ; pos < size; pos++) {
     lua_geti(L, 1, pos + 1);
     lua_seti(L, 1, pos);  /* t[pos] = t[pos + 1] */
@@ -139,7 +192,11 @@ static int tmove (lua_State *L) {
     n = e - f + 1;  /* number of elements to move */
     luaL_argcheck(L, t <= LUA_MAXINTEGER - n + 1, 4,
                   "destination wrap around");
-    if (t > e || t <= f || tt != 1) {
+    if (plaintable(L, 1) && plaintable(L, tt) &&
+        lua_arraymove(L, 1, f, e, t, tt)) {
+      /* moved all elements at once */
+    }
+    else if (t > e || t <= f || tt != 1) {
       for (i = 0; i < n; i++) {
         lua_geti(L, 1, f + i);
         lua_seti(L, tt, t + i);
@@ -173,6 +230,8 @@ static int tconcat (lua_State *L) {
   const char *sep = luaL_optlstring(L, 2, "", &lsep);
   lua_Integer i = luaL_optinteger(L, 3, 1);
   last = luaL_opt(L, luaL_checkinteger, 4, last);
+  if (plaintable(L, 1) && lua_arrayconcat(L, 1, i, last, sep, lsep))
+    return 1;  /* built the result in a single step */
   luaL_buffinit(L, &b);
   for (; i < last; i++) {
     addfield(L, &b, i);
@@ -212,6 +271,8 @@ static int unpack (lua_State *L) {
   n = (lua_Unsigned)e - i;  /* number of elements minus 1 (avoid overflows) */
   if (n >= (unsigned int)INT_MAX  || !lua_checkstack(L, (int)(++n)))
     return luaL_error(L, "too many results to unpack");
+  if (plaintable(L, 1) && lua_arraypush(L, 1, i, (int)n))
+    return (int)n;  /* pushed all elements at once */
   for (; i < e; i++) {  /* push arg[i..e - 1] (to avoid overflows) */
     lua_geti(L, 1, i);
   }
@@ -414,6 +475,9 @@ static int sort (lua_State *L) {
     if (!lua_isnoneornil(L, 2))  /* is there a 2nd argument? */
       luaL_checktype(L, 2, LUA_TFUNCTION);  /* must be a function */
     lua_settop(L, 2);  /* make sure there are two arguments */
+    if (plaintable(L, 1) &&
+        lua_arraysort(L, 1, n, lua_isnil(L, 2) ? 0 : 2))
+      return 0;  /* sorted the array part in place */
     auxsort(L, 1, (unsigned int)n, 0u);
   }
   return 0;
@@ -433,6 +497,8 @@ static const luaL_Reg tab_funcs[] = {
   {"remove", tremove},
   {"move", tmove},
   {"sort", sort},
+  {"new", tnew},
+  {"clear", tclear},
   {NULL, NULL}
 };
 
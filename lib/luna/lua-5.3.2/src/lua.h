@@ -145,6 +145,8 @@ extern const char lua_ident[];
 LUA_API lua_State *(lua_newstate) (lua_Alloc f, void *ud);
 LUA_API void       (lua_close) (lua_State *L);
 LUA_API lua_State *(lua_newthread) (lua_State *L);
+LUA_API int        (lua_resetthread) (lua_State *L);
+LUA_API unsigned int (lua_threadgen) (lua_State *L);
 
 LUA_API lua_CFunction (lua_atpanic) (lua_State *L, lua_CFunction panicf);
 
@@ -226,6 +228,11 @@ LUA_API void        (lua_pushnumber) (lua_State *L, lua_Number n);
 LUA_API void        (lua_pushinteger) (lua_State *L, lua_Integer n);
 LUA_API const char *(lua_pushlstring) (lua_State *L, const char *s, size_t len);
 LUA_API const char *(lua_pushstring) (lua_State *L, const char *s);
+LUA_API size_t      (lua_strbuffhead) (lua_State *L);
+LUA_API const char *(lua_pushstrbuff) (lua_State *L, void *block,
+                                       size_t bsize, size_t len);
+LUA_API void       *(lua_resizeblock) (lua_State *L, void *block,
+                                       size_t osize, size_t nsize);
 LUA_API const char *(lua_pushvfstring) (lua_State *L, const char *fmt,
                                                       va_list argp);
 LUA_API const char *(lua_pushfstring) (lua_State *L, const char *fmt, ...);
@@ -262,6 +269,19 @@ LUA_API void  (lua_seti) (lua_State *L, int idx, lua_Integer n);
 LUA_API void  (lua_rawset) (lua_State *L, int idx);
 LUA_API void  (lua_rawseti) (lua_State *L, int idx, lua_Integer n);
 LUA_API void  (lua_rawsetp) (lua_State *L, int idx, const void *p);
+LUA_API void  (lua_cleartable) (lua_State *L, int idx);
+
+
+/*
+** raw access to ranges of the array part of tables
+*/
+LUA_API int   (lua_arraymove) (lua_State *L, int from, lua_Integer f,
+                               lua_Integer e, lua_Integer t, int to);
+LUA_API int   (lua_arraypush) (lua_State *L, int idx, lua_Integer i, int n);
+LUA_API int   (lua_arraysort) (lua_State *L, int idx, lua_Integer n,
+                               int comp);
+LUA_API int   (lua_arrayconcat) (lua_State *L, int idx, lua_Integer i,
+                                 lua_Integer j, const char *sep, size_t lsep);
 LUA_API int   (lua_setmetatable) (lua_State *L, int objindex);
 LUA_API void  (lua_setuservalue) (lua_State *L, int idx);
 
@@ -308,9 +328,52 @@ LUA_API int (lua_isyieldable) (lua_State *L);
 #define LUA_GCSETPAUSE		6
 #define LUA_GCSETSTEPMUL	7
 #define LUA_GCISRUNNING		9
+#define LUA_GCGEN		10
+#define LUA_GCINC		11
+#define LUA_GCSETMINORMUL	12
+#define LUA_GCSETMAJORMUL	13
+#define LUA_GCSETTHREADPOOL	14
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
+/*
+** report of a time-bounded collection (see 'lua_gcstepfor')
+*/
+typedef struct lua_GCReport {
+  int steps;  /* number of basic steps done */
+  int transitions;  /* number of changes of collector state */
+  int cycles;  /* number of cycles finished */
+  const char *state;  /* state of the collector at the end */
+  long usec;  /* time used (in microseconds) */
+  long maxusec;  /* time used by the longest basic step */
+  size_t reclaimed;  /* memory freed (in bytes) */
+} lua_GCReport;
+
+LUA_API int (lua_gcstepfor) (lua_State *L, int usec, lua_GCReport *r);
+
+/*
+** statistics of a collection cycle (see 'lua_gcstats'); times are in
+** microseconds
+*/
+typedef struct lua_GCStats {
+  unsigned long cycle;  /* number of the cycle (counting from 1) */
+  const char *kind;  /* "incremental", "full", "emergency", "minor"
+                        or "major" */
+  long propagate;  /* time spent in the propagate phase */
+  long atomic;  /* time spent in the atomic phase (a single pause) */
+  long sweep;  /* time spent in the sweep phases */
+  long callfin;  /* time spent calling finalizers */
+  size_t marked;  /* bytes traversed when marking */
+  size_t swept;  /* bytes freed by the sweep */
+  size_t freed[LUA_NUMTAGS];  /* objects freed, by type */
+  size_t memory;  /* bytes in use at the end of the cycle */
+} lua_GCStats;
+
+typedef void (*lua_GCStatsF) (void *ud, const lua_GCStats *s);
+
+LUA_API int (lua_gcstats) (lua_State *L, int n, lua_GCStats *s);
+LUA_API void (lua_setgcstatsf) (lua_State *L, lua_GCStatsF f, void *ud);
+
 
 /*
 ** miscellaneous functions
@@ -437,6 +500,16 @@ LUA_API lua_Hook (lua_gethook) (lua_State *L);
 LUA_API int (lua_gethookmask) (lua_State *L);
 LUA_API int (lua_gethookcount) (lua_State *L);
 
+/* what to count in 'lua_memprofdump' */
+#define LUA_MPLIVE	0	/* bytes still in use */
+#define LUA_MPTOTAL	1	/* all bytes allocated */
+
+LUA_API int (lua_heapsnapshot) (lua_State *L, lua_Writer writer, void *data);
+
+LUA_API int (lua_memprofile) (lua_State *L, int rate);
+LUA_API int (lua_memprofdump) (lua_State *L, lua_Writer writer, void *data,
+                               int what);
+
 
 struct lua_Debug {
   int event;
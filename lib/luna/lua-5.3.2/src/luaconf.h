@@ -676,6 +676,65 @@
 /* #define LUA_NOCVTS2N */
 
 
+/*
+@@ LUA_USE_SWISSTABLE makes the hash part of tables use open addressing
+** with a side array of control bytes probed a group at a time (with
+** SSE2 when available) instead of chained scatter. It is faster for
+** big tables, at the cost of some extra memory per node.
+*/
+/* #define LUA_USE_SWISSTABLE */
+
+
+/*
+@@ LUA_USE_INCREHASH makes big tables grow their hash part incrementally:
+** the old node vector is kept while each new key moves a few of its
+** entries to the new one, instead of reinserting all keys at once.
+** (It cannot be combined with LUA_USE_SWISSTABLE.)
+*/
+/* #define LUA_USE_INCREHASH */
+
+
+/*
+@@ LUA_USE_FASTINTERN makes short strings hashed in full, a word at a
+** time, and interned in an open-addressed string table whose hashes
+** are kept apart, so that a lookup only touches the strings with the
+** same hash. (The default hash samples at most 32 characters of a
+** string, and interning walks a chain of strings.)
+*/
+/* #define LUA_USE_FASTINTERN */
+
+
+/*
+@@ LUA_USE_SHORTESTFLOAT makes 'tostring' write floats with the fewest
+** digits that read back to the same value (laid out as with "%.17g"),
+** instead of rounding them to LUA_NUMBER_FMT. Only for double floats.
+*/
+/* #define LUA_USE_SHORTESTFLOAT */
+
+
+/*
+@@ LUA_USE_NANBOX packs each value in 8 bytes instead of 16 (NaN
+** boxing: other values are stored in the unused NaN space of
+** doubles), halving stacks and array parts and shrinking table nodes
+** from 32 to 24 bytes. Floats must be 'double'. Integers keep their
+** type; those outside [-2^47, 2^47) are boxed in collectable objects,
+** so they cost an allocation each. Pointers must fit in 48 bits and
+** blocks from the allocation function must be aligned to 8 bytes.
+** Define it for Lua and for all code using it.
+*/
+/* #define LUA_USE_NANBOX */
+
+
+/*
+@@ LUA_USE_BGFREE makes the collector hand the blocks of dead objects
+** to a helper thread (POSIX threads) that gives them back to the
+** allocation function, so that sweeping only unlinks them. The
+** allocation function must be thread safe (the one from 'luaL_newstate'
+** is).
+*/
+/* #define LUA_USE_BGFREE */
+
+
 /*
 @@ LUA_USE_APICHECK turns on several consistency checks on the C API.
 ** Define it as a help when debugging C code.
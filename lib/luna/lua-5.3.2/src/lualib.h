@@ -32,6 +32,12 @@ LUAMOD_API int (luaopen_string) (lua_State *L);
 #define LUA_UTF8LIBNAME	"utf8"
 LUAMOD_API int (luaopen_utf8) (lua_State *L);
 
+#define LUA_BUFLIBNAME	"buffer"
+LUAMOD_API int (luaopen_buffer) (lua_State *L);
+
+#define LUA_NUMARRAYLIBNAME	"numarray"
+LUAMOD_API int (luaopen_numarray) (lua_State *L);
+
 #define LUA_BITLIBNAME	"bit32"
 LUAMOD_API int (luaopen_bit32) (lua_State *L);
 
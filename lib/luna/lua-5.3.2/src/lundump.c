@@ -136,7 +136,7 @@ static void LoadConstants (LoadState *S, Proto *f) {
       setfltvalue(o, LoadNumber(S));
       break;
     case LUA_TNUMINT:
-      setivalue(o, LoadInteger(S));
+      setivalue(S->L, o, LoadInteger(S));
       break;
     case LUA_TSHRSTR:
     case LUA_TLNGSTR:
@@ -4,21 +4,42 @@
 #include <dirent.h>
 #endif
 #include <map>
+#include <unordered_map>
+#include <vector>
 #include <string>
 #include <algorithm>
 #include <cstdio>
+#include <chrono>
 #include "luna.h"
 
 #define LUNA_FILE_ENV_METATABLE     "__luna_file_env_meta__"
 #define LUNA_FILE_ENV_PREFIX        "__luna_file:"
 #define LUNA_RUNTIME_METATABLE      "__luna_runtime_meta__"
 #define LUNA_RUNTIME_TABLE          "__luna_runtime__"
+#define LUNA_ASYNC_CALL_METATABLE   "__luna_async_call_meta__"
+
+struct luna_scheduler_t;
+struct luna_runtime_t;
+static luna_scheduler_t* sched_create(luna_runtime_t* runtime);
+static void sched_destroy(luna_scheduler_t* sched);
+static void lua_open_scheduler(lua_State* L, luna_scheduler_t* sched);
+static int async_call_gc(lua_State* L);
 
 struct luna_runtime_t
 {
     std::map<std::string, time_t> files;
     std::map<std::string, lua_cfunction_wrapper*> funcs;
     std::function<void(const char*)> error_func = [](const char* err) { puts(err); };
+    std::function<void(const lua_GCStats&)> gc_stats_func;
+    luna_scheduler_t* scheduler = nullptr;
+    int64_t budget_instructions = 0;    // per call, 0: no limit
+    int64_t budget_ms = 0;              // per call, 0: no limit
+    int budget_depth = 0;               // calls running with a budget (nested calls share the outer one)
+    int64_t budget_left = 0;            // instructions left in the current budget
+    std::chrono::steady_clock::time_point budget_deadline;
+    std::vector<lua_State*> resuming;   // coroutines being resumed by the scheduler, innermost last
+    lua_State* preempted = nullptr;     // coroutine that just yielded for being over budget
+    std::unordered_map<int, unsigned int> suspended;    // lua_suspend_coroutine tokens: lua_threadgen of their coroutine
 };
 
 static char* skip_utf8_bom(char* text, size_t len)
@@ -115,10 +136,12 @@ static int luna_runtime_gc(lua_State* L)
 {
     auto user_data = (luna_runtime_t**)lua_touserdata(L, 1);
     auto runtime = *user_data;
+    lua_setgcstatsf(L, nullptr, nullptr);
     for (auto one : runtime->funcs)
     {
         delete one.second;
     }
+    sched_destroy(runtime->scheduler);
     delete runtime;
     *user_data = nullptr;
     return 0;
@@ -154,6 +177,12 @@ lua_State* lua_open(std::function<void(const char*)>* error_func)
     lua_setmetatable(L, -2);
     lua_pop(L, 1);
 
+    luaL_newmetatable(L, LUNA_ASYNC_CALL_METATABLE);
+    lua_pushstring(L, "__gc");
+    lua_pushcfunction(L, async_call_gc);
+    lua_settable(L, -3);
+    lua_pop(L, 1);
+
     luaL_newmetatable(L, LUNA_FILE_ENV_METATABLE);
     lua_pushstring(L, "__index");
     lua_pushcfunction(L, file_env_index);
@@ -162,6 +191,9 @@ lua_State* lua_open(std::function<void(const char*)>* error_func)
 
     lua_register(L, "import", lua_import);
 
+    runtime->scheduler = sched_create(runtime);
+    lua_open_scheduler(L, runtime->scheduler);
+
     return L;
 }
 
@@ -195,6 +227,109 @@ void lua_register_cfunction(lua_State* L, const char* name, lua_cfunction_wrappe
     lua_setglobal(L, name);
 }
 
+bool lua_get_buffer(lua_State* L, int idx, const char** data, size_t* len)
+{
+    auto buffer = (luaL_ByteBuffer*)luaL_testudata(L, idx, LUA_BUFFERHANDLE);
+    if (buffer == nullptr)
+        return false;
+    *data = buffer->b + buffer->r;
+    *len = buffer->w - buffer->r;
+    return true;
+}
+
+static bool get_numarray(lua_State* L, int idx, int type, void** data, size_t* len)
+{
+    auto array = (luaL_NumArray*)luaL_testudata(L, idx, LUA_NUMARRAYHANDLE);
+    if (array == nullptr || array->type != type)
+        return false;
+    *data = array->p;
+    *len = array->n;
+    return true;
+}
+
+bool lua_get_numarray(lua_State* L, int idx, double** data, size_t* len) { return get_numarray(L, idx, LUA_NAFLOAT64, (void**)data, len); }
+bool lua_get_numarray(lua_State* L, int idx, float** data, size_t* len) { return get_numarray(L, idx, LUA_NAFLOAT32, (void**)data, len); }
+bool lua_get_numarray(lua_State* L, int idx, int32_t** data, size_t* len) { return get_numarray(L, idx, LUA_NAINT32, (void**)data, len); }
+bool lua_get_numarray(lua_State* L, int idx, int64_t** data, size_t* len) { return get_numarray(L, idx, LUA_NAINT64, (void**)data, len); }
+
+bool lua_set_gc_generational(lua_State* L, bool generational)
+{
+    return lua_gc(L, generational ? LUA_GCGEN : LUA_GCINC, 0) == LUA_GCGEN;
+}
+
+void lua_set_gc_auto(lua_State* L, bool enable)
+{
+    lua_gc(L, enable ? LUA_GCRESTART : LUA_GCSTOP, 0);
+}
+
+bool lua_gc_step_for(lua_State* L, int microseconds, lua_GCReport* report)
+{
+    return lua_gcstepfor(L, microseconds, report) != 0;
+}
+
+bool lua_get_gc_stats(lua_State* L, lua_GCStats* stats, int n)
+{
+    return lua_gcstats(L, n, stats) != 0;
+}
+
+static void gc_stats_callback(void* ud, const lua_GCStats* stats)
+{
+    auto runtime = (luna_runtime_t*)ud;
+    runtime->gc_stats_func(*stats);
+}
+
+void lua_set_gc_stats_callback(lua_State* L, std::function<void(const lua_GCStats&)> func)
+{
+    auto runtime = get_luna_runtime(L);
+    runtime->gc_stats_func = func;
+    if (func)
+    {
+        lua_setgcstatsf(L, gc_stats_callback, runtime);
+    }
+    else
+    {
+        lua_setgcstatsf(L, nullptr, nullptr);
+    }
+}
+
+int lua_set_thread_pool(lua_State* L, int count)
+{
+    return lua_gc(L, LUA_GCSETTHREADPOOL, count);
+}
+
+bool lua_reset_thread(lua_State* co)
+{
+    return lua_resetthread(co) == LUA_OK;
+}
+
+int lua_set_memory_profile(lua_State* L, int rate)
+{
+    return lua_memprofile(L, rate);
+}
+
+static int write_file(lua_State*, const void* data, size_t size, void* file)
+{
+    return fwrite(data, size, 1, (FILE*)file) == 1 ? 0 : 1;
+}
+
+bool lua_dump_memory_profile(lua_State* L, const char file_name[], bool live)
+{
+    FILE* file = fopen(file_name, "wb");
+    if (file == nullptr)
+        return false;
+    int status = lua_memprofdump(L, write_file, file, live ? LUA_MPLIVE : LUA_MPTOTAL);
+    return fclose(file) == 0 && status == 0;
+}
+
+bool lua_heap_snapshot(lua_State* L, const char file_name[])
+{
+    FILE* file = fopen(file_name, "wb");
+    if (file == nullptr)
+        return false;
+    int status = lua_heapsnapshot(L, write_file, file);
+    return fclose(file) == 0 && status == 0;
+}
+
 static bool lua_load_script_string(lua_State* L, const char file_name[], const char code[], int code_len)
 {
     bool reload = true;
@@ -350,6 +485,95 @@ bool lua_get_table_function(lua_State* L, const char table[], const char functio
     return true;
 }
 
+/*
+ * Call budgets: while a call runs, a count hook checks every LUNA_BUDGET_STEP instructions whether it has used up
+ * its instructions or its time; then a coroutine resumed by the scheduler yields (and goes on in the next tick),
+ * anything else fails with a timeout error. Calls nested in a call share its budget, each resume of the scheduler
+ * gets a budget of its own.
+ */
+#define LUNA_BUDGET_STEP    1000
+
+struct budget_saved_t
+{
+    lua_Hook hook;
+    int mask;
+    int count;
+    bool slice;
+    int depth;
+    int64_t left;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+static void budget_hook(lua_State* L, lua_Debug*)
+{
+    auto runtime = get_luna_runtime(L);
+    if (runtime == nullptr || runtime->budget_depth == 0)
+    {
+        // inherited by a coroutine created during a call
+        lua_sethook(L, nullptr, 0, 0);
+        return;
+    }
+
+    runtime->budget_left -= lua_gethookcount(L);
+    if (runtime->budget_left > 0 && std::chrono::steady_clock::now() < runtime->budget_deadline)
+        return;
+
+    if (!runtime->resuming.empty() && runtime->resuming.back() == L && lua_isyieldable(L))
+    {
+        runtime->preempted = L;
+        lua_yield(L, 0);
+        return;
+    }
+    luaL_error(L, "script timeout: call budget exceeded");
+}
+
+// start running L under the call budget (if any, a new one for a 'slice'), returns false if there is none
+static bool budget_enter(luna_runtime_t* runtime, lua_State* L, budget_saved_t* saved, bool slice)
+{
+    if (runtime == nullptr || (runtime->budget_instructions == 0 && runtime->budget_ms == 0))
+        return false;
+
+    saved->slice = slice;
+    if (slice)
+    {
+        saved->depth = runtime->budget_depth;
+        saved->left = runtime->budget_left;
+        saved->deadline = runtime->budget_deadline;
+        runtime->budget_depth = 0;
+    }
+    if (runtime->budget_depth++ == 0)
+    {
+        runtime->budget_left = runtime->budget_instructions ? runtime->budget_instructions : INT64_MAX;
+        runtime->budget_deadline = runtime->budget_ms ? std::chrono::steady_clock::now() + std::chrono::milliseconds(runtime->budget_ms)
+                                                      : std::chrono::steady_clock::time_point::max();
+    }
+    saved->hook = lua_gethook(L);
+    saved->mask = lua_gethookmask(L);
+    saved->count = lua_gethookcount(L);
+    int64_t step = std::min<int64_t>(LUNA_BUDGET_STEP, runtime->budget_left);
+    lua_sethook(L, budget_hook, LUA_MASKCOUNT, (int)std::max<int64_t>(step, 1));
+    return true;
+}
+
+static void budget_leave(luna_runtime_t* runtime, lua_State* L, const budget_saved_t* saved)
+{
+    lua_sethook(L, saved->hook, saved->mask, saved->count);
+    runtime->budget_depth--;
+    if (saved->slice)
+    {
+        runtime->budget_depth = saved->depth;
+        runtime->budget_left = saved->left;
+        runtime->budget_deadline = saved->deadline;
+    }
+}
+
+void lua_set_call_budget(lua_State* L, int64_t instructions, int milliseconds)
+{
+    auto runtime = get_luna_runtime(L);
+    runtime->budget_instructions = instructions > 0 ? instructions : 0;
+    runtime->budget_ms = milliseconds > 0 ? milliseconds : 0;
+}
+
 bool lua_call_function(lua_State* L, int arg_count, int ret_count)
 {
     int func_idx = lua_gettop(L) - arg_count;
@@ -364,7 +588,15 @@ bool lua_call_function(lua_State* L, int arg_count, int ret_count)
     lua_remove(L, -2); // remove 'debug'
 
     lua_insert(L, func_idx);
-    if (lua_pcall(L, arg_count, ret_count, func_idx))
+    auto runtime = get_luna_runtime(L);
+    budget_saved_t saved;
+    bool budget = budget_enter(runtime, L, &saved, false);
+    int status = lua_pcall(L, arg_count, ret_count, func_idx);
+    if (budget)
+    {
+        budget_leave(runtime, L, &saved);
+    }
+    if (status != LUA_OK)
     {
         print_error(L, lua_tostring(L, -1));
         return false;
@@ -373,3 +605,648 @@ bool lua_call_function(lua_State* L, int arg_count, int ret_count)
     return true;
 }
 
+
+/*
+ * Scheduler: coroutines parked by luna.sleep/luna.wait, woken by lua_scheduler_tick and signals.
+ *
+ * Deadlines are kept in a hierarchical timer wheel with 1ms jiffies: 256 slots for the next 256ms,
+ * then 4 levels of 64 slots, each covering 64 times the span of the level below (up to about 49 days).
+ * A level's slot moves down (cascades) when the wheel reaches it, so a tick costs the timers that
+ * expire plus at most one step per 256ms elapsed, whatever the number of parked coroutines.
+ */
+#define SCHED_ROOT_BITS     8
+#define SCHED_ROOT_SIZE     (1 << SCHED_ROOT_BITS)
+#define SCHED_LEVEL_BITS    6
+#define SCHED_LEVEL_SIZE    (1 << SCHED_LEVEL_BITS)
+#define SCHED_LEVELS        4
+#define SCHED_MAX_DELAY     ((int64_t(1) << (SCHED_ROOT_BITS + SCHED_LEVELS * SCHED_LEVEL_BITS)) - 1)
+#define SCHED_LEVEL_INDEX(time, level) (int)(((time) >> (SCHED_ROOT_BITS + (level) * SCHED_LEVEL_BITS)) & (SCHED_LEVEL_SIZE - 1))
+
+enum sched_wheel_pos
+{
+    sched_no_timer = -2,
+    sched_ready = -1,   // already due: runs in the next tick
+    sched_root = 0,     // 1..SCHED_LEVELS: in that level
+};
+
+struct sched_link_t
+{
+    sched_link_t* prev;
+    sched_link_t* next;
+};
+
+struct sched_waiter_t
+{
+    sched_link_t timer_link;    // (first member) in a slot of the wheel
+    sched_link_t event_link;    // in the waiters of an event
+    int64_t expire = 0;
+    lua_State* co = nullptr;
+    int ref = LUA_NOREF;        // keeps 'co' alive
+    unsigned int gen = 0;       // lua_threadgen(co) when parked
+    int wheel_pos = sched_no_timer;
+};
+
+struct sched_wakeup_t
+{
+    int ref;
+    bool timeout;   // luna.wait timed out (false for luna.sleep)
+    unsigned int gen;
+};
+
+struct luna_scheduler_t
+{
+    luna_runtime_t* runtime;
+    sched_link_t ready;
+    sched_link_t root[SCHED_ROOT_SIZE];
+    sched_link_t levels[SCHED_LEVELS][SCHED_LEVEL_SIZE];
+    int root_count = 0;
+    int timer_count = 0;
+    int64_t base = 0;       // host time of the first tick
+    int64_t current = 1;    // next jiffy to run, relative to 'base'
+    bool started = false;
+    std::unordered_map<std::string, sched_link_t> events;
+    std::unordered_map<lua_State*, sched_waiter_t*> parked;
+    std::vector<sched_waiter_t*> free_waiters;
+};
+
+static void sched_list_init(sched_link_t* head)
+{
+    head->prev = head->next = head;
+}
+
+static void sched_list_push(sched_link_t* head, sched_link_t* link)
+{
+    link->prev = head->prev;
+    link->next = head;
+    head->prev->next = link;
+    head->prev = link;
+}
+
+static void sched_list_remove(sched_link_t* link)
+{
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    sched_list_init(link);
+}
+
+static sched_waiter_t* sched_event_waiter(sched_link_t* link)
+{
+    return (sched_waiter_t*)((char*)link - offsetof(sched_waiter_t, event_link));
+}
+
+static luna_scheduler_t* sched_create(luna_runtime_t* runtime)
+{
+    auto sched = new luna_scheduler_t();
+    sched->runtime = runtime;
+    sched_list_init(&sched->ready);
+    for (auto& slot : sched->root)
+    {
+        sched_list_init(&slot);
+    }
+    for (auto& level : sched->levels)
+    {
+        for (auto& slot : level)
+        {
+            sched_list_init(&slot);
+        }
+    }
+    return sched;
+}
+
+static void sched_destroy(luna_scheduler_t* sched)
+{
+    for (auto& one : sched->parked)
+    {
+        delete one.second;
+    }
+    for (auto waiter : sched->free_waiters)
+    {
+        delete waiter;
+    }
+    delete sched;
+}
+
+static void sched_add_timer(luna_scheduler_t* sched, sched_waiter_t* waiter)
+{
+    sched_link_t* slot = nullptr;
+    int64_t expire = waiter->expire;
+    int64_t delay = expire - sched->current;
+
+    if (delay < 0)
+    {
+        slot = &sched->ready;
+        waiter->wheel_pos = sched_ready;
+    }
+    else if (delay < SCHED_ROOT_SIZE)
+    {
+        slot = &sched->root[expire & (SCHED_ROOT_SIZE - 1)];
+        waiter->wheel_pos = sched_root;
+        sched->root_count++;
+    }
+    else
+    {
+        if (delay > SCHED_MAX_DELAY)
+        {
+            expire = waiter->expire = sched->current + SCHED_MAX_DELAY;
+            delay = SCHED_MAX_DELAY;
+        }
+        int level = 0;
+        while (delay >= (int64_t(1) << (SCHED_ROOT_BITS + (level + 1) * SCHED_LEVEL_BITS)))
+        {
+            level++;
+        }
+        slot = &sched->levels[level][SCHED_LEVEL_INDEX(expire, level)];
+        waiter->wheel_pos = level + 1;
+    }
+    sched_list_push(slot, &waiter->timer_link);
+    sched->timer_count++;
+}
+
+static void sched_remove_timer(luna_scheduler_t* sched, sched_waiter_t* waiter)
+{
+    if (waiter->wheel_pos == sched_no_timer)
+        return;
+    if (waiter->wheel_pos == sched_root)
+    {
+        sched->root_count--;
+    }
+    sched_list_remove(&waiter->timer_link);
+    sched->timer_count--;
+    waiter->wheel_pos = sched_no_timer;
+}
+
+// move the timers of a level's slot to the levels below, returns the slot index
+static int sched_cascade(luna_scheduler_t* sched, int level)
+{
+    int index = SCHED_LEVEL_INDEX(sched->current, level);
+    sched_link_t list;
+    sched_link_t* slot = &sched->levels[level][index];
+    if (slot->next == slot)
+        return index;
+
+    // detach the slot first: timers may go back to the same level
+    list.next = slot->next;
+    list.prev = slot->prev;
+    list.next->prev = list.prev->next = &list;
+    sched_list_init(slot);
+    while (list.next != &list)
+    {
+        auto waiter = (sched_waiter_t*)list.next;
+        sched_list_remove(&waiter->timer_link);
+        sched->timer_count--;
+        sched_add_timer(sched, waiter);
+    }
+    return index;
+}
+
+static void sched_release(luna_scheduler_t* sched, sched_waiter_t* waiter)
+{
+    sched->parked.erase(waiter->co);
+    waiter->co = nullptr;
+    waiter->ref = LUA_NOREF;
+    sched->free_waiters.push_back(waiter);
+}
+
+// take a waiter out of the wheel and its event, and queue its coroutine to be resumed
+static void sched_wake(luna_scheduler_t* sched, sched_waiter_t* waiter, std::vector<sched_wakeup_t>* wakeups)
+{
+    bool waiting = waiter->event_link.next != &waiter->event_link;
+    sched_remove_timer(sched, waiter);
+    if (waiting)
+    {
+        sched_list_remove(&waiter->event_link);
+    }
+    wakeups->push_back({ waiter->ref, waiting, waiter->gen });
+    sched_release(sched, waiter);
+}
+
+static void sched_expire_list(luna_scheduler_t* sched, sched_link_t* head, std::vector<sched_wakeup_t>* wakeups)
+{
+    while (head->next != head)
+    {
+        sched_wake(sched, (sched_waiter_t*)head->next, wakeups);
+    }
+}
+
+// expire the timers due until 'target' (relative time)
+static void sched_advance(luna_scheduler_t* sched, int64_t target, std::vector<sched_wakeup_t>* wakeups)
+{
+    sched_expire_list(sched, &sched->ready, wakeups);
+    while (sched->current <= target)
+    {
+        if (sched->timer_count == 0)
+        {
+            sched->current = target + 1;
+            break;
+        }
+
+        int index = (int)(sched->current & (SCHED_ROOT_SIZE - 1));
+        if (index == 0)
+        {
+            for (int level = 0; level < SCHED_LEVELS && sched_cascade(sched, level) == 0; level++)
+            {
+            }
+        }
+        else if (sched->root_count == 0)
+        {
+            // nothing can expire before the next cascade
+            sched->current = std::min((sched->current | (SCHED_ROOT_SIZE - 1)) + 1, target + 1);
+            continue;
+        }
+
+        sched_expire_list(sched, &sched->root[index], wakeups);
+        sched->current++;
+    }
+}
+
+static void sched_add_waiter(lua_State* L, luna_scheduler_t* sched, lua_State* co, int64_t delay, const char* event, size_t event_len);
+
+// resume a coroutine with the 'arg_count' values on its stack, reporting its errors
+static bool sched_resume(lua_State* L, luna_scheduler_t* sched, lua_State* co, int arg_count)
+{
+    auto runtime = sched->runtime;
+    budget_saved_t saved;
+    bool budget = budget_enter(runtime, co, &saved, true);
+    if (budget)
+    {
+        runtime->resuming.push_back(co);
+    }
+    int status = lua_resume(co, L, arg_count);
+    if (budget)
+    {
+        runtime->resuming.pop_back();
+        budget_leave(runtime, co, &saved);
+    }
+    if (status == LUA_YIELD && runtime->preempted == co)
+    {
+        // over budget: let it go on in the next tick
+        runtime->preempted = nullptr;
+        sched_add_waiter(L, sched, co, 0, nullptr, 0);
+    }
+    if (status == LUA_OK || status == LUA_YIELD)
+    {
+        lua_settop(co, 0);  // drop results or yielded values
+        return true;
+    }
+    luaL_traceback(L, co, lua_tostring(co, -1), 0);
+    print_error(L, lua_tostring(L, -1));
+    lua_pop(L, 1);
+    return false;
+}
+
+// resume the woken coroutines that are still where they parked (not resumed by someone else or reset since then);
+// a signal passes them true and the 'arg_count' values at 'arg_idx'
+static int sched_run_wakeups(lua_State* L, luna_scheduler_t* sched, const std::vector<sched_wakeup_t>& wakeups, int arg_idx, int arg_count)
+{
+    int count = 0;
+    for (auto& wakeup : wakeups)
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, wakeup.ref);  // anchor it while it runs
+        luaL_unref(L, LUA_REGISTRYINDEX, wakeup.ref);
+        lua_State* co = lua_tothread(L, -1);
+        if (co != nullptr && lua_status(co) == LUA_YIELD && lua_threadgen(co) == wakeup.gen)
+        {
+            int nargs = 0;
+            if (wakeup.timeout)
+            {
+                lua_pushboolean(co, 0);
+                nargs = 1;
+            }
+            else if (arg_idx > 0)  // signalled
+            {
+                lua_checkstack(L, arg_count + 1);
+                lua_pushboolean(L, 1);
+                for (int i = 0; i < arg_count; i++)
+                {
+                    lua_pushvalue(L, arg_idx + i);
+                }
+                nargs = arg_count + 1;
+                lua_xmove(L, co, nargs);
+            }
+            sched_resume(L, sched, co, nargs);
+            count++;
+        }
+        lua_pop(L, 1);
+    }
+    return count;
+}
+
+static luna_scheduler_t* get_scheduler(lua_State* L)
+{
+    auto runtime = get_luna_runtime(L);
+    return runtime ? runtime->scheduler : nullptr;
+}
+
+// park 'co' (suspended or about to yield): until 'delay' ms from now (-1: no deadline) and/or an event
+static void sched_add_waiter(lua_State* L, luna_scheduler_t* sched, lua_State* co, int64_t delay, const char* event, size_t event_len)
+{
+    auto it = sched->parked.find(co);
+    if (it != sched->parked.end())
+    {
+        // it was resumed by someone else while parked: forget that wait
+        sched_waiter_t* old = it->second;
+        sched_remove_timer(sched, old);
+        if (old->event_link.next != &old->event_link)
+        {
+            sched_list_remove(&old->event_link);
+        }
+        luaL_unref(L, LUA_REGISTRYINDEX, old->ref);
+        sched_release(sched, old);
+    }
+
+    sched_waiter_t* waiter = nullptr;
+    if (sched->free_waiters.empty())
+    {
+        waiter = new sched_waiter_t();
+    }
+    else
+    {
+        waiter = sched->free_waiters.back();
+        sched->free_waiters.pop_back();
+    }
+    sched_list_init(&waiter->timer_link);
+    sched_list_init(&waiter->event_link);
+    waiter->co = co;
+    waiter->gen = lua_threadgen(co);
+    waiter->wheel_pos = sched_no_timer;
+    if (co != L)
+    {
+        lua_checkstack(co, 1);  // preempted in a Lua function, its stack may be full up to the frame top
+        lua_pushthread(co);
+        lua_xmove(co, L, 1);
+    }
+    else
+    {
+        lua_pushthread(co);
+    }
+    waiter->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    sched->parked[co] = waiter;
+
+    if (delay >= 0)
+    {
+        waiter->expire = (sched->current - 1) + std::min(delay, SCHED_MAX_DELAY);
+        sched_add_timer(sched, waiter);
+    }
+    if (event != nullptr)
+    {
+        auto& head = sched->events[std::string(event, event_len)];
+        if (head.next == nullptr)
+        {
+            sched_list_init(&head);
+        }
+        sched_list_push(&head, &waiter->event_link);
+    }
+}
+
+// park the running coroutine (see sched_add_waiter)
+static int sched_park(lua_State* L, int64_t delay, const char* event, size_t event_len)
+{
+    auto sched = (luna_scheduler_t*)lua_touserdata(L, lua_upvalueindex(1));
+    if (!lua_isyieldable(L))
+        return luaL_error(L, "attempt to wait outside a coroutine");
+
+    sched_add_waiter(L, sched, L, delay, event, event_len);
+    return lua_yield(L, 0);
+}
+
+/* luna.sleep(ms): suspend the running coroutine for 'ms' milliseconds */
+static int luna_sleep(lua_State* L)
+{
+    lua_Integer ms = luaL_checkinteger(L, 1);
+    return sched_park(L, ms < 0 ? 0 : ms, nullptr, 0);
+}
+
+/* luna.wait(event [, timeout_ms]): suspend the running coroutine until 'event' is signalled (returns true
+   and the signal values) or the timeout expires (returns false) */
+static int luna_wait(lua_State* L)
+{
+    size_t len = 0;
+    const char* event = luaL_checklstring(L, 1, &len);
+    lua_Integer ms = luaL_optinteger(L, 2, -1);
+    return sched_park(L, ms < 0 ? -1 : ms, event, len);
+}
+
+static int sched_signal(lua_State* L, luna_scheduler_t* sched, const char* event, size_t event_len, int arg_idx, int arg_count)
+{
+    auto it = sched->events.find(std::string(event, event_len));
+    if (it == sched->events.end())
+        return 0;
+
+    std::vector<sched_wakeup_t> wakeups;
+    sched_link_t* head = &it->second;
+    while (head->next != head)
+    {
+        sched_wake(sched, sched_event_waiter(head->next), &wakeups);
+        wakeups.back().timeout = false;  // signalled, not timed out
+    }
+    sched->events.erase(it);
+    return sched_run_wakeups(L, sched, wakeups, arg_idx, arg_count);
+}
+
+/* luna.signal(event, ...): wake the coroutines waiting for 'event', returns how many */
+static int luna_signal(lua_State* L)
+{
+    auto sched = (luna_scheduler_t*)lua_touserdata(L, lua_upvalueindex(1));
+    size_t len = 0;
+    const char* event = luaL_checklstring(L, 1, &len);
+    int arg_count = lua_gettop(L) - 1;
+    lua_pushinteger(L, sched_signal(L, sched, event, len, 2, arg_count));
+    return 1;
+}
+
+/* luna.spawn(func, ...): run 'func(...)' in a new coroutine (right away, until it first waits), returns the coroutine */
+static int luna_spawn(lua_State* L)
+{
+    auto sched = (luna_scheduler_t*)lua_touserdata(L, lua_upvalueindex(1));
+    int arg_count = lua_gettop(L) - 1;
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_State* co = lua_newthread(L);
+    lua_insert(L, 1);
+    lua_xmove(L, co, arg_count + 1);
+    sched_resume(L, sched, co, arg_count);
+    return 1;
+}
+
+/* luna.now(): the time of the last lua_scheduler_tick */
+static int luna_now(lua_State* L)
+{
+    auto sched = (luna_scheduler_t*)lua_touserdata(L, lua_upvalueindex(1));
+    lua_pushinteger(L, sched->started ? sched->base + sched->current - 1 : 0);
+    return 1;
+}
+
+static void lua_open_scheduler(lua_State* L, luna_scheduler_t* sched)
+{
+    static const luaL_Reg funcs[] =
+    {
+        { "spawn", luna_spawn },
+        { "sleep", luna_sleep },
+        { "wait", luna_wait },
+        { "signal", luna_signal },
+        { "now", luna_now },
+        { nullptr, nullptr }
+    };
+
+    lua_newtable(L);
+    lua_pushlightuserdata(L, sched);
+    luaL_setfuncs(L, funcs, 1);
+    lua_setglobal(L, "luna");
+}
+
+int lua_scheduler_tick(lua_State* L, int64_t now)
+{
+    auto sched = get_scheduler(L);
+    if (sched == nullptr)
+        return 0;
+
+    if (!sched->started)
+    {
+        sched->base = now;
+        sched->started = true;
+    }
+    std::vector<sched_wakeup_t> wakeups;
+    sched_advance(sched, now - sched->base, &wakeups);
+    return sched_run_wakeups(L, sched, wakeups, 0, 0);
+}
+
+int lua_scheduler_signal_top(lua_State* L, const char event[], int arg_count)
+{
+    auto sched = get_scheduler(L);
+    int count = 0;
+    if (sched != nullptr)
+    {
+        count = sched_signal(L, sched, event, strlen(event), lua_gettop(L) - arg_count + 1, arg_count);
+    }
+    lua_pop(L, arg_count);
+    return count;
+}
+
+int lua_scheduler_count(lua_State* L)
+{
+    auto sched = get_scheduler(L);
+    return sched ? (int)sched->parked.size() : 0;
+}
+
+/*
+ * Asynchronous calls: Lua functions that may wait (luna.sleep, luna.wait, lua_suspend_coroutine) called
+ * from C++ with a completion callback, and coroutines suspended by C++ until some work is done.
+ */
+struct lua_async_call_t
+{
+    std::function<void(lua_State* co, bool ok)> on_done;
+    int ret_count = 0;
+};
+
+static int async_call_gc(lua_State* L)
+{
+    auto call = (lua_async_call_t*)lua_touserdata(L, 1);
+    call->~lua_async_call_t();
+    return 0;
+}
+
+// stack: call, traceback, results (or error message)
+static int async_call_finish(lua_State* L, int status, lua_KContext)
+{
+    auto call = (lua_async_call_t*)lua_touserdata(L, 1);
+    bool ok = (status == LUA_OK || status == LUA_YIELD);
+    if (!ok)
+    {
+        print_error(L, lua_tostring(L, -1));
+    }
+    auto on_done = std::move(call->on_done);
+    call->on_done = nullptr;
+    if (on_done)
+    {
+        on_done(L, ok);
+    }
+    return 0;
+}
+
+// stack: call, function, args
+static int async_call_body(lua_State* L)
+{
+    auto call = (lua_async_call_t*)lua_touserdata(L, 1);
+    int arg_count = lua_gettop(L) - 2;
+    lua_getglobal(L, "debug");
+    lua_getfield(L, -1, "traceback");
+    lua_remove(L, -2); // remove 'debug'
+    lua_insert(L, 2);
+    return async_call_finish(L, lua_pcallk(L, arg_count, call->ret_count, 2, 0, async_call_finish), 0);
+}
+
+bool lua_call_function_async(lua_State* L, int arg_count, int ret_count, std::function<void(lua_State* co, bool ok)> on_done)
+{
+    int func_idx = lua_gettop(L) - arg_count;
+    if (func_idx <= 0 || !lua_isfunction(L, func_idx))
+    {
+        print_error(L, "call invalid function !");
+        lua_settop(L, func_idx > 0 ? func_idx - 1 : 0);
+        return false;
+    }
+
+    lua_State* co = lua_newthread(L);
+    lua_insert(L, func_idx);
+    lua_pushcfunction(co, async_call_body);
+    auto call = new (lua_newuserdata(co, sizeof(lua_async_call_t))) lua_async_call_t();
+    call->on_done = on_done;
+    call->ret_count = ret_count;
+    luaL_setmetatable(co, LUNA_ASYNC_CALL_METATABLE);
+    lua_xmove(L, co, arg_count + 1);
+
+    if (!sched_resume(L, get_scheduler(L), co, arg_count + 2) && call->on_done)
+    {
+        // it failed before calling the function
+        auto on_done = std::move(call->on_done);
+        call->on_done = nullptr;
+        on_done(co, false);
+    }
+    lua_pop(L, 1);
+    return true;
+}
+
+int lua_suspend_coroutine(lua_State* L)
+{
+    if (!lua_isyieldable(L))
+        return LUA_NOREF;
+    lua_pushthread(L);
+    int token = luaL_ref(L, LUA_REGISTRYINDEX);
+    auto runtime = get_luna_runtime(L);
+    if (runtime != nullptr)
+    {
+        runtime->suspended[token] = lua_threadgen(L);
+    }
+    return token;
+}
+
+bool lua_resume_coroutine(lua_State* L, int token, int arg_count)
+{
+    auto runtime = get_luna_runtime(L);
+    unsigned int gen = 0;
+    if (runtime != nullptr)
+    {
+        auto it = runtime->suspended.find(token);
+        if (it == runtime->suspended.end())
+        {
+            // already used: its registry slot may belong to someone else by now
+            lua_pop(L, arg_count);
+            return false;
+        }
+        gen = it->second;
+        runtime->suspended.erase(it);
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, token);
+    luaL_unref(L, LUA_REGISTRYINDEX, token);
+    lua_State* co = lua_tothread(L, -1);
+    // it must still be suspended where it was parked (not resumed by someone else or reset since then)
+    if (co == nullptr || lua_status(co) != LUA_YIELD || (runtime != nullptr && lua_threadgen(co) != gen))
+    {
+        lua_pop(L, arg_count + 1);
+        return false;
+    }
+    lua_insert(L, -arg_count - 1);  // anchor it while it runs
+    lua_xmove(L, co, arg_count);
+    bool ok = sched_resume(L, get_scheduler(L), co, arg_count);
+    lua_pop(L, 1);
+    return ok;
+}
@@ -55,6 +55,81 @@ lua_State* lua_open(std::function<void(const char*)>* error_func = nullptr);
 bool lua_load_script(lua_State* L, const char file_name[]);
 void lua_reload_scripts(lua_State* L);
 
+/* Get the unread bytes of a 'buffer' library object (valid until the buffer is modified) */
+bool lua_get_buffer(lua_State* L, int idx, const char** data, size_t* len);
+
+/* Get the elements of a 'numarray' library object of that element type (valid while it is alive, not copied);
+   exported functions may also take them as std::span<double>, std::span<float>, ... when built as C++20 */
+bool lua_get_numarray(lua_State* L, int idx, double** data, size_t* len);
+bool lua_get_numarray(lua_State* L, int idx, float** data, size_t* len);
+bool lua_get_numarray(lua_State* L, int idx, int32_t** data, size_t* len);
+bool lua_get_numarray(lua_State* L, int idx, int64_t** data, size_t* len);
+
+/* Switch the collector to generational (true) or incremental mode, returns whether it was generational */
+bool lua_set_gc_generational(lua_State* L, bool generational);
+
+/* Turn off (or back on) the collector steps triggered by allocation, so that it runs only in lua_gc_step_for and full collections */
+void lua_set_gc_auto(lua_State* L, bool enable);
+
+/* Do garbage collection work for about 'microseconds' (a whole collection in generational mode), returns whether a cycle finished */
+bool lua_gc_step_for(lua_State* L, int microseconds, lua_GCReport* report = nullptr);
+
+/* Get the statistics of the n-th last finished collection cycle (0 is the last one) */
+bool lua_get_gc_stats(lua_State* L, lua_GCStats* stats, int n = 0);
+
+/* Call 'func' at the end of each collection cycle (from inside the collector, so it must not use L); an empty func removes it */
+void lua_set_gc_stats_callback(lua_State* L, std::function<void(const lua_GCStats&)> func);
+
+/* Keep up to 'count' dead coroutines (with their stacks) for reuse by lua_newthread, returns the previous count */
+int lua_set_thread_pool(lua_State* L, int count);
+
+/* Reset a finished or suspended coroutine so that it can run a new function (a wait of luna.sleep/luna.wait it was parked in
+   is dropped), returns false if it had died with an error */
+bool lua_reset_thread(lua_State* co);
+
+/* Start the sampling memory profiler (a sample about every 'rate' bytes allocated), 0 stops it, returns the previous rate */
+int lua_set_memory_profile(lua_State* L, int rate);
+
+/* Write the memory profile as folded stacks ('frame;...;(type) bytes' lines), bytes still in use or all bytes allocated */
+bool lua_dump_memory_profile(lua_State* L, const char file_name[], bool live = true);
+
+/* Write a snapshot of the object graph, to be analyzed by tools/heapsnap */
+bool lua_heap_snapshot(lua_State* L, const char file_name[]);
+
+/* Limit each call (lua_call_function, and each run of a coroutine resumed by the scheduler) to about 'instructions' VM instructions
+   and 'milliseconds' of time, 0 for no limit; over budget, a coroutine of the scheduler yields until the next tick, other calls fail
+   with a timeout error (replaces debug hooks while they run) */
+void lua_set_call_budget(lua_State* L, int64_t instructions, int milliseconds);
+
+/* Resume the coroutines parked by luna.sleep/luna.wait whose time has come ('now' in milliseconds, any origin), returns how many */
+int lua_scheduler_tick(lua_State* L, int64_t now);
+
+/* Wake the coroutines in luna.wait(event), which return true and the 'arg_count' values on top of the stack (popped), returns how many */
+int lua_scheduler_signal_top(lua_State* L, const char event[], int arg_count);
+
+/* Wake the coroutines in luna.wait(event), which return true and 'args', returns how many */
+template <typename... arg_types>
+int lua_scheduler_signal(lua_State* L, const char event[], arg_types... args)
+{
+    int _[] = { 0, lua_push_value(L, args)... };
+    return lua_scheduler_signal_top(L, event, (int)sizeof...(arg_types));
+}
+
+/* Number of coroutines parked in luna.sleep/luna.wait */
+int lua_scheduler_count(lua_State* L);
+
+/* Call the function below the 'arg_count' values on top of the stack (all popped) in a new coroutine, so that it may wait
+   (luna.sleep, luna.wait, lua_suspend_coroutine); 'on_done' runs when it returns, with its 'ret_count' results on top of co */
+bool lua_call_function_async(lua_State* L, int arg_count, int ret_count, std::function<void(lua_State* co, bool ok)> on_done);
+
+/* For a C function that starts asynchronous work: 'token = lua_suspend_coroutine(L); ... return lua_yield(L, 0);'
+   parks the calling coroutine (LUA_NOREF if it cannot yield) until lua_resume_coroutine */
+int lua_suspend_coroutine(lua_State* L);
+
+/* Resume a coroutine parked by lua_suspend_coroutine: the 'arg_count' values on top of the stack (popped) are the results of the C function;
+   returns false (and resumes nothing) if the coroutine was resumed by someone else or reset meanwhile, or the token was already used */
+bool lua_resume_coroutine(lua_State* L, int token, int arg_count);
+
 /* Call lua script function */
 #define ret_group   std::tie
 #define arg_group   std::forward_as_tuple
@@ -0,0 +1,222 @@
+﻿
+/*
+ * C++20 coroutines and Lua coroutines (include it in code built with -std=c++20).
+ *
+ * Exported C++ functions may be coroutines returning lua_async<T>: the calling Lua coroutine waits
+ * until they co_return, without blocking the other coroutines:
+ *
+ * lua_async<int> read_size(const char* path)
+ * {
+ *      auto data = co_await disk_read(path);   // any C++ awaitable
+ *      co_return (int)data.size();
+ * }
+ *
+ * lua_export(L, read_size);                   -- lua: local size = read_size("a.txt")
+ *
+ * And C++ coroutines may await Lua functions that wait (luna.sleep, luna.wait, other lua_async functions):
+ *
+ * lua_async<void> login(lua_State* L, int64_t id)
+ * {
+ *      const char* name = nullptr;
+ *      if (co_await lua_await_global_function(L, "load_user", ret_group(name), arg_group(id)))
+ *          printf("%s\n", name);
+ * }
+ *
+ * A lua_async may also be dropped right away: it then frees itself when it finishes.
+ */
+
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include "luna.h"
+
+template <typename T> class lua_async;
+
+struct lua_async_promise_base
+{
+    lua_State* L = nullptr;     // main thread, to resume 'token' from
+    int token = LUA_NOREF;      // the Lua coroutine waiting for the result (lua_suspend_coroutine)
+    bool detached = false;      // no lua_async owns the coroutine any more
+
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    void unhandled_exception() { std::terminate(); }
+};
+
+template <typename promise_type>
+struct lua_async_final_awaiter
+{
+    bool await_ready() noexcept { return false; }
+    void await_resume() noexcept {}
+    void await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+    {
+        auto& promise = handle.promise();
+        if (promise.token != LUA_NOREF)
+        {
+            lua_resume_coroutine(promise.L, promise.token, promise.push_result(promise.L));
+        }
+        if (promise.detached)
+        {
+            handle.destroy();
+        }
+    }
+};
+
+template <typename T>
+struct lua_async_promise : lua_async_promise_base
+{
+    T value = T();
+
+    lua_async<T> get_return_object();
+    lua_async_final_awaiter<lua_async_promise> final_suspend() noexcept { return {}; }
+    void return_value(T v) { value = v; }
+    int push_result(lua_State* L) { lua_push_value(L, value); return 1; }
+};
+
+template <>
+struct lua_async_promise<void> : lua_async_promise_base
+{
+    lua_async<void> get_return_object();
+    lua_async_final_awaiter<lua_async_promise> final_suspend() noexcept { return {}; }
+    void return_void() {}
+    int push_result(lua_State* L) { return 0; }
+};
+
+template <typename T>
+class lua_async
+{
+public:
+    using promise_type = lua_async_promise<T>;
+
+    explicit lua_async(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+    lua_async(lua_async&& other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+    lua_async(const lua_async&) = delete;
+    lua_async& operator=(const lua_async&) = delete;
+
+    ~lua_async()
+    {
+        if (!m_handle)
+            return;
+        if (m_handle.done())
+        {
+            m_handle.destroy();
+        }
+        else
+        {
+            m_handle.promise().detached = true;
+        }
+    }
+
+    bool done() const { return !m_handle || m_handle.done(); }
+
+    /* Push the result for the calling Lua coroutine, or park it until there is one (the C function must return this) */
+    int return_to_lua(lua_State* L)
+    {
+        auto& promise = m_handle.promise();
+        if (m_handle.done())
+            return promise.push_result(L);
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+        promise.L = lua_tothread(L, -1);
+        lua_pop(L, 1);
+        promise.token = lua_suspend_coroutine(L);
+        promise.detached = true;
+        m_handle = nullptr;  // lua_yield does not return: nothing must be left to destroy
+        return lua_yield(L, 0);
+    }
+
+private:
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+template <typename T>
+lua_async<T> lua_async_promise<T>::get_return_object()
+{
+    return lua_async<T>(std::coroutine_handle<lua_async_promise>::from_promise(*this));
+}
+
+inline lua_async<void> lua_async_promise<void>::get_return_object()
+{
+    return lua_async<void>(std::coroutine_handle<lua_async_promise>::from_promise(*this));
+}
+
+/* Exported functions returning lua_async<T> (see lua_export) */
+template <typename T, typename... arg_types>
+lua_cfunction_wrapper create_cfunction_wrapper(lua_async<T>(*func)(arg_types...))
+{
+    return [=](lua_State* L)
+    {
+        if (!lua_isyieldable(L))
+            return luaL_error(L, "attempt to wait outside a coroutine");
+        return call_cfunction_wrapper(L, func, std::make_index_sequence<sizeof...(arg_types)>()).return_to_lua(L);
+    };
+}
+
+/* co_await of a Lua function call: true if it returned (results in 'rets'), false on errors */
+template <typename... ret_types>
+struct lua_function_awaiter
+{
+    lua_State* L;
+    int arg_count;      // -1: no function to call
+    std::tuple<ret_types&...> rets;
+    std::coroutine_handle<> handle = nullptr;
+    bool suspending = false;
+    bool done = false;
+    bool ok = false;
+
+    bool await_ready() const noexcept { return arg_count < 0; }
+    bool await_resume() const noexcept { return ok; }
+
+    bool await_suspend(std::coroutine_handle<> caller)
+    {
+        handle = caller;
+        suspending = true;
+        bool started = lua_call_function_async(L, arg_count, (int)sizeof...(ret_types), [this](lua_State* co, bool success)
+        {
+            ok = success;
+            if (success)
+            {
+                lua_to_value_multi(co, rets, std::make_index_sequence<sizeof...(ret_types)>());
+            }
+            done = true;
+            if (!suspending)
+            {
+                handle.resume();
+            }
+        });
+        suspending = false;
+        return started && !done;
+    }
+};
+
+/* Await the function below the arguments on top of the stack */
+template <typename... ret_types, typename... arg_types>
+lua_function_awaiter<ret_types...> lua_await_function(lua_State* L, std::tuple<ret_types&...>&& rets, std::tuple<arg_types&...>&& args)
+{
+    constexpr int arg_count = sizeof...(arg_types);
+    lua_push_value_multi(L, args, std::make_index_sequence<arg_count>());
+    return { L, arg_count, rets };
+}
+
+template <typename... ret_types, typename... arg_types>
+lua_function_awaiter<ret_types...> lua_await_global_function(lua_State* L, const char function[],
+                                                             std::tuple<ret_types&...>&& rets, std::tuple<arg_types&...>&& args)
+{
+    lua_getglobal(L, function);
+    if (!lua_isfunction(L, -1))
+    {
+        lua_pop(L, 1);
+        return { L, -1, rets };
+    }
+    return lua_await_function(L, std::move(rets), std::move(args));
+}
+
+template <typename... ret_types, typename... arg_types>
+lua_function_awaiter<ret_types...> lua_await_file_function(lua_State* L, const char file_name[], const char function[],
+                                                           std::tuple<ret_types&...>&& rets, std::tuple<arg_types&...>&& args)
+{
+    if (!lua_get_file_function(L, file_name, function))
+        return { L, -1, rets };
+    return lua_await_function(L, std::move(rets), std::move(args));
+}
@@ -19,6 +19,32 @@ template <> inline float        lua_to_value<float>(lua_State* L, int i)     { r
 template <> inline double       lua_to_value<double>(lua_State* L, int i)    { return (double)lua_tonumber(L, i); }
 template <> inline char*        lua_to_value<char*>(lua_State* L, int i)     { return (char*)lua_tostring(L, i); }
 template <> inline const char*  lua_to_value<const char*>(lua_State* L, int i) { return lua_tostring(L, i); }
+
+#if __cplusplus >= 202002L
+#include <span>
+// 'numarray' arguments, without copying (empty if not an array of that element type)
+template <typename T> struct lua_numarray_type;
+template <> struct lua_numarray_type<double>    { static constexpr int value = LUA_NAFLOAT64; };
+template <> struct lua_numarray_type<float>     { static constexpr int value = LUA_NAFLOAT32; };
+template <> struct lua_numarray_type<int32_t>   { static constexpr int value = LUA_NAINT32; };
+template <> struct lua_numarray_type<int64_t>   { static constexpr int value = LUA_NAINT64; };
+template <typename T> std::span<T> lua_to_numarray(lua_State* L, int i)
+{
+    auto array = (luaL_NumArray*)luaL_testudata(L, i, LUA_NUMARRAYHANDLE);
+    if (array == nullptr || array->type != lua_numarray_type<std::remove_const_t<T>>::value)
+        return {};
+    return { (T*)array->p, array->n };
+}
+template <> inline std::span<double>        lua_to_value<std::span<double>>(lua_State* L, int i)        { return lua_to_numarray<double>(L, i); }
+template <> inline std::span<const double>  lua_to_value<std::span<const double>>(lua_State* L, int i)  { return lua_to_numarray<const double>(L, i); }
+template <> inline std::span<float>         lua_to_value<std::span<float>>(lua_State* L, int i)         { return lua_to_numarray<float>(L, i); }
+template <> inline std::span<const float>   lua_to_value<std::span<const float>>(lua_State* L, int i)   { return lua_to_numarray<const float>(L, i); }
+template <> inline std::span<int32_t>       lua_to_value<std::span<int32_t>>(lua_State* L, int i)       { return lua_to_numarray<int32_t>(L, i); }
+template <> inline std::span<const int32_t> lua_to_value<std::span<const int32_t>>(lua_State* L, int i) { return lua_to_numarray<const int32_t>(L, i); }
+template <> inline std::span<int64_t>       lua_to_value<std::span<int64_t>>(lua_State* L, int i)       { return lua_to_numarray<int64_t>(L, i); }
+template <> inline std::span<const int64_t> lua_to_value<std::span<const int64_t>>(lua_State* L, int i) { return lua_to_numarray<const int64_t>(L, i); }
+#endif
+
 template<size_t... Integers, typename... var_types>
 void lua_to_value_multi(lua_State* L, std::tuple<var_types&...>& vars, std::index_sequence<Integers...>&&)
 {
@@ -0,0 +1,217 @@
+-- Benchmarks behind the numbers quoted in commit messages.
+-- Run them from this directory with "./test bench [name]" (build the
+-- library and the test with "make release" first): times are the best
+-- of a few runs, in milliseconds of CPU time.
+
+local benches = {};
+local names = {};
+
+local function bench(name, func)
+    benches[name] = func;
+    names[#names + 1] = name;
+end
+
+local function best_of(runs, func, ...)
+    local best = math.huge;
+    for i = 1, runs do
+        collectgarbage();
+        local start = os.clock();
+        func(...);
+        best = math.min(best, os.clock() - start);
+    end
+    return best * 1000;
+end
+
+local function report(name, ms, extra)
+    print(string.format("%-36s %9.1f ms%s", name, ms, extra or ""));
+end
+
+-- longest atomic pause (microseconds) of the cycles still kept
+local function max_atomic()
+    local max, n = 0, 0;
+    while true do
+        local s = collectgarbage("stats", n);
+        if not s then
+            return max;
+        end
+        max = math.max(max, s.atomic);
+        n = n + 1;
+    end
+end
+
+-- a long-lived world with short-lived garbage for each request, in both
+-- collector modes (the per-cycle statistics must not slow it down)
+bench("gc", function()
+    for _, mode in ipairs({"incremental", "generational"}) do
+        collectgarbage(mode);
+        local world = {};
+        for i = 1, 200000 do
+            world[i] = {id = i, name = "e" .. i};
+        end
+        local ms = best_of(3, function()
+            for r = 1, 20000 do
+                local records = {};
+                for j = 1, 50 do
+                    records[j] = {r, j};
+                end
+            end
+        end);
+        report("gc " .. mode, ms, string.format("  max atomic %d us", max_atomic()));
+    end
+    collectgarbage("incremental");
+end);
+
+-- small tables and strings with the memory profiler off and at two
+-- sampling rates (each allocation pays a NULL test when it is off)
+bench("memprof", function()
+    local function churn()
+        for i = 1, 200000 do
+            local t = {i, tostring(i)};
+        end
+    end
+    for _, rate in ipairs({0, 512 * 1024, 64 * 1024}) do
+        debug.memprofile(rate);
+        report("memprof rate " .. rate, best_of(10, churn));
+    end
+    debug.memprofile(0);
+end);
+
+-- a tight loop called 20 times through call_with_budget (test.cpp), with no
+-- budget and with one it never reaches: the count hook then fires every
+-- 1000 instructions
+bench("budget", function()
+    local function loop()
+        local x = 0;
+        for i = 1, 1000000 do
+            x = x + i;
+        end
+    end
+    for _, instructions in ipairs({0, 1000000000000}) do
+        local ms = best_of(15, function()
+            for i = 1, 20 do
+                call_with_budget(instructions, loop);
+            end
+        end);
+        report(instructions == 0 and "budget none" or "budget unreached", ms);
+    end
+end);
+
+-- bulk operations on 1e6 float64 elements, 20 passes, in a table and in a
+-- numarray (and the sum of a float32 one)
+bench("numarray", function()
+    local n = 1000000;
+    local ta, tb, tc = {}, {}, {};
+    for i = 1, n do
+        ta[i], tb[i], tc[i] = i, 0.5, 2;
+    end
+    local a = numarray.new("float64", ta);
+    local b = numarray.new("float64", tb);
+    local c = numarray.new("float64", tc);
+    local f = numarray.new("float32", ta);
+    local function passes(func)
+        return best_of(5, function()
+            for pass = 1, 20 do
+                func();
+            end
+        end);
+    end
+    local ops = {
+        {"add", function() for i = 1, n do ta[i] = ta[i] + tb[i]; end end, function() a:add(b); end},
+        {"fma", function() for i = 1, n do ta[i] = ta[i] + tb[i] * tc[i]; end end, function() a:fma(b, c); end},
+        {"dot", function() local s = 0; for i = 1, n do s = s + ta[i] * tb[i]; end end, function() a:dot(b); end},
+        {"sum", function() local s = 0; for i = 1, n do s = s + ta[i]; end end, function() a:sum(); end},
+    };
+    for _, op in ipairs(ops) do
+        report("numarray " .. op[1] .. " table", passes(op[2]));
+        report("numarray " .. op[1] .. " numarray", passes(op[3]));
+    end
+    report("numarray sum float32", passes(function() f:sum(); end));
+end);
+
+-- 10 full traversals of 1e6 string keys with pairs and with next(t, k),
+-- and of a 1e6-element array with pairs
+bench("pairs", function()
+    local t, a = {}, {};
+    for i = 1, 1000000 do
+        t["k" .. i] = i;
+        a[i] = i;
+    end
+    local function traverse(tab)
+        for pass = 1, 10 do
+            for k, v in pairs(tab) do
+            end
+        end
+    end
+    report("pairs string keys", best_of(3, traverse, t));
+    report("next(t, k) string keys", best_of(3, function()
+        local next = next;
+        for pass = 1, 10 do
+            local k = next(t);
+            while k ~= nil do
+                k = next(t, k);
+            end
+        end
+    end));
+    report("pairs array", best_of(3, traverse, a));
+end);
+
+-- the length operator on sequences that grow and shrink by one element
+bench("length", function()
+    local n = 1000000;
+    report("length t[#t + 1] = v, 3 tables", best_of(2, function()
+        for k = 1, 3 do
+            local t = {};
+            for i = 1, n do
+                t[#t + 1] = i;
+            end
+        end
+    end));
+    report("length table.insert, 3 tables", best_of(2, function()
+        local insert = table.insert;
+        for k = 1, 3 do
+            local t = {};
+            for i = 1, n do
+                insert(t, i);
+            end
+        end
+    end));
+    local h = {};
+    for i = n, 1, -1 do
+        h[i] = i;
+    end
+    report("length #t 1e6 times, hash-built", best_of(2, function()
+        local len = 0;
+        for i = 1, n do
+            len = len + #h;
+        end
+    end));
+    local s = {};
+    for i = 1, n do
+        s[i] = i;
+    end
+    for i = n, n / 2 + 1, -1 do
+        s[i] = nil;
+    end
+    report("length #t 3e6 times, spare array", best_of(2, function()
+        local len = 0;
+        for i = 1, 3 * n do
+            len = len + #s;
+        end
+    end));
+    report("length push, push, pop x 3e6", best_of(2, function()
+        local t = {};
+        for i = 1, 3 * n do
+            t[#t + 1] = i;
+            t[#t + 1] = i;
+            t[#t] = nil;
+        end
+    end));
+end);
+
+function run_benchmarks(filter)
+    for _, name in ipairs(names) do
+        if filter == "" or name:find(filter, 1, true) then
+            benches[name]();
+        end
+    end
+end
@@ -11,10 +11,68 @@ int sum(int a, int b)
     return a + b;
 }
 
+static int suspended_token = LUA_NOREF;
+
+static int suspend(lua_State* L)
+{
+    suspended_token = lua_suspend_coroutine(L);
+    return lua_yield(L, 0);
+}
+
+// call_with_budget(instructions, f): f() through lua_call_function under that budget, true if it finished
+static int call_with_budget(lua_State* L)
+{
+    lua_Integer instructions = luaL_checkinteger(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_settop(L, 2);
+    lua_set_call_budget(L, instructions, 0);
+    bool ok = lua_call_function(L, 0, 0);
+    lua_set_call_budget(L, 0, 0);
+    lua_pushboolean(L, ok);
+    return 1;
+}
+
+static std::string read_file(const char name[])
+{
+    std::string text;
+    FILE* file = fopen(name, "rb");
+    if (file != nullptr)
+    {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), file)) > 0)
+        {
+            text.append(buf, n);
+        }
+        fclose(file);
+    }
+    return text;
+}
+
+static int failures = 0;
+
+static void check(bool ok, const char name[])
+{
+    printf("%s: %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok)
+        failures++;
+}
+
 int main(int argc, char* argv[])
 {
 	lua_State* L = lua_open();
 	lua_export(L, sum);
+    lua_register(L, "suspend", suspend);
+    lua_register(L, "call_with_budget", call_with_budget);
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    {
+        // benchmarks behind the numbers in commit messages: ./test bench [name]
+        const char* filter = argc > 2 ? argv[2] : "";
+        lua_call_file_function(L, "bench.lua", "run_benchmarks", ret_group(), arg_group(filter));
+        lua_close(L);
+        return 0;
+    }
 
     int a, b, sum;
     lua_call_file_function(L, "test.lua", "test_sum", ret_group(a, b, sum), arg_group(2, 4));
@@ -26,6 +84,168 @@ int main(int argc, char* argv[])
     lua_call_file_function(L, "test.lua", "test_sum", ret_group(a, b, sum), arg_group(2, 4));
     lua_load_script(L, "test.lua");
 
+    int64_t string_bytes = 0;
+    lua_call_file_function(L, "test.lua", "test_memprof", ret_group(string_bytes), arg_group());
+    printf("live string bytes in memory profile: %lld\n", (long long)string_bytes);
+    check(string_bytes >= 20 * 100000, "memory profile counts adopted strings");
+
+    // allocations are charged to the line that made them, also in the profile written by C++
+    int64_t line_bytes = 0;
+    lua_call_file_function(L, "test.lua", "test_memprof_lines", ret_group(line_bytes), arg_group());
+    bool dumped = lua_dump_memory_profile(L, "memprof.folded");
+    std::string folded = read_file("memprof.folded");
+    remove("memprof.folded");
+    lua_set_memory_profile(L, 0);
+    check(line_bytes >= 1000 * 32 && dumped && folded.find(";(table) ") != std::string::npos, "memory profile by source line");
+
+    // heap snapshots from Lua and from C++ hold the reachable objects; back to back, they are the same
+    int lua_snapshot = 0;
+    lua_call_file_function(L, "test.lua", "test_heap_snapshot", ret_group(lua_snapshot), arg_group());
+    std::string snapshot = read_file("heap.snap");
+    bool snapshot_ok = lua_heap_snapshot(L, "heap.snap");
+    std::string snapshot1 = read_file("heap.snap");
+    snapshot_ok = snapshot_ok && lua_heap_snapshot(L, "heap.snap");
+    std::string snapshot2 = read_file("heap.snap");
+    remove("heap.snap");
+    check(lua_snapshot && snapshot_ok && snapshot.compare(0, 8, "\033LuaHeap") == 0 &&
+          snapshot.find("heap snapshot marker") != std::string::npos &&
+          snapshot1.find("heap snapshot marker") != std::string::npos && snapshot1.size() == snapshot2.size(), "heap snapshots");
+
+    // a coroutine reset while parked in luna.sleep must not be woken by that sleep
+    int woken = -1;
+    lua_call_file_function(L, "test.lua", "test_sched_recycle", ret_group(woken), arg_group());
+    lua_scheduler_tick(L, 1000);
+    lua_scheduler_tick(L, 1100);
+    lua_call_file_function(L, "test.lua", "test_sched_recycle_result", ret_group(woken), arg_group());
+    check(woken == 0 && lua_scheduler_count(L) == 0, "scheduler drops the waits of reset coroutines");
+
+    // nor by a signal, once resumed by someone else
+    int signalled = -1;
+    lua_call_file_function(L, "test.lua", "test_sched_stale_wait", ret_group(signalled, woken), arg_group());
+    check(signalled == 0 && woken == 0, "scheduler resumes only coroutines still parked");
+
+    // scheduler: sleeps (one through the levels of the wheel), a timeout and a signal from C++
+    int parked = 0;
+    int sched_ok = 0;
+    lua_scheduler_tick(L, 10000);
+    lua_call_file_function(L, "test.lua", "test_sched_start", ret_group(parked), arg_group());
+    int parked_count = lua_scheduler_count(L);
+    lua_scheduler_tick(L, 10005);
+    int go_count = lua_scheduler_signal(L, "go", 1, 2);
+    lua_scheduler_tick(L, 10020);
+    lua_scheduler_tick(L, 10999);
+    lua_scheduler_tick(L, 11000);
+    const char* sched_expected = "sleep5@10005 go:true,1,2 timeout:false sleep1000@11000";
+    lua_call_file_function(L, "test.lua", "test_sched_result", ret_group(sched_ok), arg_group(sched_expected));
+    check(parked == 4 && parked_count == 4 && go_count == 1 && sched_ok && lua_scheduler_count(L) == 0, "scheduler timers and signals");
+
+    // a token of lua_suspend_coroutine resumes its coroutine only where it was suspended, and only once
+    lua_call_file_function(L, "test.lua", "test_suspend_stale", ret_group(woken), arg_group());
+    bool resumed = lua_resume_coroutine(L, suspended_token, 0);
+    bool resumed_again = lua_resume_coroutine(L, suspended_token, 0);
+    lua_call_file_function(L, "test.lua", "test_suspend_stale_result", ret_group(woken), arg_group());
+    check(!resumed && !resumed_again && woken == 0, "lua_resume_coroutine checks the coroutine is still suspended");
+
+    // an async call runs until it suspends, and completes with its results (or its error) once resumed
+    int async_ok[2] = { -1, -1 };
+    int64_t async_result = 0;
+    bool async_pending = true;
+    for (int i = 0; i < 2; i++)
+    {
+        lua_settop(L, 0);
+        lua_get_file_function(L, "test.lua", "test_async");
+        lua_pushinteger(L, 20);
+        lua_call_function_async(L, 1, 1, [&, i](lua_State* co, bool ok) {
+            async_ok[i] = ok ? 1 : 0;
+            if (ok)
+                async_result = lua_tointeger(co, -1);
+        });
+        async_pending = async_pending && async_ok[i] == -1 && lua_gettop(L) == 0;
+        lua_pushinteger(L, i == 0 ? 22 : -1);
+        lua_resume_coroutine(L, suspended_token, 1);
+    }
+    check(async_pending && async_ok[0] == 1 && async_result == 42 && async_ok[1] == 0, "async call completes when resumed");
+
+    // over budget, a call fails instead of hanging, and a coroutine of the scheduler goes on in the next ticks
+    lua_set_call_budget(L, 100000, 0);
+    bool budget_loop = lua_call_file_function(L, "test.lua", "test_budget_loop");
+    int sliced = -1;
+    int slices = 0;
+    int sliced_loop = 1000000;
+    lua_call_file_function(L, "test.lua", "test_budget_slices", ret_group(sliced), arg_group(sliced_loop));
+    while (sliced == 0 && slices < 1000)
+    {
+        lua_scheduler_tick(L, 20000 + slices++);
+        lua_call_file_function(L, "test.lua", "test_budget_slices_done", ret_group(sliced), arg_group());
+    }
+    lua_set_call_budget(L, 0, 20);
+    bool timed_loop = lua_call_file_function(L, "test.lua", "test_budget_loop");
+    lua_set_call_budget(L, 0, 0);
+    int budget_nested = 0;
+    lua_call_file_function(L, "test.lua", "test_budget_nested", ret_group(budget_nested), arg_group());
+    check(!budget_loop && !timed_loop && sliced == 1 && slices > 1 && budget_nested, "call budgets");
+
+    // numarray: bulk operations and their checks, and the elements seen from C++ without a copy
+    int numarray_ok = 0;
+    double* numarray_data = nullptr;
+    float* numarray_wrong = nullptr;
+    size_t numarray_len = 0;
+    lua_call_file_function(L, "test.lua", "test_numarray", ret_group(numarray_ok), arg_group());
+    lua_settop(L, 0);
+    bool numarray_got = lua_get_file_function(L, "test.lua", "test_numarray_values") && lua_call_function(L, 0, 1) &&
+                        lua_get_numarray(L, -1, &numarray_data, &numarray_len) && numarray_len == 3 && numarray_data[2] == 3.5;
+    bool numarray_typed = !lua_get_numarray(L, -1, &numarray_wrong, &numarray_len);
+    check(numarray_ok && numarray_got && numarray_typed, "numarray");
+
+    // pairs and next resume from the key given, also when it is not the last one returned, and so does lua_next
+    int next_ok = 0;
+    int next_keys = 0;
+    lua_call_file_function(L, "test.lua", "test_next_hint", ret_group(next_ok), arg_group());
+    lua_settop(L, 0);
+    if (lua_get_file_function(L, "test.lua", "test_next_hint_table") && lua_call_function(L, 0, 1))
+    {
+        lua_pushnil(L);
+        while (lua_next(L, 1))
+        {
+            next_keys++;
+            lua_pop(L, 1);
+            lua_pushvalue(L, -1);
+            lua_pushnil(L);
+            lua_rawset(L, 1); // cleared while traversed
+        }
+        lua_pushnil(L);
+        next_ok = next_ok && lua_next(L, 1) == 0;
+    }
+    check(next_ok && next_keys == 1000, "table traversals");
+
+    // the length of a table follows appends and removals, from Lua and from C++
+    int border_ok = 0;
+    lua_call_file_function(L, "test.lua", "test_border_cache", ret_group(border_ok), arg_group());
+    lua_settop(L, 0);
+    lua_newtable(L);
+    for (int i = 1; i <= 100; i++)
+    {
+        lua_pushinteger(L, i);
+        lua_rawseti(L, 1, i);
+        border_ok = border_ok && lua_rawlen(L, 1) == (size_t)i;
+    }
+    for (int i = 100; i > 50; i--)
+    {
+        lua_pushnil(L);
+        lua_rawseti(L, 1, i);
+        border_ok = border_ok && lua_rawlen(L, 1) == (size_t)i - 1;
+    }
+    check(border_ok, "table length");
+
+    // GC statistics: kept for the last cycles and reported to the callback
+    int gc_callbacks = 0;
+    int cycle = 0;
+    lua_GCStats stats;
+    lua_set_gc_stats_callback(L, [&](const lua_GCStats&) { gc_callbacks++; });
+    lua_call_file_function(L, "test.lua", "test_gc_stats", ret_group(cycle), arg_group());
+    lua_set_gc_stats_callback(L, nullptr);
+    check(cycle > 0 && gc_callbacks > 0 && lua_get_gc_stats(L, &stats) && (int)stats.cycle >= cycle, "GC statistics of the last cycle");
+
 	lua_close(L);
-	return 0;
+	return failures > 0 ? 1 : 0;
 }
@@ -34,3 +34,347 @@ function test_sum(a, b)
     return a, b, sum(a, b);
 end
 
+
+function test_memprof()
+    debug.memprofile(1);
+
+    -- strings built in a luaL_Buffer are adopted, not allocated by luaM_realloc_
+    local strs = {};
+    for i = 1, 20 do
+        strs[i] = string.rep("x", 100000);
+    end
+
+    local bytes = 0;
+    for n in debug.memprofdump("live"):gmatch("%(string%) (%d+)\n") do
+        bytes = bytes + tonumber(n);
+    end
+
+    debug.memprofile(0);
+    return bytes;
+end
+
+-- leaves the profiler on, with 'memprof_kept' live
+function test_memprof_lines()
+    debug.memprofile(1);
+    memprof_kept = {};
+    for i = 1, 1000 do memprof_kept[i] = {i, i}; end local line = debug.getinfo(1, "l").currentline;
+
+    local dump = debug.memprofdump("live");
+    return tonumber(dump:match("test%.lua[^:]*:" .. line .. ";%(table%) (%d+)")) or 0;
+end
+
+function test_heap_snapshot()
+    heap_marker = {name = "heap snapshot marker"};
+    return debug.heapsnapshot("heap.snap") and 1 or 0;
+end
+
+local sched_log = {};
+function test_sched_start()
+    luna.spawn(function()
+        luna.sleep(5);
+        sched_log[#sched_log + 1] = "sleep5@" .. luna.now();
+    end);
+    luna.spawn(function()
+        luna.sleep(1000);
+        sched_log[#sched_log + 1] = "sleep1000@" .. luna.now();
+    end);
+    luna.spawn(function()
+        local ok = luna.wait("never", 20);
+        sched_log[#sched_log + 1] = "timeout:" .. tostring(ok);
+    end);
+    luna.spawn(function()
+        local ok, a, b = luna.wait("go");
+        sched_log[#sched_log + 1] = "go:" .. tostring(ok) .. "," .. a .. "," .. b;
+    end);
+    return #sched_log == 0 and 4 or 0;
+end
+
+function test_sched_result(expected)
+    local log = table.concat(sched_log, " ");
+    if log ~= expected then
+        print(log);
+        return 0;
+    end
+    return 1;
+end
+
+local recycled = nil;
+local recycled_woken = 0;
+function test_sched_recycle()
+    recycled = coroutine.create(function()
+        luna.sleep(10);
+        recycled_woken = recycled_woken + 1;
+    end);
+    coroutine.resume(recycled); -- parked in luna.sleep
+
+    coroutine.recycle(recycled, function()
+        coroutine.yield();
+        recycled_woken = recycled_woken + 100;
+    end);
+    coroutine.resume(recycled); -- suspended again, but not by luna.sleep
+    return recycled_woken;
+end
+
+function test_sched_recycle_result()
+    return recycled_woken;
+end
+
+function test_sched_stale_wait()
+    local woken = 0;
+    local co = coroutine.create(function()
+        luna.wait("test_stale_wait");
+        coroutine.yield(); -- suspended again, but not by luna.wait
+        woken = woken + 1;
+    end);
+    coroutine.resume(co); -- parked in luna.wait
+    coroutine.resume(co); -- resumed by hand, not by the scheduler
+
+    local signalled = luna.signal("test_stale_wait");
+    return signalled, woken;
+end
+
+local suspend_woken = 0;
+function test_suspend_stale()
+    local co = coroutine.create(function()
+        suspend(); -- parked by lua_suspend_coroutine
+        coroutine.yield(); -- suspended again, on its own
+        suspend_woken = suspend_woken + 1;
+    end);
+    coroutine.resume(co);
+    coroutine.resume(co); -- resumed by hand, not with the token
+    return suspend_woken;
+end
+
+function test_suspend_stale_result()
+    return suspend_woken;
+end
+
+function test_async(n)
+    local v = suspend(); -- resumed by lua_resume_coroutine with v
+    if v < 0 then
+        error("negative");
+    end
+    return n + v;
+end
+
+function test_budget_loop()
+    while true do
+    end
+end
+
+local sliced_done = false;
+function test_budget_slices(n)
+    luna.spawn(function()
+        local x = 0;
+        for i = 1, n do
+            x = x + i;
+        end
+        sliced_done = true;
+    end);
+    return sliced_done and 1 or 0;
+end
+
+function test_budget_slices_done()
+    return sliced_done and 1 or 0;
+end
+
+function test_budget_nested()
+    local finished = call_with_budget(1000000, function() end);
+    local stopped = call_with_budget(100000, test_budget_loop);
+    return (finished and not stopped) and 1 or 0;
+end
+
+function test_numarray()
+    local ok = true;
+    local a = numarray.new("float64", {1, 2, 3, 4, 5, 6, 7});
+    local b = numarray.new("float64", 7):fill(2);
+    ok = ok and #a == 7 and a[1] == 1 and a[7] == 7 and a[8] == nil;
+    ok = ok and numarray.type(a) == "float64" and numarray.type({}) == nil;
+
+    a:add(b):mul(3):sub(1); -- 8, 11, ..., 26
+    ok = ok and a[1] == 8 and a[7] == 26 and a:sum() == 119 and a:dot(b) == 238;
+    ok = ok and a:min() == 8 and a:max() == 26 and numarray.new("int64", 0):min() == nil;
+    a:fma(b, 0.5):scale(2); -- 18, 24, ..., 54
+    ok = ok and a[1] == 18 and a:sum() == 252;
+
+    local v = a:view(2, 4):fill(0);
+    ok = ok and #v == 3 and a[1] == 18 and a[2] == 0 and a[4] == 0 and a[5] == 42;
+    local t = a:totable();
+    ok = ok and #t == 7 and t[7] == 54;
+
+    local idx = numarray.new("int32", {7, 1, 5});
+    local g = numarray.new("float64", 3):gather(a, idx);
+    ok = ok and g[1] == 54 and g[2] == 18 and g[3] == 42;
+    local s = numarray.new("float64", 7):scatter(idx, g);
+    ok = ok and s[7] == 54 and s[1] == 18 and s[5] == 42 and s[2] == 0;
+
+    -- past the SIMD main loops, with a tail
+    local big = numarray.new("float32", 1001):fill(0.5);
+    local ones = numarray.new("float64", 1001):fill(1);
+    ok = ok and big:sum() == 500.5 and big:dot(big) == 250.25 and ones:fma(ones, ones):sum() == 2002;
+
+    -- integers wrap around and reject what they cannot hold
+    local ints = numarray.new("int32", {2147483647, 1}):add(1);
+    ok = ok and ints[1] == -2147483648 and ints[2] == 2;
+    ok = ok and not pcall(function() ints[1] = 1.5; end) and not pcall(function() ints[1] = 2^40; end);
+    ok = ok and not pcall(function() ints[3] = 1; end);
+    ok = ok and not pcall(a.add, a, numarray.new("float32", 7)) and not pcall(a.add, a, g);
+    ok = ok and not pcall(g.gather, g, a, numarray.new("int32", {8, 1, 1}));
+    return ok and 1 or 0;
+end
+
+function test_numarray_values()
+    return numarray.new("float64", {1.5, 2.5, 3.5});
+end
+
+function test_next_hint()
+    local ok = true;
+    local t = {};
+    for i = 1, 1000 do
+        t["k" .. i] = i;
+    end
+    for i = 1, 10 do
+        t[i] = i;
+    end
+
+    -- each key once, while the ones seen are assigned or cleared
+    local seen, count = {}, 0;
+    for k, v in pairs(t) do
+        ok = ok and not seen[k];
+        seen[k] = true;
+        count = count + 1;
+        t[k] = (count % 2 == 0) and v * 2 or nil;
+    end
+    ok = ok and count == 1010;
+    count = 0;
+    for k, v in pairs(t) do
+        ok = ok and v == 2 * (type(k) == "number" and k or tonumber(k:sub(2)));
+        count = count + 1;
+    end
+    ok = ok and count == 505;
+
+    -- nested traversals of the same table make the outer one miss its hint
+    count = 0;
+    for k in pairs(t) do
+        for k2 in pairs(t) do
+            count = count + 1;
+        end
+    end
+    ok = ok and count == 505 * 505;
+
+    -- next from any key, not only the one it returned last
+    local keys = {};
+    for k in pairs(t) do
+        keys[#keys + 1] = k;
+    end
+    for i = #keys, 1, -1 do
+        ok = ok and next(t, keys[i]) == keys[i + 1];
+    end
+    ok = ok and not pcall(next, t, "no such key");
+
+    -- a traversal left halfway, then a rehash
+    for k in pairs(t) do
+        if k == keys[100] then
+            break;
+        end
+    end
+    for i = 1, 1000 do
+        t["n" .. i] = i;
+    end
+    count = 0;
+    for k in pairs(t) do
+        count = count + 1;
+    end
+    ok = ok and count == 1505;
+    return ok and 1 or 0;
+end
+
+function test_next_hint_table()
+    local t = {};
+    for i = 1, 1000 do
+        t["k" .. i] = i;
+    end
+    return t;
+end
+
+local function is_border(t, n)
+    return (n == 0 or t[n] ~= nil) and t[n + 1] == nil;
+end
+
+function test_border_cache()
+    local ok = true;
+    local t = {};
+    for i = 1, 100 do
+        t[#t + 1] = i;
+        ok = ok and #t == i;
+    end
+    for i = 100, 51, -1 do
+        t[#t] = nil;
+        ok = ok and #t == i - 1;
+    end
+    table.insert(t, 1, 0);
+    ok = ok and #t == 51 and t[1] == 0 and t[51] == 50;
+    table.remove(t);
+    table.remove(t, 1);
+    ok = ok and #t == 49 and t[1] == 1 and t[49] == 49;
+    for i = 1, 1000 do
+        t[#t + 1] = i;
+        t[#t + 1] = i;
+        t[#t] = nil;
+    end
+    ok = ok and #t == 1049 and t[1049] == 1000;
+
+    -- a sequence in the hash part
+    local h = {};
+    for i = 1000, 1, -1 do
+        h[i] = i;
+    end
+    ok = ok and #h == 1000;
+    h[1001] = 1001;
+    ok = ok and #h == 1001;
+    h[1001] = nil;
+    h[1000] = nil;
+    ok = ok and #h == 999;
+
+    -- the border found last time, then a hole below it and writes above it
+    local s = {};
+    for i = 1, 64 do
+        s[i] = i;
+    end
+    for i = 64, 33, -1 do
+        s[i] = nil;
+    end
+    ok = ok and #s == 32;
+    s[20] = nil;
+    ok = ok and is_border(s, #s);
+    s[32] = nil;
+    ok = ok and is_border(s, #s);
+    s[33], s[40] = 33, 40;
+    ok = ok and is_border(s, #s);
+    for i = 1, 64 do
+        s[i] = nil;
+    end
+    ok = ok and #s == 0;
+    for i = 1, 200 do
+        s[i] = i; -- grows past the array part
+    end
+    ok = ok and #s == 200;
+    return ok and 1 or 0;
+end
+
+function test_gc_stats()
+    local garbage = {};
+    for i = 1, 1000 do
+        garbage[i] = {i};
+    end
+    garbage = nil;
+    collectgarbage();
+
+    local s = collectgarbage("stats");
+    local previous = collectgarbage("stats", 1);
+    if s.kind ~= "full" or s.marked <= 0 or s.swept <= 0 or (s.freed.table or 0) < 1000 or s.memory <= 0 or
+        s.atomic < 0 or not previous or previous.cycle ~= s.cycle - 1 then
+        return 0;
+    end
+    return s.cycle;
+end
@@ -0,0 +1,670 @@
+/*
+** heapsnap: offline analyzer for the heap snapshots written by
+** lua_heapsnapshot / debug.heapsnapshot.
+**
+** usage: heapsnap [-n count] snapshot
+**
+** Builds the object graph (weak references do not retain), computes
+** its dominator tree and prints memory by type and the objects that
+** retain the most memory, each with a shortest path from the roots.
+** The format is described with 'luaC_heapsnapshot' in lgc.c.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+// variant tags of Lua 5.3
+enum
+{
+    tag_short_string = 4,
+    tag_table = 5,
+    tag_lua_closure = 6,
+    tag_userdata = 7,
+    tag_thread = 8,
+    tag_proto = 9,
+    tag_long_string = 4 | (1 << 4),
+    tag_c_closure = 6 | (2 << 4),
+    tag_boxed_integer = 3 | (1 << 4), // LUA_USE_NANBOX
+};
+
+// roots and edges, as in lgc.c
+enum
+{
+    root_registry = 1,
+    root_main_thread,
+    root_metatable,
+    root_tobefnz,
+};
+
+enum
+{
+    edge_metatable = 1,
+    edge_uservalue,
+    edge_array,
+    edge_key,
+    edge_field,
+    edge_index,
+    edge_value,
+    edge_upvalue,
+    edge_proto,
+    edge_constant,
+    edge_name,
+    edge_stack,
+    edge_weak = 32,
+};
+
+static const uint32_t no_node = UINT32_MAX;
+
+struct edge_t
+{
+    uint64_t target;   // object id, later its node index
+    uint64_t aux;
+    uint8_t kind;
+};
+
+struct node_t
+{
+    uint64_t id;
+    uint64_t size;
+    uint64_t info;      // string length, C function or line defined
+    uint32_t first_edge;
+    uint32_t text = no_node;   // index in 'texts' (strings)
+    uint8_t tag;
+};
+
+struct snapshot_t
+{
+    std::vector<node_t> nodes;     // nodes[0] is a pseudo root
+    std::vector<edge_t> edges;
+    std::vector<std::string> texts;
+    std::unordered_map<uint64_t, uint32_t> index;
+};
+
+struct reader_t
+{
+    FILE* file;
+    bool error = false;
+
+    int byte()
+    {
+        int c = getc(file);
+        if (c == EOF)
+            error = true;
+        return c;
+    }
+
+    uint64_t uint()
+    {
+        uint64_t x = 0;
+        int shift = 0;
+        int c;
+        do
+        {
+            c = byte();
+            if (c == EOF || shift > 63)
+            {
+                error = true;
+                return 0;
+            }
+            x |= (uint64_t)(c & 0x7f) << shift;
+            shift += 7;
+        } while (c & 0x80);
+        return x;
+    }
+};
+
+static bool load_snapshot(snapshot_t* snap, const char file_name[])
+{
+    FILE* file = fopen(file_name, "rb");
+    if (file == nullptr)
+    {
+        fprintf(stderr, "cannot open %s\n", file_name);
+        return false;
+    }
+
+    reader_t r = { file };
+    char magic[8];
+    bool done = false;
+    if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, "\33LuaHeap", 8) != 0 || r.uint() != 1)
+    {
+        fprintf(stderr, "%s: not a heap snapshot\n", file_name);
+        fclose(file);
+        return false;
+    }
+
+    node_t root = {};
+    root.tag = 0;
+    snap->nodes.push_back(root);
+    std::vector<edge_t> root_edges;
+
+    while (!done && !r.error)
+    {
+        switch (r.byte())
+        {
+        case 'r':
+        {
+            edge_t edge;
+            edge.kind = (uint8_t)r.uint();
+            edge.target = r.uint();
+            edge.aux = 0;
+            root_edges.push_back(edge);
+            break;
+        }
+        case 'o':
+        {
+            node_t node = {};
+            node.id = r.uint();
+            node.tag = (uint8_t)r.uint();
+            node.size = r.uint();
+            if (node.tag == tag_short_string || node.tag == tag_long_string)
+            {
+                node.info = r.uint();
+                std::string text(r.uint(), '\0');
+                if (!text.empty() && fread(&text[0], text.size(), 1, file) != 1)
+                    r.error = true;
+                node.text = (uint32_t)snap->texts.size();
+                snap->texts.push_back(text);
+            }
+            else if (node.tag == tag_c_closure || node.tag == tag_proto)
+            {
+                node.info = r.uint();
+            }
+            node.first_edge = (uint32_t)snap->edges.size();
+            for (uint64_t kind = r.uint(); kind != 0 && !r.error; kind = r.uint())
+            {
+                edge_t edge;
+                edge.kind = (uint8_t)kind;
+                edge.target = r.uint();
+                edge.aux = r.uint();
+                snap->edges.push_back(edge);
+            }
+            snap->index[node.id] = (uint32_t)snap->nodes.size();
+            snap->nodes.push_back(node);
+            break;
+        }
+        case 'e':
+            r.uint();
+            done = true;
+            break;
+        default:
+            r.error = true;
+            break;
+        }
+    }
+    fclose(file);
+    if (!done)
+    {
+        fprintf(stderr, "%s: truncated or corrupted snapshot\n", file_name);
+        return false;
+    }
+
+    // root edges go first: give them to the pseudo root
+    size_t object_edges = snap->edges.size();
+    snap->edges.insert(snap->edges.begin(), root_edges.begin(), root_edges.end());
+    for (size_t i = 1; i < snap->nodes.size(); i++)
+    {
+        snap->nodes[i].first_edge += (uint32_t)root_edges.size();
+    }
+    snap->nodes[0].first_edge = 0;
+
+    // edge targets: from ids to node indexes
+    for (size_t i = 0; i < root_edges.size() + object_edges; i++)
+    {
+        auto it = snap->index.find(snap->edges[i].target);
+        snap->edges[i].target = (it == snap->index.end()) ? no_node : it->second;
+    }
+    node_t end = {};
+    end.first_edge = (uint32_t)snap->edges.size();
+    snap->nodes.push_back(end);  // sentinel for the edges of the last node
+    return true;
+}
+
+#define edges_of(snap, n) \
+    for (uint32_t e = (snap).nodes[n].first_edge; e < (snap).nodes[(n) + 1].first_edge; e++)
+
+static bool is_strong(const edge_t& edge)
+{
+    return edge.target != no_node && !(edge.kind & edge_weak);
+}
+
+/*
+** Dominators (Lengauer-Tarjan, simple version) over the nodes reached
+** from the pseudo root by strong edges. Results are in DFS numbers.
+*/
+struct dominators_t
+{
+    std::vector<uint32_t> dfn;      // node -> DFS number (no_node if not reached)
+    std::vector<uint32_t> vertex;   // DFS number -> node
+    std::vector<uint32_t> idom;     // DFS number -> DFS number of its immediate dominator
+};
+
+static void compute_dominators(const snapshot_t& snap, dominators_t* dom)
+{
+    size_t count = snap.nodes.size() - 1;
+    dom->dfn.assign(count, no_node);
+    std::vector<uint32_t> parent;
+
+    // iterative DFS (edge positions in 'stack')
+    std::vector<std::pair<uint32_t, uint32_t>> stack;
+    dom->dfn[0] = 0;
+    dom->vertex.push_back(0);
+    parent.push_back(0);
+    stack.push_back({ 0, snap.nodes[0].first_edge });
+    while (!stack.empty())
+    {
+        auto& top = stack.back();
+        uint32_t node = top.first;
+        if (top.second == snap.nodes[node + 1].first_edge)
+        {
+            stack.pop_back();
+            continue;
+        }
+        const edge_t& edge = snap.edges[top.second++];
+        if (!is_strong(edge) || dom->dfn[edge.target] != no_node)
+            continue;
+        uint32_t w = (uint32_t)edge.target;
+        dom->dfn[w] = (uint32_t)dom->vertex.size();
+        dom->vertex.push_back(w);
+        parent.push_back(dom->dfn[node]);
+        stack.push_back({ w, snap.nodes[w].first_edge });
+    }
+
+    // predecessors, in DFS numbers
+    size_t n = dom->vertex.size();
+    std::vector<uint32_t> pred_first(n + 1, 0);
+    std::vector<uint32_t> preds;
+    for (size_t v = 0; v < n; v++)
+    {
+        edges_of(snap, dom->vertex[v])
+        {
+            if (is_strong(snap.edges[e]))
+                pred_first[dom->dfn[snap.edges[e].target] + 1]++;
+        }
+    }
+    for (size_t v = 0; v < n; v++)
+        pred_first[v + 1] += pred_first[v];
+    preds.resize(pred_first[n]);
+    std::vector<uint32_t> fill(pred_first.begin(), pred_first.end() - 1);
+    for (size_t v = 0; v < n; v++)
+    {
+        edges_of(snap, dom->vertex[v])
+        {
+            if (is_strong(snap.edges[e]))
+                preds[fill[dom->dfn[snap.edges[e].target]]++] = (uint32_t)v;
+        }
+    }
+
+    std::vector<uint32_t> semi(n), label(n), ancestor(n, no_node);
+    std::vector<uint32_t> bucket_head(n, no_node), bucket_next(n, no_node);
+    std::vector<uint32_t> chain;
+    dom->idom.assign(n, 0);
+    for (size_t v = 0; v < n; v++)
+        semi[v] = label[v] = (uint32_t)v;
+
+    auto eval = [&](uint32_t v) -> uint32_t
+    {
+        if (ancestor[v] == no_node)
+            return v;
+        // compress the path from 'v' (iteratively; it may be long)
+        chain.clear();
+        for (uint32_t x = v; ancestor[ancestor[x]] != no_node; x = ancestor[x])
+            chain.push_back(x);
+        while (!chain.empty())
+        {
+            uint32_t x = chain.back();
+            chain.pop_back();
+            uint32_t a = ancestor[x];
+            if (semi[label[a]] < semi[label[x]])
+                label[x] = label[a];
+            ancestor[x] = ancestor[a];
+        }
+        return label[v];
+    };
+
+    for (size_t i = n - 1; i >= 1; i--)
+    {
+        uint32_t w = (uint32_t)i;
+        for (uint32_t p = pred_first[w]; p < pred_first[w + 1]; p++)
+        {
+            uint32_t u = eval(preds[p]);
+            if (semi[u] < semi[w])
+                semi[w] = semi[u];
+        }
+        bucket_next[w] = bucket_head[semi[w]];
+        bucket_head[semi[w]] = w;
+        ancestor[w] = parent[w];
+        for (uint32_t v = bucket_head[parent[w]]; v != no_node; v = bucket_next[v])
+        {
+            uint32_t u = eval(v);
+            dom->idom[v] = (semi[u] < semi[v]) ? u : parent[w];
+        }
+        bucket_head[parent[w]] = no_node;
+    }
+    for (size_t i = 1; i < n; i++)
+    {
+        if (dom->idom[i] != semi[i])
+            dom->idom[i] = dom->idom[dom->idom[i]];
+    }
+}
+
+static const char* type_name(uint8_t tag)
+{
+    switch (tag)
+    {
+    case tag_short_string: case tag_long_string: return "string";
+    case tag_table: return "table";
+    case tag_lua_closure: return "function";
+    case tag_c_closure: return "C function";
+    case tag_userdata: return "userdata";
+    case tag_thread: return "thread";
+    case tag_proto: return "proto";
+    case tag_boxed_integer: return "integer";
+    default: return "?";
+    }
+}
+
+static std::string quote(const std::string& text, uint64_t length)
+{
+    std::string out = "\"";
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if ((unsigned char)c < 32 || (unsigned char)c >= 127)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\%d", (unsigned char)c);
+            out += buf;
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    out += (length > text.size()) ? "\"..." : "\"";
+    return out;
+}
+
+static std::string string_of(const snapshot_t& snap, uint32_t node)
+{
+    if (node == no_node || snap.nodes[node].text == no_node)
+        return "?";
+    return snap.texts[snap.nodes[node].text];
+}
+
+static uint32_t edge_target(const snapshot_t& snap, uint32_t node, uint8_t kind)
+{
+    edges_of(snap, node)
+    {
+        if ((snap.edges[e].kind & ~edge_weak) == kind)
+            return (uint32_t)snap.edges[e].target;
+    }
+    return no_node;
+}
+
+static std::string describe(const snapshot_t& snap, uint32_t node)
+{
+    const node_t& n = snap.nodes[node];
+    char buf[64];
+    switch (n.tag)
+    {
+    case tag_short_string: case tag_long_string:
+        return "string " + quote(snap.texts[n.text], n.info);
+    case tag_lua_closure:
+    {
+        uint32_t proto = edge_target(snap, node, edge_proto);
+        if (proto != no_node)
+            return "function <" + describe(snap, proto).substr(6) + ">";
+        break;
+    }
+    case tag_proto:
+    {
+        std::string source = string_of(snap, edge_target(snap, node, edge_name));
+        if (!source.empty() && (source[0] == '@' || source[0] == '='))
+            source = source.substr(1);
+        snprintf(buf, sizeof(buf), ":%llu", (unsigned long long)n.info);
+        return "proto " + source + buf;
+    }
+    case tag_c_closure:
+        snprintf(buf, sizeof(buf), "C function %#llx", (unsigned long long)n.info);
+        return buf;
+    default:
+        break;
+    }
+    snprintf(buf, sizeof(buf), "%s %#llx", type_name(n.tag), (unsigned long long)n.id);
+    return buf;
+}
+
+static bool is_identifier(const std::string& s)
+{
+    if (s.empty() || !(isalpha((unsigned char)s[0]) || s[0] == '_'))
+        return false;
+    for (char c : s)
+    {
+        if (!(isalnum((unsigned char)c) || c == '_'))
+            return false;
+    }
+    return true;
+}
+
+static std::string edge_label(const snapshot_t& snap, uint32_t from, const edge_t& edge)
+{
+    char buf[64];
+    if (from == 0)
+    {
+        switch (edge.kind)
+        {
+        case root_registry: return "registry";
+        case root_main_thread: return "main thread";
+        case root_metatable: return "(metatable of a basic type)";
+        case root_tobefnz: return "(being finalized)";
+        default: return "(?)";
+        }
+    }
+    switch (edge.kind & ~edge_weak)
+    {
+    case edge_metatable: return "(metatable)";
+    case edge_uservalue: return "(uservalue)";
+    case edge_array:
+        snprintf(buf, sizeof(buf), "[%llu]", (unsigned long long)edge.aux);
+        return buf;
+    case edge_key: return "(key)";
+    case edge_field:
+    {
+        auto it = snap.index.find(edge.aux);
+        std::string key = (it == snap.index.end()) ? "?" : string_of(snap, it->second);
+        return is_identifier(key) ? "." + key : "[" + quote(key, key.size()) + "]";
+    }
+    case edge_index:
+        snprintf(buf, sizeof(buf), "[%lld]", (long long)edge.aux);
+        return buf;
+    case edge_value:
+    {
+        auto it = snap.index.find(edge.aux);
+        if (it == snap.index.end())
+            return "[?]";
+        return "[" + describe(snap, it->second) + "]";
+    }
+    case edge_upvalue:
+        snprintf(buf, sizeof(buf), "(upvalue %llu)", (unsigned long long)edge.aux);
+        return buf;
+    case edge_proto: return "(proto)";
+    case edge_constant: return "(constant)";
+    case edge_name: return "(name)";
+    case edge_stack:
+        snprintf(buf, sizeof(buf), "(stack %llu)", (unsigned long long)edge.aux);
+        return buf;
+    default: return "(?)";
+    }
+}
+
+/*
+** shortest paths from the pseudo root by strong edges: for each node,
+** the edge that reaches it
+*/
+static void compute_paths(const snapshot_t& snap, std::vector<uint32_t>* via)
+{
+    std::vector<uint32_t> queue;
+    via->assign(snap.nodes.size() - 1, no_node);
+    queue.push_back(0);
+    (*via)[0] = 0;
+    for (size_t q = 0; q < queue.size(); q++)
+    {
+        uint32_t node = queue[q];
+        edges_of(snap, node)
+        {
+            const edge_t& edge = snap.edges[e];
+            if (is_strong(edge) && (*via)[edge.target] == no_node && edge.target != 0)
+            {
+                (*via)[edge.target] = e;
+                queue.push_back((uint32_t)edge.target);
+            }
+        }
+    }
+}
+
+static std::string path_to(const snapshot_t& snap, const std::vector<uint32_t>& via, uint32_t node)
+{
+    std::vector<std::pair<uint32_t, uint32_t>> steps;   // (from, edge)
+    while (node != 0 && via[node] != no_node)
+    {
+        uint32_t e = via[node];
+        uint32_t from = (uint32_t)(std::upper_bound(snap.nodes.begin(), snap.nodes.end() - 1, e,
+            [](uint32_t x, const node_t& n) { return x < n.first_edge; }) - snap.nodes.begin()) - 1;
+        // (nodes without edges share 'first_edge': take the last one, which owns the edge)
+        steps.push_back({ from, e });
+        node = from;
+    }
+    std::string path;
+    for (auto it = steps.rbegin(); it != steps.rend(); ++it)
+    {
+        const edge_t& edge = snap.edges[it->second];
+        // registry[2] is the table of globals
+        if (path == "registry" && (edge.kind & ~edge_weak) == edge_array && edge.aux == 2)
+        {
+            path = "_G";
+            continue;
+        }
+        std::string label = edge_label(snap, it->first, edge);
+        if (!path.empty() && label[0] != '.' && label[0] != '[')
+            path += " ";
+        path += label;
+    }
+    return path;
+}
+
+static std::string human(uint64_t bytes)
+{
+    char buf[32];
+    if (bytes >= 10 * 1024 * 1024)
+        snprintf(buf, sizeof(buf), "%.1fM", bytes / (1024.0 * 1024.0));
+    else if (bytes >= 10 * 1024)
+        snprintf(buf, sizeof(buf), "%.1fK", bytes / 1024.0);
+    else
+        snprintf(buf, sizeof(buf), "%llu", (unsigned long long)bytes);
+    return buf;
+}
+
+int main(int argc, char* argv[])
+{
+    int top_count = 20;
+    const char* file_name = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            top_count = atoi(argv[++i]);
+        }
+        else
+        {
+            file_name = argv[i];
+        }
+    }
+    if (file_name == nullptr)
+    {
+        fprintf(stderr, "usage: %s [-n count] snapshot\n", argv[0]);
+        return 1;
+    }
+
+    snapshot_t snap;
+    if (!load_snapshot(&snap, file_name))
+        return 1;
+
+    dominators_t dom;
+    compute_dominators(snap, &dom);
+    size_t n = dom.vertex.size();
+    std::vector<uint64_t> retained(n);
+    for (size_t v = 0; v < n; v++)
+        retained[v] = snap.nodes[dom.vertex[v]].size;
+    for (size_t v = n - 1; v >= 1; v--)
+        retained[dom.idom[v]] += retained[v];
+
+    // memory by type
+    struct type_total_t { uint64_t count = 0, bytes = 0; };
+    std::vector<std::pair<std::string, type_total_t>> types;
+    uint64_t weak_count = 0, weak_bytes = 0;
+    for (size_t i = 1; i < snap.nodes.size() - 1; i++)
+    {
+        const node_t& node = snap.nodes[i];
+        if (dom.dfn[i] == no_node)
+        {
+            weak_count++;
+            weak_bytes += node.size;
+            continue;
+        }
+        std::string name = type_name(node.tag);
+        auto it = std::find_if(types.begin(), types.end(), [&](const std::pair<std::string, type_total_t>& t) { return t.first == name; });
+        if (it == types.end())
+        {
+            types.push_back({ name, type_total_t() });
+            it = types.end() - 1;
+        }
+        it->second.count++;
+        it->second.bytes += node.size;
+    }
+    std::sort(types.begin(), types.end(), [](const std::pair<std::string, type_total_t>& a, const std::pair<std::string, type_total_t>& b)
+    {
+        return a.second.bytes > b.second.bytes;
+    });
+
+    printf("%zu objects, %s bytes\n", n - 1, human(retained[0]).c_str());
+    if (weak_count > 0)
+        printf("%llu objects (%s bytes) only weakly reachable\n", (unsigned long long)weak_count, human(weak_bytes).c_str());
+    printf("\n%-12s %10s %10s\n", "type", "count", "bytes");
+    for (auto& t : types)
+    {
+        printf("%-12s %10llu %10s\n", t.first.c_str(), (unsigned long long)t.second.count, human(t.second.bytes).c_str());
+    }
+
+    // top retainers: biggest retained sizes, leaving out the roots themselves
+    std::vector<uint32_t> order;
+    for (size_t v = 1; v < n; v++)
+    {
+        if (dom.idom[v] != 0)
+            order.push_back((uint32_t)v);
+    }
+    size_t shown = std::min(order.size(), (size_t)std::max(top_count, 0));
+    std::partial_sort(order.begin(), order.begin() + shown, order.end(), [&](uint32_t a, uint32_t b)
+    {
+        return retained[a] > retained[b];
+    });
+
+    std::vector<uint32_t> via;
+    compute_paths(snap, &via);
+    printf("\n%10s %10s  %s\n", "retained", "self", "object / path");
+    for (size_t i = 0; i < shown; i++)
+    {
+        uint32_t node = dom.vertex[order[i]];
+        printf("%10s %10s  %s\n", human(retained[order[i]]).c_str(), human(snap.nodes[node].size).c_str(), describe(snap, node).c_str());
+        printf("%22s  %s\n", "", path_to(snap, via, node).c_str());
+    }
+    return 0;
+}